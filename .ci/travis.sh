@@ -190,8 +190,8 @@ function test_handlebars() (
 		make code-coverage-capture
 	fi
 
-	if [ -f ./bench/run.sh.log ]; then
-		cat ./bench/run.sh.log
+	if [ -f ./bench/handlebars_bench.log ]; then
+		cat ./bench/handlebars_bench.log
 	fi
 )
 
@@ -0,0 +1,604 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <time.h>
+
+#include "handlebars.h"
+#include "handlebars_compiler.h"
+#include "handlebars_delimiters.h"
+#include "handlebars_json.h"
+#include "handlebars_json_parser.h"
+#include "handlebars_memory.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_parser.h"
+#include "handlebars_partial_loader.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "handlebars_vm.h"
+
+#ifndef HANDLEBARS_BENCH_DIR
+#define HANDLEBARS_BENCH_DIR "."
+#endif
+
+
+
+enum bench_phase {
+    bench_phase_lex = 0,
+    bench_phase_parse,
+    bench_phase_compile,
+    bench_phase_serialize,
+    bench_phase_execute,
+    bench_phase_execute_json,
+    bench_phase_count
+};
+
+static const char * bench_phase_names[bench_phase_count] = {
+    "lex",
+    "parse",
+    "compile",
+    "serialize",
+    "execute",
+    "execute_json"
+};
+
+struct bench_case {
+    const char * template;
+    const char * data;
+    unsigned long flags;
+};
+
+// Each template runs with its data file. Mustache templates are compiled with the compat flag
+static const struct bench_case bench_cases[] = {
+    {"array-each.handlebars", "array-each.json", 0},
+    {"array-each.mustache", "array-each.json", handlebars_compiler_flag_compat},
+    {"complex.handlebars", "complex.json", 0},
+    {"complex.mustache", "complex.json", handlebars_compiler_flag_compat},
+    {"data.handlebars", "data.json", 0},
+    {"depth-1.handlebars", "depth-1.json", 0},
+    {"depth-1.mustache", "depth-1.json", handlebars_compiler_flag_compat},
+    {"depth-2.handlebars", "depth-2.json", 0},
+    {"depth-2.mustache", "depth-2.json", handlebars_compiler_flag_compat},
+    {"object-mustache.handlebars", "object-mustache.json", 0},
+    {"object.handlebars", "object.json", 0},
+    {"object.mustache", "object.json", handlebars_compiler_flag_compat},
+    {"partial.handlebars", "partial.json", 0},
+    {"partial.mustache", "partial.json", handlebars_compiler_flag_compat},
+    {"partial-recursion.handlebars", "partial-recursion.json", 0},
+    {"partial-recursion.mustache", "partial-recursion.json", handlebars_compiler_flag_compat},
+    {"paths.handlebars", "paths.json", 0},
+    {"paths.mustache", "paths.json", handlebars_compiler_flag_compat},
+    {"string.handlebars", "string.json", 0},
+    {"string.mustache", "string.json", handlebars_compiler_flag_compat},
+    {"variables.handlebars", "variables.json", 0},
+    {"variables.mustache", "variables.json", handlebars_compiler_flag_compat},
+};
+
+struct bench_sample {
+    uint64_t ns;
+    size_t allocs;
+    size_t bytes;
+};
+
+struct bench_result {
+    double ns_per_op;
+    uint64_t p50;
+    uint64_t p99;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+struct bench_state {
+    struct handlebars_context * ctx;
+    const struct bench_case * bcase;
+    struct handlebars_string * tmpl;
+    struct handlebars_module * module;
+    struct handlebars_value * input;
+    struct handlebars_value * input_json;
+    struct handlebars_value * partials;
+};
+
+static const char * bench_dir = HANDLEBARS_BENCH_DIR;
+static const char * filter = NULL;
+static long iterations = 1000;
+static long warmup = 100;
+static bool json_output = false;
+static unsigned long extra_flags = 0;
+
+static size_t bench_allocs = 0;
+static size_t bench_bytes = 0;
+
+
+
+// Count allocations by interposing malloc. The sanitizers interpose it themselves.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define HANDLEBARS_BENCH_COUNT_ALLOCS 1
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+void * malloc(size_t size)
+{
+    bench_allocs++;
+    bench_bytes += size;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    bench_bytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    bench_allocs++;
+    bench_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static inline void bench_start(struct timespec * start)
+{
+    bench_allocs = 0;
+    bench_bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static inline void bench_stop(struct timespec * start, struct bench_sample * sample)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sample->ns = (uint64_t) (end.tv_sec - start->tv_sec) * 1000000000ULL + (uint64_t) end.tv_nsec - (uint64_t) start->tv_nsec;
+    sample->allocs = bench_allocs;
+    sample->bytes = bench_bytes;
+}
+
+static char * read_file(struct handlebars_context * ctx, const char * dir, const char * name, size_t * length)
+{
+    char * path = talloc_asprintf(ctx, "%s/%s", dir, name);
+    FILE * f;
+    long size;
+    char * buf;
+
+    f = fopen(path, "rb");
+    if( !f ) {
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to open file: %s", path);
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = handlebars_talloc_array(ctx, char, size + 1);
+    if( size > 0 && 1 != fread(buf, size, 1, f) ) {
+        fclose(f);
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to read file: %s", path);
+    }
+    fclose(f);
+
+    buf[size] = 0;
+    *length = (size_t) size;
+    talloc_free(path);
+    return buf;
+}
+
+// Compare ignoring whitespace, like `diff --ignore-all-space`
+static bool output_matches(const char * expected, const char * actual)
+{
+    for( ;; ) {
+        while( isspace((unsigned char) *expected) ) expected++;
+        while( isspace((unsigned char) *actual) ) actual++;
+        if( *expected != *actual ) {
+            return false;
+        } else if( !*expected ) {
+            return true;
+        }
+        expected++;
+        actual++;
+    }
+}
+
+static struct handlebars_ast_node * bench_parse(struct handlebars_parser * parser, struct bench_state * state)
+{
+    return handlebars_parse_ex(parser, state->tmpl, state->bcase->flags);
+}
+
+static struct handlebars_program * bench_compile(struct handlebars_compiler * compiler, struct handlebars_ast_node * ast, struct bench_state * state)
+{
+    handlebars_compiler_set_flags(compiler, state->bcase->flags);
+    return handlebars_compiler_compile_ex(compiler, ast);
+}
+
+static struct handlebars_string * bench_execute(struct bench_state * state, struct handlebars_value * input, struct bench_sample * sample)
+{
+    struct handlebars_vm * vm;
+    struct handlebars_string * buffer;
+    struct timespec start;
+
+    // Only the render is measured, the VM is set up and destroyed like the parser and compiler of the other phases
+    vm = handlebars_vm_ctor(state->ctx);
+    handlebars_vm_set_flags(vm, state->bcase->flags);
+    handlebars_vm_set_partials(vm, state->partials);
+
+    if( sample ) {
+        bench_start(&start);
+        buffer = handlebars_vm_execute(vm, state->module, input);
+        bench_stop(&start, sample);
+        buffer = NULL;
+    } else {
+        // Keep the output for verification
+        buffer = talloc_steal(state->ctx, handlebars_vm_execute(vm, state->module, input));
+    }
+
+    handlebars_vm_dtor(vm);
+    return buffer;
+}
+
+// Run one phase once, with whatever it needs prepared outside of the measurement
+static void bench_run(struct bench_state * state, enum bench_phase phase, struct bench_sample * sample)
+{
+    struct handlebars_context * ctx = state->ctx;
+    struct handlebars_parser * parser = NULL;
+    struct handlebars_compiler * compiler = NULL;
+    struct handlebars_ast_node * ast;
+    struct handlebars_program * program;
+    struct handlebars_module * module;
+    struct handlebars_token ** tokens;
+    struct timespec start;
+
+    switch( phase ) {
+        case bench_phase_lex:
+            parser = handlebars_parser_ctor(ctx);
+            bench_start(&start);
+            tokens = handlebars_lex_ex(parser, state->tmpl);
+            bench_stop(&start, sample);
+            (void) tokens;
+            break;
+
+        case bench_phase_parse:
+            parser = handlebars_parser_ctor(ctx);
+            bench_start(&start);
+            ast = bench_parse(parser, state);
+            bench_stop(&start, sample);
+            (void) ast;
+            break;
+
+        case bench_phase_compile:
+            parser = handlebars_parser_ctor(ctx);
+            compiler = handlebars_compiler_ctor(ctx);
+            ast = bench_parse(parser, state);
+            bench_start(&start);
+            program = bench_compile(compiler, ast, state);
+            bench_stop(&start, sample);
+            (void) program;
+            break;
+
+        case bench_phase_serialize:
+            parser = handlebars_parser_ctor(ctx);
+            compiler = handlebars_compiler_ctor(ctx);
+            program = bench_compile(compiler, bench_parse(parser, state), state);
+            bench_start(&start);
+            module = handlebars_program_serialize(ctx, program);
+            bench_stop(&start, sample);
+            handlebars_talloc_free(module);
+            break;
+
+        case bench_phase_execute:
+            bench_execute(state, state->input, sample);
+            break;
+
+        case bench_phase_execute_json:
+            bench_execute(state, state->input_json, sample);
+            break;
+
+        default: assert(0); break; // LCOV_EXCL_LINE
+    }
+
+    if( compiler ) {
+        handlebars_compiler_dtor(compiler);
+    }
+    if( parser ) {
+        handlebars_parser_dtor(parser);
+    }
+}
+
+static int sample_compare(const void * a, const void * b)
+{
+    uint64_t na = ((const struct bench_sample *) a)->ns;
+    uint64_t nb = ((const struct bench_sample *) b)->ns;
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+static void bench_phase(struct bench_state * state, enum bench_phase phase, struct bench_result * result)
+{
+    struct bench_sample * samples = handlebars_talloc_array(state->ctx, struct bench_sample, iterations);
+    double ns = 0;
+    double allocs = 0;
+    double bytes = 0;
+    long i;
+
+    for( i = 0; i < warmup; i++ ) {
+        bench_run(state, phase, &samples[0]);
+    }
+
+    for( i = 0; i < iterations; i++ ) {
+        bench_run(state, phase, &samples[i]);
+        ns += (double) samples[i].ns;
+        allocs += (double) samples[i].allocs;
+        bytes += (double) samples[i].bytes;
+    }
+
+    qsort(samples, iterations, sizeof(*samples), sample_compare);
+
+    result->ns_per_op = ns / iterations;
+    result->p50 = samples[(iterations - 1) * 50 / 100].ns;
+    result->p99 = samples[(iterations - 1) * 99 / 100].ns;
+    result->allocs_per_op = allocs / iterations;
+    result->bytes_per_op = bytes / iterations;
+
+    handlebars_talloc_free(samples);
+}
+
+static void print_result(const struct bench_case * bcase, enum bench_phase phase, struct bench_result * result, bool * first)
+{
+    if( json_output ) {
+        fprintf(
+            stdout,
+            "%s\n    {\"template\": \"%s\", \"phase\": \"%s\", \"ns_per_op\": %.1f, \"p50_ns\": %" PRIu64 ", "
+            "\"p99_ns\": %" PRIu64 ", \"allocs_per_op\": ",
+            *first ? "" : ",",
+            bcase->template,
+            bench_phase_names[phase],
+            result->ns_per_op,
+            result->p50,
+            result->p99
+        );
+#ifdef HANDLEBARS_BENCH_COUNT_ALLOCS
+        fprintf(stdout, "%.1f, \"bytes_per_op\": %.1f}", result->allocs_per_op, result->bytes_per_op);
+#else
+        fprintf(stdout, "null, \"bytes_per_op\": null}");
+#endif
+    } else {
+        fprintf(
+            stdout,
+            "%-30s %-13s %12.1f %12" PRIu64 " %12" PRIu64 " %10.1f %12.1f\n",
+            bcase->template,
+            bench_phase_names[phase],
+            result->ns_per_op,
+            result->p50,
+            result->p99,
+            result->allocs_per_op,
+            result->bytes_per_op
+        );
+    }
+
+    *first = false;
+}
+
+static bool bench_case_run(struct handlebars_context * ctx, const struct bench_case * bcase, bool * first)
+{
+    struct handlebars_parser * parser;
+    struct handlebars_compiler * compiler;
+    struct handlebars_string * buffer;
+    struct handlebars_string * partial_path;
+    struct handlebars_string * partial_ext;
+    struct bench_result result;
+    struct bench_state state = {0};
+    char * templates_dir = talloc_asprintf(ctx, "%s/templates", bench_dir);
+    char * expected_file = talloc_strdup(ctx, bcase->template);
+    char * expected;
+    char * data;
+    char * tmpl;
+    size_t data_length;
+    size_t length;
+    bool pass = true;
+    int phase;
+
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(input_json);
+    HANDLEBARS_VALUE_DECL(partials);
+
+    state.ctx = ctx;
+    state.bcase = bcase;
+    state.input = input;
+    state.input_json = input_json;
+    state.partials = partials;
+
+    // Read
+    tmpl = read_file(ctx, templates_dir, bcase->template, &length);
+    state.tmpl = handlebars_string_ctor(ctx, tmpl, length);
+    if( bcase->flags & handlebars_compiler_flag_compat ) {
+        state.tmpl = handlebars_preprocess_delimiters(ctx, state.tmpl, NULL, NULL);
+    }
+
+    data = read_file(ctx, templates_dir, bcase->data, &data_length);
+    handlebars_value_parse_json_stringl(ctx, input, data, data_length);
+#ifdef HANDLEBARS_HAVE_JSON
+    handlebars_value_init_json_stringl(ctx, input_json, data, data_length);
+#endif
+
+    *strrchr(expected_file, '.') = 0;
+    expected_file = talloc_asprintf_append(expected_file, ".expected");
+    expected = read_file(ctx, templates_dir, expected_file, &length);
+
+    partial_path = handlebars_string_asprintf(ctx, "%s/partials", bench_dir);
+    partial_ext = handlebars_string_ctor(ctx, HBS_STRL(".handlebars"));
+    (void) handlebars_value_partial_loader_init(ctx, partial_path, partial_ext, partials);
+
+    // Compile once for execution
+    parser = handlebars_parser_ctor(ctx);
+    compiler = handlebars_compiler_ctor(ctx);
+    state.module = handlebars_program_serialize(ctx, bench_compile(compiler, bench_parse(parser, &state), &state));
+    handlebars_compiler_dtor(compiler);
+    handlebars_parser_dtor(parser);
+
+    // Verify
+    for( phase = bench_phase_execute; phase < bench_phase_count; phase++ ) {
+#ifndef HANDLEBARS_HAVE_JSON
+        if( phase == bench_phase_execute_json ) {
+            continue;
+        }
+#endif
+        buffer = bench_execute(&state, phase == bench_phase_execute ? input : input_json, NULL);
+        if( !output_matches(expected, hbs_str_val(buffer)) ) {
+            fprintf(stderr, "FAIL %s (%s)\nExpected: %s\nActual: %s\n", bcase->template, bench_phase_names[phase], expected, hbs_str_val(buffer));
+            pass = false;
+        }
+        handlebars_talloc_free(buffer);
+    }
+
+    // Measure
+    for( phase = 0; pass && phase < bench_phase_count; phase++ ) {
+#ifndef HANDLEBARS_HAVE_JSON
+        if( phase == bench_phase_execute_json ) {
+            continue;
+        }
+#endif
+        bench_phase(&state, phase, &result);
+        print_result(bcase, phase, &result, first);
+    }
+
+    HANDLEBARS_VALUE_UNDECL(partials);
+    HANDLEBARS_VALUE_UNDECL(input_json);
+    HANDLEBARS_VALUE_UNDECL(input);
+    handlebars_talloc_free(state.module);
+    talloc_free(templates_dir);
+    return pass;
+}
+
+static int do_usage(void)
+{
+    fprintf(stdout,
+        "Usage: handlebars_bench [OPTIONS]\n"
+        "\n"
+        "Runs each benchmark template through the lex, parse, compile, serialize and execute phases\n"
+        "separately, and prints the mean, median and 99th percentile time of each phase along with\n"
+        "the number of allocations and bytes allocated per operation.\n"
+        "\n"
+        "Options:\n"
+        "  -h, --help            Show this message\n"
+        "  --dir=DIR             The directory containing the templates and partials directories\n"
+        "                        (default: %s)\n"
+        "  --filter=STRING       Only run templates whose name contains STRING\n"
+        "  --iterations=NUM      The number of measured runs of each phase (default: 1000)\n"
+        "  --warmup=NUM          The number of runs of each phase before measuring (default: 100)\n"
+        "  --json                Print the results as JSON\n"
+        "  --registers           Lower programs to registers (handlebars_compiler_flag_registers)\n",
+        HANDLEBARS_BENCH_DIR
+    );
+    return 0;
+}
+
+static bool read_opts(int argc, char * argv[])
+{
+    int c;
+    int option_index = 0;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"dir", required_argument, 0, 'd'},
+        {"filter", required_argument, 0, 'f'},
+        {"iterations", required_argument, 0, 'i'},
+        {"warmup", required_argument, 0, 'w'},
+        {"json", no_argument, 0, 'j'},
+        {"registers", no_argument, 0, 'r'},
+        {0, 0, 0, 0}
+    };
+
+    while( -1 != (c = getopt_long(argc, argv, "h", long_options, &option_index)) ) {
+        switch( c ) {
+            case 'd': bench_dir = optarg; break;
+            case 'f': filter = optarg; break;
+            case 'i': sscanf(optarg, "%ld", &iterations); break;
+            case 'w': sscanf(optarg, "%ld", &warmup); break;
+            case 'j': json_output = true; break;
+            case 'r': extra_flags |= handlebars_compiler_flag_registers; break;
+            default: return false;
+        }
+    }
+
+    return iterations > 0 && warmup >= 0;
+}
+
+static bool bench_all(struct handlebars_context * ctx)
+{
+    bool first = true;
+    bool pass = true;
+    size_t i;
+
+    if( json_output ) {
+        fprintf(stdout, "{\"version\": \"%s\", \"iterations\": %ld, \"warmup\": %ld, \"results\": [", handlebars_version_string(), iterations, warmup);
+    } else {
+        fprintf(stdout, "%-30s %-13s %12s %12s %12s %10s %12s\n", "template", "phase", "ns/op", "p50 ns", "p99 ns", "allocs/op", "bytes/op");
+    }
+
+    for( i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++ ) {
+        struct bench_case bcase = bench_cases[i];
+        if( filter && !strstr(bcase.template, filter) ) {
+            continue;
+        }
+        bcase.flags |= extra_flags;
+        if( !bench_case_run(ctx, &bcase, &first) ) {
+            pass = false;
+        }
+    }
+
+    if( json_output ) {
+        fprintf(stdout, "\n]}\n");
+    }
+
+    return pass;
+}
+
+int main(int argc, char * argv[])
+{
+    struct handlebars_context * ctx;
+    bool pass;
+    jmp_buf jmp;
+
+    if( !read_opts(argc, argv) ) {
+        do_usage();
+        return 1;
+    }
+
+    ctx = handlebars_context_ctor();
+
+    if( handlebars_setjmp_ex(ctx, &jmp) ) {
+        fprintf(stderr, "ERROR: %s\n", handlebars_error_message(ctx));
+        handlebars_context_dtor(ctx);
+        return 1;
+    }
+
+    pass = bench_all(ctx);
+
+    handlebars_context_dtor(ctx);
+    return pass ? 0 : 1;
+}
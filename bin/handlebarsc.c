@@ -25,7 +25,16 @@
 #include <talloc.h>
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef HANDLEBARS_HAVE_VALGRIND
 #include <valgrind/valgrind.h>
@@ -35,15 +44,19 @@
 #include "handlebars.h"
 #include "handlebars_ast.h"
 #include "handlebars_ast_printer.h"
+#include "handlebars_binary.h"
+#include "handlebars_bundle.h"
 #include "handlebars_cache.h"
 #include "handlebars_closure.h"
 #include "handlebars_compiler.h"
 #include "handlebars_delimiters.h"
 #include "handlebars_json.h"
+#include "handlebars_json_parser.h"
 #include "handlebars_helpers.h"
 #include "handlebars_map.h"
 #include "handlebars_memory.h"
 #include "handlebars_module_printer.h"
+#include "handlebars_native.h"
 #include "handlebars_opcodes.h"
 #include "handlebars_opcode_printer.h"
 #include "handlebars_opcode_serializer.h"
@@ -54,6 +67,8 @@
 #include "handlebars_token.h"
 #include "handlebars_value.h"
 #include "handlebars_vm.h"
+#include "handlebars_vm_profile.h"
+#include "handlebars_vm_trace.h"
 #include "handlebars_yaml.h"
 
 #ifdef _MSC_VER
@@ -78,6 +93,17 @@ static bool convert_input = true;
 static bool newline_at_eof = true;
 static size_t pool_size = 2 * 1024 * 1024;
 static bool pretty_print = true;
+static bool stream_output = false;
+static size_t arena_size = 0;
+static bool lazy_input = false;
+static const char * data_format = NULL;
+static const char * bundle_file = NULL;
+static long njobs = 0;
+static bool print_timings = false;
+static bool profile_execution = false;
+static const char * trace_file = NULL;
+static const char * trace_format = "chrome";
+static const char * template_name = NULL;
 
 enum handlebarsc_mode {
     handlebarsc_mode_usage = 0,
@@ -87,7 +113,9 @@ enum handlebarsc_mode {
     handlebarsc_mode_compile,
     handlebarsc_mode_module,
     handlebarsc_mode_execute,
-    handlebarsc_mode_debuginfo
+    handlebarsc_mode_debuginfo,
+    handlebarsc_mode_bundle,
+    handlebarsc_mode_emit_c
 };
 
 enum handlebarsc_flag {
@@ -97,6 +125,7 @@ enum handlebarsc_flag {
     handlebarsc_flag_template = 't',
     handlebarsc_flag_data = 'D',
     handlebarsc_flag_no_newline = 'n',
+    handlebarsc_flag_jobs = 'j',
 
     // misc flags
     handlebarsc_flag_pool_size = 500,
@@ -107,6 +136,16 @@ enum handlebarsc_flag {
     handlebarsc_flag_partial_loader = 505,
     handlebarsc_flag_flags = 506,
     handlebarsc_flag_pretty_print = 507,
+    handlebarsc_flag_stream = 508,
+    handlebarsc_flag_arena_size = 509,
+    handlebarsc_flag_lazy_input = 510,
+    handlebarsc_flag_data_format = 511,
+    handlebarsc_flag_bundle_file = 512,
+    handlebarsc_flag_timings = 513,
+    handlebarsc_flag_profile = 514,
+    handlebarsc_flag_trace = 515,
+    handlebarsc_flag_trace_format = 516,
+    handlebarsc_flag_template_name = 517,
 
     // modes
     handlebarsc_flag_lex = 600,
@@ -114,7 +153,9 @@ enum handlebarsc_flag {
     handlebarsc_flag_compile = 602,
     handlebarsc_flag_execute = 603,
     handlebarsc_flag_debuginfo = 604,
-    handlebarsc_flag_module = 605
+    handlebarsc_flag_module = 605,
+    handlebarsc_flag_bundle = 606,
+    handlebarsc_flag_emit_c = 607
 };
 
 static enum handlebarsc_mode mode = handlebarsc_mode_execute;
@@ -139,12 +180,17 @@ static void readOpts(int argc, char * argv[])
         HBSC_OPT(parse, no_argument, handlebarsc_flag_parse)
         HBSC_OPT(compile, no_argument, handlebarsc_flag_compile)
         HBSC_OPT(module, no_argument, handlebarsc_flag_module)
+        HBSC_OPT(bundle, no_argument, handlebarsc_flag_bundle)
+        HBSC_OPT(emit-c, no_argument, handlebarsc_flag_emit_c)
         HBSC_OPT(execute, no_argument, handlebarsc_flag_execute)
         HBSC_OPT(version, no_argument, handlebarsc_flag_version)
         HBSC_OPT(debuginfo, no_argument, handlebarsc_flag_debuginfo)
         // input
         HBSC_OPT(template, required_argument, handlebarsc_flag_template)
         HBSC_OPT(data, required_argument, handlebarsc_flag_data)
+        HBSC_OPT(data-format, required_argument, handlebarsc_flag_data_format)
+        HBSC_OPT(bundle-file, required_argument, handlebarsc_flag_bundle_file)
+        HBSC_OPT(template-name, required_argument, handlebarsc_flag_template_name)
         // compiler flags
         HBSC_OPT(flags, required_argument, handlebarsc_flag_flags)
         // loaders
@@ -157,12 +203,20 @@ static void readOpts(int argc, char * argv[])
         HBSC_OPT(no-newline, no_argument, handlebarsc_flag_no_newline)
         HBSC_OPT(pool-size, required_argument, handlebarsc_flag_pool_size)
         HBSC_OPT(pretty-print, no_argument, handlebarsc_flag_pretty_print)
+        HBSC_OPT(stream, no_argument, handlebarsc_flag_stream)
+        HBSC_OPT(arena-size, required_argument, handlebarsc_flag_arena_size)
+        HBSC_OPT(lazy-input, no_argument, handlebarsc_flag_lazy_input)
+        HBSC_OPT(jobs, required_argument, handlebarsc_flag_jobs)
+        HBSC_OPT(timings, no_argument, handlebarsc_flag_timings)
+        HBSC_OPT(profile, no_argument, handlebarsc_flag_profile)
+        HBSC_OPT(trace, required_argument, handlebarsc_flag_trace)
+        HBSC_OPT(trace-format, required_argument, handlebarsc_flag_trace_format)
         // end
         HBSC_OPT_END
     };
 
 start:
-    c = getopt_long(argc, argv, "hnVt:D:", long_options, &option_index);
+    c = getopt_long(argc, argv, "hnVt:D:j:", long_options, &option_index);
     if( c == -1 ) {
         return;
     }
@@ -193,6 +247,14 @@ start:
             mode = handlebarsc_mode_execute;
             break;
 
+        case handlebarsc_flag_bundle:
+            mode = handlebarsc_mode_bundle;
+            break;
+
+        case handlebarsc_flag_emit_c:
+            mode = handlebarsc_mode_emit_c;
+            break;
+
         case handlebarsc_flag_version:
             mode = handlebarsc_mode_version;
             break;
@@ -234,6 +296,9 @@ start:
             if (NULL != strstr(optarg, "mustache_style_lambdas")) {
                 compiler_flags |= handlebars_compiler_flag_mustache_style_lambdas;
             }
+            if (NULL != strstr(optarg, "registers")) {
+                compiler_flags |= handlebars_compiler_flag_registers;
+            }
             break;
 
         // partials
@@ -256,6 +321,15 @@ start:
         case handlebarsc_flag_data:
             input_data_name = optarg;
             break;
+        case handlebarsc_flag_data_format:
+            data_format = optarg;
+            break;
+        case handlebarsc_flag_bundle_file:
+            bundle_file = optarg;
+            break;
+        case handlebarsc_flag_template_name:
+            template_name = optarg;
+            break;
 
         // misc
         case handlebarsc_flag_run_count:
@@ -278,6 +352,38 @@ start:
             pretty_print = true;
             break;
 
+        case handlebarsc_flag_stream:
+            stream_output = true;
+            break;
+
+        case handlebarsc_flag_arena_size:
+            sscanf(optarg, "%zu", &arena_size);
+            break;
+
+        case handlebarsc_flag_lazy_input:
+            lazy_input = true;
+            break;
+
+        case handlebarsc_flag_jobs:
+            sscanf(optarg, "%ld", &njobs);
+            break;
+
+        case handlebarsc_flag_timings:
+            print_timings = true;
+            break;
+
+        case handlebarsc_flag_profile:
+            profile_execution = true;
+            break;
+
+        case handlebarsc_flag_trace:
+            trace_file = optarg;
+            break;
+
+        case handlebarsc_flag_trace_format:
+            trace_format = optarg;
+            break;
+
         default: assert(0); break; // LCOV_EXCL_LINE
     }
 
@@ -342,6 +448,23 @@ static void readInput(void)
     input_buf_length = talloc_array_length(input_buf) - 1;
 }
 
+// Guess the format of the input data from the file extension
+static const char * guess_data_format(const char * filename)
+{
+    const char * ext = strrchr(filename, '.');
+
+    if (!ext) {
+        return "json";
+    } else if (0 == strcmp(ext, ".yaml") || 0 == strcmp(ext, ".yml")) {
+        return "yaml";
+    } else if (0 == strcmp(ext, ".msgpack") || 0 == strcmp(ext, ".mpk") || 0 == strcmp(ext, ".mp")) {
+        return "msgpack";
+    } else if (0 == strcmp(ext, ".cbor")) {
+        return "cbor";
+    }
+    return "json";
+}
+
 static int do_usage(void)
 {
     fprintf(stdout,
@@ -356,27 +479,55 @@ static int do_usage(void)
         "  --parse               Parse the specified template into an AST\n"
         "  --compile             Compile the specified template into opcodes\n"
         "  --module              Compile and serialize the specified template into a module\n"
+        "  --bundle              Compile every template below the directory specified with -t, or\n"
+        "                        listed in the file specified with -t, into the bundle specified\n"
+        "                        with --bundle-file\n"
+        "  --emit-c              Compile the specified template into C source for a native template\n"
         "\n"
         "Input options:\n"
         "  -t, --template=FILE   The template to operate on\n"
-        "  -D, --data=FILE       The input data file. Supports JSON and YAML.\n"
+        "  -D, --data=FILE       The input data file. Supports JSON, YAML, MessagePack and CBOR.\n"
+        "  --data-format=FORMAT  The format of the input data, one of: json, yaml, msgpack, cbor\n"
+        "                        (default: guessed from the file extension, otherwise json)\n"
+        "  --bundle-file=FILE    The bundle to write with --bundle. When executing, the template is\n"
+        "                        looked up in this bundle by name instead of being compiled, and\n"
+        "                        --flags should match the flags the bundle was compiled with.\n"
+        "  --template-name=NAME  The name of the native template with --emit-c (default: the template\n"
+        "                        path without the partial-extension)\n"
         "\n"
         "Behavior options:\n"
         "  -n, --no-newline      Do not print a newline after execution\n"
+        "  --arena-size=SIZE     The size of the per-render VM arena, 0 to disable (default 0)\n"
+        "  -j, --jobs=NUM        The number of templates to compile in parallel with --bundle\n"
+        "                        (default: the number of CPUs)\n"
         "  --flags=FLAGS         The flags to pass to the compiler separated by commas. One or more of:\n"
         "                        compat, known_helpers_only, string_params, track_ids, no_escape,\n"
         "                        ignore_standalone, alternate_decorators, strict, assume_objects,\n"
-        "                        mustache_style_lambdas\n"
+        "                        mustache_style_lambdas, registers\n"
+        "  --lazy-input          Only decode the parts of JSON, MessagePack or CBOR data that are used\n"
         "  --no-convert-input    Do not convert data to native types (use JSON wrapper)\n"
         "  --partial-loader      Specify to enable loading partials dynamically\n"
         "  --partial-path=DIR    The directory in which to look for partials\n"
         "  --partial-ext=EXT     The file extension of partials, including the '.'\n"
         "  --pool-size=SIZE      The size of the memory pool to use, 0 to disable (default 2 MB)\n"
+        "  --profile             Print the time spent in each opcode and program to STDERR after\n"
+        "                        execution. Requires a library built with --enable-profiling\n"
         "  --run-count=NUM       The number of times to execute (for benchmarking)\n"
+        "  --stream              Write output to STDOUT as it is rendered instead of buffering it\n"
+        "  --timings             Print the compile time of each template with --bundle, slowest first\n"
+        "  --trace=FILE          Write the time spent in the template and each partial and helper to FILE\n"
+        "  --trace-format=FORMAT The format of --trace, one of: chrome (trace event JSON, default),\n"
+        "                        folded (stacks for flamegraph.pl)\n"
         "\n"
         "The partial loader will concat the partial-path, given partial name in the template,\n"
         "and the partial-extension to resolve the file from which to load the partial.\n"
         "\n"
+        "Templates in a bundle are named by their path relative to the directory, without the\n"
+        "partial-extension, e.g. users/show for users/show.hbs. Templates in a list file, one path\n"
+        "per line, are named by their path as given, without the partial-extension.\n"
+        "\n"
+        "Native templates are loaded with handlebars_native_module_ctor(), see handlebars_native.h.\n"
+        "\n"
         "If a FILE is specified as '-', it will be read from STDIN.\n"
         "\n"
         "handlebarsc home page: https://github.com/jbboehr/handlebars.c\n"
@@ -633,17 +784,455 @@ static int do_module(void)
     return 0;
 }
 
+static struct handlebars_module * compile_template(struct handlebars_context * ctx, struct handlebars_string * tmpl)
+{
+    struct handlebars_parser * parser = handlebars_parser_ctor(ctx);
+    struct handlebars_compiler * compiler = handlebars_compiler_ctor(ctx);
+
+    handlebars_compiler_set_flags(compiler, compiler_flags);
+
+    // Preprocess
+    if( compiler_flags & handlebars_compiler_flag_compat ) {
+        tmpl = handlebars_preprocess_delimiters(ctx, tmpl, NULL, NULL);
+    }
+
+    // Parse, compile and serialize
+    struct handlebars_ast_node * ast = handlebars_parse_ex(parser, tmpl, compiler_flags);
+    struct handlebars_program * program = handlebars_compiler_compile_ex(compiler, ast);
+    struct handlebars_module * module = handlebars_program_serialize(ctx, program);
+
+    handlebars_compiler_dtor(compiler);
+    handlebars_parser_dtor(parser);
+    return module;
+}
+
+struct bundle_job {
+    const char * path;
+    const char * name;
+    struct handlebars_module * module;
+    char * error;
+    double time;
+};
+
+struct bundle_jobs {
+    struct bundle_job * jobs;
+    size_t count;
+    size_t next;
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+};
+
+struct bundle_worker {
+    struct bundle_jobs * jobs;
+    struct handlebars_context * ctx;
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_t thread;
+#endif
+};
+
+static void bundle_jobs_push(struct handlebars_context * ctx, struct bundle_jobs * jobs, char * path, char * name)
+{
+    size_t name_len = strlen(name);
+    size_t ext_len = strlen(partial_extension);
+    struct bundle_job * job;
+
+    // Templates are named without the extension
+    if( name_len > ext_len && 0 == strcmp(name + name_len - ext_len, partial_extension) ) {
+        name[name_len - ext_len] = 0;
+    }
+
+    jobs->jobs = handlebars_talloc_realloc(ctx, jobs->jobs, struct bundle_job, jobs->count + 1);
+    job = &jobs->jobs[jobs->count++];
+    memset(job, 0, sizeof(*job));
+    job->path = talloc_steal(jobs->jobs, path);
+    job->name = talloc_steal(jobs->jobs, name);
+}
+
+// Queue every template below dir, named by its path relative to the top directory
+static void bundle_jobs_add_dir(struct handlebars_context * ctx, struct bundle_jobs * jobs, const char * dir, const char * prefix)
+{
+    size_t ext_len = strlen(partial_extension);
+    struct dirent * ent;
+    DIR * d;
+
+    d = opendir(dir);
+    if( !d ) {
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to open directory %s: %s", dir, strerror(errno));
+    }
+
+    while( NULL != (ent = readdir(d)) ) {
+        struct stat st;
+        char * path;
+        char * name;
+        size_t name_len;
+
+        if( ent->d_name[0] == '.' ) {
+            continue;
+        }
+
+        path = talloc_asprintf(ctx, "%s/%s", dir, ent->d_name);
+        name = prefix ? talloc_asprintf(ctx, "%s/%s", prefix, ent->d_name) : talloc_strdup(ctx, ent->d_name);
+        name_len = strlen(name);
+
+        if( 0 != stat(path, &st) ) {
+            closedir(d);
+            handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to stat %s: %s", path, strerror(errno));
+        }
+
+        if( S_ISDIR(st.st_mode) ) {
+            bundle_jobs_add_dir(ctx, jobs, path, name);
+        } else if( name_len > ext_len && 0 == strcmp(name + name_len - ext_len, partial_extension) ) {
+            bundle_jobs_push(ctx, jobs, path, name);
+            continue;
+        }
+
+        talloc_free(name);
+        talloc_free(path);
+    }
+
+    closedir(d);
+}
+
+// Queue every template listed in a file, one path per line, named by its path
+static void bundle_jobs_add_list(struct handlebars_context * ctx, struct bundle_jobs * jobs, char * list)
+{
+    char * line = list;
+
+    while( *line ) {
+        char * eol = strchr(line, '\n');
+        size_t len = eol ? (size_t) (eol - line) : strlen(line);
+
+        while( len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t') ) {
+            len--;
+        }
+
+        if( len > 0 ) {
+            char * path = talloc_strndup(ctx, line, len);
+            bundle_jobs_push(ctx, jobs, path, talloc_strdup(ctx, path));
+        }
+
+        if( !eol ) {
+            break;
+        }
+        line = eol + 1;
+    }
+}
+
+static struct bundle_job * bundle_jobs_next(struct bundle_jobs * jobs)
+{
+    struct bundle_job * job = NULL;
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_mutex_lock(&jobs->mutex);
+#endif
+    if( jobs->next < jobs->count ) {
+        job = &jobs->jobs[jobs->next++];
+    }
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_mutex_unlock(&jobs->mutex);
+#endif
+
+    return job;
+}
+
+static double elapsed_ms(struct timespec * start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start->tv_sec) * 1000.0 + (double) (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static struct handlebars_string * read_template(struct handlebars_context * ctx, const char * path)
+{
+    struct handlebars_string * tmpl;
+    char * buf;
+    FILE * f;
+    long size;
+
+    f = fopen(path, "rb");
+    if( !f ) {
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to open file: %s", strerror(errno));
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = handlebars_talloc_array(ctx, char, size + 1);
+    if( size > 0 && 1 != fread(buf, size, 1, f) ) {
+        fclose(f);
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to read file");
+    }
+    fclose(f);
+
+    tmpl = handlebars_string_ctor(ctx, buf, size);
+    handlebars_talloc_free(buf);
+    return tmpl;
+}
+
+// Compile one template, recording the error instead of giving up on the whole bundle
+static void bundle_compile_job(struct handlebars_context * ctx, struct bundle_job * job)
+{
+    struct handlebars_string * tmpl;
+    struct timespec start;
+    jmp_buf jmp;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if( handlebars_setjmp_ex(ctx, &jmp) ) {
+        job->error = handlebars_error_message(ctx);
+        job->time = elapsed_ms(&start);
+        return;
+    }
+
+    tmpl = read_template(ctx, job->path);
+    job->module = compile_template(ctx, tmpl);
+    job->time = elapsed_ms(&start);
+
+    handlebars_talloc_free(tmpl);
+}
+
+static void * bundle_worker_run(void * arg)
+{
+    struct bundle_worker * worker = arg;
+    struct bundle_job * job;
+
+    while( NULL != (job = bundle_jobs_next(worker->jobs)) ) {
+        bundle_compile_job(worker->ctx, job);
+    }
+
+    return NULL;
+}
+
+static int bundle_job_time_compare(const void * a, const void * b)
+{
+    double ta = (*(struct bundle_job * const *) a)->time;
+    double tb = (*(struct bundle_job * const *) b)->time;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+// Print the compile time of each template, slowest first
+static void bundle_print_timings(struct handlebars_context * ctx, struct bundle_jobs * jobs, long nworkers, double total)
+{
+    struct bundle_job ** sorted = handlebars_talloc_array(ctx, struct bundle_job *, jobs->count);
+    double sum = 0;
+    size_t i;
+
+    for( i = 0; i < jobs->count; i++ ) {
+        sorted[i] = &jobs->jobs[i];
+        sum += jobs->jobs[i].time;
+    }
+
+    qsort(sorted, jobs->count, sizeof(*sorted), bundle_job_time_compare);
+
+    for( i = 0; i < jobs->count; i++ ) {
+        fprintf(stderr, "%10.3f ms  %s\n", sorted[i]->time, sorted[i]->name);
+    }
+
+    fprintf(stderr, "Compiled %zu templates in %.3f ms (%.3f ms of compile time) using %ld jobs\n", jobs->count, total, sum, nworkers);
+    handlebars_talloc_free(sorted);
+}
+
+static int bundle_build(struct handlebars_context * ctx)
+{
+    struct handlebars_bundle_builder * builder = NULL;
+    struct bundle_jobs jobs = {0};
+    struct bundle_worker * workers;
+    struct timespec start;
+    struct stat st;
+    long nworkers = njobs;
+    long started = 1;
+    long i;
+    size_t j;
+    bool failed = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Collect
+    if( 0 == strcmp(input_name, "-") || (0 == stat(input_name, &st) && !S_ISDIR(st.st_mode)) ) {
+        bundle_jobs_add_list(ctx, &jobs, file_get_contents(input_name));
+    } else {
+        bundle_jobs_add_dir(ctx, &jobs, input_name, NULL);
+    }
+
+    if( nworkers <= 0 ) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#if !defined(HANDLEBARS_HAVE_PTHREAD) || !defined(TLS)
+    // Without thread-local storage the parser keeps its state in a global, so parse one template at a time
+    nworkers = 1;
+#endif
+    if( nworkers > (long) jobs.count ) {
+        nworkers = (long) jobs.count;
+    }
+    if( nworkers < 1 ) {
+        nworkers = 1;
+    }
+
+    // Compile. Each worker gets its own context, since talloc is not thread-safe
+    workers = handlebars_talloc_array(ctx, struct bundle_worker, nworkers);
+    memset(workers, 0, sizeof(*workers) * nworkers);
+    for( i = 0; i < nworkers; i++ ) {
+        workers[i].jobs = &jobs;
+        workers[i].ctx = handlebars_context_ctor_ex(NULL);
+    }
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_mutex_init(&jobs.mutex, NULL);
+    for( started = 1; started < nworkers; started++ ) {
+        // Make do with the threads we have
+        if( 0 != pthread_create(&workers[started].thread, NULL, bundle_worker_run, &workers[started]) ) {
+            break;
+        }
+    }
+#endif
+
+    bundle_worker_run(&workers[0]);
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    for( i = 1; i < started; i++ ) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&jobs.mutex);
+#endif
+
+    // Report
+    for( j = 0; j < jobs.count; j++ ) {
+        if( jobs.jobs[j].error ) {
+            fprintf(stderr, "ERROR: %s: %s\n", jobs.jobs[j].path, jobs.jobs[j].error);
+            failed = true;
+        }
+    }
+
+    if( print_timings ) {
+        bundle_print_timings(ctx, &jobs, started, elapsed_ms(&start));
+    }
+
+    // Write. The builder keeps a copy of each module
+    if( !failed ) {
+        builder = handlebars_bundle_builder_ctor(ctx);
+        for( j = 0; j < jobs.count; j++ ) {
+            struct handlebars_string * key = handlebars_string_ctor(ctx, jobs.jobs[j].name, strlen(jobs.jobs[j].name));
+            handlebars_bundle_builder_add(builder, key, jobs.jobs[j].module);
+            handlebars_talloc_free(key);
+        }
+    }
+
+    for( i = 0; i < nworkers; i++ ) {
+        handlebars_context_dtor(workers[i].ctx);
+    }
+
+    if( !failed ) {
+        handlebars_bundle_builder_write(builder, bundle_file);
+    }
+
+    return failed ? 1 : 0;
+}
+
+static int do_bundle(void)
+{
+    struct handlebars_context * ctx;
+    jmp_buf jmp;
+    int ret;
+
+    if( !input_name || !bundle_file ) {
+        fprintf(stderr, "A template directory or list and --bundle-file are required\n");
+        return 1;
+    }
+
+    ctx = handlebars_context_ctor_ex(root);
+
+    // Save jump buffer
+    if( handlebars_setjmp_ex(ctx, &jmp) ) {
+        fprintf(stderr, "ERROR: %s\n", handlebars_error_message(ctx));
+        handlebars_context_dtor(ctx);
+        return 1;
+    }
+
+    ret = bundle_build(ctx);
+
+    handlebars_context_dtor(ctx);
+    return ret;
+}
+
+static int do_emit_c(void)
+{
+    struct handlebars_context * ctx;
+    struct handlebars_string * tmpl;
+    struct handlebars_module * module;
+    struct handlebars_string * output;
+    char * name;
+    size_t name_len;
+    size_t ext_len = strlen(partial_extension);
+    jmp_buf jmp;
+
+    ctx = handlebars_context_ctor_ex(root);
+
+    // Save jump buffer
+    if( handlebars_setjmp_ex(ctx, &jmp) ) {
+        fprintf(stderr, "ERROR: %s\n", handlebars_error_message(ctx));
+        handlebars_context_dtor(ctx);
+        return 1;
+    }
+
+    // Templates are named without the extension, like in bundles
+    if( template_name ) {
+        name = talloc_strdup(ctx, template_name);
+    } else if( input_name && 0 != strcmp(input_name, "-") ) {
+        name = talloc_strdup(ctx, input_name);
+        name_len = strlen(name);
+        if( name_len > ext_len && 0 == strcmp(name + name_len - ext_len, partial_extension) ) {
+            name[name_len - ext_len] = 0;
+        }
+    } else {
+        fprintf(stderr, "A --template-name is required when reading the template from STDIN\n");
+        handlebars_context_dtor(ctx);
+        return 1;
+    }
+
+    // Read
+    readInput();
+    tmpl = handlebars_string_ctor(HBSCTX(ctx), input_buf, strlen(input_buf));
+
+    // Compile and translate
+    module = compile_template(ctx, tmpl);
+    output = handlebars_native_emit(ctx, module, name);
+    fwrite(hbs_str_val(output), sizeof(char), hbs_str_len(output), stdout);
+
+    handlebars_context_dtor(ctx);
+    return 0;
+}
+
+static void stdout_output_func(struct handlebars_vm * vm, const char * str, size_t len, void * ctx)
+{
+    fwrite(str, sizeof(char), len, stdout);
+}
+
 static int do_execute(void)
 {
     struct handlebars_context * ctx;
     struct handlebars_parser * parser;
     struct handlebars_compiler * compiler;
-    struct handlebars_string * tmpl;
-    struct handlebars_ast_node * ast;
-    struct handlebars_program * program;
+    struct handlebars_string * volatile tmpl = NULL;
+    struct handlebars_module * module;
+    struct handlebars_vm_profile * volatile profile = NULL;
+    struct handlebars_vm_trace_collector * volatile trace = NULL;
     HANDLEBARS_VALUE_DECL(partials);
     jmp_buf jmp;
 
+    if( trace_file && 0 != strcmp(trace_format, "chrome") && 0 != strcmp(trace_format, "folded") ) {
+        fprintf(stderr, "Unknown trace format: %s\n", trace_format);
+        return 1;
+    }
+
+#ifndef HANDLEBARS_ENABLE_PROFILING
+    if( profile_execution ) {
+        fprintf(stderr, "Profiling is not available, handlebars was built without --enable-profiling\n");
+        return 1;
+    }
+#endif
+
     ctx = handlebars_context_ctor_ex(root);
 
     // Save jump buffer
@@ -666,54 +1255,92 @@ static int do_execute(void)
 
     handlebars_compiler_set_flags(compiler, compiler_flags);
 
-    // Read
-    readInput();
-    tmpl = handlebars_string_ctor(HBSCTX(parser), input_buf, strlen(input_buf));
+    // Read, unless the template is looked up in a bundle
+    if( !bundle_file ) {
+        readInput();
+        tmpl = handlebars_string_ctor(HBSCTX(parser), input_buf, strlen(input_buf));
 
-    // Preprocess
-    if( compiler_flags & handlebars_compiler_flag_compat ) {
-        tmpl = handlebars_preprocess_delimiters(ctx, tmpl, NULL, NULL);
+        // Preprocess
+        if( compiler_flags & handlebars_compiler_flag_compat ) {
+            tmpl = handlebars_preprocess_delimiters(ctx, tmpl, NULL, NULL);
+        }
+    } else if( !input_name ) {
+        fprintf(stderr, "No template name!\n");
+        exit(1);
     }
 
     // Read context
     HANDLEBARS_VALUE_DECL(input);
     if( input_data_name ) {
-        size_t input_data_name_len = strlen(input_data_name);
-        char * input_str = file_get_contents(input_data_name);
-        size_t input_str_size = talloc_array_length(input_str);
-        if (input_str && input_str_size > 1) {
-            if (handlebars_value_is_empty(input) && input_data_name_len > 5 && (0 == strcmp(input_data_name + input_data_name_len - 5, ".yaml") ||
-                    0 == strcmp(input_data_name + input_data_name_len - 4, ".yml"))) {
+        const char * format = data_format ? data_format : guess_data_format(input_data_name);
+        if (0 == strcmp(format, "json") && lazy_input) {
+            handlebars_value_init_json_lazy_file(ctx, input, input_data_name);
+        } else {
+            char * input_str = file_get_contents(input_data_name);
+            size_t input_str_size = talloc_array_length(input_str);
+            if (!input_str || input_str_size <= 1) {
+                // empty input
+            } else if (0 == strcmp(format, "yaml")) {
 #ifdef HANDLEBARS_HAVE_YAML
                 handlebars_value_init_yaml_string(ctx, input, input_str);
 #else
                 fprintf(stderr, "Failed to process input data: YAML support is disabled");
                 exit(1);
 #endif
-            }
-            if (handlebars_value_is_empty(input)) {
-#ifdef HANDLEBARS_HAVE_JSON
-                // assume json
-                handlebars_value_init_json_stringl(ctx, input, input_str, input_str_size - 1);
-                if (convert_input) {
-                    handlebars_value_convert(input);
+            } else if (0 == strcmp(format, "msgpack")) {
+                if (lazy_input) {
+                    handlebars_value_init_msgpack_lazy(ctx, input, input_str, input_str_size - 1);
+                } else {
+                    handlebars_value_init_msgpack_stringl(ctx, input, input_str, input_str_size - 1);
                 }
+            } else if (0 == strcmp(format, "cbor")) {
+                if (lazy_input) {
+                    handlebars_value_init_cbor_lazy(ctx, input, input_str, input_str_size - 1);
+                } else {
+                    handlebars_value_init_cbor_stringl(ctx, input, input_str, input_str_size - 1);
+                }
+            } else if (0 == strcmp(format, "json")) {
+                if (convert_input) {
+                    handlebars_value_parse_json_stringl(ctx, input, input_str, input_str_size - 1);
+                } else {
+#ifdef HANDLEBARS_HAVE_JSON
+                    handlebars_value_init_json_stringl(ctx, input, input_str, input_str_size - 1);
 #else
-                fprintf(stderr, "Failed to process input data: JSON support is disabled");
-                exit(1);
+                    fprintf(stderr, "Failed to process input data: JSON support is disabled");
+                    exit(1);
 #endif
+                }
+            } else {
+                fprintf(stderr, "Unknown data format: %s\n", format);
+                exit(1);
             }
         }
     }
 
-    // Parse
-    ast = handlebars_parse_ex(parser, tmpl, compiler_flags);
+    if( bundle_file ) {
+        // Look up
+        struct handlebars_bundle * bundle = handlebars_bundle_ctor(ctx, bundle_file);
+        module = handlebars_bundle_find(bundle, input_name, strlen(input_name));
+        if( !module ) {
+            handlebars_throw(ctx, HANDLEBARS_ERROR, "Template %s not found in bundle %s", input_name, bundle_file);
+        }
+    } else {
+        // Parse
+        struct handlebars_ast_node * ast = handlebars_parse_ex(parser, tmpl, compiler_flags);
 
-    // Compile
-    program = handlebars_compiler_compile_ex(compiler, ast);
+        // Compile
+        struct handlebars_program * program = handlebars_compiler_compile_ex(compiler, ast);
 
-    // Serialize
-    struct handlebars_module * module = handlebars_program_serialize(ctx, program);
+        // Serialize
+        module = handlebars_program_serialize(ctx, program);
+    }
+
+    if( profile_execution ) {
+        profile = handlebars_vm_profile_ctor(ctx);
+    }
+    if( trace_file ) {
+        trace = handlebars_vm_trace_collector_ctor(ctx);
+    }
 
     // Execute
     struct handlebars_string * buffer = NULL;
@@ -727,6 +1354,19 @@ static int do_execute(void)
         vm = handlebars_vm_ctor(ctx);
         handlebars_vm_set_flags(vm, compiler_flags);
         handlebars_vm_set_partials(vm, partials);
+        if (stream_output) {
+            handlebars_vm_set_output(vm, stdout_output_func, NULL, HANDLEBARS_VM_OUTPUT_THRESHOLD);
+        }
+        if (arena_size > 0) {
+            handlebars_vm_set_arena(vm, arena_size);
+        }
+        if (profile) {
+            handlebars_vm_set_profile(vm, profile);
+        }
+        if (trace) {
+            handlebars_vm_trace_collector_attach(trace, vm, 1);
+            handlebars_vm_set_trace_name(vm, input_name);
+        }
 
         buffer = handlebars_vm_execute(vm, module, input);
         buffer = talloc_steal(ctx, buffer);
@@ -742,6 +1382,36 @@ static int do_execute(void)
         fwrite("\n", sizeof(char), 1, stdout);
     }
 
+    if (profile) {
+        struct handlebars_string * report = handlebars_vm_profile_print(ctx, profile);
+        fflush(stdout);
+        fwrite(hbs_str_val(report), sizeof(char), hbs_str_len(report), stderr);
+        handlebars_vm_profile_dtor(profile);
+    }
+
+    if (trace) {
+        struct handlebars_string * report;
+        FILE * fp;
+        if (0 == strcmp(trace_format, "folded")) {
+            report = handlebars_vm_trace_collector_folded(ctx, trace);
+        } else {
+            report = handlebars_vm_trace_collector_chrome(ctx, trace);
+        }
+        fp = 0 == strcmp(trace_file, "-") ? stderr : fopen(trace_file, "w");
+        if (!fp) {
+            handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to open file: %s", strerror(errno));
+        }
+        fwrite(hbs_str_val(report), sizeof(char), hbs_str_len(report), fp);
+        if (fp != stderr) {
+            fclose(fp);
+        }
+        if (handlebars_vm_trace_collector_dropped(trace) > 0) {
+            fprintf(stderr, "Trace limited to %zu events, %zu more were dropped\n",
+                handlebars_vm_trace_collector_count(trace), handlebars_vm_trace_collector_dropped(trace));
+        }
+        handlebars_vm_trace_collector_dtor(trace);
+    }
+
     HANDLEBARS_VALUE_UNDECL(input);
     HANDLEBARS_VALUE_UNDECL(partials);
     handlebars_context_dtor(ctx);
@@ -784,6 +1454,8 @@ int main(int argc, char * argv[])
         case handlebarsc_mode_parse: return do_parse();
         case handlebarsc_mode_compile: return do_compile();
         case handlebarsc_mode_module: return do_module();
+        case handlebarsc_mode_bundle: return do_bundle();
+        case handlebarsc_mode_emit_c: return do_emit_c();
         case handlebarsc_mode_execute: return do_execute();
         case handlebarsc_mode_debuginfo: return do_debuginfo();
         case handlebarsc_mode_usage: return do_usage();
@@ -157,7 +157,6 @@ stdenv.mkDerivation rec {
     ++ lib.optional checkSupport "-DHANDLEBARS_ENABLE_TESTS=1";
 
   preConfigure = lib.optionalString checkSupport ''
-    patchShebangs ./bench/run.sh
     patchShebangs ./tests/test_executable.bats
     export handlebars_export_dir=${handlebars_spec}/share/handlebars-spec/export/
     export handlebars_spec_dir=${handlebars_spec}/share/handlebars-spec/spec/
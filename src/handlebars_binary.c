@@ -0,0 +1,1013 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <talloc.h>
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_private.h"
+#include "handlebars_value_private.h"
+
+#include "handlebars_binary.h"
+#include "handlebars_map.h"
+#include "handlebars_stack.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "handlebars_value_handlers.h"
+
+
+
+enum binary_format {
+    BINARY_FORMAT_MSGPACK = 0,
+    BINARY_FORMAT_CBOR = 1
+};
+
+static const char * binary_format_names[] = {
+    "MessagePack",
+    "CBOR"
+};
+
+enum binary_kind {
+    BINARY_KIND_NULL = 0,
+    BINARY_KIND_FALSE,
+    BINARY_KIND_TRUE,
+    BINARY_KIND_INTEGER,
+    BINARY_KIND_FLOAT,
+    BINARY_KIND_STRING,
+    BINARY_KIND_ARRAY,
+    BINARY_KIND_MAP
+};
+
+struct binary_item {
+    enum binary_kind kind;
+    long lval;
+    double dval;
+    //! String payload, pointing into the document
+    const char * str;
+    //! String length, or the number of children of an array or map
+    size_t len;
+};
+
+struct binary_reader {
+    struct handlebars_context * ctx;
+    enum binary_format format;
+    const unsigned char * start;
+    const unsigned char * p;
+    const unsigned char * end;
+    unsigned depth;
+    const char * error;
+
+    //! Open addressing table of map keys, so each distinct key is allocated and hashed once. Holds a reference to
+    //! each key.
+    void * tmp;
+    struct handlebars_string ** keys;
+    size_t keys_size;
+    size_t keys_count;
+};
+
+static bool binary_error(struct binary_reader * reader, const unsigned char * p, const char * msg)
+{
+    reader->p = p;
+    reader->error = msg;
+    return false;
+}
+
+static inline uint16_t load16(const unsigned char * p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t load32(const unsigned char * p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline uint64_t load64(const unsigned char * p)
+{
+    return ((uint64_t) load32(p) << 32) | load32(p + 4);
+}
+
+static inline double load_float32(const unsigned char * p)
+{
+    uint32_t bits = load32(p);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline double load_float64(const unsigned char * p)
+{
+    uint64_t bits = load64(p);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static double load_float16(const unsigned char * p)
+{
+    unsigned half = load16(p);
+    unsigned exponent = (half >> 10) & 0x1F;
+    unsigned mantissa = half & 0x3FF;
+    double d;
+
+    if (exponent == 0) {
+        d = ldexp(mantissa, -24);
+    } else if (exponent != 31) {
+        d = ldexp(mantissa + 1024, (int) exponent - 25);
+    } else {
+        d = mantissa == 0 ? INFINITY : NAN;
+    }
+
+    return half & 0x8000 ? -d : d;
+}
+
+static inline void item_unsigned(struct binary_item * item, uint64_t u)
+{
+    if (u <= LONG_MAX) {
+        item->kind = BINARY_KIND_INTEGER;
+        item->lval = (long) u;
+    } else {
+        item->kind = BINARY_KIND_FLOAT;
+        item->dval = (double) u;
+    }
+}
+
+// {{{ Headers
+
+// Read the fixed-size part of a length, moving past it
+static inline bool read_length(struct binary_reader * reader, size_t width, uint64_t * rv)
+{
+    if ((size_t) (reader->end - reader->p) < width) {
+        return binary_error(reader, reader->p, "unexpected end of input");
+    }
+
+    switch (width) {
+        case 1: *rv = reader->p[0]; break;
+        case 2: *rv = load16(reader->p); break;
+        case 4: *rv = load32(reader->p); break;
+        default: *rv = load64(reader->p); break;
+    }
+
+    reader->p += width;
+    return true;
+}
+
+static inline bool read_payload(struct binary_reader * reader, struct binary_item * item, uint64_t len)
+{
+    if ((uint64_t) (reader->end - reader->p) < len) {
+        return binary_error(reader, reader->p, "unexpected end of input");
+    }
+    item->kind = BINARY_KIND_STRING;
+    item->str = (const char *) reader->p;
+    item->len = (size_t) len;
+    reader->p += len;
+    return true;
+}
+
+static inline bool read_container(struct binary_reader * reader, struct binary_item * item, enum binary_kind kind, uint64_t count)
+{
+    // Every child takes at least one byte, which bounds the count before anything is allocated for it
+    if (count > (uint64_t) (reader->end - reader->p) / (kind == BINARY_KIND_MAP ? 2 : 1)) {
+        return binary_error(reader, reader->p, "unexpected end of input");
+    }
+    item->kind = kind;
+    item->len = (size_t) count;
+    return true;
+}
+
+static bool read_msgpack(struct binary_reader * reader, struct binary_item * item)
+{
+    const unsigned char * begin = reader->p;
+    unsigned char c = *reader->p++;
+    uint64_t u;
+
+    if (c <= 0x7F) {
+        item->kind = BINARY_KIND_INTEGER;
+        item->lval = c;
+        return true;
+    } else if (c >= 0xE0) {
+        item->kind = BINARY_KIND_INTEGER;
+        item->lval = (signed char) c;
+        return true;
+    } else if (c <= 0x8F) {
+        return read_container(reader, item, BINARY_KIND_MAP, c & 0x0F);
+    } else if (c <= 0x9F) {
+        return read_container(reader, item, BINARY_KIND_ARRAY, c & 0x0F);
+    } else if (c <= 0xBF) {
+        return read_payload(reader, item, c & 0x1F);
+    }
+
+    switch (c) {
+        case 0xC0: item->kind = BINARY_KIND_NULL; return true;
+        case 0xC2: item->kind = BINARY_KIND_FALSE; return true;
+        case 0xC3: item->kind = BINARY_KIND_TRUE; return true;
+
+        // bin 8/16/32 and str 8/16/32
+        case 0xC4: case 0xD9:
+            return read_length(reader, 1, &u) && read_payload(reader, item, u);
+        case 0xC5: case 0xDA:
+            return read_length(reader, 2, &u) && read_payload(reader, item, u);
+        case 0xC6: case 0xDB:
+            return read_length(reader, 4, &u) && read_payload(reader, item, u);
+
+        // ext 8/16/32, the type byte is dropped
+        case 0xC7:
+            return read_length(reader, 1, &u) && read_length(reader, 1, &(uint64_t){0}) && read_payload(reader, item, u);
+        case 0xC8:
+            return read_length(reader, 2, &u) && read_length(reader, 1, &(uint64_t){0}) && read_payload(reader, item, u);
+        case 0xC9:
+            return read_length(reader, 4, &u) && read_length(reader, 1, &(uint64_t){0}) && read_payload(reader, item, u);
+
+        // fixext 1/2/4/8/16
+        case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8:
+            return read_length(reader, 1, &(uint64_t){0}) && read_payload(reader, item, 1u << (c - 0xD4));
+
+        case 0xCA:
+            if (!read_length(reader, 4, &u)) {
+                return false;
+            }
+            item->kind = BINARY_KIND_FLOAT;
+            item->dval = load_float32(reader->p - 4);
+            return true;
+        case 0xCB:
+            if (!read_length(reader, 8, &u)) {
+                return false;
+            }
+            item->kind = BINARY_KIND_FLOAT;
+            item->dval = load_float64(reader->p - 8);
+            return true;
+
+        // uint 8/16/32/64
+        case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+            if (!read_length(reader, 1u << (c - 0xCC), &u)) {
+                return false;
+            }
+            item_unsigned(item, u);
+            return true;
+
+        // int 8/16/32/64
+        case 0xD0: case 0xD1: case 0xD2: case 0xD3: {
+            size_t width = 1u << (c - 0xD0);
+            if (!read_length(reader, width, &u)) {
+                return false;
+            }
+            item->kind = BINARY_KIND_INTEGER;
+            switch (width) {
+                case 1: item->lval = (int8_t) u; break;
+                case 2: item->lval = (int16_t) u; break;
+                case 4: item->lval = (int32_t) u; break;
+                default: item->lval = (long) (int64_t) u; break;
+            }
+            return true;
+        }
+
+        case 0xDC:
+            return read_length(reader, 2, &u) && read_container(reader, item, BINARY_KIND_ARRAY, u);
+        case 0xDD:
+            return read_length(reader, 4, &u) && read_container(reader, item, BINARY_KIND_ARRAY, u);
+        case 0xDE:
+            return read_length(reader, 2, &u) && read_container(reader, item, BINARY_KIND_MAP, u);
+        case 0xDF:
+            return read_length(reader, 4, &u) && read_container(reader, item, BINARY_KIND_MAP, u);
+
+        default:
+            return binary_error(reader, begin, "invalid type byte");
+    }
+}
+
+static bool read_cbor(struct binary_reader * reader, struct binary_item * item)
+{
+    const unsigned char * begin;
+    unsigned char c;
+    unsigned major;
+    unsigned info;
+    uint64_t u;
+
+    // Tags are skipped, the tagged item is decoded as is
+    do {
+        if (reader->p >= reader->end) {
+            return binary_error(reader, reader->p, "unexpected end of input");
+        }
+        begin = reader->p;
+        c = *reader->p++;
+        major = c >> 5;
+        info = c & 0x1F;
+
+        if (info < 24) {
+            u = info;
+        } else if (info <= 27) {
+            if (!read_length(reader, 1u << (info - 24), &u)) {
+                return false;
+            }
+        } else if (info == 31) {
+            return binary_error(reader, begin, "indefinite-length items are not supported");
+        } else {
+            return binary_error(reader, begin, "invalid additional information");
+        }
+    } while (major == 6);
+
+    switch (major) {
+        case 0:
+            item_unsigned(item, u);
+            return true;
+        case 1:
+            if (u <= LONG_MAX) {
+                item->kind = BINARY_KIND_INTEGER;
+                item->lval = -1 - (long) u;
+            } else {
+                item->kind = BINARY_KIND_FLOAT;
+                item->dval = -1.0 - (double) u;
+            }
+            return true;
+        case 2:
+        case 3:
+            return read_payload(reader, item, u);
+        case 4:
+            return read_container(reader, item, BINARY_KIND_ARRAY, u);
+        case 5:
+            return read_container(reader, item, BINARY_KIND_MAP, u);
+        default:
+            break;
+    }
+
+    // Simple values and floats
+    switch (info) {
+        case 20: item->kind = BINARY_KIND_FALSE; break;
+        case 21: item->kind = BINARY_KIND_TRUE; break;
+        case 25:
+            item->kind = BINARY_KIND_FLOAT;
+            item->dval = load_float16(reader->p - 2);
+            break;
+        case 26:
+            item->kind = BINARY_KIND_FLOAT;
+            item->dval = load_float32(reader->p - 4);
+            break;
+        case 27:
+            item->kind = BINARY_KIND_FLOAT;
+            item->dval = load_float64(reader->p - 8);
+            break;
+        default:
+            // null, undefined and unassigned simple values
+            item->kind = BINARY_KIND_NULL;
+            break;
+    }
+    return true;
+}
+
+// Read the header of the next item. Strings are consumed entirely, containers up to their first child.
+static inline bool read_item(struct binary_reader * reader, struct binary_item * item)
+{
+    if (reader->p >= reader->end) {
+        return binary_error(reader, reader->p, "unexpected end of input");
+    }
+    if (reader->format == BINARY_FORMAT_MSGPACK) {
+        return read_msgpack(reader, item);
+    }
+    return read_cbor(reader, item);
+}
+
+// }}} Headers
+
+// {{{ Validation
+
+// Validate the item at the current position and move past it, without allocating
+static bool skip_item(struct binary_reader * reader)
+{
+    struct binary_item item;
+    size_t i;
+
+    if (!read_item(reader, &item)) {
+        return false;
+    }
+
+    if (item.kind != BINARY_KIND_ARRAY && item.kind != BINARY_KIND_MAP) {
+        return true;
+    }
+
+    if (++reader->depth > HANDLEBARS_BINARY_MAX_DEPTH) {
+        return binary_error(reader, reader->p, "maximum nesting depth exceeded");
+    }
+
+    for (i = 0; i < item.len; i++) {
+        if (item.kind == BINARY_KIND_MAP) {
+            struct binary_item key;
+            const unsigned char * begin = reader->p;
+            if (!read_item(reader, &key)) {
+                return false;
+            }
+            if (key.kind != BINARY_KIND_STRING && key.kind != BINARY_KIND_INTEGER) {
+                return binary_error(reader, begin, "map keys must be strings or integers");
+            }
+        }
+        if (!skip_item(reader)) {
+            return false;
+        }
+    }
+
+    reader->depth--;
+    return true;
+}
+
+static void binary_validate(struct binary_reader * reader)
+{
+    bool ok = skip_item(reader);
+
+    if (ok && reader->p < reader->end) {
+        ok = binary_error(reader, reader->p, "unexpected trailing data");
+    }
+
+    if (!ok) {
+        handlebars_throw(
+            reader->ctx,
+            HANDLEBARS_ERROR,
+            "%s decode error: %s at offset %zu",
+            binary_format_names[reader->format],
+            reader->error,
+            (size_t) (reader->p - reader->start)
+        );
+    }
+
+    reader->p = reader->start;
+}
+
+static void binary_reader_init(
+    struct binary_reader * reader,
+    struct handlebars_context * ctx,
+    enum binary_format format,
+    const char * data,
+    size_t length
+) {
+    memset(reader, 0, sizeof(*reader));
+    reader->ctx = ctx;
+    reader->format = format;
+    reader->start = reader->p = (const unsigned char *) data;
+    reader->end = reader->start + length;
+}
+
+// }}} Validation
+
+// {{{ Decoding
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(reader->ctx)
+
+// Convert an integer map key to a string
+static inline size_t format_key(char * buf, size_t size, struct binary_item * key)
+{
+    int len = snprintf(buf, size, "%ld", key->lval);
+    key->str = buf;
+    key->len = (size_t) len;
+    return key->len;
+}
+
+static void keys_grow(struct binary_reader * reader)
+{
+    size_t old_size = reader->keys_size;
+    struct handlebars_string ** old_keys = reader->keys;
+    size_t i;
+
+    reader->keys_size = old_size * 2;
+    reader->keys = MC(handlebars_talloc_zero_size(reader->tmp, sizeof(struct handlebars_string *) * reader->keys_size));
+
+    for (i = 0; i < old_size; i++) {
+        if (old_keys[i]) {
+            size_t j = hbs_str_hash(old_keys[i]) & (reader->keys_size - 1);
+            while (reader->keys[j]) {
+                j = (j + 1) & (reader->keys_size - 1);
+            }
+            reader->keys[j] = old_keys[i];
+        }
+    }
+
+    handlebars_talloc_free(old_keys);
+}
+
+static struct handlebars_string * intern_key(struct binary_reader * reader, const char * str, size_t len)
+{
+    uint32_t hash = handlebars_string_hash(str, len);
+    size_t mask = reader->keys_size - 1;
+    size_t i = hash & mask;
+    struct handlebars_string * key;
+
+    while (NULL != (key = reader->keys[i])) {
+        if (hbs_str_hash(key) == hash && hbs_str_len(key) == len && 0 == memcmp(hbs_str_val(key), str, len)) {
+            return key;
+        }
+        i = (i + 1) & mask;
+    }
+
+    key = handlebars_string_ctor_ex(reader->ctx, str, len, hash);
+    handlebars_string_addref(key);
+    reader->keys[i] = key;
+    if (++reader->keys_count * 2 > reader->keys_size) {
+        keys_grow(reader);
+    }
+    return key;
+}
+
+static void decode_scalar(struct binary_reader * reader, struct binary_item * item, struct handlebars_value * rv)
+{
+    switch (item->kind) {
+        case BINARY_KIND_FALSE:
+            handlebars_value_boolean(rv, false);
+            break;
+        case BINARY_KIND_TRUE:
+            handlebars_value_boolean(rv, true);
+            break;
+        case BINARY_KIND_INTEGER:
+            handlebars_value_integer(rv, item->lval);
+            break;
+        case BINARY_KIND_FLOAT:
+            handlebars_value_float(rv, item->dval);
+            break;
+        case BINARY_KIND_STRING:
+            handlebars_value_str(rv, handlebars_string_ctor(reader->ctx, item->str, item->len));
+            break;
+        default:
+            handlebars_value_null(rv);
+            break;
+    }
+}
+
+// Decode a validated item
+static void decode_item(struct binary_reader * reader, struct handlebars_value * rv)
+{
+    struct binary_item item;
+    size_t i;
+
+    read_item(reader, &item);
+
+    if (item.kind == BINARY_KIND_MAP) {
+        struct handlebars_map * map = handlebars_map_ctor(reader->ctx, item.len);
+        for (i = 0; i < item.len; i++) {
+            struct binary_item key;
+            struct handlebars_value child;
+            char buf[32];
+            read_item(reader, &key);
+            if (key.kind == BINARY_KIND_INTEGER) {
+                format_key(buf, sizeof(buf), &key);
+            }
+            handlebars_value_init(&child);
+            decode_item(reader, &child);
+            map = handlebars_map_update(map, intern_key(reader, key.str, key.len), &child);
+            handlebars_value_dtor(&child);
+        }
+        handlebars_value_map(rv, map);
+    } else if (item.kind == BINARY_KIND_ARRAY) {
+        struct handlebars_stack * stack = handlebars_stack_ctor(reader->ctx, item.len);
+        for (i = 0; i < item.len; i++) {
+            struct handlebars_value child;
+            handlebars_value_init(&child);
+            decode_item(reader, &child);
+            stack = handlebars_stack_push(stack, &child);
+            handlebars_value_dtor(&child);
+        }
+        handlebars_value_array(rv, stack);
+    } else {
+        decode_scalar(reader, &item, rv);
+    }
+}
+
+static void binary_decode(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    enum binary_format format,
+    const char * data,
+    size_t length
+) {
+    struct binary_reader reader;
+    size_t i;
+
+    binary_reader_init(&reader, ctx, format, data, length);
+    binary_validate(&reader);
+
+    reader.tmp = talloc_new(ctx);
+    HANDLEBARS_MEMCHECK(reader.tmp, ctx);
+    reader.keys_size = 64;
+    reader.keys = handlebars_talloc_zero_size(reader.tmp, sizeof(struct handlebars_string *) * reader.keys_size);
+    HANDLEBARS_MEMCHECK(reader.keys, ctx);
+
+    decode_item(&reader, value);
+
+    for (i = 0; i < reader.keys_size; i++) {
+        if (reader.keys[i]) {
+            handlebars_string_delref(reader.keys[i]);
+        }
+    }
+    handlebars_talloc_free(reader.tmp);
+}
+
+// }}} Decoding
+
+// {{{ Lazy documents
+
+struct binary_document {
+    const char * data;
+    size_t length;
+    enum binary_format format;
+    //! The number of lazy values referencing the document
+    size_t refcount;
+};
+
+struct binary_lazy_entry {
+    //! The key bytes in the document, or of string for integer keys. Unused for arrays
+    const char * key;
+    size_t key_length;
+    uint32_t hash;
+    //! The key, created on first use
+    struct handlebars_string * string;
+    //! Offset of the value in the document
+    size_t offset;
+    //! The value, decoded on first use
+    bool materialized;
+    struct handlebars_value value;
+};
+
+struct handlebars_binary_lazy {
+    struct handlebars_user user;
+    struct binary_document * doc;
+    //! Offset of the container header in the document
+    size_t offset;
+    bool is_map;
+    //! The children are scanned on first access
+    bool indexed;
+    size_t count;
+    struct binary_lazy_entry * entries;
+    //! Open addressing table of entry index + 1, maps only
+    uint32_t * table;
+    size_t table_size;
+};
+
+#define GET_LAZY_V(value) GET_LAZY(handlebars_value_get_user(value))
+#define GET_LAZY(user) ((struct handlebars_binary_lazy *) talloc_get_type_abort(user, struct handlebars_binary_lazy))
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(intern->user.ctx)
+
+static const struct handlebars_value_handlers handlebars_value_binary_lazy_handlers;
+
+static void binary_document_release(struct binary_document * doc)
+{
+    if (--doc->refcount == 0) {
+        handlebars_talloc_free(doc);
+    }
+}
+
+static void binary_lazy_reader_init(struct binary_reader * reader, struct handlebars_binary_lazy * intern, size_t offset)
+{
+    binary_reader_init(reader, intern->user.ctx, intern->doc->format, intern->doc->data, intern->doc->length);
+    reader->p += offset;
+}
+
+static void binary_lazy_ctor(struct handlebars_context * ctx, struct handlebars_value * value, struct binary_document * doc, size_t offset, bool is_map)
+{
+    struct handlebars_binary_lazy * intern = handlebars_talloc_zero(ctx, struct handlebars_binary_lazy);
+    HANDLEBARS_MEMCHECK(intern, ctx);
+    handlebars_user_init((struct handlebars_user *) intern, ctx, &handlebars_value_binary_lazy_handlers);
+    intern->doc = doc;
+    intern->offset = offset;
+    intern->is_map = is_map;
+    doc->refcount++;
+    handlebars_value_user(value, (struct handlebars_user *) intern);
+}
+
+static struct binary_lazy_entry * binary_lazy_table_find(struct handlebars_binary_lazy * intern, const char * key, size_t len, uint32_t hash, uint32_t ** slot)
+{
+    size_t mask = intern->table_size - 1;
+    size_t i = hash & mask;
+    uint32_t index;
+
+    while (0 != (index = intern->table[i])) {
+        struct binary_lazy_entry * entry = &intern->entries[index - 1];
+        if (entry->hash == hash && entry->key_length == len && 0 == memcmp(entry->key, key, len)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (slot) {
+        *slot = &intern->table[i];
+    }
+    return index ? &intern->entries[index - 1] : NULL;
+}
+
+// Scan the direct children of the container, skipping over nested containers
+static void binary_lazy_index(struct handlebars_binary_lazy * intern)
+{
+    struct binary_reader reader;
+    struct binary_item item;
+    size_t i;
+
+    binary_lazy_reader_init(&reader, intern, intern->offset);
+    read_item(&reader, &item);
+
+    intern->indexed = true;
+    intern->entries = MC(handlebars_talloc_array(intern, struct binary_lazy_entry, item.len ? item.len : 1));
+    if (intern->is_map) {
+        intern->table_size = 8;
+        while (intern->table_size < item.len * 2) {
+            intern->table_size *= 2;
+        }
+        intern->table = MC(handlebars_talloc_zero_size(intern, sizeof(uint32_t) * intern->table_size));
+    }
+
+    for (i = 0; i < item.len; i++) {
+        struct binary_lazy_entry * entry = &intern->entries[intern->count];
+
+        memset(entry, 0, sizeof(*entry));
+        handlebars_value_init(&entry->value);
+
+        if (intern->is_map) {
+            struct binary_item key;
+            read_item(&reader, &key);
+            if (key.kind == BINARY_KIND_INTEGER) {
+                char buf[32];
+                format_key(buf, sizeof(buf), &key);
+                entry->string = handlebars_string_ctor(intern->user.ctx, key.str, key.len);
+                handlebars_string_addref(entry->string);
+                key.str = hbs_str_val(entry->string);
+            }
+            entry->key = key.str;
+            entry->key_length = key.len;
+            entry->hash = handlebars_string_hash(key.str, key.len);
+        }
+
+        entry->offset = (size_t) (reader.p - reader.start);
+        skip_item(&reader);
+
+        if (intern->is_map) {
+            uint32_t * slot;
+            struct binary_lazy_entry * prev = binary_lazy_table_find(intern, entry->key, entry->key_length, entry->hash, &slot);
+            if (prev) {
+                // The last duplicate key wins, at the position of the first, like handlebars_map_update
+                prev->offset = entry->offset;
+                if (entry->string) {
+                    handlebars_string_delref(entry->string);
+                }
+                continue;
+            }
+            *slot = (uint32_t) intern->count + 1;
+        }
+        intern->count++;
+    }
+}
+
+static inline void binary_lazy_ensure_index(struct handlebars_binary_lazy * intern)
+{
+    if (unlikely(!intern->indexed)) {
+        binary_lazy_index(intern);
+    }
+}
+
+static struct handlebars_value * binary_lazy_entry_value(struct handlebars_binary_lazy * intern, struct binary_lazy_entry * entry)
+{
+    if (!entry->materialized) {
+        struct binary_reader reader;
+        struct binary_item item;
+
+        binary_lazy_reader_init(&reader, intern, entry->offset);
+        read_item(&reader, &item);
+        if (item.kind == BINARY_KIND_MAP || item.kind == BINARY_KIND_ARRAY) {
+            binary_lazy_ctor(intern->user.ctx, &entry->value, intern->doc, entry->offset, item.kind == BINARY_KIND_MAP);
+        } else {
+            decode_scalar(&reader, &item, &entry->value);
+        }
+        entry->materialized = true;
+    }
+    return &entry->value;
+}
+
+static struct handlebars_string * binary_lazy_entry_key(struct handlebars_binary_lazy * intern, struct binary_lazy_entry * entry)
+{
+    if (!entry->string) {
+        entry->string = handlebars_string_ctor_ex(intern->user.ctx, entry->key, entry->key_length, entry->hash);
+        handlebars_string_addref(entry->string);
+    }
+    return entry->string;
+}
+
+static struct handlebars_value * hbs_binary_lazy_copy(struct handlebars_value * value)
+{
+    abort(); // LCOV_EXCL_LINE
+}
+
+static void hbs_binary_lazy_dtor(struct handlebars_user * user)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY(user);
+    size_t i;
+
+    for (i = 0; i < intern->count; i++) {
+        if (intern->entries[i].materialized) {
+            handlebars_value_dtor(&intern->entries[i].value);
+        }
+        if (intern->entries[i].string) {
+            handlebars_string_delref(intern->entries[i].string);
+        }
+    }
+    intern->count = 0;
+
+    if (intern->doc) {
+        binary_document_release(intern->doc);
+        intern->doc = NULL;
+    }
+}
+
+static void hbs_binary_lazy_convert(struct handlebars_value * value, bool recurse)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY_V(value);
+    size_t i;
+
+    binary_lazy_ensure_index(intern);
+
+    if (intern->is_map) {
+        struct handlebars_map * map = handlebars_map_ctor(intern->user.ctx, intern->count);
+        for (i = 0; i < intern->count; i++) {
+            struct handlebars_value * child = binary_lazy_entry_value(intern, &intern->entries[i]);
+            if (recurse && handlebars_value_get_real_type(child) == HANDLEBARS_VALUE_TYPE_USER) {
+                hbs_binary_lazy_convert(child, recurse);
+            }
+            map = handlebars_map_update(map, binary_lazy_entry_key(intern, &intern->entries[i]), child);
+        }
+        handlebars_value_map(value, map);
+    } else {
+        struct handlebars_stack * stack = handlebars_stack_ctor(intern->user.ctx, intern->count);
+        for (i = 0; i < intern->count; i++) {
+            struct handlebars_value * child = binary_lazy_entry_value(intern, &intern->entries[i]);
+            if (recurse && handlebars_value_get_real_type(child) == HANDLEBARS_VALUE_TYPE_USER) {
+                hbs_binary_lazy_convert(child, recurse);
+            }
+            stack = handlebars_stack_push(stack, child);
+        }
+        handlebars_value_array(value, stack);
+    }
+}
+
+static enum handlebars_value_type hbs_binary_lazy_type(struct handlebars_value * value)
+{
+    return GET_LAZY_V(value)->is_map ? HANDLEBARS_VALUE_TYPE_MAP : HANDLEBARS_VALUE_TYPE_ARRAY;
+}
+
+static struct handlebars_value * hbs_binary_lazy_map_find(struct handlebars_value * value, struct handlebars_string * key, struct handlebars_value * rv)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY_V(value);
+    struct binary_lazy_entry * entry;
+
+    binary_lazy_ensure_index(intern);
+
+    entry = binary_lazy_table_find(intern, hbs_str_val(key), hbs_str_len(key), hbs_str_hash(key), NULL);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    handlebars_value_value(rv, binary_lazy_entry_value(intern, entry));
+    return rv;
+}
+
+static struct handlebars_value * hbs_binary_lazy_array_find(struct handlebars_value * value, size_t index, struct handlebars_value * rv)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY_V(value);
+
+    binary_lazy_ensure_index(intern);
+
+    if (index >= intern->count) {
+        return NULL;
+    }
+
+    handlebars_value_value(rv, binary_lazy_entry_value(intern, &intern->entries[index]));
+    return rv;
+}
+
+static bool hbs_binary_lazy_iterator_next_void(struct handlebars_value_iterator * it)
+{
+    return false;
+}
+
+static bool hbs_binary_lazy_iterator_next(struct handlebars_value_iterator * it)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY_V(it->value);
+
+    if (it->index >= intern->count - 1) {
+        handlebars_value_dtor(it->cur);
+        return false;
+    }
+
+    it->index++;
+    if (intern->is_map) {
+        it->key = binary_lazy_entry_key(intern, &intern->entries[it->index]);
+    }
+    handlebars_value_value(it->cur, binary_lazy_entry_value(intern, &intern->entries[it->index]));
+    return true;
+}
+
+static bool hbs_binary_lazy_iterator_init(struct handlebars_value_iterator * it, struct handlebars_value * value)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY_V(value);
+
+    binary_lazy_ensure_index(intern);
+
+    if (intern->count == 0) {
+        it->next = &hbs_binary_lazy_iterator_next_void;
+        return false;
+    }
+
+    it->value = value;
+    it->index = 0;
+    if (intern->is_map) {
+        it->key = binary_lazy_entry_key(intern, &intern->entries[0]);
+    }
+    handlebars_value_value(it->cur, binary_lazy_entry_value(intern, &intern->entries[0]));
+    it->next = &hbs_binary_lazy_iterator_next;
+    return true;
+}
+
+static long hbs_binary_lazy_count(struct handlebars_value * value)
+{
+    struct handlebars_binary_lazy * intern = GET_LAZY_V(value);
+    binary_lazy_ensure_index(intern);
+    return (long) intern->count;
+}
+
+static const struct handlebars_value_handlers handlebars_value_binary_lazy_handlers = {
+    "binary_lazy",
+    &hbs_binary_lazy_copy,
+    &hbs_binary_lazy_dtor,
+    &hbs_binary_lazy_convert,
+    &hbs_binary_lazy_type,
+    &hbs_binary_lazy_map_find,
+    &hbs_binary_lazy_array_find,
+    &hbs_binary_lazy_iterator_init,
+    NULL, // call
+    &hbs_binary_lazy_count
+};
+
+static void binary_lazy_init(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    enum binary_format format,
+    const char * data,
+    size_t length
+) {
+    struct binary_reader reader;
+    struct binary_item item;
+    struct binary_document * doc;
+
+    binary_reader_init(&reader, ctx, format, data, length);
+    binary_validate(&reader);
+
+    read_item(&reader, &item);
+    if (item.kind != BINARY_KIND_MAP && item.kind != BINARY_KIND_ARRAY) {
+        decode_scalar(&reader, &item, value);
+        return;
+    }
+
+    doc = handlebars_talloc_zero(ctx, struct binary_document);
+    HANDLEBARS_MEMCHECK(doc, ctx);
+    doc->data = data;
+    doc->length = length;
+    doc->format = format;
+    binary_lazy_ctor(ctx, value, doc, 0, item.kind == BINARY_KIND_MAP);
+}
+
+// }}} Lazy documents
+
+void handlebars_value_init_msgpack_stringl(struct handlebars_context * ctx, struct handlebars_value * value, const char * data, size_t length)
+{
+    binary_decode(ctx, value, BINARY_FORMAT_MSGPACK, data, length);
+}
+
+void handlebars_value_init_msgpack_lazy(struct handlebars_context * ctx, struct handlebars_value * value, const char * data, size_t length)
+{
+    binary_lazy_init(ctx, value, BINARY_FORMAT_MSGPACK, data, length);
+}
+
+void handlebars_value_init_cbor_stringl(struct handlebars_context * ctx, struct handlebars_value * value, const char * data, size_t length)
+{
+    binary_decode(ctx, value, BINARY_FORMAT_CBOR, data, length);
+}
+
+void handlebars_value_init_cbor_lazy(struct handlebars_context * ctx, struct handlebars_value * value, const char * data, size_t length)
+{
+    binary_lazy_init(ctx, value, BINARY_FORMAT_CBOR, data, length);
+}
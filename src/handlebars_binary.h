@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief MessagePack and CBOR data input
+ *
+ * Both decoders are built in and need no external library. Binary and extension payloads decode to strings, CBOR
+ * tags are ignored, and integer map keys are converted to their decimal representation. Indefinite-length CBOR items
+ * are not supported. Integers that do not fit in a long decode to floats.
+ */
+
+#ifndef HANDLEBARS_BINARY_H
+#define HANDLEBARS_BINARY_H
+
+#include "handlebars.h"
+
+HBS_EXTERN_C_START
+
+struct handlebars_context;
+struct handlebars_value;
+
+#ifndef HANDLEBARS_BINARY_MAX_DEPTH
+#define HANDLEBARS_BINARY_MAX_DEPTH 512
+#endif
+
+/**
+ * @brief Decode a MessagePack document into native values. Throws on invalid input.
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] data The encoded document
+ * @param[in] length The length of the encoded document
+ * @return void
+ */
+void handlebars_value_init_msgpack_stringl(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * data,
+    size_t length
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Wrap a MessagePack document without decoding it. Maps and arrays are user values that index their direct
+ *        children on first access and decode each child on first lookup. The buffer is not copied and must outlive
+ *        the value. Like lazy JSON values, these cache what they decode and must not be shared between threads
+ *        before #handlebars_value_freeze. Throws on invalid input.
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] data The encoded document
+ * @param[in] length The length of the encoded document
+ * @return void
+ */
+void handlebars_value_init_msgpack_lazy(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * data,
+    size_t length
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Decode a CBOR document into native values. Throws on invalid input.
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] data The encoded document
+ * @param[in] length The length of the encoded document
+ * @return void
+ */
+void handlebars_value_init_cbor_stringl(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * data,
+    size_t length
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Like #handlebars_value_init_msgpack_lazy, for a CBOR document
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] data The encoded document
+ * @param[in] length The length of the encoded document
+ * @return void
+ */
+void handlebars_value_init_cbor_lazy(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * data,
+    size_t length
+) HBS_ATTR_NONNULL_ALL;
+
+HBS_EXTERN_C_END
+
+#endif /* HANDLEBARS_BINARY_H */
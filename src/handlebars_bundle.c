@@ -0,0 +1,497 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <talloc.h>
+#include <unistd.h>
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define HANDLEBARS_OPCODE_SERIALIZER_PRIVATE
+
+#include "handlebars.h"
+#include "handlebars_bundle.h"
+#include "handlebars_memory.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_private.h"
+#include "handlebars_string.h"
+
+#include "sort_r.h"
+
+
+
+// The file starts with the header, followed by the entries sorted by name, the buckets of the name index, the names
+// and finally the modules. All offsets are from the start of the file, all numbers are in native byte order.
+
+static const char bundle_magic[8] = "HBSBNDL";
+
+#define BUNDLE_FORMAT 2
+#define BUNDLE_BYTE_ORDER 0x01020304
+#define BUNDLE_MODULE_ALIGNMENT 16
+
+struct bundle_header {
+    char magic[8];
+
+    uint32_t format;
+
+    //! BUNDLE_BYTE_ORDER as written by the machine that built the bundle
+    uint32_t byte_order;
+
+    //! The pointer size of the machine that built the bundle
+    uint32_t pointer_size;
+
+    //! The handlebars version that built the bundle
+    int32_t version;
+
+    //! The format of the modules in the bundle, #HANDLEBARS_MODULE_FORMAT
+    int32_t module_format;
+
+    uint32_t count;
+
+    //! The number of buckets of the name index, a power of two greater than count
+    uint32_t bucket_count;
+
+    //! The size of the file
+    uint64_t size;
+
+    uint64_t entries_offset;
+
+    uint64_t buckets_offset;
+};
+
+struct bundle_entry {
+    //! The hash of the name
+    uint64_t hash;
+
+    //! The offset of the name, which is followed by a NUL byte
+    uint64_t name_offset;
+
+    uint64_t name_length;
+
+    uint64_t module_offset;
+
+    uint64_t module_size;
+};
+
+struct handlebars_bundle_builder {
+    //! Common header
+    struct handlebars_context ctx;
+
+    //! The names
+    struct handlebars_string ** names;
+
+    //! The modules, normalized to address zero
+    struct handlebars_module ** modules;
+
+    size_t count;
+
+    size_t capacity;
+};
+
+struct handlebars_bundle {
+    //! Common header
+    struct handlebars_context ctx;
+
+    //! The mapped file
+    char * addr;
+
+    size_t size;
+
+    struct bundle_header * header;
+
+    struct bundle_entry * entries;
+
+    //! The entry index plus one for each bucket, or zero
+    uint32_t * buckets;
+
+    //! Whether the module of each entry was verified and relocated. Set with release semantics once the module is
+    //! relocated, so a module is never relocated twice or used before it is.
+    bool * ready;
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    //! Held while relocating a module
+    pthread_mutex_t lock;
+    bool lock_init;
+#endif
+};
+
+static inline uint64_t bundle_hash(const char * name, size_t length)
+{
+    return handlebars_hash_xxh3(name, length);
+}
+
+// {{{ Builder
+
+#undef CONTEXT
+#define CONTEXT context
+
+struct handlebars_bundle_builder * handlebars_bundle_builder_ctor(struct handlebars_context * context)
+{
+    struct handlebars_bundle_builder * builder = MC(handlebars_talloc_zero(context, struct handlebars_bundle_builder));
+    handlebars_context_bind(context, HBSCTX(builder));
+    return builder;
+}
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(builder)
+
+void handlebars_bundle_builder_dtor(struct handlebars_bundle_builder * builder)
+{
+    handlebars_talloc_free(builder);
+}
+
+void handlebars_bundle_builder_add(
+    struct handlebars_bundle_builder * builder,
+    struct handlebars_string * name,
+    struct handlebars_module * module
+) {
+    struct handlebars_module * copy;
+
+    if( builder->count >= builder->capacity ) {
+        builder->capacity = builder->capacity ? builder->capacity * 2 : 16;
+        builder->names = MC(handlebars_talloc_realloc(builder, builder->names, struct handlebars_string *, builder->capacity));
+        builder->modules = MC(handlebars_talloc_realloc(builder, builder->modules, struct handlebars_module *, builder->capacity));
+    }
+
+    copy = MC(handlebars_talloc_size(builder, module->size));
+    talloc_set_type(copy, struct handlebars_module);
+    memcpy(copy, module, module->size);
+    handlebars_module_patch_pointers(copy);
+    handlebars_module_normalize_pointers(copy, (void *) 0);
+
+    // Bundles are meant to be reproducible
+    copy->ts = 0;
+    handlebars_module_generate_hash(copy);
+
+    builder->names[builder->count] = MC(talloc_steal(builder, handlebars_string_copy_ctor(CONTEXT, name)));
+    builder->modules[builder->count] = copy;
+    builder->count++;
+}
+
+static int compare_names(const struct handlebars_string * a, const struct handlebars_string * b)
+{
+    size_t a_len = hbs_str_len((struct handlebars_string *) a);
+    size_t b_len = hbs_str_len((struct handlebars_string *) b);
+    int rv = memcmp(hbs_str_val((struct handlebars_string *) a), hbs_str_val((struct handlebars_string *) b), a_len < b_len ? a_len : b_len);
+    if( rv != 0 ) {
+        return rv;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int compare_indexes(const void * a, const void * b, void * arg)
+{
+    struct handlebars_string ** names = arg;
+    return compare_names(names[*(const size_t *) a], names[*(const size_t *) b]);
+}
+
+void handlebars_bundle_builder_write(struct handlebars_bundle_builder * builder, const char * filename)
+{
+    struct bundle_header * header;
+    struct bundle_entry * entries;
+    uint32_t * buckets;
+    size_t * order;
+    char * buf;
+    size_t bucket_count = 1;
+    size_t names_offset;
+    size_t modules_offset;
+    size_t size;
+    size_t offset;
+    size_t written;
+    size_t i;
+    FILE * fp;
+
+    if( builder->count >= UINT32_MAX / 2 ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Too many modules in bundle: %zu", builder->count);
+    }
+
+    // Sort by name, so the output does not depend on the order of the calls
+    order = MC(handlebars_talloc_array(builder, size_t, builder->count));
+    for( i = 0; i < builder->count; i++ ) {
+        order[i] = i;
+    }
+    sort_r(order, builder->count, sizeof(size_t), &compare_indexes, builder->names);
+
+    for( i = 1; i < builder->count; i++ ) {
+        if( compare_names(builder->names[order[i - 1]], builder->names[order[i]]) == 0 ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Duplicate module name in bundle: %s", hbs_str_val(builder->names[order[i]]));
+        }
+    }
+
+    // Calculate the layout. The index is at most half full.
+    while( bucket_count <= builder->count * 2 ) {
+        bucket_count <<= 1;
+    }
+    names_offset = sizeof(struct bundle_header) + builder->count * sizeof(struct bundle_entry) + bucket_count * sizeof(uint32_t);
+    modules_offset = names_offset;
+    for( i = 0; i < builder->count; i++ ) {
+        modules_offset += hbs_str_len(builder->names[i]) + 1;
+    }
+    modules_offset = handlebars_align_size(modules_offset, BUNDLE_MODULE_ALIGNMENT);
+    size = modules_offset;
+    for( i = 0; i < builder->count; i++ ) {
+        size += handlebars_align_size(builder->modules[i]->size, BUNDLE_MODULE_ALIGNMENT);
+    }
+
+    buf = MC(handlebars_talloc_zero_size(builder, size));
+    header = (struct bundle_header *) (void *) buf;
+    entries = (struct bundle_entry *) (void *) (buf + sizeof(struct bundle_header));
+    buckets = (uint32_t *) (void *) (buf + sizeof(struct bundle_header) + builder->count * sizeof(struct bundle_entry));
+
+    memcpy(header->magic, bundle_magic, sizeof(bundle_magic));
+    header->format = BUNDLE_FORMAT;
+    header->byte_order = BUNDLE_BYTE_ORDER;
+    header->pointer_size = sizeof(void *);
+    header->version = handlebars_version();
+    header->module_format = HANDLEBARS_MODULE_FORMAT;
+    header->count = (uint32_t) builder->count;
+    header->bucket_count = (uint32_t) bucket_count;
+    header->size = size;
+    header->entries_offset = sizeof(struct bundle_header);
+    header->buckets_offset = (uint64_t) ((char *) buckets - buf);
+
+    // Names and modules
+    offset = modules_offset;
+    for( i = 0; i < builder->count; i++ ) {
+        struct handlebars_string * name = builder->names[order[i]];
+        struct handlebars_module * module = builder->modules[order[i]];
+        struct bundle_entry * entry = &entries[i];
+
+        entry->hash = bundle_hash(hbs_str_val(name), hbs_str_len(name));
+        entry->name_offset = names_offset;
+        entry->name_length = hbs_str_len(name);
+        memcpy(buf + names_offset, hbs_str_val(name), hbs_str_len(name));
+        names_offset += hbs_str_len(name) + 1;
+
+        entry->module_offset = offset;
+        entry->module_size = module->size;
+        memcpy(buf + offset, module, module->size);
+        offset += handlebars_align_size(module->size, BUNDLE_MODULE_ALIGNMENT);
+    }
+
+    // Index, with linear probing
+    for( i = 0; i < builder->count; i++ ) {
+        size_t bucket = entries[i].hash & (bucket_count - 1);
+        while( buckets[bucket] != 0 ) {
+            bucket = (bucket + 1) & (bucket_count - 1);
+        }
+        buckets[bucket] = (uint32_t) (i + 1);
+    }
+
+    // Write
+    fp = fopen(filename, "wb");
+    if( !fp ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to open %s: %s", filename, strerror(errno));
+    }
+    written = fwrite(buf, 1, size, fp);
+    if( fclose(fp) != 0 || written != size ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to write %s: %s", filename, strerror(errno));
+    }
+
+    handlebars_talloc_free(buf);
+    handlebars_talloc_free(order);
+}
+
+// }}} Builder
+
+// {{{ Reader
+
+static int bundle_dtor(struct handlebars_bundle * bundle)
+{
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    if( bundle->lock_init ) {
+        pthread_mutex_destroy(&bundle->lock);
+        bundle->lock_init = false;
+    }
+#endif
+    if( bundle->addr ) {
+        munmap(bundle->addr, bundle->size);
+        bundle->addr = NULL;
+    }
+    return 0;
+}
+
+#undef CONTEXT
+#define CONTEXT context
+
+struct handlebars_bundle * handlebars_bundle_ctor(struct handlebars_context * context, const char * filename)
+{
+    struct handlebars_bundle * bundle;
+    struct bundle_header * header;
+    struct stat st;
+    void * addr;
+    int fd;
+
+    bundle = MC(handlebars_talloc_zero(context, struct handlebars_bundle));
+    handlebars_context_bind(context, HBSCTX(bundle));
+    talloc_set_destructor(bundle, bundle_dtor);
+
+    fd = open(filename, O_RDONLY);
+    if( fd < 0 ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to open %s: %s", filename, strerror(errno));
+    }
+    if( fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct bundle_header) ) {
+        close(fd);
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid bundle %s", filename);
+    }
+
+    // Modules are relocated in place, which only copies the pages they are on
+    addr = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( addr == MAP_FAILED ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to map %s: %s", filename, strerror(errno));
+    }
+    bundle->addr = addr;
+    bundle->size = (size_t) st.st_size;
+
+    header = bundle->header = addr;
+    if( memcmp(header->magic, bundle_magic, sizeof(bundle_magic)) != 0 || header->format != BUNDLE_FORMAT ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid bundle %s", filename);
+    }
+    if( header->byte_order != BUNDLE_BYTE_ORDER || header->pointer_size != sizeof(void *) || header->version != handlebars_version() ||
+            header->module_format != HANDLEBARS_MODULE_FORMAT ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Bundle %s was built by an incompatible version of handlebars", filename);
+    }
+    if( header->size != bundle->size ||
+            header->bucket_count <= header->count ||
+            (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+            header->entries_offset < sizeof(struct bundle_header) ||
+            header->entries_offset % sizeof(uint64_t) != 0 ||
+            header->entries_offset > bundle->size ||
+            (bundle->size - header->entries_offset) / sizeof(struct bundle_entry) < header->count ||
+            header->buckets_offset % sizeof(uint32_t) != 0 ||
+            header->buckets_offset > bundle->size ||
+            (bundle->size - header->buckets_offset) / sizeof(uint32_t) < header->bucket_count ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid bundle %s", filename);
+    }
+
+    bundle->entries = (struct bundle_entry *) (void *) (bundle->addr + header->entries_offset);
+    bundle->buckets = (uint32_t *) (void *) (bundle->addr + header->buckets_offset);
+    bundle->ready = MC(handlebars_talloc_zero_size(bundle, sizeof(bool) * (header->count ? header->count : 1)));
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    if( pthread_mutex_init(&bundle->lock, NULL) != 0 ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to initialize bundle lock");
+    }
+    bundle->lock_init = true;
+#endif
+
+    return bundle;
+}
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(bundle)
+
+void handlebars_bundle_dtor(struct handlebars_bundle * bundle)
+{
+    handlebars_talloc_free(bundle);
+}
+
+size_t handlebars_bundle_count(struct handlebars_bundle * bundle)
+{
+    return bundle->header->count;
+}
+
+static inline bool entry_name_eq(struct handlebars_bundle * bundle, struct bundle_entry * entry, const char * name, size_t length)
+{
+    return entry->name_length == length &&
+        entry->name_offset <= bundle->size &&
+        bundle->size - entry->name_offset > length &&
+        memcmp(bundle->addr + entry->name_offset, name, length) == 0;
+}
+
+static struct handlebars_module * entry_module(struct handlebars_bundle * bundle, uint32_t index)
+{
+    struct bundle_entry * entry = &bundle->entries[index];
+    struct handlebars_module * module = (struct handlebars_module *) (void *) (bundle->addr + entry->module_offset);
+
+    bool verified;
+
+    if( likely(__atomic_load_n(&bundle->ready[index], __ATOMIC_ACQUIRE)) ) {
+        return module;
+    }
+
+    if( entry->module_offset % BUNDLE_MODULE_ALIGNMENT != 0 ||
+            entry->module_offset > bundle->size ||
+            entry->module_size > bundle->size - entry->module_offset ||
+            entry->module_size < sizeof(struct handlebars_module) ||
+            module->size != entry->module_size ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid module in bundle: %.*s", (int) entry->name_length, bundle->addr + entry->name_offset);
+    }
+
+    // Relocating adds the address of the module to its pointers, so only one thread may do it, once
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_mutex_lock(&bundle->lock);
+#endif
+    verified = __atomic_load_n(&bundle->ready[index], __ATOMIC_RELAXED);
+    if( !verified && (verified = handlebars_module_verify(module, NULL)) ) {
+        handlebars_module_patch_pointers(module);
+        __atomic_store_n(&bundle->ready[index], true, __ATOMIC_RELEASE);
+    }
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    pthread_mutex_unlock(&bundle->lock);
+#endif
+
+    // Throw outside of the lock, the module was left as it is
+    if( !verified ) {
+        handlebars_module_verify(module, CONTEXT);
+    }
+
+    return module;
+}
+
+struct handlebars_module * handlebars_bundle_find(struct handlebars_bundle * bundle, const char * name, size_t length)
+{
+    uint64_t hash = bundle_hash(name, length);
+    uint32_t mask = bundle->header->bucket_count - 1;
+    uint32_t bucket = (uint32_t) hash & mask;
+    uint32_t n;
+
+    for( n = 0; n <= mask; n++, bucket = (bucket + 1) & mask ) {
+        uint32_t index = bundle->buckets[bucket];
+        struct bundle_entry * entry;
+
+        if( index == 0 ) {
+            break;
+        }
+        if( unlikely(index > bundle->header->count) ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid bundle index");
+        }
+
+        entry = &bundle->entries[index - 1];
+        if( entry->hash == hash && entry_name_eq(bundle, entry, name, length) ) {
+            return entry_module(bundle, index - 1);
+        }
+    }
+
+    return NULL;
+}
+
+// }}} Reader
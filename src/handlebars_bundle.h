@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Precompiled template bundles
+ *
+ * A bundle is a single file holding any number of serialized modules, each under a name, together with a hash index
+ * of the names. Opening a bundle maps the file into memory, and looking up a module only hashes the name, so no
+ * template is parsed or compiled at runtime. Modules are stored in the native layout of the library that built the
+ * bundle, so a bundle can only be opened by the same version of handlebars on the same kind of machine.
+ */
+
+#ifndef HANDLEBARS_BUNDLE_H
+#define HANDLEBARS_BUNDLE_H
+
+#include "handlebars.h"
+
+HBS_EXTERN_C_START
+
+struct handlebars_bundle;
+struct handlebars_bundle_builder;
+struct handlebars_context;
+struct handlebars_module;
+struct handlebars_string;
+
+/**
+ * @brief Construct a new bundle builder
+ * @param[in] context The handlebars context
+ * @return The bundle builder
+ */
+struct handlebars_bundle_builder * handlebars_bundle_builder_ctor(
+    struct handlebars_context * context
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Destruct a bundle builder
+ * @param[in] builder The bundle builder
+ * @return void
+ */
+void handlebars_bundle_builder_dtor(
+    struct handlebars_bundle_builder * builder
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Add a module to a bundle. The module is copied. Adding the same name twice is an error, which is reported
+ *        by #handlebars_bundle_builder_write.
+ * @param[in] builder The bundle builder
+ * @param[in] name The name to look the module up by
+ * @param[in] module The module
+ * @return void
+ */
+void handlebars_bundle_builder_add(
+    struct handlebars_bundle_builder * builder,
+    struct handlebars_string * name,
+    struct handlebars_module * module
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Write the bundle to a file. The output only depends on the names and modules that were added, not on the
+ *        order they were added in.
+ * @param[in] builder The bundle builder
+ * @param[in] filename The bundle file
+ * @return void
+ */
+void handlebars_bundle_builder_write(
+    struct handlebars_bundle_builder * builder,
+    const char * filename
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Open a bundle. The file is mapped privately, so modules are only copied when they are first looked up, and
+ *        only the pages they occupy.
+ * @param[in] context The handlebars context
+ * @param[in] filename The bundle file
+ * @return The bundle
+ */
+struct handlebars_bundle * handlebars_bundle_ctor(
+    struct handlebars_context * context,
+    const char * filename
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Close a bundle. Modules found in it must not be used afterwards.
+ * @param[in] bundle The bundle
+ * @return void
+ */
+void handlebars_bundle_dtor(
+    struct handlebars_bundle * bundle
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Look up a module by name. The first lookup of a module verifies it with #handlebars_module_verify, which
+ *        throws if the bundle is damaged, and relocates it in place. Relocation happens once under a lock, so lookups
+ *        may run concurrently on the same bundle. The module is owned by the bundle and must not be freed.
+ * @param[in] bundle The bundle
+ * @param[in] name The name of the module
+ * @param[in] length The length of the name
+ * @return The module, or NULL
+ */
+struct handlebars_module * handlebars_bundle_find(
+    struct handlebars_bundle * bundle,
+    const char * name,
+    size_t length
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Get the number of modules in a bundle
+ * @param[in] bundle The bundle
+ * @return The number of modules
+ */
+size_t handlebars_bundle_count(
+    struct handlebars_bundle * bundle
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_PURE;
+
+HBS_EXTERN_C_END
+
+#endif /* HANDLEBARS_BUNDLE_H */
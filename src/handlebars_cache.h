@@ -75,6 +75,26 @@ struct handlebars_cache * handlebars_cache_mmap_ctor(
     size_t entries
 ) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
 
+/**
+ * @brief Construct a new mmap cache backed by a file, so that compiled modules survive restarts. The file is created
+ *        if it does not exist. When no other process has it open, every entry is checked with
+ *        #handlebars_module_verify and dropped if that fails, and a file that was created by another version or
+ *        with another size or number of entries is reinitialized. Entries contain absolute pointers, so processes
+ *        that open the file while it is in use must be able to map it at the same address as the others, which is
+ *        usually the case for processes running the same executable.
+ * @param[in] context The handlebars context
+ * @param[in] path The cache file
+ * @param[in] size The size of the mmap block, in bytes
+ * @param[in] entries The fixed number of entries in the hash table
+ * @return The cache
+ */
+struct handlebars_cache * handlebars_cache_mmap_file_ctor(
+    struct handlebars_context * context,
+    const char * path,
+    size_t size,
+    size_t entries
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
 #endif
 
 /**
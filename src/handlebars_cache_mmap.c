@@ -55,42 +55,124 @@
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
 #ifndef __APPLE__
 #define USE_SPINLOCK 1
 #endif
 
+#ifndef HANDLEBARS_CACHE_MMAP_SHARDS
+#define HANDLEBARS_CACHE_MMAP_SHARDS 16
+#endif
+
+#if (HANDLEBARS_CACHE_MMAP_SHARDS & (HANDLEBARS_CACHE_MMAP_SHARDS - 1)) != 0
+#error "HANDLEBARS_CACHE_MMAP_SHARDS must be a power of two"
+#endif
+
+#ifndef HANDLEBARS_CACHE_LINE_SIZE
+#define HANDLEBARS_CACHE_LINE_SIZE 64
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CACHE_ALIGNED __attribute__((aligned(HANDLEBARS_CACHE_LINE_SIZE)))
+#else
+#define CACHE_ALIGNED
+#endif
+
+// Statistics only need atomicity and entries are published with release/acquire. Unlinking an entry (clear the slot,
+// then check its pins) vs. looking it up (pin the slot, then check it still holds the entry) needs sequential
+// consistency on both sides, so that at least one of them sees the other.
 #ifdef HAVE_ATOMIC_BUILTINS
-#define INCR(var) __atomic_add_fetch(&var, 1, __ATOMIC_SEQ_CST)
-#define DECR(var) __atomic_sub_fetch(&var, 1, __ATOMIC_SEQ_CST)
+#define LOAD(var, order) __atomic_load_n(&(var), __ATOMIC_ ## order)
+#define STORE(var, val, order) __atomic_store_n(&(var), val, __ATOMIC_ ## order)
+#define INCR(var, order) __atomic_add_fetch(&(var), 1, __ATOMIC_ ## order)
+#define DECR(var, order) __atomic_sub_fetch(&(var), 1, __ATOMIC_ ## order)
 #else
-#define INCR(var) lock(cache); var++; unlock(cache)
-#define DECR(var) lock(cache); var--; unlock(cache)
+// Only for code analysis, the cache requires atomic builtins
+#define LOAD(var, order) (var)
+#define STORE(var, val, order) ((var) = (val))
+#define INCR(var, order) (++(var))
+#define DECR(var, order) (--(var))
 #endif
 
 
 
 static const char head[] = "handlebars shared opcode cache";
-static const size_t PADDING = 1;
 static size_t page_size;
 
-struct handlebars_cache_mmap {
-    //! Header
-    char head[32];
+//! The minimum size of the data segment of a shard. Small caches use fewer shards.
+static const size_t MIN_SHARD_DATA_SIZE = 64 * 1024;
 
-    //! The size of the memory block
+//! Block sizes are multiples of this
+#define BLOCK_ALIGNMENT 16
+
+//! The number of segregated free lists. List n holds the free blocks of at least 2^(n+5) bytes.
+#define FREE_LIST_COUNT 24
+
+#define NO_BLOCK ((size_t) -1)
+
+//! The header of every block of the data segment
+struct cache_block {
+    //! The size of the block in bytes, including this header. The low bit is set while the block is in use.
     size_t size;
 
-    //! The page-aligned size of this struct
-    size_t intern_size;
+    //! The size of the previous block, or zero for the first block
+    size_t prev_size;
+};
 
-    //! The version of handlebars this block was initialized with
-    int version;
+//! A free block
+struct cache_free_block {
+    struct cache_block block;
 
-    //! The pointer to the table segment
-    struct table_entry ** table;
+    //! The offset of the next and previous free blocks in the same list, or NO_BLOCK
+    size_t next;
 
-    //! The size in bytes of the hash table
-    size_t table_size;
+    size_t prev;
+};
+
+#define MIN_BLOCK_SIZE sizeof(struct cache_free_block)
+
+//! An entry is a single block: the header, this struct, the module, then the key
+struct table_entry {
+    //! The key of this entry, inside the block
+    struct handlebars_string * key;
+
+    //! The module of this entry, directly following this struct
+    void * data;
+
+    //! The index of the table slot of this entry
+    size_t slot;
+};
+
+//! A table slot. Lookups write to the slot, so each has its own cache line.
+struct table_slot {
+    //! The entry, or NULL
+    struct table_entry * entry;
+
+    //! The number of lookups of this slot currently executing its entry
+    long refcount;
+
+    //! Set by lookups, cleared by the eviction clock hand
+    int referenced;
+
+    //! An entry that was unlinked while in use, freed with the last pin
+    struct table_entry * zombie;
+} CACHE_ALIGNED;
+
+struct cache_shard {
+    //! Written by every lookup. Kept on its own cache line, away from the fields lookups only read.
+    struct {
+        size_t hits;
+
+        size_t misses;
+
+        size_t collisions;
+    } CACHE_ALIGNED counters;
+
+    //! The pointer to the table segment. The table is not write protected, only the data segment is.
+    struct table_slot * table CACHE_ALIGNED;
 
     //! The number of slots in the hash table
     uint32_t table_count;
@@ -98,120 +180,554 @@ struct handlebars_cache_mmap {
     //! The number of used slots in the hash table
     uint32_t table_entries;
 
-    //! The pointer to the data segment
+    //! The size in bytes of the hash table
+    size_t table_size;
+
+    //! The pointer to the data segment, which directly follows the table segment
     void * data;
 
     //! The size in bytes of the data segment
     size_t data_size;
 
-    //! The length in bytes of the currently used part of the data segment
+    //! The number of bytes of the data segment in use
     size_t data_length;
 
-    size_t hits;
+    //! The heads of the free lists
+    size_t free_lists[FREE_LIST_COUNT];
 
-    size_t misses;
-
-    size_t collisions;
-
-    bool in_reset;
+    //! The next slot the eviction clock hand looks at
+    uint32_t clock_hand;
 
 #ifdef USE_SPINLOCK
     pthread_spinlock_t write_lock;
 #else
     pthread_mutex_t write_lock;
 #endif
-
-    long refcount;
 };
 
-struct table_entry {
-    //! The offset from the beginning of the memory block at which the key for the entry resides
-    struct handlebars_string * key;
+struct handlebars_cache_mmap {
+    //! Header
+    char head[32];
 
-    //! The offset from the beginning of the memory block at which the data for this entry resides
-    void * data;
-};
+    //! The size of the memory block
+    size_t size;
 
-static inline void * append(struct handlebars_cache_mmap * intern, void * source, size_t size)
-{
-    size_t aligned_size = handlebars_align_size(size + PADDING, sizeof(void *));
-    void * addr = (char *) intern->data + intern->data_length;
-    assert(((uintptr_t) addr) % sizeof(void *) == 0);
-    if( intern->data_length + aligned_size >= intern->data_size ) {
-        return NULL;
-    }
-    intern->data_length += aligned_size;
-    memcpy(addr, source, size);
-    if (aligned_size > size) {
-        memset((char *) addr + size, 0, aligned_size - size);
-    }
-    return addr;
-}
+    //! The page-aligned size of this struct, including the shards
+    size_t intern_size;
+
+    //! The version of handlebars this block was initialized with
+    int version;
+
+    //! The module format this block was initialized with, #HANDLEBARS_MODULE_FORMAT
+    int module_format;
+
+    //! The number of shards, a power of two
+    uint32_t shard_count;
+
+    //! The size in bytes of the table and data segments of each shard
+    size_t shard_size;
+
+    //! The pointer to the table segment of the first shard
+    void * segments;
+
+    //! The address this block is mapped at. Entries contain absolute pointers, so all processes using a cache file
+    //! have to map it at the same address.
+    void * base;
 
-static inline void protect(struct handlebars_cache * cache, bool on)
+    //! The shards. Entries are assigned to a shard by key hash, and each shard has its own lock, table and data
+    //! segment, so writers only contend within a shard and lookups never take a lock.
+    struct cache_shard shards[];
+};
+
+static inline void protect(struct handlebars_cache * cache, struct cache_shard * shard, bool on)
 {
-    struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
     int prot = on ? PROT_READ : PROT_READ | PROT_WRITE;
-    int rc = mprotect(intern->table, intern->table_size + intern->data_size, prot);
+    int rc = mprotect(shard->data, shard->data_size, prot);
     if( rc != 0 ) {
-        handlebars_throw(HBSCTX(cache), HANDLEBARS_ERROR, "mprotect error: %s (%d)", strerror(rc), rc);
+        handlebars_throw(HBSCTX(cache), HANDLEBARS_ERROR, "mprotect error: %s (%d)", strerror(errno), errno);
     }
 }
 
-static inline void lock(struct handlebars_cache * cache)
+static inline void lock(struct handlebars_cache * cache, struct cache_shard * shard)
 {
-    struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
     int rc;
 
     // Lock
 #ifdef USE_SPINLOCK
-    rc = pthread_spin_lock(&intern->write_lock);
+    rc = pthread_spin_lock(&shard->write_lock);
 #else
-    rc = pthread_mutex_lock(&intern->write_lock);
+    rc = pthread_mutex_lock(&shard->write_lock);
 #endif
     if( rc != 0 ) {
         handlebars_throw(HBSCTX(cache), HANDLEBARS_ERROR, "pthread lock error: %s (%d)", strerror(rc), rc);
     }
 }
 
-static inline void unlock(struct handlebars_cache * cache)
+static inline void unlock(struct handlebars_cache * cache, struct cache_shard * shard)
 {
-    struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
     int rc;
 
     // Unlock
 #ifdef USE_SPINLOCK
-    rc = pthread_spin_unlock(&intern->write_lock);
+    rc = pthread_spin_unlock(&shard->write_lock);
 #else
-    rc = pthread_mutex_unlock(&intern->write_lock);
+    rc = pthread_mutex_unlock(&shard->write_lock);
 #endif
     if( rc != 0 ) {
         handlebars_throw(HBSCTX(cache), HANDLEBARS_ERROR, "pthread unlock error: %s (%d)", strerror(rc), rc);
     }
 }
 
-static inline struct table_entry * table_find(struct handlebars_cache_mmap * intern, struct handlebars_string * string)
+// {{{ Allocator
+// Each data segment is a sequence of blocks with boundary tags. Free blocks are kept in segregated free lists and
+// are merged with their free neighbours as soon as they are freed. All of this runs with the shard locked and the
+// data segment unprotected.
+
+static inline struct cache_block * block_at(struct cache_shard * shard, size_t offset)
+{
+    return (struct cache_block *) (void *) ((char *) shard->data + offset);
+}
+
+static inline size_t block_offset(struct cache_shard * shard, struct cache_block * block)
+{
+    return (size_t) ((char *) block - (char *) shard->data);
+}
+
+static inline size_t block_size(struct cache_block * block)
 {
-    uint32_t offset = hbs_str_hash(string) % intern->table_count;
-    return intern->table[offset];
+    return block->size & ~(size_t) 1;
 }
 
-static inline void table_set(struct handlebars_cache_mmap * intern, struct table_entry * entry)
+static inline bool block_used(struct cache_block * block)
 {
-    uint32_t offset = hbs_str_hash(entry->key) % intern->table_count;
-    if( entry == NULL ) {
-        intern->table[offset] = NULL;
+    return block->size & 1;
+}
+
+static inline struct cache_block * block_next(struct cache_shard * shard, struct cache_block * block)
+{
+    size_t offset = block_offset(shard, block) + block_size(block);
+    return offset < shard->data_size ? block_at(shard, offset) : NULL;
+}
+
+static inline struct cache_block * entry_block(struct table_entry * entry)
+{
+    return (struct cache_block *) (void *) ((char *) entry - sizeof(struct cache_block));
+}
+
+static inline unsigned free_list_index(size_t size)
+{
+    unsigned index = 0;
+    size >>= 6;
+    while( size && index < FREE_LIST_COUNT - 1 ) {
+        size >>= 1;
+        index++;
+    }
+    return index;
+}
+
+static void free_list_insert(struct cache_shard * shard, struct cache_block * block)
+{
+    struct cache_free_block * free_block = (struct cache_free_block *) block;
+    unsigned index = free_list_index(block_size(block));
+    size_t offset = block_offset(shard, block);
+
+    free_block->prev = NO_BLOCK;
+    free_block->next = shard->free_lists[index];
+    if( free_block->next != NO_BLOCK ) {
+        ((struct cache_free_block *) block_at(shard, free_block->next))->prev = offset;
+    }
+    shard->free_lists[index] = offset;
+}
+
+static void free_list_remove(struct cache_shard * shard, struct cache_block * block)
+{
+    struct cache_free_block * free_block = (struct cache_free_block *) block;
+
+    if( free_block->prev != NO_BLOCK ) {
+        ((struct cache_free_block *) block_at(shard, free_block->prev))->next = free_block->next;
     } else {
-        intern->table[offset] = append(intern, entry, sizeof(struct table_entry));
+        shard->free_lists[free_list_index(block_size(block))] = free_block->next;
+    }
+    if( free_block->next != NO_BLOCK ) {
+        ((struct cache_free_block *) block_at(shard, free_block->next))->prev = free_block->prev;
+    }
+}
+
+// Turn the given range into a single free block
+static void block_make_free(struct cache_shard * shard, size_t offset, size_t size, size_t prev_size)
+{
+    struct cache_block * block = block_at(shard, offset);
+    struct cache_block * next;
+
+    block->size = size;
+    block->prev_size = prev_size;
+    if( NULL != (next = block_next(shard, block)) ) {
+        next->prev_size = size;
+    }
+    free_list_insert(shard, block);
+}
+
+static struct cache_block * block_alloc(struct cache_shard * shard, size_t size)
+{
+    unsigned index;
+
+    for( index = free_list_index(size); index < FREE_LIST_COUNT; index++ ) {
+        size_t offset = shard->free_lists[index];
+        while( offset != NO_BLOCK ) {
+            struct cache_block * block = block_at(shard, offset);
+            size_t available = block_size(block);
+            if( available >= size ) {
+                free_list_remove(shard, block);
+                if( available - size >= MIN_BLOCK_SIZE ) {
+                    block_make_free(shard, offset + size, available - size, size);
+                } else {
+                    size = available;
+                }
+                block->size = size | 1;
+                shard->data_length += size;
+                return block;
+            }
+            offset = ((struct cache_free_block *) block)->next;
+        }
+    }
+
+    return NULL;
+}
+
+static void block_free(struct cache_shard * shard, struct cache_block * block)
+{
+    size_t offset = block_offset(shard, block);
+    size_t size = block_size(block);
+    size_t prev_size = block->prev_size;
+    struct cache_block * next = block_next(shard, block);
+
+    shard->data_length -= size;
+
+    // Merge with the next block
+    if( next && !block_used(next) ) {
+        free_list_remove(shard, next);
+        size += block_size(next);
+    }
+
+    // Merge with the previous block
+    if( prev_size > 0 ) {
+        struct cache_block * prev = block_at(shard, offset - prev_size);
+        if( !block_used(prev) ) {
+            free_list_remove(shard, prev);
+            offset -= prev_size;
+            size += prev_size;
+            prev_size = prev->prev_size;
+        }
+    }
+
+    block_make_free(shard, offset, size, prev_size);
+}
+
+static void shard_init_data(struct cache_shard * shard)
+{
+    unsigned i;
+
+    for( i = 0; i < FREE_LIST_COUNT; i++ ) {
+        shard->free_lists[i] = NO_BLOCK;
+    }
+    shard->data_length = 0;
+    block_make_free(shard, 0, shard->data_size, 0);
+}
+
+// }}} Allocator
+
+// {{{ Entries
+
+static inline struct cache_shard * shard_for_key(struct handlebars_cache_mmap * intern, struct handlebars_string * string)
+{
+    return &intern->shards[hbs_str_hash(string) & (intern->shard_count - 1)];
+}
+
+static inline struct cache_shard * shard_for_module(struct handlebars_cache_mmap * intern, struct handlebars_module * module)
+{
+    size_t offset = (size_t) ((char *) module - (char *) intern->segments);
+    return &intern->shards[offset / intern->shard_size];
+}
+
+// The low bits of the hash select the shard, the rest select the slot
+static inline struct table_slot * table_slot(struct handlebars_cache_mmap * intern, struct cache_shard * shard, struct handlebars_string * string)
+{
+    uint32_t offset = (hbs_str_hash(string) / intern->shard_count) % shard->table_count;
+    return &shard->table[offset];
+}
+
+static inline struct table_entry * module_entry(struct handlebars_module * module)
+{
+    return (struct table_entry *) (void *) ((char *) module - sizeof(struct table_entry));
+}
+
+static inline size_t entry_size(struct handlebars_string * key, struct handlebars_module * module)
+{
+    return handlebars_align_size(
+        sizeof(struct cache_block) + sizeof(struct table_entry) + module->size + HBS_STR_SIZE(hbs_str_len(key)),
+        BLOCK_ALIGNMENT
+    );
+}
+
+// Remove the entry from its slot. If it is in use, it is freed when the last lookup releases it.
+static void slot_unlink(struct cache_shard * shard, struct table_slot * slot)
+{
+    struct table_entry * entry = slot->entry;
+
+    STORE(slot->entry, NULL, SEQ_CST);
+    shard->table_entries--;
+
+    if( LOAD(slot->refcount, SEQ_CST) == 0 ) {
+        block_free(shard, entry_block(entry));
+        return;
+    }
+
+    STORE(slot->zombie, entry, SEQ_CST);
+    if( LOAD(slot->refcount, SEQ_CST) == 0 ) {
+        // Released in the meantime, without seeing the zombie
+        slot->zombie = NULL;
+        block_free(shard, entry_block(entry));
+    }
+}
+
+static void slot_release(struct handlebars_cache * cache, struct cache_shard * shard, struct table_slot * slot)
+{
+    if( DECR(slot->refcount, SEQ_CST) > 0 || !LOAD(slot->zombie, SEQ_CST) ) {
+        return;
+    }
+
+    lock(cache, shard);
+    if( slot->zombie && LOAD(slot->refcount, SEQ_CST) == 0 ) {
+        protect(cache, shard, false);
+        block_free(shard, entry_block(slot->zombie));
+        slot->zombie = NULL;
+        protect(cache, shard, true);
+    }
+    unlock(cache, shard);
+}
+
+// Evict one entry that is not in use, giving entries that were looked up since the clock hand last passed them
+// another round
+static bool shard_evict(struct cache_shard * shard)
+{
+    uint32_t n;
+
+    for( n = 0; n < 2 * shard->table_count; n++ ) {
+        struct table_slot * slot = &shard->table[shard->clock_hand];
+        shard->clock_hand = (shard->clock_hand + 1) % shard->table_count;
+
+        if( !slot->entry || slot->zombie || LOAD(slot->refcount, RELAXED) > 0 ) {
+            continue;
+        }
+        if( LOAD(slot->referenced, RELAXED) ) {
+            STORE(slot->referenced, 0, RELAXED);
+            continue;
+        }
+
+        slot_unlink(shard, slot);
+        if( !slot->zombie ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void entry_move(struct cache_shard * shard, struct table_entry * entry, size_t offset)
+{
+    struct cache_block * block = block_at(shard, offset);
+    struct table_entry * moved = (struct table_entry *) (void *) ((char *) block + sizeof(struct cache_block));
+    ptrdiff_t delta = (char *) block - (char *) entry_block(entry);
+
+    memmove(block, entry_block(entry), block_size(entry_block(entry)));
+    moved->key = (struct handlebars_string *) (void *) ((char *) moved->key + delta);
+    moved->data = (char *) moved->data + delta;
+    handlebars_module_patch_pointers(moved->data);
+    handlebars_module_generate_hash(moved->data);
+    STORE(shard->table[moved->slot].entry, moved, RELEASE);
+}
+
+// Slide every entry that is not in use towards the beginning of the data segment, so the free space becomes
+// contiguous. Entries in use stay where they are.
+static void shard_compact(struct cache_shard * shard)
+{
+    size_t offset = 0;
+    size_t dest = 0;
+    size_t prev_size = 0;
+    unsigned i;
+
+    for( i = 0; i < FREE_LIST_COUNT; i++ ) {
+        shard->free_lists[i] = NO_BLOCK;
+    }
+
+    while( offset < shard->data_size ) {
+        struct cache_block * block = block_at(shard, offset);
+        size_t size = block_size(block);
+        struct table_entry * entry;
+        struct table_slot * slot;
+
+        if( !block_used(block) ) {
+            offset += size;
+            continue;
+        }
+
+        entry = (struct table_entry *) (void *) ((char *) block + sizeof(struct cache_block));
+        slot = &shard->table[entry->slot];
+
+        if( dest != offset && slot->entry == entry ) {
+            // Take it out of the table while it is moved, unless it is in use
+            STORE(slot->entry, NULL, SEQ_CST);
+            if( LOAD(slot->refcount, SEQ_CST) == 0 ) {
+                block->prev_size = prev_size;
+                entry_move(shard, entry, dest);
+                prev_size = size;
+                dest += size;
+                offset += size;
+                continue;
+            }
+            STORE(slot->entry, entry, RELEASE);
+        }
+
+        // Pinned in place, the gap before it becomes a free block
+        if( dest != offset ) {
+            block_make_free(shard, dest, offset - dest, prev_size);
+            prev_size = offset - dest;
+        }
+        block->prev_size = prev_size;
+        prev_size = size;
+        offset += size;
+        dest = offset;
+    }
+
+    if( dest < shard->data_size ) {
+        block_make_free(shard, dest, shard->data_size - dest, prev_size);
     }
 }
 
-static inline void table_unset(struct handlebars_cache_mmap * intern, struct handlebars_string * string)
+// Check that the blocks of a data segment read from a cache file tile it exactly
+static bool shard_check_blocks(struct cache_shard * shard)
 {
-    uint32_t offset = hbs_str_hash(string) % intern->table_count;
-    intern->table[offset] = NULL;
+    size_t offset = 0;
+    size_t prev_size = 0;
+
+    while( offset < shard->data_size ) {
+        struct cache_block * block = block_at(shard, offset);
+        size_t size = block_size(block);
+        if( size < MIN_BLOCK_SIZE || size % BLOCK_ALIGNMENT != 0 || size > shard->data_size - offset || block->prev_size != prev_size ) {
+            return false;
+        }
+        prev_size = size;
+        offset += size;
+    }
+
+    return true;
+}
+
+// Check an entry of a cache file that was written by a process that mapped it delta bytes lower
+static bool entry_verify(struct cache_block * block, struct table_entry * entry, ptrdiff_t delta)
+{
+    struct handlebars_module * module = (struct handlebars_module *) (void *) ((char *) entry + sizeof(struct table_entry));
+    size_t available = block_size(block) - sizeof(struct cache_block) - sizeof(struct table_entry) - HBS_STR_SIZE(0);
+    struct handlebars_string * key;
+
+    if( (char *) entry->data + delta != (char *) module || (char *) module->addr + delta != (char *) module ) {
+        return false;
+    }
+    if( module->size < sizeof(struct handlebars_module) || module->size > available ) {
+        return false;
+    }
+
+    key = (struct handlebars_string *) (void *) ((char *) module + module->size);
+    if( (char *) entry->key + delta != (char *) key || hbs_str_len(key) > available - module->size ) {
+        return false;
+    }
+
+    return handlebars_module_verify(module, NULL);
+}
+
+// Bring a shard of a cache file that no other process has mapped back into a consistent state. Entries are rebased
+// by delta bytes, and dropped if they fail verification or are not linked from their slot. Pins and zombies left
+// behind by processes that exited are discarded.
+static void shard_recover(struct cache_shard * shard, ptrdiff_t delta)
+{
+    size_t offset = 0;
+    size_t dest = 0;
+    size_t prev_size = 0;
+    uint32_t i;
+
+    for( i = 0; i < shard->table_count; i++ ) {
+        struct table_slot * slot = &shard->table[i];
+        slot->refcount = 0;
+        slot->referenced = 0;
+        slot->zombie = NULL;
+        if( slot->entry ) {
+            slot->entry = (struct table_entry *) (void *) ((char *) slot->entry + delta);
+        }
+    }
+
+    shard->table_entries = 0;
+
+    if( !shard_check_blocks(shard) ) {
+        memset(shard->table, 0, shard->table_size);
+        shard_init_data(shard);
+        return;
+    }
+
+    for( i = 0; i < FREE_LIST_COUNT; i++ ) {
+        shard->free_lists[i] = NO_BLOCK;
+    }
+    shard->data_length = 0;
+
+    while( offset < shard->data_size ) {
+        struct cache_block * block = block_at(shard, offset);
+        size_t size = block_size(block);
+        struct table_entry * entry = (struct table_entry *) (void *) ((char *) block + sizeof(struct cache_block));
+
+        offset += size;
+
+        if( !block_used(block) ||
+                size < sizeof(struct cache_block) + sizeof(struct table_entry) + sizeof(struct handlebars_module) + HBS_STR_SIZE(0) ||
+                entry->slot >= shard->table_count ||
+                shard->table[entry->slot].entry != entry ||
+                !entry_verify(block, entry, delta) ) {
+            // Becomes part of the free block before the next entry
+            continue;
+        }
+
+        entry->key = (struct handlebars_string *) (void *) ((char *) entry->key + delta);
+        entry->data = (char *) entry->data + delta;
+        handlebars_module_patch_pointers(entry->data);
+        handlebars_module_generate_hash(entry->data);
+
+        // Mark the slot as valid
+        shard->table[entry->slot].referenced = 1;
+
+        if( dest != offset - size ) {
+            block_make_free(shard, dest, offset - size - dest, prev_size);
+            prev_size = offset - size - dest;
+        }
+        block->prev_size = prev_size;
+        prev_size = size;
+        dest = offset;
+        shard->data_length += size;
+        shard->table_entries++;
+    }
+
+    if( dest < shard->data_size ) {
+        block_make_free(shard, dest, shard->data_size - dest, prev_size);
+    }
+
+    // Drop the slots that did not point to a valid entry
+    for( i = 0; i < shard->table_count; i++ ) {
+        if( !shard->table[i].referenced ) {
+            shard->table[i].entry = NULL;
+        }
+        shard->table[i].referenced = 0;
+    }
 }
 
+// }}} Entries
+
 static int cache_dtor(struct handlebars_cache * cache)
 {
     struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
@@ -224,46 +740,32 @@ static int cache_dtor(struct handlebars_cache * cache)
     return 0;
 }
 
-static void cache_reset(struct handlebars_cache * cache)
+static void shard_reset(struct handlebars_cache * cache, struct cache_shard * shard)
 {
-    struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
+    uint32_t i;
 
-    // Lock
-    intern->in_reset = true;
+    lock(cache, shard);
+    protect(cache, shard, false);
 
-    // Try to wait for refcount to empty
-#ifdef HAVE_ATOMIC_BUILTINS
-    int counter = 0;
-    while( __atomic_load_n(&intern->refcount, __ATOMIC_SEQ_CST) > 0 && ++counter <= 100 ) {
-        usleep(5000);
-    }
-    if( __atomic_load_n(&intern->refcount, __ATOMIC_SEQ_CST) > 0 ) {
-        goto error;
-    }
-#else
-    if (intern->refcount > 0) {
-        goto error;
+    for( i = 0; i < shard->table_count; i++ ) {
+        if( shard->table[i].entry ) {
+            slot_unlink(shard, &shard->table[i]);
+        }
+        STORE(shard->table[i].referenced, 0, RELAXED);
     }
-#endif
-
-    // Unprotect/Lock
-    lock(cache);
-    protect(cache, false);
 
-    // Initialize header
-    intern->table_entries = 0;
-    intern->data_length = 0;
-
-    // Zero out the hash table
-    memset(intern->table, 0, intern->table_size);
+    protect(cache, shard, true);
+    unlock(cache, shard);
+}
 
-    // Protect/Unlock
-    protect(cache, true);
-    unlock(cache);
+static void cache_reset(struct handlebars_cache * cache)
+{
+    struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
+    uint32_t i;
 
-error:
-    // Unlock
-    intern->in_reset = false;
+    for( i = 0; i < intern->shard_count; i++ ) {
+        shard_reset(cache, &intern->shards[i]);
+    }
 }
 
 static int cache_gc(struct handlebars_cache * cache)
@@ -275,27 +777,31 @@ static int cache_gc(struct handlebars_cache * cache)
 static struct handlebars_module * cache_find(struct handlebars_cache * cache, struct handlebars_string * key)
 {
     struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
-    struct handlebars_module * module = NULL;
+    struct cache_shard * shard = shard_for_key(intern, key);
+    struct table_slot * slot = table_slot(intern, shard, key);
+    struct handlebars_module * module;
     time_t now;
 
-    // Currently resetting
-    if( intern->in_reset ) {
-        return NULL;
-    }
-
     // Find entry
-    struct table_entry * entry = table_find(intern, key);
+    struct table_entry * entry = LOAD(slot->entry, ACQUIRE);
 
     if( !entry ) {
         // Not found, or not ready
-        INCR(intern->misses);
+        INCR(shard->counters.misses, RELAXED);
+        return NULL;
+    }
+
+    // Pin the slot, then make sure the entry was not unlinked or moved before the pin was seen
+    INCR(slot->refcount, SEQ_CST);
+    if( LOAD(slot->entry, SEQ_CST) != entry ) {
+        INCR(shard->counters.misses, RELAXED);
         goto error;
     }
 
     // Compare key
     if( !handlebars_string_eq(key, entry->key) ) {
-        INCR(intern->misses);
-        //INCR(intern->collisions);
+        INCR(shard->counters.misses, RELAXED);
+        //INCR(shard->counters.collisions, RELAXED);
         goto error;
     }
 
@@ -304,27 +810,34 @@ static struct handlebars_module * cache_find(struct handlebars_cache * cache, st
 
     // Check if it's too old or wrong version
     time(&now);
-    if( module->version != handlebars_version() || (cache->max_age >= 0 && difftime(now, module->ts) >= cache->max_age) ) {
-        lock(cache);
-        protect(cache, false);
-        table_unset(intern, key);
-        intern->misses++;
-        intern->table_entries--;
-        protect(cache, true);
-        unlock(cache);
+    if( module->version != handlebars_version() || module->format != HANDLEBARS_MODULE_FORMAT || (cache->max_age >= 0 && difftime(now, module->ts) >= cache->max_age) ) {
+        lock(cache, shard);
+        if( slot->entry == entry ) {
+            protect(cache, shard, false);
+            slot_unlink(shard, slot);
+            protect(cache, shard, true);
+        }
+        unlock(cache, shard);
+        INCR(shard->counters.misses, RELAXED);
         goto error;
     }
 
     // Check for pointer mismatch
     if( unlikely((void *) module != module->addr) ) {
+        slot_release(cache, shard, slot);
         handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Shared memory pointer mismatch: %p != %p", module, module->addr);
     }
 
-    INCR(intern->hits);
-    INCR(intern->refcount);
+    // Only write the bit if needed, to keep the cache line shared
+    if( !LOAD(slot->referenced, RELAXED) ) {
+        STORE(slot->referenced, 1, RELAXED);
+    }
+    INCR(shard->counters.hits, RELAXED);
+    return module;
 
 error:
-    return module;
+    slot_release(cache, shard, slot);
+    return NULL;
 }
 
 static void cache_add(
@@ -333,81 +846,249 @@ static void cache_add(
     struct handlebars_module * module
 ) {
     struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
-    struct table_entry entry;
+    struct cache_shard * shard = shard_for_key(intern, key);
+    struct table_slot * slot = table_slot(intern, shard, key);
+    size_t size = entry_size(key, module);
+    struct cache_block * block;
+    struct table_entry * entry;
+    bool compacted = false;
 
-    // Currently resetting
-    if( intern->in_reset ) {
+    assert(module == module->addr);
+
+    if( size > shard->data_size ) {
         return;
     }
 
     // Lock
-    lock(cache);
-    protect(cache, false);
-
-    assert(module == module->addr);
+    lock(cache, shard);
+    protect(cache, shard, false);
 
     // Collision
-    struct table_entry * found = table_find(intern, key);
-    if( found ) {
-        if( !handlebars_string_eq(found->key, key) ) {
-            INCR(intern->collisions);
+    if( slot->entry ) {
+        if( !handlebars_string_eq(slot->entry->key, key) ) {
+            INCR(shard->counters.collisions, RELAXED);
         }
         goto error;
     }
 
-    // Copy key
-    entry.key = append(intern, (void *) key, HBS_STR_SIZE(hbs_str_len(key)));
-
-    // Copy data
-    entry.data = append(intern, (void *) module, module->size);
+    // The previous entry of this slot is still in use
+    if( slot->zombie ) {
+        goto error;
+    }
 
-    // Check for failure
-    if( unlikely(!entry.key || !entry.data) ) {
-        protect(cache, true);
-        unlock(cache);
-        cache_reset(cache);
-        return;
+    // Make room. If there is enough free space, but not in one piece, compact the segment once before evicting
+    // anything (else).
+    while( NULL == (block = block_alloc(shard, size)) ) {
+        if( !compacted && shard->data_size - shard->data_length >= size ) {
+            shard_compact(shard);
+            compacted = true;
+        } else if( !shard_evict(shard) ) {
+            break;
+        }
     }
+    if( !block ) {
+        goto error;
+    }
+
+    // Copy the entry, the module and the key
+    entry = (struct table_entry *) (void *) ((char *) block + sizeof(struct cache_block));
+    entry->slot = (size_t) (slot - shard->table);
+    entry->data = (char *) entry + sizeof(struct table_entry);
+    memcpy(entry->data, module, module->size);
+    entry->key = (struct handlebars_string *) (void *) ((char *) entry->data + module->size);
+    memcpy(entry->key, key, HBS_STR_SIZE(hbs_str_len(key)));
 
-    // Pre-patch pointers
-    handlebars_module_patch_pointers(entry.data);
+    // Pre-patch pointers. The hash lets a cache file verify the module when it is opened again.
+    handlebars_module_patch_pointers(entry->data);
+    handlebars_module_generate_hash(entry->data);
 
-    // Finish;
-    table_set(intern, &entry);
-    intern->table_entries++;
+    // Finish, publishing the entry only once it is complete
+    STORE(slot->referenced, 0, RELAXED);
+    STORE(slot->entry, entry, RELEASE);
+    shard->table_entries++;
 
 error:
     // Unlock
-    protect(cache, true);
-    unlock(cache);
+    protect(cache, shard, true);
+    unlock(cache, shard);
 }
 
 static void cache_release(struct handlebars_cache * cache, struct handlebars_string * tmpl, struct handlebars_module * module)
 {
     struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
-    DECR(intern->refcount);
+    struct cache_shard * shard = shard_for_module(intern, module);
+    slot_release(cache, shard, &shard->table[module_entry(module)->slot]);
 }
 
 static struct handlebars_cache_stat cache_stat(struct handlebars_cache * cache)
 {
     struct handlebars_cache_mmap * intern = (struct handlebars_cache_mmap *) cache->internal;
     struct handlebars_cache_stat stat = {0};
+    uint32_t i;
+    uint32_t j;
+
     stat.name = "mmap";
     stat.total_size = intern->size;
-    stat.total_table_size = intern->table_size;
-    stat.total_data_size = intern->data_size;
-    stat.total_entries = intern->table_count;
-    stat.current_entries = intern->table_entries;
-    stat.current_table_size = intern->table_entries * sizeof(struct table_entry);
-    stat.current_data_size = intern->data_length;
+
+    for( i = 0; i < intern->shard_count; i++ ) {
+        struct cache_shard * shard = &intern->shards[i];
+        stat.total_table_size += shard->table_size;
+        stat.total_data_size += shard->data_size;
+        stat.total_entries += shard->table_count;
+        stat.current_entries += shard->table_entries;
+        stat.current_data_size += shard->data_length;
+        stat.hits += LOAD(shard->counters.hits, RELAXED);
+        stat.misses += LOAD(shard->counters.misses, RELAXED);
+        stat.collisions += LOAD(shard->counters.collisions, RELAXED);
+        for( j = 0; j < shard->table_count; j++ ) {
+            stat.refcount += LOAD(shard->table[j].refcount, RELAXED);
+        }
+    }
+
+    stat.current_table_size = stat.current_entries * sizeof(struct table_slot);
     stat.current_size = stat.current_table_size + stat.current_data_size;
-    stat.hits = intern->hits;
-    stat.misses = intern->misses;
-    stat.refcount = intern->refcount;
-    stat.collisions = intern->collisions;
     return stat;
 }
 
+// {{{ Layout
+
+struct cache_layout {
+    //! The page-aligned size of the memory block
+    size_t size;
+
+    //! The page-aligned size of the header, including the shards
+    size_t intern_size;
+
+    uint32_t shard_count;
+
+    size_t shard_size;
+
+    size_t table_size;
+
+    //! The number of slots of each shard
+    size_t shard_entries;
+};
+
+// Calculate sizes, using fewer shards when they would end up too small
+static void cache_layout(struct handlebars_cache * cache, size_t size, size_t entries, struct cache_layout * layout)
+{
+    layout->size = handlebars_align_size(size, page_size);
+    layout->shard_count = HANDLEBARS_CACHE_MMAP_SHARDS;
+
+    for( ;; ) {
+        layout->intern_size = handlebars_align_size(sizeof(struct handlebars_cache_mmap) + layout->shard_count * sizeof(struct cache_shard), page_size);
+        layout->shard_entries = (entries + layout->shard_count - 1) / layout->shard_count;
+        layout->table_size = handlebars_align_size(layout->shard_entries * sizeof(struct table_slot), page_size);
+        layout->shard_size = layout->size > layout->intern_size ? (layout->size - layout->intern_size) / layout->shard_count / page_size * page_size : 0;
+        if( layout->shard_count == 1 || layout->shard_size >= layout->table_size + MIN_SHARD_DATA_SIZE ) {
+            break;
+        }
+        layout->shard_count /= 2;
+    }
+
+    if( layout->table_size >= layout->shard_size ) {
+        handlebars_throw(HBSCTX(cache), HANDLEBARS_ERROR, "Table size must not be greater than segment size");
+    }
+}
+
+// Point a shard at its segments and initialize its lock. The lock of a shard is never held while this runs.
+static void shard_setup(struct handlebars_cache * cache, struct handlebars_cache_mmap * intern, uint32_t i, const struct cache_layout * layout)
+{
+    struct cache_shard * shard = &intern->shards[i];
+    int rc;
+
+    shard->table = (struct table_slot *) (void *) ((char *) intern->segments + i * layout->shard_size);
+    shard->table_size = layout->table_size;
+    shard->table_count = layout->shard_entries;
+    shard->data = ((char *) shard->table) + layout->table_size;
+    shard->data_size = layout->shard_size - layout->table_size;
+
+#ifdef USE_SPINLOCK
+    rc = pthread_spin_init(&shard->write_lock, PTHREAD_PROCESS_SHARED);
+#else
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    rc = pthread_mutex_init(&shard->write_lock, &mattr);
+#endif
+    if( rc != 0 ) {
+        handlebars_throw(HBSCTX(cache), HANDLEBARS_ERROR, "Failed to init lock: %s (%d)", strerror(rc), rc);
+    }
+}
+
+static void cache_init(struct handlebars_cache * cache, struct handlebars_cache_mmap * intern, const struct cache_layout * layout)
+{
+    uint32_t i;
+
+    memset(intern, 0, layout->intern_size);
+    memcpy(intern, head, sizeof(head));
+    intern->version = handlebars_version();
+    intern->module_format = HANDLEBARS_MODULE_FORMAT;
+    intern->size = layout->size;
+    intern->intern_size = layout->intern_size;
+    intern->shard_count = layout->shard_count;
+    intern->shard_size = layout->shard_size;
+    intern->segments = ((char *) intern) + layout->intern_size;
+    intern->base = intern;
+
+    for( i = 0; i < layout->shard_count; i++ ) {
+        struct cache_shard * shard = &intern->shards[i];
+        shard_setup(cache, intern, i, layout);
+        memset(shard->table, 0, shard->table_size);
+        shard_init_data(shard);
+    }
+
+    for( i = 0; i < layout->shard_count; i++ ) {
+        protect(cache, &intern->shards[i], true);
+    }
+}
+
+// Check that a cache file was initialized by this version with the given layout
+static bool cache_check(struct handlebars_cache_mmap * intern, const struct cache_layout * layout)
+{
+    uint32_t i;
+
+    if( memcmp(intern->head, head, sizeof(head)) != 0 ||
+            intern->version != handlebars_version() ||
+            intern->module_format != HANDLEBARS_MODULE_FORMAT ||
+            intern->size != layout->size ||
+            intern->intern_size != layout->intern_size ||
+            intern->shard_count != layout->shard_count ||
+            intern->shard_size != layout->shard_size ||
+            intern->base == NULL ) {
+        return false;
+    }
+
+    for( i = 0; i < layout->shard_count; i++ ) {
+        if( intern->shards[i].table_count != layout->shard_entries || intern->shards[i].table_size != layout->table_size ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Recover a cache file that no other process has mapped, moving it to the address it is now mapped at
+static void cache_recover(struct handlebars_cache * cache, struct handlebars_cache_mmap * intern, const struct cache_layout * layout)
+{
+    ptrdiff_t delta = (char *) intern - (char *) intern->base;
+    uint32_t i;
+
+    intern->segments = ((char *) intern) + layout->intern_size;
+    intern->base = intern;
+
+    for( i = 0; i < layout->shard_count; i++ ) {
+        shard_setup(cache, intern, i, layout);
+        shard_recover(&intern->shards[i], delta);
+    }
+
+    for( i = 0; i < layout->shard_count; i++ ) {
+        protect(cache, &intern->shards[i], true);
+    }
+}
+
+// }}} Layout
+
 #undef CONTEXT
 #define CONTEXT context
 
@@ -420,11 +1101,8 @@ static const struct handlebars_cache_handlers hbs_cache_handlers_mmap = {
     &cache_reset
 };
 
-struct handlebars_cache * handlebars_cache_mmap_ctor(
-    struct handlebars_context * context,
-    size_t size,
-    size_t entries
-) {
+static struct handlebars_cache * cache_ctor(struct handlebars_context * context)
+{
     struct handlebars_cache * cache = MC(handlebars_talloc_zero(context, struct handlebars_cache));
     handlebars_context_bind(context, HBSCTX(cache));
 
@@ -442,48 +1120,130 @@ struct handlebars_cache * handlebars_cache_mmap_ctor(
 #error "Unable to query page size"
 #endif
 
-    // Calculate sizes
-    size_t intern_size = handlebars_align_size(sizeof(struct handlebars_cache_mmap), page_size);
-    size_t shm_size = handlebars_align_size(size, page_size);
-    size_t table_size = handlebars_align_size(entries * sizeof(struct table_entry *), page_size);
-    size_t data_size = shm_size - table_size - intern_size;
+    return cache;
+}
 
-    if( table_size >= shm_size ) {
-        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Table size must not be greater than segment size");
-    }
+struct handlebars_cache * handlebars_cache_mmap_ctor(
+    struct handlebars_context * context,
+    size_t size,
+    size_t entries
+) {
+    struct handlebars_cache * cache = cache_ctor(context);
+    struct cache_layout layout;
+
+    cache_layout(cache, size, entries, &layout);
 
-    struct handlebars_cache_mmap * intern = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    struct handlebars_cache_mmap * intern = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
     if( intern == MAP_FAILED ) {
         handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to mmap: %s", strerror(errno));
     }
     cache->internal = intern;
 
-    memset(intern, 0, intern_size);
-    memcpy(intern, head, sizeof(head));
-    intern->version = handlebars_version();
-    intern->size = shm_size;
-    intern->intern_size = intern_size;
-    intern->table_size = table_size;
-    intern->data_size = data_size;
-    intern->table_count = entries; //table_size / sizeof(struct table_entry *);
+    cache_init(cache, intern, &layout);
 
-    intern->table = (struct table_entry **) (void *) ((char *) intern + intern_size);
-    intern->data = ((char *) intern) + intern_size + table_size;
+    return cache;
+}
 
-#ifdef USE_SPINLOCK
-    int rc = pthread_spin_init(&intern->write_lock, PTHREAD_PROCESS_SHARED);
-#else
-    pthread_mutexattr_t mattr;
-    pthread_mutexattr_init(&mattr);
-    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
-    int rc = pthread_mutex_init(&intern->write_lock, &mattr);
-#endif
-    if( rc != 0 ) {
-        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to init lock: %s (%d)", strerror(rc), rc);
+static int file_dtor(int * fd)
+{
+    if( *fd >= 0 ) {
+        close(*fd);
     }
+    return 0;
+}
+
+struct handlebars_cache * handlebars_cache_mmap_file_ctor(
+    struct handlebars_context * context,
+    const char * path,
+    size_t size,
+    size_t entries
+) {
+    struct handlebars_cache * cache = cache_ctor(context);
+    struct handlebars_cache_mmap header;
+    struct handlebars_cache_mmap * intern;
+    struct cache_layout layout;
+    struct stat st;
+    size_t map_size;
+    bool exclusive;
+    int attempt;
+    int * fd;
+
+    cache_layout(cache, size, entries, &layout);
+
+    // Closing the file releases the lock, after the destructor of the cache unmapped it
+    fd = MC(handlebars_talloc(cache, int));
+    *fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if( *fd < 0 ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to open %s: %s", path, strerror(errno));
+    }
+    talloc_set_destructor(fd, file_dtor);
+
+    for( attempt = 0; ; attempt++ ) {
+        // Every process holds a shared lock while it has the file mapped. Only a process that can get an exclusive
+        // lock may repair, move or reinitialize the file.
+        exclusive = flock(*fd, LOCK_EX | LOCK_NB) == 0;
+        if( !exclusive && flock(*fd, LOCK_SH) != 0 ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to lock %s: %s", path, strerror(errno));
+        }
 
-    cache_reset(cache);
-    protect(cache, true);
+        if( fstat(*fd, &st) != 0 ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to stat %s: %s", path, strerror(errno));
+        }
+
+        // Read the header, to map the file at the same address as before
+        memset(&header, 0, sizeof(header));
+        if( (size_t) st.st_size >= sizeof(header) && pread(*fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ) {
+            memset(&header, 0, sizeof(header));
+        }
+
+        if( exclusive ) {
+            map_size = layout.size;
+            if( (size_t) st.st_size != map_size ) {
+                if( ftruncate(*fd, (off_t) map_size) != 0 ) {
+                    handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to resize %s: %s", path, strerror(errno));
+                }
+                memset(&header, 0, sizeof(header));
+            }
+        } else {
+            map_size = (size_t) st.st_size;
+            if( map_size < sizeof(header) || header.size != map_size ) {
+                handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid cache file %s", path);
+            }
+        }
+
+        intern = mmap(header.base, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+        if( intern == MAP_FAILED ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to mmap %s: %s", path, strerror(errno));
+        }
+        cache->internal = intern;
+
+        if( exclusive ) {
+            if( header.base && cache_check(intern, &layout) ) {
+                cache_recover(cache, intern, &layout);
+            } else {
+                cache_init(cache, intern, &layout);
+            }
+            if( flock(*fd, LOCK_SH) != 0 ) {
+                handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Failed to lock %s: %s", path, strerror(errno));
+            }
+        } else if( memcmp(intern->head, head, sizeof(head)) != 0 || intern->version != handlebars_version() ||
+                intern->module_format != HANDLEBARS_MODULE_FORMAT ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Incompatible cache file %s", path);
+        }
+
+        // Other processes use the file at an address that was not available, or one moved it while the lock was
+        // downgraded
+        if( intern->base == intern ) {
+            break;
+        }
+
+        munmap(intern, map_size);
+        cache->internal = NULL;
+
+        if( attempt >= 2 ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Cache file %s is in use at an address that is not available", path);
+        }
+    }
 
     return cache;
 }
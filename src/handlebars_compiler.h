@@ -91,6 +91,11 @@ enum handlebars_compiler_flag {
 
     handlebars_compiler_flag_mustache_style_lambdas = (1 << 12),
 
+    /**
+     * @brief Lower programs to the register form of the VM when serializing them (experimental)
+     */
+    handlebars_compiler_flag_registers = (1 << 13),
+
     // Composite option flags
 
     /**
@@ -101,7 +106,7 @@ enum handlebars_compiler_flag {
     /**
      * @brief All flags
      */
-    handlebars_compiler_flag_all = ((1 << 13) - 1)
+    handlebars_compiler_flag_all = ((1 << 14) - 1)
 };
 
 enum handlebars_compiler_result_flag {
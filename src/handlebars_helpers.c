@@ -45,7 +45,7 @@
 const size_t HANDLEBARS_OPTIONS_SIZE = sizeof(struct handlebars_options);
 
 #undef CONTEXT
-#define CONTEXT HBSCTX(vm)
+#define CONTEXT HANDLEBARS_VM_RENDER_CTX(vm)
 
 void handlebars_options_deinit(struct handlebars_options * options)
 {
@@ -60,22 +60,38 @@ void handlebars_options_deinit(struct handlebars_options * options)
     }
 }
 
+// Whether the VM lets this call append its output to vm->buffer instead of returning it. The permission is used up
+// by the first check, so nothing the helper calls in turn sees it.
+static inline bool take_append_direct(struct handlebars_vm * vm, struct handlebars_options * options)
+{
+    bool direct = vm->append_options == options;
+    vm->append_options = NULL;
+    return direct;
+}
+
+// Keep the permission for a helper this call delegates to, only if that is still the builtin
+static inline void pass_append_direct(struct handlebars_vm * vm, struct handlebars_options * options, const char * name, size_t len)
+{
+    if( vm->append_options == options && handlebars_vm_helper_overridden(vm, name, len) ) {
+        vm->append_options = NULL;
+    }
+}
+
 struct handlebars_value * handlebars_builtin_each(HANDLEBARS_HELPER_ARGS)
 {
+    bool direct = take_append_direct(vm, options);
     struct handlebars_value * context;
-    struct handlebars_string * result_str = handlebars_string_ctor(CONTEXT, HBS_STRL(""));
+    struct handlebars_string * result_str = direct ? vm->buffer : handlebars_string_init(CONTEXT, HANDLEBARS_VM_BUFFER_INIT_SIZE);
+    size_t iteration_len;
     short use_data;
-    struct handlebars_string * tmp;
     size_t i = 0;
     size_t len;
+    size_t prev_len;
+    size_t max_iteration_len = 0;
     HANDLEBARS_VALUE_DECL(rv2);
-    HANDLEBARS_VALUE_DECL(index);
-    HANDLEBARS_VALUE_DECL(key);
-    HANDLEBARS_VALUE_DECL(first);
-    HANDLEBARS_VALUE_DECL(last);
     HANDLEBARS_VALUE_DECL(data);
     HANDLEBARS_VALUE_DECL(block_params);
-    struct handlebars_map * data_map = NULL;
+    struct handlebars_vm_data_frame frame;
 
     use_data = (options->data != NULL);
 
@@ -98,18 +114,11 @@ struct handlebars_value * handlebars_builtin_each(HANDLEBARS_HELPER_ARGS)
         goto whoopsie;
     }
 
+    // The iteration variables live in a frame instead of a copy of the data map, which is only made if a helper in
+    // the block asks for it
     if( use_data ) {
         handlebars_value_array(block_params, handlebars_stack_ctor(CONTEXT, 2));
-
-        if( handlebars_value_get_type(options->data) == HANDLEBARS_VALUE_TYPE_MAP ) {
-            data_map = handlebars_map_ctor(CONTEXT, handlebars_value_count(options->data) + 4);
-            HANDLEBARS_VALUE_FOREACH_KV(options->data, options_key, child) {
-                data_map = handlebars_map_update(data_map, options_key, child);
-            } HANDLEBARS_VALUE_FOREACH_END();
-        } else {
-            data_map = handlebars_map_ctor(CONTEXT, 4);
-        }
-        handlebars_map_addref(data_map);
+        handlebars_vm_data_frame_init(&frame, vm->data_frame, options->data);
     }
 
     len = handlebars_value_count(context);
@@ -123,92 +132,97 @@ struct handlebars_value * handlebars_builtin_each(HANDLEBARS_HELPER_ARGS)
         //     continue;
         // }
 
-        if( it_key /*it->value->type == HANDLEBARS_VALUE_TYPE_MAP*/ ) {
-            handlebars_value_str(key, it_key);
-        } else {
-            handlebars_value_integer(key, it_index);
+        // Iterations append to the result directly, and appends only grow it to fit, so make room for at least
+        // the largest iteration so far ahead of time, doubling the buffer
+        if( HBS_STR_SIZE(hbs_str_len(result_str) + max_iteration_len) > talloc_get_size(result_str) ) {
+            result_str = handlebars_string_extend(CONTEXT, result_str, 2 * hbs_str_len(result_str) + max_iteration_len);
         }
+        prev_len = hbs_str_len(result_str);
 
-        if( use_data && data_map ) {
+        if( use_data ) {
+            if( it_key /*it->value->type == HANDLEBARS_VALUE_TYPE_MAP*/ ) {
+                handlebars_value_str(&frame.key, it_key);
+            } else {
+                handlebars_value_integer(&frame.key, it_index);
+            }
             if( it_index ) {
-                handlebars_value_integer(index, it_index);
+                handlebars_value_integer(&frame.index, it_index);
             } else {
-                handlebars_value_integer(index, i);
+                handlebars_value_integer(&frame.index, i);
             }
-            handlebars_value_boolean(first, i == 0);
-            handlebars_value_boolean(last, i == len);
+            handlebars_value_boolean(&frame.first, i == 0);
+            handlebars_value_boolean(&frame.last, i == len);
+            frame.map_stale = true;
 
             handlebars_value_array_set(block_params, 0, it_child);
-            handlebars_value_array_set(block_params, 1, key);
+            handlebars_value_array_set(block_params, 1, &frame.key);
 
-            data_map = handlebars_map_str_update(data_map, HBS_STRL("index"), index);
-            data_map = handlebars_map_str_update(data_map, HBS_STRL("key"), key);
-            data_map = handlebars_map_str_update(data_map, HBS_STRL("first"), first);
-            data_map = handlebars_map_str_update(data_map, HBS_STRL("last"), last);
-            handlebars_value_map(data, data_map);
+            result_str = handlebars_vm_execute_program_append(vm, options->program, it_child, options->data, &frame, block_params, result_str);
+        } else {
+            result_str = handlebars_vm_execute_program_append(vm, options->program, it_child, data, NULL, block_params, result_str);
         }
 
-        tmp = handlebars_vm_execute_program_ex(vm, options->program, it_child, data, block_params);
-        result_str = handlebars_string_append(HBSCTX(vm), result_str, HBS_STR_STRL(tmp));
-
-        handlebars_value_null(data);
-
+        // The output may have been flushed if appended to the top-level buffer
+        iteration_len = hbs_str_len(result_str) > prev_len ? hbs_str_len(result_str) - prev_len : 0;
+        if( iteration_len > max_iteration_len ) {
+            max_iteration_len = iteration_len;
+        }
         i++;
     } HANDLEBARS_VALUE_FOREACH_END();
 
 whoopsie:
     if( i == 0 ) {
-        tmp = handlebars_vm_execute_program(vm, options->inverse, options->scope);
-        assert(tmp != NULL);
-        result_str = handlebars_string_append(HBSCTX(vm), result_str, HBS_STR_STRL(tmp));
+        result_str = handlebars_vm_execute_program_append(vm, options->inverse, options->scope, NULL, vm->data_frame, NULL, result_str);
     }
 
-    handlebars_value_str(rv, result_str);
+    if( direct ) {
+        vm->buffer = result_str;
+    } else {
+        handlebars_value_str(rv, result_str);
+    }
 
-    if( use_data && data_map ) {
-        handlebars_map_delref(data_map);
+    if( use_data ) {
+        handlebars_vm_data_frame_deinit(&frame);
     }
 
     HANDLEBARS_VALUE_UNDECL(rv2);
     HANDLEBARS_VALUE_UNDECL(block_params);
     HANDLEBARS_VALUE_UNDECL(data);
-    HANDLEBARS_VALUE_UNDECL(last);
-    HANDLEBARS_VALUE_UNDECL(first);
-    HANDLEBARS_VALUE_UNDECL(key);
-    HANDLEBARS_VALUE_UNDECL(index);
 
     return rv;
 }
 
 struct handlebars_value * handlebars_builtin_block_helper_missing(HANDLEBARS_HELPER_ARGS)
 {
-    struct handlebars_value * context;
-    struct handlebars_string * result_str = NULL;
+    struct handlebars_value * context = options->scope;
+    long program;
     bool is_zero;
 
     if( argc < 1 ) {
-        goto inverse;
+        program = options->inverse;
+    } else {
+        is_zero = handlebars_value_get_type(&argv[0]) == HANDLEBARS_VALUE_TYPE_INTEGER && handlebars_value_get_intval(&argv[0]) == 0;
+
+        if( handlebars_value_get_type(&argv[0]) == HANDLEBARS_VALUE_TYPE_TRUE ) {
+            program = options->program;
+        } else if( handlebars_value_is_empty(&argv[0]) && !is_zero ) {
+            program = options->inverse;
+        } else if( handlebars_value_get_type(&argv[0]) == HANDLEBARS_VALUE_TYPE_ARRAY ) {
+            pass_append_direct(vm, options, HBS_STRL("each"));
+            return handlebars_vm_call_helper_str(HBS_STRL("each"), HANDLEBARS_HELPER_ARGS_PASSTHRU);
+        } else {
+            // For object, etc
+            program = options->program;
+            context = &argv[0];
+        }
     }
 
-    context = &argv[0];
-    is_zero = handlebars_value_get_type(context) == HANDLEBARS_VALUE_TYPE_INTEGER && handlebars_value_get_intval(context) == 0;
-
-    if( handlebars_value_get_type(context) == HANDLEBARS_VALUE_TYPE_TRUE ) {
-        result_str = handlebars_vm_execute_program(vm, options->program, options->scope);
-    } else if( handlebars_value_is_empty(context) && !is_zero ) {
-inverse:
-        result_str = handlebars_vm_execute_program(vm, options->inverse, options->scope);
-    } else if( handlebars_value_get_type(context) == HANDLEBARS_VALUE_TYPE_ARRAY ) {
-        rv = handlebars_vm_call_helper_str(HBS_STRL("each"), HANDLEBARS_HELPER_ARGS_PASSTHRU);
-        goto done;
+    if( take_append_direct(vm, options) ) {
+        vm->buffer = handlebars_vm_execute_program_append(vm, program, context, NULL, vm->data_frame, NULL, vm->buffer);
     } else {
-        // For object, etc
-        result_str = handlebars_vm_execute_program(vm, options->program, context);
+        handlebars_value_str(rv, handlebars_vm_execute_program(vm, program, context));
     }
 
-    handlebars_value_str(rv, result_str);
-
-done:
     return rv;
 }
 
@@ -274,9 +288,9 @@ struct handlebars_value * handlebars_builtin_lookup(HANDLEBARS_HELPER_ARGS)
 
 struct handlebars_value * handlebars_builtin_if(HANDLEBARS_HELPER_ARGS)
 {
+    bool direct = take_append_direct(vm, options);
     struct handlebars_value * conditional = &argv[0];
     long program;
-    struct handlebars_string * result_str = NULL;
     HANDLEBARS_VALUE_DECL(rv2);
 
     if (argc != 1) {
@@ -301,8 +315,11 @@ struct handlebars_value * handlebars_builtin_if(HANDLEBARS_HELPER_ARGS)
         program = options->inverse;
     }
 
-    result_str = handlebars_vm_execute_program(vm, program, options->scope);
-    handlebars_value_str(rv, result_str);
+    if( direct ) {
+        vm->buffer = handlebars_vm_execute_program_append(vm, program, options->scope, NULL, vm->data_frame, NULL, vm->buffer);
+    } else {
+        handlebars_value_str(rv, handlebars_vm_execute_program(vm, program, options->scope));
+    }
 
     HANDLEBARS_VALUE_UNDECL(rv2);
 
@@ -322,12 +339,14 @@ struct handlebars_value * handlebars_builtin_unless(HANDLEBARS_HELPER_ARGS)
 
     handlebars_value_boolean(conditional, handlebars_value_is_empty(conditional));
 
+    pass_append_direct(vm, options, HBS_STRL("if"));
     return handlebars_vm_call_helper_str(HBS_STRL("if"), HANDLEBARS_HELPER_ARGS_PASSTHRU);
 }
 
 struct handlebars_value * handlebars_builtin_with(HANDLEBARS_HELPER_ARGS)
 {
-    struct handlebars_string * result_str = NULL;
+    bool direct = take_append_direct(vm, options);
+    struct handlebars_string * result_str = direct ? vm->buffer : NULL;
     struct handlebars_value * context = &argv[0];
     HANDLEBARS_VALUE_DECL(block_params);
     HANDLEBARS_VALUE_DECL(rv2);
@@ -347,15 +366,27 @@ struct handlebars_value * handlebars_builtin_with(HANDLEBARS_HELPER_ARGS)
     assert(context != NULL);
 
     if( handlebars_value_get_type(context) == HANDLEBARS_VALUE_TYPE_NULL ) {
-        result_str = handlebars_vm_execute_program(vm, options->inverse, context);
+        if( direct ) {
+            result_str = handlebars_vm_execute_program_append(vm, options->inverse, context, NULL, vm->data_frame, NULL, result_str);
+        } else {
+            result_str = handlebars_vm_execute_program(vm, options->inverse, context);
+        }
     } else {
         handlebars_value_array(block_params, handlebars_stack_ctor(CONTEXT, 2));
         handlebars_value_array_set(block_params, 0, context);
 
-        result_str = handlebars_vm_execute_program_ex(vm, options->program, context, options->data, block_params);
+        if( direct ) {
+            result_str = handlebars_vm_execute_program_append(vm, options->program, context, options->data, NULL, block_params, result_str);
+        } else {
+            result_str = handlebars_vm_execute_program_ex(vm, options->program, context, options->data, block_params);
+        }
     }
 
-    handlebars_value_str(rv, result_str);
+    if( direct ) {
+        vm->buffer = result_str;
+    } else {
+        handlebars_value_str(rv, result_str);
+    }
 
     HANDLEBARS_VALUE_UNDECL(rv2);
     HANDLEBARS_VALUE_UNDECL(block_params);
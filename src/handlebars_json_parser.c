@@ -0,0 +1,1287 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <talloc.h>
+#include <unistd.h>
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_private.h"
+#include "handlebars_value_private.h"
+
+#include "handlebars_json_parser.h"
+#include "handlebars_map.h"
+#include "handlebars_stack.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "handlebars_value_handlers.h"
+
+#if defined(__x86_64__) && defined(__SSE2__) && !defined(HANDLEBARS_NO_SIMD)
+#define HANDLEBARS_JSON_PARSER_SIMD 1
+#include <emmintrin.h>
+#endif
+
+
+
+struct json_entry {
+    struct handlebars_string * key;
+    struct handlebars_value value;
+};
+
+struct json_parser {
+    struct handlebars_context * ctx;
+    //! Scratch memory, freed once parsing is done
+    void * tmp;
+    const char * start;
+    const char * p;
+    const char * end;
+    unsigned depth;
+    const char * error;
+
+    //! Members of the objects and arrays currently being parsed, innermost last
+    struct json_entry * entries;
+    size_t entries_count;
+    size_t entries_capacity;
+
+    //! Open addressing table of object keys, so each distinct key is allocated and hashed once. Holds a reference to
+    //! each key.
+    struct handlebars_string ** keys;
+    size_t keys_size;
+    size_t keys_count;
+};
+
+static bool parse_value(struct json_parser * parser, struct handlebars_value * rv);
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(parser->ctx)
+
+static bool json_error(struct json_parser * parser, const char * p, const char * msg)
+{
+    parser->p = p;
+    parser->error = msg;
+    return false;
+}
+
+static inline void skip_whitespace(struct json_parser * parser)
+{
+    const char * p = parser->p;
+    const char * end = parser->end;
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+        p++;
+    }
+    parser->p = p;
+}
+
+// Returns the first quote, backslash or control character at or after p, or end
+static inline const char * scan_string(const char * p, const char * end)
+{
+#ifdef HANDLEBARS_JSON_PARSER_SIMD
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (const void *) p);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)
+        );
+        int mask = _mm_movemask_epi8(special);
+        if (mask) {
+            return p + __builtin_ctz((unsigned) mask);
+        }
+    }
+#endif
+
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char) *p;
+        if (c == '"' || c == '\\' || c < 0x20) {
+            break;
+        }
+    }
+
+    return p;
+}
+
+// {{{ Keys
+
+static void keys_grow(struct json_parser * parser)
+{
+    size_t old_size = parser->keys_size;
+    struct handlebars_string ** old_keys = parser->keys;
+    size_t i;
+
+    parser->keys_size = old_size * 2;
+    parser->keys = MC(handlebars_talloc_zero_size(parser->tmp, sizeof(struct handlebars_string *) * parser->keys_size));
+
+    for (i = 0; i < old_size; i++) {
+        if (old_keys[i]) {
+            size_t j = hbs_str_hash(old_keys[i]) & (parser->keys_size - 1);
+            while (parser->keys[j]) {
+                j = (j + 1) & (parser->keys_size - 1);
+            }
+            parser->keys[j] = old_keys[i];
+        }
+    }
+
+    handlebars_talloc_free(old_keys);
+}
+
+static struct handlebars_string ** keys_slot(struct json_parser * parser, const char * str, size_t len, uint32_t hash)
+{
+    size_t mask = parser->keys_size - 1;
+    size_t i = hash & mask;
+    struct handlebars_string * key;
+
+    while (NULL != (key = parser->keys[i])) {
+        if (hbs_str_hash(key) == hash && hbs_str_len(key) == len && 0 == memcmp(hbs_str_val(key), str, len)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return &parser->keys[i];
+}
+
+static struct handlebars_string * keys_insert(struct json_parser * parser, struct handlebars_string ** slot, struct handlebars_string * key)
+{
+    handlebars_string_addref(key);
+    *slot = key;
+    if (++parser->keys_count * 2 > parser->keys_size) {
+        keys_grow(parser);
+    }
+    return key;
+}
+
+static void keys_release(struct json_parser * parser)
+{
+    size_t i;
+    for (i = 0; i < parser->keys_size; i++) {
+        if (parser->keys[i]) {
+            handlebars_string_delref(parser->keys[i]);
+        }
+    }
+}
+
+static struct handlebars_string * intern_key(struct json_parser * parser, const char * str, size_t len)
+{
+    uint32_t hash = handlebars_string_hash(str, len);
+    struct handlebars_string ** slot = keys_slot(parser, str, len, hash);
+    if (*slot) {
+        return *slot;
+    }
+    return keys_insert(parser, slot, handlebars_string_ctor_ex(parser->ctx, str, len, hash));
+}
+
+static struct handlebars_string * intern_string(struct json_parser * parser, struct handlebars_string * string)
+{
+    struct handlebars_string ** slot = keys_slot(parser, hbs_str_val(string), hbs_str_len(string), hbs_str_hash(string));
+    if (*slot) {
+        handlebars_talloc_free(string);
+        return *slot;
+    }
+    return keys_insert(parser, slot, string);
+}
+
+// }}} Keys
+
+// {{{ Strings
+
+static inline int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+static long parse_hex4(const char * p, const char * end)
+{
+    long cp = 0;
+    int i;
+
+    if (end - p < 4) {
+        return -1;
+    }
+    for (i = 0; i < 4; i++) {
+        int d = hex_digit(p[i]);
+        if (d < 0) {
+            return -1;
+        }
+        cp = (cp << 4) | d;
+    }
+    return cp;
+}
+
+static size_t encode_utf8(char * buf, unsigned long cp)
+{
+    if (cp < 0x80) {
+        buf[0] = (char) cp;
+        return 1;
+    } else if (cp < 0x800) {
+        buf[0] = (char) (0xC0 | (cp >> 6));
+        buf[1] = (char) (0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        buf[0] = (char) (0xE0 | (cp >> 12));
+        buf[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char) (0x80 | (cp & 0x3F));
+        return 3;
+    } else {
+        buf[0] = (char) (0xF0 | (cp >> 18));
+        buf[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char) (0x80 | (cp & 0x3F));
+        return 4;
+    }
+}
+
+// Slow path for strings containing escape sequences. begin is the first character of the string, first the first
+// special character in it.
+static struct handlebars_string * parse_escaped_string(struct json_parser * parser, const char * begin, const char * first)
+{
+    const char * end = parser->end;
+    const char * close = first;
+    const char * p;
+    struct handlebars_string * string;
+
+    // Find the closing quote. Unescaping never makes a string longer, so its raw length bounds the result.
+    for (;;) {
+        if (close >= end) {
+            json_error(parser, begin - 1, "unterminated string");
+            return NULL;
+        } else if (*close == '"') {
+            break;
+        } else if (*close == '\\') {
+            if (end - close < 2) {
+                json_error(parser, begin - 1, "unterminated string");
+                return NULL;
+            }
+            close += 2;
+        } else {
+            json_error(parser, close, "control character in string");
+            return NULL;
+        }
+        close = scan_string(close, end);
+    }
+
+    string = handlebars_string_init(parser->ctx, close - begin);
+
+    for (p = begin; p < close; ) {
+        const char * q = scan_string(p, close);
+        char buf[4];
+        size_t len = 1;
+        long cp;
+
+        string = handlebars_string_append_unsafe(string, p, q - p);
+        if (q >= close) {
+            break;
+        }
+
+        // q is on a backslash
+        switch (q[1]) {
+            case '"': buf[0] = '"'; break;
+            case '\\': buf[0] = '\\'; break;
+            case '/': buf[0] = '/'; break;
+            case 'b': buf[0] = '\b'; break;
+            case 'f': buf[0] = '\f'; break;
+            case 'n': buf[0] = '\n'; break;
+            case 'r': buf[0] = '\r'; break;
+            case 't': buf[0] = '\t'; break;
+            case 'u':
+                cp = parse_hex4(q + 2, close);
+                if (cp < 0) {
+                    handlebars_talloc_free(string);
+                    json_error(parser, q, "invalid unicode escape");
+                    return NULL;
+                }
+                q += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF && close - q >= 8 && q[2] == '\\' && q[3] == 'u') {
+                    long low = parse_hex4(q + 4, close);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        q += 6;
+                    }
+                }
+                if (cp >= 0xD800 && cp <= 0xDFFF) {
+                    // Unpaired surrogate
+                    cp = 0xFFFD;
+                }
+                len = encode_utf8(buf, (unsigned long) cp);
+                break;
+            default:
+                handlebars_talloc_free(string);
+                json_error(parser, q, "invalid escape sequence");
+                return NULL;
+        }
+
+        string = handlebars_string_append_unsafe(string, buf, len);
+        p = q + 2;
+    }
+
+    parser->p = close + 1;
+    return string;
+}
+
+// Parse the string starting at the current quote into a new string, or an interned key
+static struct handlebars_string * parse_string(struct json_parser * parser, bool is_key)
+{
+    const char * begin = parser->p + 1;
+    const char * q = scan_string(begin, parser->end);
+    struct handlebars_string * string;
+
+    if (likely(q < parser->end && *q == '"')) {
+        parser->p = q + 1;
+        if (is_key) {
+            return intern_key(parser, begin, q - begin);
+        }
+        return handlebars_string_ctor(parser->ctx, begin, q - begin);
+    }
+
+    string = parse_escaped_string(parser, begin, q);
+    if (string && is_key) {
+        string = intern_string(parser, string);
+    }
+    return string;
+}
+
+// }}} Strings
+
+// {{{ Values
+
+static bool parse_number(struct json_parser * parser, struct handlebars_value * rv)
+{
+    const char * begin = parser->p;
+    const char * p = begin;
+    const char * end = parser->end;
+    bool negative = false;
+    bool is_float = false;
+
+    if (*p == '-') {
+        negative = true;
+        p++;
+    }
+
+    if (p < end && *p == '0') {
+        p++;
+    } else if (p < end && *p >= '1' && *p <= '9') {
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    } else {
+        return json_error(parser, begin, "invalid number");
+    }
+
+    if (p < end && *p == '.') {
+        is_float = true;
+        p++;
+        if (p >= end || *p < '0' || *p > '9') {
+            return json_error(parser, begin, "invalid number");
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (p < end && (*p | 0x20) == 'e') {
+        is_float = true;
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        if (p >= end || *p < '0' || *p > '9') {
+            return json_error(parser, begin, "invalid number");
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    parser->p = p;
+
+    // Up to 18 digits always fit
+    if (!is_float && p - begin <= 18) {
+        long lval = 0;
+        const char * d;
+        for (d = negative ? begin + 1 : begin; d < p; d++) {
+            lval = lval * 10 + (*d - '0');
+        }
+        handlebars_value_integer(rv, negative ? -lval : lval);
+        return true;
+    }
+
+    // strtol and strtod need a terminated copy
+    char buf[64];
+    char * str = buf;
+    size_t len = p - begin;
+    if (len >= sizeof(buf)) {
+        str = MC(handlebars_talloc_strndup(parser->ctx, begin, len));
+    } else {
+        memcpy(buf, begin, len);
+        buf[len] = 0;
+    }
+
+    errno = 0;
+    long lval = is_float ? 0 : strtol(str, NULL, 10);
+    if (!is_float && errno != ERANGE) {
+        handlebars_value_integer(rv, lval);
+    } else {
+        handlebars_value_float(rv, strtod(str, NULL));
+    }
+
+    if (str != buf) {
+        handlebars_talloc_free(str);
+    }
+    return true;
+}
+
+static bool parse_literal(struct json_parser * parser, const char * literal, size_t len)
+{
+    if ((size_t) (parser->end - parser->p) < len || 0 != memcmp(parser->p, literal, len)) {
+        return json_error(parser, parser->p, "invalid literal");
+    }
+    parser->p += len;
+    return true;
+}
+
+static void push_entry(struct json_parser * parser, struct handlebars_string * key, struct handlebars_value * value)
+{
+    if (parser->entries_count >= parser->entries_capacity) {
+        parser->entries_capacity *= 2;
+        parser->entries = MC(handlebars_talloc_realloc(parser->tmp, parser->entries, struct json_entry, parser->entries_capacity));
+    }
+
+    struct json_entry * entry = &parser->entries[parser->entries_count++];
+    entry->key = key;
+    entry->value = *value;
+}
+
+static bool parse_object(struct json_parser * parser, struct handlebars_value * rv)
+{
+    size_t base = parser->entries_count;
+    struct handlebars_map * map;
+    size_t i;
+
+    if (++parser->depth > HANDLEBARS_JSON_PARSER_MAX_DEPTH) {
+        return json_error(parser, parser->p, "maximum nesting depth exceeded");
+    }
+
+    parser->p++;
+    skip_whitespace(parser);
+
+    if (parser->p < parser->end && *parser->p == '}') {
+        parser->p++;
+    } else {
+        for (;;) {
+            struct handlebars_string * key;
+            struct handlebars_value child;
+
+            if (parser->p >= parser->end || *parser->p != '"') {
+                return json_error(parser, parser->p, "expected string key");
+            }
+            if (NULL == (key = parse_string(parser, true))) {
+                return false;
+            }
+
+            skip_whitespace(parser);
+            if (parser->p >= parser->end || *parser->p != ':') {
+                return json_error(parser, parser->p, "expected ':'");
+            }
+            parser->p++;
+            skip_whitespace(parser);
+
+            handlebars_value_init(&child);
+            if (!parse_value(parser, &child)) {
+                return false;
+            }
+            push_entry(parser, key, &child);
+
+            skip_whitespace(parser);
+            if (parser->p < parser->end && *parser->p == ',') {
+                parser->p++;
+                skip_whitespace(parser);
+            } else if (parser->p < parser->end && *parser->p == '}') {
+                parser->p++;
+                break;
+            } else {
+                return json_error(parser, parser->p, "expected ',' or '}'");
+            }
+        }
+    }
+
+    map = handlebars_map_ctor(parser->ctx, parser->entries_count - base);
+    for (i = base; i < parser->entries_count; i++) {
+        map = handlebars_map_update(map, parser->entries[i].key, &parser->entries[i].value);
+        handlebars_value_dtor(&parser->entries[i].value);
+    }
+    parser->entries_count = base;
+    parser->depth--;
+
+    handlebars_value_map(rv, map);
+    return true;
+}
+
+static bool parse_array(struct json_parser * parser, struct handlebars_value * rv)
+{
+    size_t base = parser->entries_count;
+    struct handlebars_stack * stack;
+    size_t i;
+
+    if (++parser->depth > HANDLEBARS_JSON_PARSER_MAX_DEPTH) {
+        return json_error(parser, parser->p, "maximum nesting depth exceeded");
+    }
+
+    parser->p++;
+    skip_whitespace(parser);
+
+    if (parser->p < parser->end && *parser->p == ']') {
+        parser->p++;
+    } else {
+        for (;;) {
+            struct handlebars_value child;
+
+            handlebars_value_init(&child);
+            if (!parse_value(parser, &child)) {
+                return false;
+            }
+            push_entry(parser, NULL, &child);
+
+            skip_whitespace(parser);
+            if (parser->p < parser->end && *parser->p == ',') {
+                parser->p++;
+                skip_whitespace(parser);
+            } else if (parser->p < parser->end && *parser->p == ']') {
+                parser->p++;
+                break;
+            } else {
+                return json_error(parser, parser->p, "expected ',' or ']'");
+            }
+        }
+    }
+
+    stack = handlebars_stack_ctor(parser->ctx, parser->entries_count - base);
+    for (i = base; i < parser->entries_count; i++) {
+        stack = handlebars_stack_push(stack, &parser->entries[i].value);
+        handlebars_value_dtor(&parser->entries[i].value);
+    }
+    parser->entries_count = base;
+    parser->depth--;
+
+    handlebars_value_array(rv, stack);
+    return true;
+}
+
+static bool parse_value(struct json_parser * parser, struct handlebars_value * rv)
+{
+    struct handlebars_string * string;
+
+    if (parser->p >= parser->end) {
+        return json_error(parser, parser->p, "unexpected end of input");
+    }
+
+    switch (*parser->p) {
+        case '{':
+            return parse_object(parser, rv);
+        case '[':
+            return parse_array(parser, rv);
+        case '"':
+            if (NULL == (string = parse_string(parser, false))) {
+                return false;
+            }
+            handlebars_value_str(rv, string);
+            return true;
+        case 't':
+            handlebars_value_boolean(rv, true);
+            return parse_literal(parser, HBS_STRL("true"));
+        case 'f':
+            handlebars_value_boolean(rv, false);
+            return parse_literal(parser, HBS_STRL("false"));
+        case 'n':
+            handlebars_value_null(rv);
+            return parse_literal(parser, HBS_STRL("null"));
+        case '-':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return parse_number(parser, rv);
+        default:
+            return json_error(parser, parser->p, "unexpected character");
+    }
+}
+
+// }}} Values
+
+// {{{ Validation
+
+static bool skip_string(struct json_parser * parser)
+{
+    const char * p = parser->p + 1;
+    const char * end = parser->end;
+
+    for (;;) {
+        p = scan_string(p, end);
+        if (p >= end) {
+            return json_error(parser, parser->p, "unterminated string");
+        } else if (*p == '"') {
+            parser->p = p + 1;
+            return true;
+        } else if (*p != '\\') {
+            return json_error(parser, p, "control character in string");
+        } else if (end - p < 2) {
+            return json_error(parser, parser->p, "unterminated string");
+        }
+
+        switch (p[1]) {
+            case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                p += 2;
+                break;
+            case 'u':
+                if (parse_hex4(p + 2, end) < 0) {
+                    return json_error(parser, p, "invalid unicode escape");
+                }
+                p += 6;
+                break;
+            default:
+                return json_error(parser, p, "invalid escape sequence");
+        }
+    }
+}
+
+// Validate the value at the current position and move past it, without allocating
+static bool skip_value(struct json_parser * parser)
+{
+    struct handlebars_value scalar;
+    char close;
+
+    if (parser->p >= parser->end) {
+        return json_error(parser, parser->p, "unexpected end of input");
+    }
+
+    switch (*parser->p) {
+        case '{':
+        case '[':
+            break;
+        case '"':
+            return skip_string(parser);
+        case 't':
+            return parse_literal(parser, HBS_STRL("true"));
+        case 'f':
+            return parse_literal(parser, HBS_STRL("false"));
+        case 'n':
+            return parse_literal(parser, HBS_STRL("null"));
+        case '-':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            handlebars_value_init(&scalar);
+            return parse_number(parser, &scalar);
+        default:
+            return json_error(parser, parser->p, "unexpected character");
+    }
+
+    if (++parser->depth > HANDLEBARS_JSON_PARSER_MAX_DEPTH) {
+        return json_error(parser, parser->p, "maximum nesting depth exceeded");
+    }
+
+    close = *parser->p == '{' ? '}' : ']';
+    parser->p++;
+    skip_whitespace(parser);
+
+    if (parser->p < parser->end && *parser->p == close) {
+        parser->p++;
+        parser->depth--;
+        return true;
+    }
+
+    for (;;) {
+        if (close == '}') {
+            if (parser->p >= parser->end || *parser->p != '"') {
+                return json_error(parser, parser->p, "expected string key");
+            }
+            if (!skip_string(parser)) {
+                return false;
+            }
+            skip_whitespace(parser);
+            if (parser->p >= parser->end || *parser->p != ':') {
+                return json_error(parser, parser->p, "expected ':'");
+            }
+            parser->p++;
+            skip_whitespace(parser);
+        }
+
+        if (!skip_value(parser)) {
+            return false;
+        }
+
+        skip_whitespace(parser);
+        if (parser->p < parser->end && *parser->p == ',') {
+            parser->p++;
+            skip_whitespace(parser);
+        } else if (parser->p < parser->end && *parser->p == close) {
+            parser->p++;
+            break;
+        } else {
+            return json_error(parser, parser->p, close == '}' ? "expected ',' or '}'" : "expected ',' or ']'");
+        }
+    }
+
+    parser->depth--;
+    return true;
+}
+
+// }}} Validation
+
+// {{{ Lazy documents
+
+struct json_document {
+    const char * data;
+    size_t length;
+    //! The file mapping backing data, or NULL if the caller owns the buffer
+    void * mapping;
+    //! The number of lazy values referencing the document
+    size_t refcount;
+};
+
+struct json_lazy_entry {
+    //! The raw key in the document, or the bytes of string if the key contains escapes. Unused for arrays
+    const char * key;
+    size_t key_length;
+    uint32_t hash;
+    //! The key, created on first use
+    struct handlebars_string * string;
+    //! Offset of the value in the document
+    size_t offset;
+    //! The value, materialized on first use
+    bool materialized;
+    struct handlebars_value value;
+};
+
+struct handlebars_json_lazy {
+    struct handlebars_user user;
+    struct json_document * doc;
+    //! Offset of the opening brace or bracket in the document
+    size_t offset;
+    bool is_object;
+    //! The children are scanned on first access
+    bool indexed;
+    size_t count;
+    struct json_lazy_entry * entries;
+    //! Open addressing table of entry index + 1, objects only
+    uint32_t * table;
+    size_t table_size;
+};
+
+#define GET_LAZY_V(value) GET_LAZY(handlebars_value_get_user(value))
+#define GET_LAZY(user) ((struct handlebars_json_lazy *) talloc_get_type_abort(user, struct handlebars_json_lazy))
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(intern->user.ctx)
+
+static const struct handlebars_value_handlers handlebars_value_json_lazy_handlers;
+
+static int json_document_dtor(struct json_document * doc)
+{
+    if (doc->mapping) {
+        munmap(doc->mapping, doc->length);
+        doc->mapping = NULL;
+    }
+    return 0;
+}
+
+static void json_document_release(struct json_document * doc)
+{
+    if (--doc->refcount == 0) {
+        handlebars_talloc_free(doc);
+    }
+}
+
+static void json_lazy_parser_init(struct json_parser * parser, struct handlebars_json_lazy * intern, size_t offset)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->ctx = intern->user.ctx;
+    parser->start = intern->doc->data;
+    parser->p = intern->doc->data + offset;
+    parser->end = intern->doc->data + intern->doc->length;
+}
+
+static void json_lazy_ctor(struct handlebars_context * ctx, struct handlebars_value * value, struct json_document * doc, size_t offset)
+{
+    struct handlebars_json_lazy * intern = handlebars_talloc_zero(ctx, struct handlebars_json_lazy);
+    HANDLEBARS_MEMCHECK(intern, ctx);
+    handlebars_user_init((struct handlebars_user *) intern, ctx, &handlebars_value_json_lazy_handlers);
+    intern->doc = doc;
+    intern->offset = offset;
+    intern->is_object = doc->data[offset] == '{';
+    doc->refcount++;
+    handlebars_value_user(value, (struct handlebars_user *) intern);
+}
+
+static struct json_lazy_entry * json_lazy_table_find(struct handlebars_json_lazy * intern, const char * key, size_t len, uint32_t hash, uint32_t ** slot)
+{
+    size_t mask = intern->table_size - 1;
+    size_t i = hash & mask;
+    uint32_t index;
+
+    while (0 != (index = intern->table[i])) {
+        struct json_lazy_entry * entry = &intern->entries[index - 1];
+        if (entry->hash == hash && entry->key_length == len && 0 == memcmp(entry->key, key, len)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (slot) {
+        *slot = &intern->table[i];
+    }
+    return index ? &intern->entries[index - 1] : NULL;
+}
+
+static void json_lazy_table_grow(struct handlebars_json_lazy * intern)
+{
+    size_t i;
+
+    handlebars_talloc_free(intern->table);
+    intern->table_size = intern->table_size ? intern->table_size * 2 : 8;
+    intern->table = MC(handlebars_talloc_zero_size(intern, sizeof(uint32_t) * intern->table_size));
+
+    for (i = 0; i < intern->count; i++) {
+        uint32_t * slot;
+        json_lazy_table_find(intern, intern->entries[i].key, intern->entries[i].key_length, intern->entries[i].hash, &slot);
+        *slot = (uint32_t) i + 1;
+    }
+}
+
+// Scan the direct children of the container, skipping over nested containers
+static void json_lazy_index(struct handlebars_json_lazy * intern)
+{
+    struct json_parser parser;
+    size_t capacity = 8;
+    char close = intern->is_object ? '}' : ']';
+
+    json_lazy_parser_init(&parser, intern, intern->offset + 1);
+    intern->indexed = true;
+    intern->entries = MC(handlebars_talloc_array(intern, struct json_lazy_entry, capacity));
+    if (intern->is_object) {
+        json_lazy_table_grow(intern);
+    }
+
+    skip_whitespace(&parser);
+    if (*parser.p == close) {
+        return;
+    }
+
+    for (;;) {
+        struct json_lazy_entry * entry;
+
+        if (intern->count >= capacity) {
+            capacity *= 2;
+            intern->entries = MC(handlebars_talloc_realloc(intern, intern->entries, struct json_lazy_entry, capacity));
+        }
+
+        entry = &intern->entries[intern->count];
+        memset(entry, 0, sizeof(*entry));
+        handlebars_value_init(&entry->value);
+
+        if (intern->is_object) {
+            const char * key = parser.p + 1;
+            const char * q = scan_string(key, parser.end);
+            if (likely(*q == '"')) {
+                entry->key = key;
+                entry->key_length = q - key;
+                entry->hash = handlebars_string_hash(key, entry->key_length);
+                parser.p = q + 1;
+            } else {
+                entry->string = parse_string(&parser, false);
+                handlebars_string_addref(entry->string);
+                entry->key = hbs_str_val(entry->string);
+                entry->key_length = hbs_str_len(entry->string);
+                entry->hash = hbs_str_hash(entry->string);
+            }
+            skip_whitespace(&parser);
+            parser.p++;
+            skip_whitespace(&parser);
+        }
+
+        entry->offset = parser.p - parser.start;
+        skip_value(&parser);
+
+        if (intern->is_object) {
+            uint32_t * slot;
+            struct json_lazy_entry * prev = json_lazy_table_find(intern, entry->key, entry->key_length, entry->hash, &slot);
+            if (prev) {
+                // The last duplicate key wins, at the position of the first, like handlebars_map_update
+                prev->offset = entry->offset;
+                if (entry->string) {
+                    handlebars_string_delref(entry->string);
+                }
+            } else {
+                *slot = (uint32_t) ++intern->count;
+                if (intern->count * 2 > intern->table_size) {
+                    json_lazy_table_grow(intern);
+                }
+            }
+        } else {
+            intern->count++;
+        }
+
+        skip_whitespace(&parser);
+        if (*parser.p != ',') {
+            break;
+        }
+        parser.p++;
+        skip_whitespace(&parser);
+    }
+}
+
+static inline void json_lazy_ensure_index(struct handlebars_json_lazy * intern)
+{
+    if (unlikely(!intern->indexed)) {
+        json_lazy_index(intern);
+    }
+}
+
+static struct handlebars_value * json_lazy_entry_value(struct handlebars_json_lazy * intern, struct json_lazy_entry * entry)
+{
+    if (!entry->materialized) {
+        char c = intern->doc->data[entry->offset];
+        if (c == '{' || c == '[') {
+            json_lazy_ctor(intern->user.ctx, &entry->value, intern->doc, entry->offset);
+        } else {
+            struct json_parser parser;
+            json_lazy_parser_init(&parser, intern, entry->offset);
+            parse_value(&parser, &entry->value);
+        }
+        entry->materialized = true;
+    }
+    return &entry->value;
+}
+
+static struct handlebars_string * json_lazy_entry_key(struct handlebars_json_lazy * intern, struct json_lazy_entry * entry)
+{
+    if (!entry->string) {
+        entry->string = handlebars_string_ctor_ex(intern->user.ctx, entry->key, entry->key_length, entry->hash);
+        handlebars_string_addref(entry->string);
+    }
+    return entry->string;
+}
+
+static struct handlebars_value * hbs_json_lazy_copy(struct handlebars_value * value)
+{
+    abort(); // LCOV_EXCL_LINE
+}
+
+static void hbs_json_lazy_dtor(struct handlebars_user * user)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY(user);
+    size_t i;
+
+    for (i = 0; i < intern->count; i++) {
+        if (intern->entries[i].materialized) {
+            handlebars_value_dtor(&intern->entries[i].value);
+        }
+        if (intern->entries[i].string) {
+            handlebars_string_delref(intern->entries[i].string);
+        }
+    }
+    intern->count = 0;
+
+    if (intern->doc) {
+        json_document_release(intern->doc);
+        intern->doc = NULL;
+    }
+}
+
+static void hbs_json_lazy_convert(struct handlebars_value * value, bool recurse)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY_V(value);
+    size_t i;
+
+    json_lazy_ensure_index(intern);
+
+    if (intern->is_object) {
+        struct handlebars_map * map = handlebars_map_ctor(intern->user.ctx, intern->count);
+        for (i = 0; i < intern->count; i++) {
+            struct handlebars_value * child = json_lazy_entry_value(intern, &intern->entries[i]);
+            if (recurse && handlebars_value_get_real_type(child) == HANDLEBARS_VALUE_TYPE_USER) {
+                hbs_json_lazy_convert(child, recurse);
+            }
+            map = handlebars_map_update(map, json_lazy_entry_key(intern, &intern->entries[i]), child);
+        }
+        handlebars_value_map(value, map);
+    } else {
+        struct handlebars_stack * stack = handlebars_stack_ctor(intern->user.ctx, intern->count);
+        for (i = 0; i < intern->count; i++) {
+            struct handlebars_value * child = json_lazy_entry_value(intern, &intern->entries[i]);
+            if (recurse && handlebars_value_get_real_type(child) == HANDLEBARS_VALUE_TYPE_USER) {
+                hbs_json_lazy_convert(child, recurse);
+            }
+            stack = handlebars_stack_push(stack, child);
+        }
+        handlebars_value_array(value, stack);
+    }
+}
+
+static enum handlebars_value_type hbs_json_lazy_type(struct handlebars_value * value)
+{
+    return GET_LAZY_V(value)->is_object ? HANDLEBARS_VALUE_TYPE_MAP : HANDLEBARS_VALUE_TYPE_ARRAY;
+}
+
+static struct handlebars_value * hbs_json_lazy_map_find(struct handlebars_value * value, struct handlebars_string * key, struct handlebars_value * rv)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY_V(value);
+    struct json_lazy_entry * entry;
+
+    json_lazy_ensure_index(intern);
+
+    entry = json_lazy_table_find(intern, hbs_str_val(key), hbs_str_len(key), hbs_str_hash(key), NULL);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    handlebars_value_value(rv, json_lazy_entry_value(intern, entry));
+    return rv;
+}
+
+static struct handlebars_value * hbs_json_lazy_array_find(struct handlebars_value * value, size_t index, struct handlebars_value * rv)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY_V(value);
+
+    json_lazy_ensure_index(intern);
+
+    if (index >= intern->count) {
+        return NULL;
+    }
+
+    handlebars_value_value(rv, json_lazy_entry_value(intern, &intern->entries[index]));
+    return rv;
+}
+
+static bool hbs_json_lazy_iterator_next_void(struct handlebars_value_iterator * it)
+{
+    return false;
+}
+
+static bool hbs_json_lazy_iterator_next(struct handlebars_value_iterator * it)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY_V(it->value);
+
+    if (it->index >= intern->count - 1) {
+        handlebars_value_dtor(it->cur);
+        return false;
+    }
+
+    it->index++;
+    if (intern->is_object) {
+        it->key = json_lazy_entry_key(intern, &intern->entries[it->index]);
+    }
+    handlebars_value_value(it->cur, json_lazy_entry_value(intern, &intern->entries[it->index]));
+    return true;
+}
+
+static bool hbs_json_lazy_iterator_init(struct handlebars_value_iterator * it, struct handlebars_value * value)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY_V(value);
+
+    json_lazy_ensure_index(intern);
+
+    if (intern->count == 0) {
+        it->next = &hbs_json_lazy_iterator_next_void;
+        return false;
+    }
+
+    it->value = value;
+    it->index = 0;
+    if (intern->is_object) {
+        it->key = json_lazy_entry_key(intern, &intern->entries[0]);
+    }
+    handlebars_value_value(it->cur, json_lazy_entry_value(intern, &intern->entries[0]));
+    it->next = &hbs_json_lazy_iterator_next;
+    return true;
+}
+
+static long hbs_json_lazy_count(struct handlebars_value * value)
+{
+    struct handlebars_json_lazy * intern = GET_LAZY_V(value);
+    json_lazy_ensure_index(intern);
+    return (long) intern->count;
+}
+
+static const struct handlebars_value_handlers handlebars_value_json_lazy_handlers = {
+    "json_lazy",
+    &hbs_json_lazy_copy,
+    &hbs_json_lazy_dtor,
+    &hbs_json_lazy_convert,
+    &hbs_json_lazy_type,
+    &hbs_json_lazy_map_find,
+    &hbs_json_lazy_array_find,
+    &hbs_json_lazy_iterator_init,
+    NULL, // call
+    &hbs_json_lazy_count
+};
+
+// Validate the document and wrap its root. Takes ownership of doc.
+static void json_lazy_init(struct handlebars_context * ctx, struct handlebars_value * value, struct json_document * doc)
+{
+    struct json_parser parser = {0};
+    const char * root;
+    bool ok;
+
+    parser.ctx = ctx;
+    parser.start = parser.p = doc->data;
+    parser.end = doc->data + doc->length;
+
+    skip_whitespace(&parser);
+    root = parser.p;
+    ok = skip_value(&parser);
+    if (ok) {
+        skip_whitespace(&parser);
+        if (parser.p < parser.end) {
+            ok = json_error(&parser, parser.p, "unexpected trailing characters");
+        }
+    }
+
+    if (!ok) {
+        size_t offset = parser.p - parser.start;
+        handlebars_talloc_free(doc);
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "JSON Parse error: %s at offset %zu", parser.error, offset);
+    }
+
+    if (*root == '{' || *root == '[') {
+        json_lazy_ctor(ctx, value, doc, root - doc->data);
+    } else {
+        parser.p = root;
+        parse_value(&parser, value);
+        handlebars_talloc_free(doc);
+    }
+}
+
+// }}} Lazy documents
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(ctx)
+
+void handlebars_value_parse_json_stringl(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * json,
+    size_t length
+) {
+    struct json_parser parser = {0};
+    size_t i;
+    bool ok;
+
+    parser.ctx = ctx;
+    parser.tmp = MC(talloc_new(ctx));
+    parser.start = parser.p = json;
+    parser.end = json + length;
+    parser.keys_size = 64;
+    parser.keys = MC(handlebars_talloc_zero_size(parser.tmp, sizeof(struct handlebars_string *) * parser.keys_size));
+    parser.entries_capacity = 32;
+    parser.entries = MC(handlebars_talloc_array(parser.tmp, struct json_entry, parser.entries_capacity));
+
+    skip_whitespace(&parser);
+    ok = parse_value(&parser, value);
+    if (ok) {
+        skip_whitespace(&parser);
+        if (parser.p < parser.end) {
+            handlebars_value_null(value);
+            ok = json_error(&parser, parser.p, "unexpected trailing characters");
+        }
+    }
+
+    if (!ok) {
+        size_t offset = parser.p - parser.start;
+        const char * error = parser.error;
+        for (i = 0; i < parser.entries_count; i++) {
+            handlebars_value_dtor(&parser.entries[i].value);
+        }
+        keys_release(&parser);
+        handlebars_talloc_free(parser.tmp);
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "JSON Parse error: %s at offset %zu", error, offset);
+    }
+
+    keys_release(&parser);
+    handlebars_talloc_free(parser.tmp);
+}
+
+void handlebars_value_parse_json_string(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * json
+) {
+    handlebars_value_parse_json_stringl(ctx, value, json, strlen(json));
+}
+
+void handlebars_value_init_json_lazy(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * json,
+    size_t length
+) {
+    struct json_document * doc = MC(handlebars_talloc_zero(ctx, struct json_document));
+    doc->data = json;
+    doc->length = length;
+    json_lazy_init(ctx, value, doc);
+}
+
+void handlebars_value_init_json_lazy_file(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * filename
+) {
+    struct json_document * doc;
+    struct stat st;
+    void * mapping;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to open %s: %s", filename, strerror(errno));
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "JSON Parse error: unexpected end of input at offset 0");
+    }
+
+    mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        handlebars_throw(ctx, HANDLEBARS_ERROR, "Failed to map %s: %s", filename, strerror(errno));
+    }
+
+    doc = handlebars_talloc_zero(ctx, struct json_document);
+    if (unlikely(doc == NULL)) {
+        munmap(mapping, (size_t) st.st_size);
+        handlebars_throw(ctx, HANDLEBARS_NOMEM, HANDLEBARS_MEMCHECK_MSG);
+    }
+    doc->data = mapping;
+    doc->length = (size_t) st.st_size;
+    doc->mapping = mapping;
+    talloc_set_destructor(doc, json_document_dtor);
+    json_lazy_init(ctx, value, doc);
+}
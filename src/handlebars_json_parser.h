@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Built-in JSON parser producing native or lazily materialized values
+ */
+
+#ifndef HANDLEBARS_JSON_PARSER_H
+#define HANDLEBARS_JSON_PARSER_H
+
+#include "handlebars.h"
+
+HBS_EXTERN_C_START
+
+struct handlebars_context;
+struct handlebars_value;
+
+#ifndef HANDLEBARS_JSON_PARSER_MAX_DEPTH
+#define HANDLEBARS_JSON_PARSER_MAX_DEPTH 512
+#endif
+
+/**
+ * @brief Parse a JSON document directly into native values. Objects become maps and arrays become stacks, sized
+ *        exactly. Object keys are hashed once and shared between all objects of the document that use the same
+ *        key. Unlike #handlebars_value_init_json_stringl, this does not require json-c and the result needs no
+ *        conversion. Throws on invalid input.
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] json The JSON string
+ * @param[in] length The JSON string length
+ * @return void
+ */
+void handlebars_value_parse_json_stringl(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * json,
+    size_t length
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Like #handlebars_value_parse_json_stringl, for a NUL-terminated string
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] json The JSON string
+ * @return void
+ */
+void handlebars_value_parse_json_string(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * json
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Wrap a JSON document without parsing it. The document is validated once, without allocating. Objects and
+ *        arrays are user values that index their direct children on first access and materialize each child on
+ *        first lookup, so rendering a small part of a large document only pays for the part that is used. The
+ *        buffer is not copied and must outlive the value. Lazy values cache what they materialize and so must not
+ *        be shared between threads; #handlebars_value_freeze converts them first. Throws on invalid input.
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] json The JSON string, which does not need to be NUL-terminated
+ * @param[in] length The JSON string length
+ * @return void
+ */
+void handlebars_value_init_json_lazy(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * json,
+    size_t length
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Like #handlebars_value_init_json_lazy, for a file that is mapped read-only into memory. The mapping is
+ *        released with the last value referencing it.
+ * @param[in] ctx The handlebars context
+ * @param[in] value The value to initialize
+ * @param[in] filename The JSON file
+ * @return void
+ */
+void handlebars_value_init_json_lazy_file(
+    struct handlebars_context * ctx,
+    struct handlebars_value * value,
+    const char * filename
+) HBS_ATTR_NONNULL_ALL;
+
+HBS_EXTERN_C_END
+
+#endif /* HANDLEBARS_JSON_PARSER_H */
@@ -61,6 +61,7 @@ struct handlebars_map {
     uint32_t vec_capacity;
 
     bool is_in_iteration;
+    bool is_frozen;
 
     char data[];
 };
@@ -452,6 +453,27 @@ struct handlebars_value * handlebars_map_find(struct handlebars_map * map, struc
     }
 }
 
+struct handlebars_value * handlebars_map_find_ex(struct handlebars_map * map, struct handlebars_string * key, uint32_t * hint)
+{
+    struct handlebars_map_entry * vec = map_vec(map);
+
+    // Removed entries are replaced with a tombstone with a NULL key
+    if (likely(*hint < map->vec_offset)) {
+        struct handlebars_map_entry * entry = &vec[*hint];
+        if (entry->key && handlebars_string_eq(entry->key, key)) {
+            return &entry->value;
+        }
+    }
+
+    struct ht_find_result o = map_find_entry(map, key);
+    if (o.entry) {
+        *hint = (uint32_t) (o.entry - vec);
+        return &o.entry->value;
+    } else {
+        return NULL;
+    }
+}
+
 struct handlebars_map * handlebars_map_update(struct handlebars_map * map, struct handlebars_string * key, struct handlebars_value * value)
 {
     // Rehash
@@ -548,16 +570,15 @@ void handlebars_map_sparse_array_compact(struct handlebars_map * map)
     struct handlebars_map_entry * vec = map_vec(map);
     struct handlebars_map_entry ** table = map_table(map);
 
-    // Scan until the first tombstone
+    // Scan until the first tombstone, everything before it stays in place
     for (; i < map->vec_offset; i++) {
         if (0 == memcmp(&vec[i], &HANDLEBARS_MAP_TOMBSTONE_V, sizeof(HANDLEBARS_MAP_TOMBSTONE_V))) {
-            i++;
-            vec_offset++;
             break;
         }
     }
+    vec_offset = i;
 
-    // Now patch everything
+    // Now move every later entry down
     for (; i < map->vec_offset; i++) {
         if (0 != memcmp(&vec[i], &HANDLEBARS_MAP_TOMBSTONE_V, sizeof(HANDLEBARS_MAP_TOMBSTONE_V))) {
             vec[vec_offset] = vec[i];
@@ -576,11 +597,42 @@ size_t handlebars_map_sparse_array_count(struct handlebars_map * map)
 
 bool handlebars_map_set_is_in_iteration(struct handlebars_map * map, bool is_in_iteration)
 {
+    // Frozen maps may be iterated by several threads at once, so never write to them
+    if (map->is_frozen) {
+        return false;
+    }
+
     bool old = map->is_in_iteration;
     map->is_in_iteration = is_in_iteration;
     return old;
 }
 
+bool handlebars_map_is_frozen(struct handlebars_map * map)
+{
+    return map->is_frozen;
+}
+
+void handlebars_map_freeze(struct handlebars_map * map)
+{
+    if (map->is_frozen) {
+        return;
+    }
+
+    // Compact now so that iterators never need to touch the map
+    handlebars_map_sparse_array_compact(map);
+    map->is_frozen = true;
+
+    handlebars_map_foreach(map, index, key, value) {
+        (void) hbs_str_hash(key);
+        handlebars_string_immortalize(key);
+        handlebars_value_freeze(value);
+    } handlebars_map_foreach_end(map);
+
+#ifndef HANDLEBARS_NO_REFCOUNT
+    handlebars_rc_immortalize(&map->rc);
+#endif
+}
+
 static int map_entry_compare(const void * ptr1, const void * ptr2, void * arg)
 {
     assert(ptr1 != NULL);
@@ -112,6 +112,21 @@ struct handlebars_value * handlebars_map_find(
     struct handlebars_string * key
 ) HBS_ATTR_NONNULL_ALL;
 
+/**
+ * @brief Find a value by key, using and updating a slot hint. If the entry at the hinted position matches the key,
+ *        the hash table probe is skipped. Intended for callers that repeatedly look up the same key in maps with the
+ *        same layout, such as the VM's inline lookup cache.
+ * @param[in] map
+ * @param[in] key
+ * @param[in,out] hint The position of the entry in the map on the previous hit. Updated on a successful probe.
+ * @return The found value, or NULL
+ */
+struct handlebars_value * handlebars_map_find_ex(
+    struct handlebars_map * map,
+    struct handlebars_string * key,
+    uint32_t * hint
+) HBS_ATTR_NONNULL_ALL;
+
 /**
  * @brief Find a value by key (const char[] with length variant)
  * @param[in] map
@@ -269,6 +284,25 @@ bool handlebars_map_set_is_in_iteration(
     bool is_in_iteration
 ) HBS_ATTR_NONNULL_ALL;
 
+/**
+ * @brief Check if the map has been frozen with #handlebars_map_freeze
+ * @param[in] map
+ * @return true if the map is frozen
+ */
+bool handlebars_map_is_frozen(
+    struct handlebars_map * map
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Compact the map, make it and its keys immortal, and freeze its values. A frozen map is never written to
+ *        by lookups or iteration; any modification returns a copy. See #handlebars_value_freeze.
+ * @param[in] map
+ * @return void
+ */
+void handlebars_map_freeze(
+    struct handlebars_map * map
+) HBS_ATTR_NONNULL_ALL;
+
 /**
  * @brief Sort the map's backing vector using a specified compare function. Will rehash
  *        if the backing vector is sparse. In the future, may reallocate the map itself
@@ -77,10 +77,12 @@ struct handlebars_string * handlebars_module_print(
             "PROGRAM: %zu\n"
             "OPCODE_COUNT: %zu\n"
             "OPCODE_OFFSET: %zu\n"
+            "REGISTER_COUNT: %zu\n"
             "\n",
             module->programs[i].guid,
             module->programs[i].opcode_count,
-            module->programs[i].opcode_offset
+            module->programs[i].opcode_offset,
+            module->programs[i].register_count
         );
     }
     buffer = handlebars_string_asprintf_append(ctx, buffer, "PROGRAM: %zu\n", program_guid);
@@ -94,6 +96,9 @@ struct handlebars_string * handlebars_module_print(
 
         struct handlebars_opcode * opcode = &module->opcodes[i];
         buffer = handlebars_string_asprintf_append(ctx, buffer, "OP[%03zu,%03zu]: ", local_opcode_id, i);
+        if (module->programs[program_guid].register_count > 0) {
+            buffer = handlebars_string_asprintf_append(ctx, buffer, "R%d ", opcode->reg);
+        }
         buffer = handlebars_opcode_print_append(ctx, buffer, &module->opcodes[i], 0);
         buffer = handlebars_string_asprintf_append(ctx, buffer, "\n");
         if (opcode->type == handlebars_opcode_type_return) {
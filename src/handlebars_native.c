@@ -0,0 +1,394 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <talloc.h>
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define HANDLEBARS_OPCODE_SERIALIZER_PRIVATE
+#define HANDLEBARS_OPCODES_PRIVATE
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_native.h"
+#include "handlebars_opcodes.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_private.h"
+#include "handlebars_string.h"
+
+
+
+// Bytes of the module per line of generated source
+#define NATIVE_BYTES_PER_LINE 12
+
+// Characters of static content per line of generated source
+#define NATIVE_CHARS_PER_LINE 72
+
+// The native programs of each module loaded by handlebars_native_module_ctor. They are kept out of the module itself
+// because modules are copied into caches and bundles, where a function pointer would outlive this process.
+struct handlebars_native_binding {
+    const struct handlebars_module * module;
+    const handlebars_native_func * programs;
+    struct handlebars_native_binding * next;
+};
+
+static struct handlebars_native_binding * native_bindings = NULL;
+
+// Only changed while holding native_lock, read without it to skip the lock when there are no native modules
+static size_t native_binding_count = 0;
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+static pthread_mutex_t native_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NATIVE_LOCK() pthread_mutex_lock(&native_lock)
+#define NATIVE_UNLOCK() pthread_mutex_unlock(&native_lock)
+#else
+#define NATIVE_LOCK()
+#define NATIVE_UNLOCK()
+#endif
+
+#undef CONTEXT
+#define CONTEXT context
+
+// The runtime entry point of an opcode, NULL if the VM does not execute it
+static const char * native_opcode_name(enum handlebars_opcode_type type)
+{
+#define NATIVE_CASE(name) case handlebars_opcode_type_ ## name: return #name;
+    switch( type ) {
+        NATIVE_CASE(ambiguous_block_value)
+        NATIVE_CASE(append)
+        NATIVE_CASE(append_escaped)
+        NATIVE_CASE(assign_to_hash)
+        NATIVE_CASE(block_value)
+        NATIVE_CASE(block_if)
+        NATIVE_CASE(block_unless)
+        NATIVE_CASE(block_with)
+        NATIVE_CASE(block_each)
+        NATIVE_CASE(empty_hash)
+        NATIVE_CASE(get_context)
+        NATIVE_CASE(invoke_ambiguous)
+        NATIVE_CASE(invoke_helper)
+        NATIVE_CASE(invoke_known_helper)
+        NATIVE_CASE(invoke_partial)
+        NATIVE_CASE(lookup_block_param)
+        NATIVE_CASE(lookup_data)
+        NATIVE_CASE(lookup_on_context)
+        NATIVE_CASE(lookup_and_append)
+        NATIVE_CASE(lookup_and_append_escaped)
+        NATIVE_CASE(pop_hash)
+        NATIVE_CASE(push_context)
+        NATIVE_CASE(push_hash)
+        NATIVE_CASE(push_program)
+        NATIVE_CASE(push_literal)
+        NATIVE_CASE(push_string)
+        NATIVE_CASE(resolve_possible_lambda)
+        default: return NULL;
+    }
+#undef NATIVE_CASE
+}
+
+// The name as the tail of an identifier. Letters and digits are kept, underscores are doubled and every other byte is
+// written as an underscore followed by two hex digits, so different names never share an identifier. The result may
+// start with a digit, so it always follows a prefix.
+static struct handlebars_string * native_identifier(struct handlebars_context * context, const char * name)
+{
+    struct handlebars_string * ident = handlebars_string_init(context, strlen(name) * 3);
+    size_t i;
+
+    for( i = 0; name[i]; i++ ) {
+        unsigned char c = (unsigned char) name[i];
+        if( (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ) {
+            ident = handlebars_string_append(context, ident, (const char *) &c, 1);
+        } else if( c == '_' ) {
+            ident = handlebars_string_append(context, ident, HBS_STRL("__"));
+        } else {
+            ident = handlebars_string_asprintf_append(context, ident, "_%02x", c);
+        }
+    }
+
+    return ident;
+}
+
+// Append a C string literal, split into lines after newlines and long runs. Octal escapes always take three digits
+// so they cannot run into the next character, and question marks are escaped so they cannot form trigraphs.
+static struct handlebars_string * native_append_literal(
+    struct handlebars_context * context,
+    struct handlebars_string * string,
+    const char * str,
+    size_t len,
+    const char * indent
+) {
+    size_t line = 0;
+    size_t i;
+
+    string = handlebars_string_append(context, string, HBS_STRL("\""));
+    for( i = 0; i < len; i++ ) {
+        unsigned char c = (unsigned char) str[i];
+
+        if( line >= NATIVE_CHARS_PER_LINE ) {
+            string = handlebars_string_asprintf_append(context, string, "\"\n%s\"", indent);
+            line = 0;
+        }
+
+        switch( c ) {
+            case '\\': string = handlebars_string_append(context, string, HBS_STRL("\\\\")); line += 2; break;
+            case '"': string = handlebars_string_append(context, string, HBS_STRL("\\\"")); line += 2; break;
+            case '?': string = handlebars_string_append(context, string, HBS_STRL("\\?")); line += 2; break;
+            case '\t': string = handlebars_string_append(context, string, HBS_STRL("\\t")); line += 2; break;
+            case '\r': string = handlebars_string_append(context, string, HBS_STRL("\\r")); line += 2; break;
+            case '\n':
+                string = handlebars_string_append(context, string, HBS_STRL("\\n"));
+                line = i + 1 < len ? NATIVE_CHARS_PER_LINE : 0;
+                break;
+            default:
+                if( c < 0x20 || c >= 0x7f ) {
+                    string = handlebars_string_asprintf_append(context, string, "\\%03o", c);
+                    line += 4;
+                } else {
+                    string = handlebars_string_append(context, string, (const char *) &c, 1);
+                    line++;
+                }
+                break;
+        }
+    }
+
+    return handlebars_string_append(context, string, HBS_STRL("\""));
+}
+
+static struct handlebars_string * native_append_program(
+    struct handlebars_context * context,
+    struct handlebars_string * string,
+    struct handlebars_module * module,
+    struct handlebars_string * ident,
+    size_t program
+) {
+    struct handlebars_module_table_entry * entry = &module->programs[program];
+    struct handlebars_opcode * opcodes = &module->opcodes[entry->opcode_offset];
+    bool uses_opcodes = false;
+    size_t i;
+
+    string = handlebars_string_asprintf_append(
+        context, string,
+        "static void hbs_native_%s_program_%zu(struct handlebars_vm * vm, struct handlebars_opcode * opcodes)\n{\n",
+        hbs_str_val(ident), program
+    );
+
+    // Every program ends with a return opcode
+    for( i = 0; i < entry->opcode_count && opcodes[i].type != handlebars_opcode_type_return; i++ ) {
+        struct handlebars_opcode * opcode = &opcodes[i];
+        const char * name;
+
+        if( opcode->type == handlebars_opcode_type_append_content ) {
+            struct handlebars_string * content = opcode->op1.data.string.string;
+            string = handlebars_string_append(context, string, HBS_STRL("    handlebars_vm_native_append_static(vm,\n        "));
+            string = native_append_literal(context, string, HBS_STR_STRL(content), "        ");
+            string = handlebars_string_asprintf_append(context, string, ", %zu);\n", hbs_str_len(content));
+        } else if( NULL != (name = native_opcode_name(opcode->type)) ) {
+            string = handlebars_string_asprintf_append(context, string, "    handlebars_vm_native_%s(vm, &opcodes[%zu]);\n", name, i);
+            uses_opcodes = true;
+        } else {
+            string = handlebars_string_asprintf_append(context, string, "    handlebars_vm_native_unhandled(vm, &opcodes[%zu]);\n", i);
+            uses_opcodes = true;
+        }
+    }
+
+    // Programs with only static content would otherwise warn about the unused parameter
+    if( !uses_opcodes ) {
+        string = handlebars_string_append(context, string, HBS_STRL("    (void) opcodes;\n"));
+    }
+
+    return handlebars_string_append(context, string, HBS_STRL("}\n\n"));
+}
+
+struct handlebars_string * handlebars_native_emit(
+    struct handlebars_context * context,
+    struct handlebars_module * module,
+    const char * name
+) {
+    struct handlebars_string * string;
+    struct handlebars_string * ident;
+    struct handlebars_module * copy;
+    const unsigned char * bytes;
+    size_t i;
+
+    for( i = 0; i < module->program_count; i++ ) {
+        if( module->programs[i].register_count > 0 ) {
+            handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Native templates cannot be generated from programs lowered to registers");
+        }
+    }
+
+    // Embed the module the way bundles store it: position independent and reproducible
+    copy = MC(handlebars_talloc_size(context, module->size));
+    talloc_set_type(copy, struct handlebars_module);
+    memcpy(copy, module, module->size);
+    handlebars_module_patch_pointers(copy);
+    handlebars_module_normalize_pointers(copy, (void *) 0);
+    copy->ts = 0;
+    handlebars_module_generate_hash(copy);
+
+    ident = native_identifier(context, name);
+    string = handlebars_string_init(context, 1024 + copy->size * 6);
+
+    string = handlebars_string_asprintf_append(
+        context, string,
+        "/* Native template generated by handlebarsc %s. Do not edit. */\n\n"
+        "#define HANDLEBARS_OPCODES_PRIVATE\n\n"
+        "#include \"handlebars.h\"\n"
+        "#include \"handlebars_native.h\"\n"
+        "#include \"handlebars_opcodes.h\"\n\n",
+        handlebars_version_string()
+    );
+
+    // Module
+    string = handlebars_string_asprintf_append(context, string, "static const unsigned char hbs_native_%s_module[%zu] = {", hbs_str_val(ident), copy->size);
+    bytes = (const unsigned char *) copy;
+    for( i = 0; i < copy->size; i++ ) {
+        if( i % NATIVE_BYTES_PER_LINE == 0 ) {
+            string = handlebars_string_append(context, string, HBS_STRL("\n   "));
+        }
+        string = handlebars_string_asprintf_append(context, string, " 0x%02x,", bytes[i]);
+    }
+    string = handlebars_string_append(context, string, HBS_STRL("\n};\n\n"));
+    handlebars_talloc_free(copy);
+
+    // Programs
+    for( i = 0; i < module->program_count; i++ ) {
+        string = native_append_program(context, string, module, ident, i);
+    }
+
+    string = handlebars_string_asprintf_append(context, string, "static const handlebars_native_func hbs_native_%s_programs[%zu] = {\n", hbs_str_val(ident), module->program_count);
+    for( i = 0; i < module->program_count; i++ ) {
+        string = handlebars_string_asprintf_append(context, string, "    hbs_native_%s_program_%zu,\n", hbs_str_val(ident), i);
+    }
+    string = handlebars_string_append(context, string, HBS_STRL("};\n\n"));
+
+    // Template
+    string = handlebars_string_asprintf_append(context, string, "const struct handlebars_native_template handlebars_native_template_%s = {\n    ", hbs_str_val(ident));
+    string = native_append_literal(context, string, name, strlen(name), "    ");
+    string = handlebars_string_asprintf_append(
+        context, string,
+        ", %zu,\n    hbs_native_%s_module, sizeof(hbs_native_%s_module),\n    hbs_native_%s_programs, %zu\n};\n",
+        strlen(name), hbs_str_val(ident), hbs_str_val(ident), hbs_str_val(ident), module->program_count
+    );
+
+    handlebars_talloc_free(ident);
+
+    return string;
+}
+
+static int native_binding_dtor(struct handlebars_native_binding * binding)
+{
+    struct handlebars_native_binding ** ptr;
+
+    NATIVE_LOCK();
+    for( ptr = &native_bindings; *ptr; ptr = &(*ptr)->next ) {
+        if( *ptr == binding ) {
+            *ptr = binding->next;
+            __atomic_store_n(&native_binding_count, native_binding_count - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    NATIVE_UNLOCK();
+
+    return 0;
+}
+
+struct handlebars_module * handlebars_native_module_ctor(
+    struct handlebars_context * context,
+    const struct handlebars_native_template * native
+) {
+    struct handlebars_module * module;
+    struct handlebars_native_binding * binding;
+
+    if( native->module_size < sizeof(struct handlebars_module) ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid native template: %.*s", (int) native->name_length, native->name);
+    }
+
+    module = MC(handlebars_talloc_size(context, native->module_size));
+    talloc_set_type(module, struct handlebars_module);
+    memcpy(module, native->module, native->module_size);
+
+    if( module->size != native->module_size ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid native template: %.*s", (int) native->name_length, native->name);
+    }
+
+    handlebars_module_verify(module, CONTEXT);
+    handlebars_module_patch_pointers(module);
+
+    if( module->program_count != native->program_count ) {
+        handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid native template: %.*s", (int) native->name_length, native->name);
+    }
+
+    binding = MC(handlebars_talloc(module, struct handlebars_native_binding));
+    binding->module = module;
+    binding->programs = native->programs;
+
+    NATIVE_LOCK();
+    binding->next = native_bindings;
+    native_bindings = binding;
+    __atomic_store_n(&native_binding_count, native_binding_count + 1, __ATOMIC_RELEASE);
+    NATIVE_UNLOCK();
+
+    // Unbound before the module is freed
+    talloc_set_destructor(binding, native_binding_dtor);
+
+    return module;
+}
+
+const handlebars_native_func * handlebars_native_module_programs(const struct handlebars_module * module)
+{
+    struct handlebars_native_binding * binding;
+    const handlebars_native_func * programs = NULL;
+
+    if( __atomic_load_n(&native_binding_count, __ATOMIC_ACQUIRE) == 0 ) {
+        return NULL;
+    }
+
+    NATIVE_LOCK();
+    for( binding = native_bindings; binding; binding = binding->next ) {
+        if( binding->module == module ) {
+            programs = binding->programs;
+            break;
+        }
+    }
+    NATIVE_UNLOCK();
+
+    return programs;
+}
+
+const struct handlebars_native_template * handlebars_native_find(
+    const struct handlebars_native_template * const * templates,
+    size_t count,
+    const char * name,
+    size_t length
+) {
+    size_t i;
+
+    for( i = 0; i < count; i++ ) {
+        if( templates[i]->name_length == length && 0 == memcmp(templates[i]->name, name, length) ) {
+            return templates[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Native templates
+ *
+ * A native template is a module translated into C source (`handlebarsc --emit-c`) to be compiled into an
+ * application. Each program becomes a C function that calls the VM runtime for each of its opcodes in turn, so no
+ * opcodes are dispatched at runtime and static content is appended from string literals. The serialized module is
+ * embedded alongside the functions for the operands of the other opcodes, so native templates are tied to the
+ * version of handlebars and the kind of machine that generated them, like bundles.
+ */
+
+#ifndef HANDLEBARS_NATIVE_H
+#define HANDLEBARS_NATIVE_H
+
+#include "handlebars.h"
+
+HBS_EXTERN_C_START
+
+struct handlebars_context;
+struct handlebars_module;
+struct handlebars_opcode;
+struct handlebars_string;
+struct handlebars_vm;
+
+/**
+ * @brief A program of a native template
+ * @param[in] vm The VM
+ * @param[in] opcodes The opcodes of the program in the module the VM is executing
+ * @return void
+ */
+typedef void (*handlebars_native_func)(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcodes
+);
+
+struct handlebars_native_template {
+    //! The template name
+    const char * name;
+    size_t name_length;
+    //! The serialized module, with pointers normalized to zero
+    const unsigned char * module;
+    size_t module_size;
+    //! The programs, indexed by guid
+    const handlebars_native_func * programs;
+    size_t program_count;
+};
+
+/**
+ * @brief Translate a module into the C source of a native template. The source defines a
+ *        `const struct handlebars_native_template` named `handlebars_native_template_` followed by the name. Letters
+ *        and digits are kept, underscores are doubled and any other byte is written as an underscore followed by its
+ *        value in two lowercase hex digits, so `users/show` becomes `handlebars_native_template_users_2fshow`.
+ * @param[in] context The handlebars context
+ * @param[in] module The module. It may not be lowered to registers.
+ * @param[in] name The template name
+ * @return The C source
+ */
+struct handlebars_string * handlebars_native_emit(
+    struct handlebars_context * context,
+    struct handlebars_module * module,
+    const char * name
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Load a native template. The module is copied and verified, and its programs run the native functions
+ *        instead of being interpreted. Throws if the template was generated by another version of handlebars.
+ * @param[in] context The handlebars context
+ * @param[in] native The native template
+ * @return The module, to be executed with #handlebars_vm_execute
+ */
+struct handlebars_module * handlebars_native_module_ctor(
+    struct handlebars_context * context,
+    const struct handlebars_native_template * native
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief The native programs of a module loaded with #handlebars_native_module_ctor. Copies of the module, such as
+ *        the ones stored in caches and bundles, are interpreted.
+ * @param[in] module The module
+ * @return The programs, indexed by guid, or NULL if the module was not loaded from a native template
+ */
+const handlebars_native_func * handlebars_native_module_programs(
+    const struct handlebars_module * module
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Look up a native template by name
+ * @param[in] templates The native templates
+ * @param[in] count The number of native templates
+ * @param[in] name The template name
+ * @param[in] length The length of the name
+ * @return The native template, or NULL if not found
+ */
+const struct handlebars_native_template * handlebars_native_find(
+    const struct handlebars_native_template * const * templates,
+    size_t count,
+    const char * name,
+    size_t length
+) HBS_ATTR_NONNULL(3) HBS_ATTR_PURE;
+
+/**
+ * Runtime entry points called by native templates, one per opcode. They are not meant to be called otherwise.
+ */
+#define HANDLEBARS_NATIVE_OPCODE(name) \
+    void handlebars_vm_native_ ## name(struct handlebars_vm * vm, struct handlebars_opcode * opcode) HBS_ATTR_NONNULL_ALL
+
+HANDLEBARS_NATIVE_OPCODE(ambiguous_block_value);
+HANDLEBARS_NATIVE_OPCODE(append);
+HANDLEBARS_NATIVE_OPCODE(append_escaped);
+HANDLEBARS_NATIVE_OPCODE(assign_to_hash);
+HANDLEBARS_NATIVE_OPCODE(block_value);
+HANDLEBARS_NATIVE_OPCODE(block_if);
+HANDLEBARS_NATIVE_OPCODE(block_unless);
+HANDLEBARS_NATIVE_OPCODE(block_with);
+HANDLEBARS_NATIVE_OPCODE(block_each);
+HANDLEBARS_NATIVE_OPCODE(empty_hash);
+HANDLEBARS_NATIVE_OPCODE(get_context);
+HANDLEBARS_NATIVE_OPCODE(invoke_ambiguous);
+HANDLEBARS_NATIVE_OPCODE(invoke_helper);
+HANDLEBARS_NATIVE_OPCODE(invoke_known_helper);
+HANDLEBARS_NATIVE_OPCODE(invoke_partial);
+HANDLEBARS_NATIVE_OPCODE(lookup_block_param);
+HANDLEBARS_NATIVE_OPCODE(lookup_data);
+HANDLEBARS_NATIVE_OPCODE(lookup_on_context);
+HANDLEBARS_NATIVE_OPCODE(lookup_and_append);
+HANDLEBARS_NATIVE_OPCODE(lookup_and_append_escaped);
+HANDLEBARS_NATIVE_OPCODE(pop_hash);
+HANDLEBARS_NATIVE_OPCODE(push_context);
+HANDLEBARS_NATIVE_OPCODE(push_hash);
+HANDLEBARS_NATIVE_OPCODE(push_program);
+HANDLEBARS_NATIVE_OPCODE(push_literal);
+HANDLEBARS_NATIVE_OPCODE(push_string);
+HANDLEBARS_NATIVE_OPCODE(resolve_possible_lambda);
+
+//! Opcodes the VM does not execute, throws
+HANDLEBARS_NATIVE_OPCODE(unhandled);
+
+/**
+ * @brief Append static content, in place of the append_content opcode
+ * @param[in] vm The VM
+ * @param[in] str The content
+ * @param[in] len The length of the content
+ * @return void
+ */
+void handlebars_vm_native_append_static(
+    struct handlebars_vm * vm,
+    const char * str,
+    size_t len
+) HBS_ATTR_NONNULL_ALL;
+
+HBS_EXTERN_C_END
+
+#endif /* HANDLEBARS_NATIVE_H */
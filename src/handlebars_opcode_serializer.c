@@ -20,6 +20,7 @@
 #endif
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef HAVE_ALLOCA_H
@@ -42,6 +43,9 @@
 #define PATCH(ptr, baseaddr) ptr = (void *) (((char *) ptr) - ((char *) module->addr) + ((char *) baseaddr))
 #define align_size(size) handlebars_align_size(size, sizeof(void *))
 
+//! How deeply hashes may nest in a program lowered to registers
+#define REGISTER_HASH_DEPTH 16
+
 const size_t HANDLEBARS_MODULE_SIZE = sizeof(struct handlebars_module);
 const size_t HANDLEBARS_MODULE_TABLE_ENTRY_SIZE = sizeof(struct handlebars_module_table_entry);
 
@@ -68,7 +72,79 @@ static inline void patch_string(struct handlebars_string * str) {
     handlebars_string_immortalize(str);
 }
 
-static size_t calculate_size_operand(struct handlebars_module * module, struct handlebars_operand * operand)
+// Open addressing set of the strings written to the data segment, so identical strings are only stored once. Both
+// passes walk the opcodes in the same order, so the sizing pass makes the same decisions as the serialization pass.
+struct string_table {
+    struct handlebars_context * context;
+    void * memctx;
+    struct handlebars_string ** entries;
+    size_t size;
+    size_t count;
+};
+
+static void string_table_reset(struct string_table * table)
+{
+    table->count = 0;
+    memset(table->entries, 0, sizeof(struct handlebars_string *) * table->size);
+}
+
+static struct handlebars_string ** string_table_slot(struct string_table * table, struct handlebars_string * string)
+{
+    size_t mask = table->size - 1;
+    size_t pos = hbs_str_hash(string) & mask;
+    struct handlebars_string * entry;
+
+    while( NULL != (entry = table->entries[pos]) ) {
+        if( hbs_str_len(entry) == hbs_str_len(string) && hbs_str_hash(entry) == hbs_str_hash(string) &&
+                0 == memcmp(hbs_str_val(entry), hbs_str_val(string), hbs_str_len(string)) ) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    return &table->entries[pos];
+}
+
+static void string_table_add(struct string_table * table, struct handlebars_string ** slot, struct handlebars_string * string)
+{
+    size_t i;
+
+    *slot = string;
+
+    if( ++table->count * 2 < table->size ) {
+        return;
+    }
+
+    struct handlebars_string ** prev_entries = table->entries;
+    size_t prev_size = table->size;
+
+    table->size *= 2;
+    table->entries = handlebars_talloc_array(table->memctx, struct handlebars_string *, table->size);
+    HANDLEBARS_MEMCHECK(table->entries, table->context);
+    memset(table->entries, 0, sizeof(struct handlebars_string *) * table->size);
+
+    for( i = 0; i < prev_size; i++ ) {
+        if( prev_entries[i] ) {
+            *string_table_slot(table, prev_entries[i]) = prev_entries[i];
+        }
+    }
+
+    handlebars_talloc_free(prev_entries);
+}
+
+static size_t calculate_size_string(struct string_table * table, struct handlebars_string * string)
+{
+    struct handlebars_string ** slot = string_table_slot(table, string);
+
+    if( *slot ) {
+        return 0;
+    }
+
+    string_table_add(table, slot, string);
+    return align_size(HBS_STR_SIZE(hbs_str_len(string)));
+}
+
+static size_t calculate_size_operand(struct handlebars_module * module, struct string_table * strings, struct handlebars_operand * operand)
 {
     size_t i;
     size_t size = 0;
@@ -76,12 +152,12 @@ static size_t calculate_size_operand(struct handlebars_module * module, struct h
     // Increment for children
     switch( operand->type ) {
         case handlebars_operand_type_string:
-            size += align_size(HBS_STR_SIZE(hbs_str_len(operand->data.string.string)));
+            size += calculate_size_string(strings, operand->data.string.string);
             break;
         case handlebars_operand_type_array:
             size += align_size(sizeof(struct handlebars_operand_string) * operand->data.array.count);
             for( i = 0; i < operand->data.array.count; i++ ) {
-                size += align_size(HBS_STR_SIZE(hbs_str_len(operand->data.array.array[i].string)));
+                size += calculate_size_string(strings, operand->data.array.array[i].string);
             }
             break;
         default:
@@ -92,22 +168,141 @@ static size_t calculate_size_operand(struct handlebars_module * module, struct h
     return size;
 }
 
-static size_t calculate_size_opcode(struct handlebars_module * module, struct handlebars_opcode * opcode)
+static size_t calculate_size_opcode(struct handlebars_module * module, struct string_table * strings, struct handlebars_opcode * opcode)
 {
     size_t size = 0;
 
     size += sizeof(struct handlebars_opcode);
     module->opcode_count++;
 
-    size += calculate_size_operand(module, &opcode->op1);
-    size += calculate_size_operand(module, &opcode->op2);
-    size += calculate_size_operand(module, &opcode->op3);
-    size += calculate_size_operand(module, &opcode->op4);
+    size += calculate_size_operand(module, strings, &opcode->op1);
+    size += calculate_size_operand(module, strings, &opcode->op2);
+    size += calculate_size_operand(module, strings, &opcode->op3);
+    size += calculate_size_operand(module, strings, &opcode->op4);
 
     return size;
 }
 
-static size_t calculate_size_program(struct handlebars_module * module, struct handlebars_program * program)
+// Merge a run of `appendContent` opcodes, left behind by comments and whitespace control, into one
+static size_t coalesce_append_content(
+    struct string_table * strings,
+    struct handlebars_opcode ** opcodes,
+    size_t count,
+    struct handlebars_opcode * fused
+) {
+    size_t i;
+    size_t len = 0;
+
+    for( i = 0; i < count && opcodes[i]->type == handlebars_opcode_type_append_content; i++ ) {
+        len += hbs_str_len(opcodes[i]->op1.data.string.string);
+    }
+
+    *fused = *opcodes[0];
+
+    if( i > 1 ) {
+        struct handlebars_string * string = handlebars_string_init(strings->context, len);
+        size_t j;
+        for( j = 0; j < i; j++ ) {
+            string = handlebars_string_append(strings->context, string, HBS_STR_STRL(opcodes[j]->op1.data.string.string));
+        }
+        talloc_steal(strings->memctx, string);
+        fused->op1.data.string.string = string;
+    }
+
+    return i;
+}
+
+// Replace `pushProgram, pushProgram, emptyHash, invokeKnownHelper, append` (the sequence emitted for a block of a
+// builtin helper with one parameter and no hash) with a dedicated opcode, which the VM runs without building the helper
+// options. The parameter is still pushed by the opcodes before. Returns the number of opcodes consumed, or zero.
+static size_t specialize_block_helper(
+    struct handlebars_opcode ** opcodes,
+    size_t count,
+    struct handlebars_opcode * fused
+) {
+    static const struct {
+        const char * name;
+        size_t len;
+        enum handlebars_opcode_type type;
+    } builtins[] = {
+        {HBS_STRL("if"), handlebars_opcode_type_block_if},
+        {HBS_STRL("unless"), handlebars_opcode_type_block_unless},
+        {HBS_STRL("with"), handlebars_opcode_type_block_with},
+        {HBS_STRL("each"), handlebars_opcode_type_block_each}
+    };
+    struct handlebars_string * name;
+    size_t i;
+
+    if (
+        count < 5 ||
+        opcodes[0]->type != handlebars_opcode_type_push_program ||
+        opcodes[1]->type != handlebars_opcode_type_push_program ||
+        opcodes[2]->type != handlebars_opcode_type_empty_hash ||
+        opcodes[3]->type != handlebars_opcode_type_invoke_known_helper ||
+        opcodes[3]->op1.type != handlebars_operand_type_long ||
+        opcodes[3]->op1.data.longval != 1 ||
+        opcodes[3]->op2.type != handlebars_operand_type_string ||
+        opcodes[4]->type != handlebars_opcode_type_append
+    ) {
+        return 0;
+    }
+
+    name = opcodes[3]->op2.data.string.string;
+    for( i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++ ) {
+        if( hbs_str_eq_strl(name, builtins[i].name, builtins[i].len) ) {
+            *fused = *opcodes[3];
+            fused->type = builtins[i].type;
+            fused->op1 = opcodes[3]->op2;
+            fused->op2 = opcodes[0]->op1;
+            fused->op3 = opcodes[1]->op1;
+            handlebars_operand_set_null(&fused->op4);
+            return 5;
+        }
+    }
+
+    return 0;
+}
+
+// Fuse `getContext, lookupOnContext|pushContext, resolvePossibleLambda, append|appendEscaped` (the sequence emitted
+// for a simple mustache) into a single superinstruction. The context depth is stored in op2, which is unused by
+// lookupOnContext at runtime. Returns the number of opcodes consumed.
+static size_t fuse_opcodes(
+    struct string_table * strings,
+    struct handlebars_opcode ** opcodes,
+    size_t count,
+    struct handlebars_opcode * fused
+) {
+    size_t consumed;
+
+    if( opcodes[0]->type == handlebars_opcode_type_append_content ) {
+        return coalesce_append_content(strings, opcodes, count, fused);
+    }
+
+    if( opcodes[0]->type == handlebars_opcode_type_push_program && (consumed = specialize_block_helper(opcodes, count, fused)) ) {
+        return consumed;
+    }
+
+    if (
+        count < 4 ||
+        opcodes[0]->type != handlebars_opcode_type_get_context ||
+        opcodes[0]->op1.type != handlebars_operand_type_long ||
+        (opcodes[1]->type != handlebars_opcode_type_lookup_on_context && opcodes[1]->type != handlebars_opcode_type_push_context) ||
+        opcodes[2]->type != handlebars_opcode_type_resolve_possible_lambda ||
+        (opcodes[3]->type != handlebars_opcode_type_append && opcodes[3]->type != handlebars_opcode_type_append_escaped)
+    ) {
+        *fused = *opcodes[0];
+        return 1;
+    }
+
+    *fused = *opcodes[1];
+    fused->type = opcodes[3]->type == handlebars_opcode_type_append_escaped ?
+        handlebars_opcode_type_lookup_and_append_escaped :
+        handlebars_opcode_type_lookup_and_append;
+    handlebars_operand_set_longval(&fused->op2, opcodes[0]->op1.data.longval);
+    return 4;
+}
+
+static size_t calculate_size_program(struct handlebars_module * module, struct string_table * strings, struct handlebars_program * program)
 {
     size_t i;
     size_t size = 0;
@@ -116,48 +311,75 @@ static size_t calculate_size_program(struct handlebars_module * module, struct h
     size += sizeof(struct handlebars_module_table_entry);
     module->program_count++;
 
-    // Increment for children
-    for( i = 0; i < program->children_length; i++ ) {
-        size += calculate_size_program(module, program->children[i]);
-    }
-
     // Increment for opcodes
-    for( i = 0; i < program->opcodes_length; i++ ) {
-        size += calculate_size_opcode(module, program->opcodes[i]);
+    for( i = 0; i < program->opcodes_length; ) {
+        struct handlebars_opcode fused;
+        i += fuse_opcodes(strings, &program->opcodes[i], program->opcodes_length - i, &fused);
+        size += calculate_size_opcode(module, strings, &fused);
     }
 
     // Insert return opcode
     struct handlebars_opcode opcode = {0};
     opcode.type = handlebars_opcode_type_return;
-    size += calculate_size_opcode(module, &opcode);
+    size += calculate_size_opcode(module, strings, &opcode);
+
+    // Increment for children, after the opcodes to match the order they are serialized in
+    for( i = 0; i < program->children_length; i++ ) {
+        size += calculate_size_program(module, strings, program->children[i]);
+    }
 
     return size;
 }
 
-static void serialize_operand(struct handlebars_module * module, struct handlebars_operand * operand)
+static long operand_string_index(struct handlebars_string * string)
+{
+    // Matches the previous sscanf("%ld") behavior of the VM, any leading number is accepted
+    char * end = NULL;
+    long index = strtol(hbs_str_val(string), &end, 10);
+    if (end == hbs_str_val(string) || index < 0) {
+        return -1;
+    }
+    return index;
+}
+
+static struct handlebars_string * serialize_string(struct handlebars_module * module, struct string_table * strings, struct handlebars_string * string)
+{
+    // Make sure hash is computed
+    hbs_str_hash(string);
+
+    struct handlebars_string ** slot = string_table_slot(strings, string);
+    if( *slot ) {
+        return *slot;
+    }
+
+    string = append(module, string, HBS_STR_SIZE(hbs_str_len(string)));
+    patch_string(string);
+
+    // HBS_STR_SIZE overestimates, since the header has padding. Don't copy whatever was past the terminator
+    char * end = (char *) string + HBS_STR_SIZE(hbs_str_len(string));
+    char * tail = hbs_str_val(string) + hbs_str_len(string) + 1;
+    memset(tail, 0, end - tail);
+    string_table_add(strings, slot, string);
+    return string;
+}
+
+static void serialize_operand(struct handlebars_module * module, struct string_table * strings, struct handlebars_operand * operand)
 {
     size_t i;
-    size_t size;
 
     // Increment for children
     switch( operand->type ) {
         case handlebars_operand_type_string:
-            // Make sure hash is computed
-            hbs_str_hash(operand->data.string.string);
-
-            size = HBS_STR_SIZE(hbs_str_len(operand->data.string.string));
-            operand->data.string.string = append(module, operand->data.string.string, size);
-            patch_string(operand->data.string.string);
+            operand->data.string.string = serialize_string(module, strings, operand->data.string.string);
+            operand->data.string.index = operand_string_index(operand->data.string.string);
             break;
         case handlebars_operand_type_array:
             operand->data.array.array = append(module, operand->data.array.array, sizeof(struct handlebars_operand_string) * operand->data.array.count);
             for( i = 0; i < operand->data.array.count; i++ ) {
-                // Make sure hash is computed
-                hbs_str_hash(operand->data.array.array[i].string);
+                operand->data.array.array[i].string = serialize_string(module, strings, operand->data.array.array[i].string);
 
-                size = HBS_STR_SIZE(hbs_str_len(operand->data.array.array[i].string));
-                operand->data.array.array[i].string = append(module, operand->data.array.array[i].string, size);
-                patch_string(operand->data.array.array[i].string);
+                // Resolve array indexes once instead of parsing them on every lookup
+                operand->data.array.array[i].index = operand_string_index(operand->data.array.array[i].string);
             }
             break;
         default:
@@ -166,7 +388,7 @@ static void serialize_operand(struct handlebars_module * module, struct handleba
     }
 }
 
-static void serialize_opcode(struct handlebars_module * module, struct handlebars_opcode * opcode, struct handlebars_module_table_entry ** table)
+static void serialize_opcode(struct handlebars_module * module, struct string_table * strings, struct handlebars_opcode * opcode, struct handlebars_module_table_entry ** table)
 {
     size_t guid = module->opcode_count++;
     struct handlebars_opcode * new_opcode = &module->opcodes[guid];
@@ -175,10 +397,10 @@ static void serialize_opcode(struct handlebars_module * module, struct handlebar
     *new_opcode = *opcode;
 
     // Serialize operands
-    serialize_operand(module, &new_opcode->op1);
-    serialize_operand(module, &new_opcode->op2);
-    serialize_operand(module, &new_opcode->op3);
-    serialize_operand(module, &new_opcode->op4);
+    serialize_operand(module, strings, &new_opcode->op1);
+    serialize_operand(module, strings, &new_opcode->op2);
+    serialize_operand(module, strings, &new_opcode->op3);
+    serialize_operand(module, strings, &new_opcode->op4);
 
     // Patch push_program opcode
     if( new_opcode->type == handlebars_opcode_type_push_program ) {
@@ -187,6 +409,148 @@ static void serialize_opcode(struct handlebars_module * module, struct handlebar
             new_opcode->op4.data.boolval = 1;
         }
     }
+
+    // Patch the programs of builtin blocks, which are always fused from a fresh copy
+    if(
+        new_opcode->type == handlebars_opcode_type_block_if ||
+        new_opcode->type == handlebars_opcode_type_block_unless ||
+        new_opcode->type == handlebars_opcode_type_block_with ||
+        new_opcode->type == handlebars_opcode_type_block_each
+    ) {
+        if( new_opcode->op2.type == handlebars_operand_type_long ) {
+            new_opcode->op2.data.longval = table[new_opcode->op2.data.longval]->guid;
+        }
+        if( new_opcode->op3.type == handlebars_operand_type_long ) {
+            new_opcode->op3.data.longval = table[new_opcode->op3.data.longval]->guid;
+        }
+    }
+}
+
+// Lower a serialized program to the register form of the VM. Every value the stack VM would push is given a fixed
+// register, numbered by the depth of the stack at that point, and opcode->reg is set to the first register each opcode
+// reads or writes. Hashes are built in the register they are passed in, so popHash does nothing, and assignToHash keeps
+// the register of its hash in op2. Returns the number of registers, or zero if the program has to run on the stacks.
+static size_t lower_registers(struct handlebars_opcode * opcodes, size_t count)
+{
+    long hashes[REGISTER_HASH_DEPTH];
+    long hash_count = 0;
+    long sp = 0;
+    long max = 0;
+    size_t i;
+
+    for( i = 0; i < count; i++ ) {
+        struct handlebars_opcode * opcode = &opcodes[i];
+        long pops;
+        long pushes = 0;
+
+        switch( opcode->type ) {
+            case handlebars_opcode_type_append_content:
+            case handlebars_opcode_type_get_context:
+            case handlebars_opcode_type_lookup_and_append:
+            case handlebars_opcode_type_lookup_and_append_escaped:
+            case handlebars_opcode_type_return:
+                pops = 0;
+                break;
+
+            case handlebars_opcode_type_push_hash:
+                if( hash_count >= REGISTER_HASH_DEPTH ) {
+                    return 0;
+                }
+                hashes[hash_count++] = sp;
+                // fallthrough
+            case handlebars_opcode_type_empty_hash:
+            case handlebars_opcode_type_lookup_block_param:
+            case handlebars_opcode_type_lookup_data:
+            case handlebars_opcode_type_lookup_on_context:
+            case handlebars_opcode_type_push_context:
+            case handlebars_opcode_type_push_literal:
+            case handlebars_opcode_type_push_program:
+            case handlebars_opcode_type_push_string:
+                pops = 0;
+                pushes = 1;
+                break;
+
+            case handlebars_opcode_type_assign_to_hash:
+                if( hash_count <= 0 ) {
+                    return 0;
+                }
+                handlebars_operand_set_longval(&opcode->op2, hashes[hash_count - 1]);
+                pops = 1;
+                break;
+
+            case handlebars_opcode_type_pop_hash:
+                if( hash_count <= 0 || hashes[--hash_count] != sp - 1 ) {
+                    return 0;
+                }
+                // fallthrough
+            case handlebars_opcode_type_resolve_possible_lambda:
+                pops = 1;
+                pushes = 1;
+                break;
+
+            case handlebars_opcode_type_append:
+            case handlebars_opcode_type_append_escaped:
+                // blockValue appends its result itself, so the append after it has nothing to pop
+                if( sp == 0 ) {
+                    opcode->reg = -1;
+                    continue;
+                }
+                // fallthrough
+            case handlebars_opcode_type_block_if:
+            case handlebars_opcode_type_block_unless:
+            case handlebars_opcode_type_block_with:
+            case handlebars_opcode_type_block_each:
+                pops = 1;
+                break;
+
+            case handlebars_opcode_type_invoke_ambiguous:
+                // program, inverse, value
+                pops = 3;
+                pushes = 1;
+                break;
+
+            case handlebars_opcode_type_block_value:
+                // value, program, inverse, hash
+                pops = 4;
+                break;
+
+            case handlebars_opcode_type_ambiguous_block_value:
+                pops = 4;
+                pushes = 1;
+                break;
+
+            case handlebars_opcode_type_invoke_known_helper:
+                // params, program, inverse, hash
+                pops = opcode->op1.data.longval + 3;
+                pushes = 1;
+                break;
+
+            case handlebars_opcode_type_invoke_helper:
+                // params, program, inverse, hash, value
+                pops = opcode->op1.data.longval + 4;
+                pushes = 1;
+                break;
+
+            case handlebars_opcode_type_invoke_partial:
+                // name if dynamic, context, program, inverse, hash
+                pops = opcode->op1.data.boolval ? 5 : 4;
+                break;
+
+            default:
+                return 0;
+        }
+
+        if( sp < pops ) {
+            return 0;
+        }
+        opcode->reg = (int) (sp - pops);
+        sp += pushes - pops;
+        if( sp > max ) {
+            max = sp;
+        }
+    }
+
+    return (size_t) max;
 }
 
 static struct handlebars_module_table_entry * serialize_program_shallow(struct handlebars_module * module, struct handlebars_program * program)
@@ -199,7 +563,7 @@ static struct handlebars_module_table_entry * serialize_program_shallow(struct h
     return entry;
 }
 
-static void serialize_program2(struct handlebars_module * module, struct handlebars_program * program, struct handlebars_module_table_entry * entry)
+static void serialize_program2(struct handlebars_module * module, struct string_table * strings, struct handlebars_program * program, struct handlebars_module_table_entry * entry)
 {
     size_t i;
     //struct handlebars_module_table_entry * children[program->children_length];
@@ -211,28 +575,34 @@ static void serialize_program2(struct handlebars_module * module, struct handleb
     }
 
     // Serialize opcodes
-    entry->opcode_count = program->opcodes_length;
     entry->opcode_offset = module->opcode_count;
-    for( i = 0 ; i < program->opcodes_length; i++ ) {
-        serialize_opcode(module, program->opcodes[i], children);
+    for( i = 0 ; i < program->opcodes_length; ) {
+        struct handlebars_opcode fused;
+        i += fuse_opcodes(strings, &program->opcodes[i], program->opcodes_length - i, &fused);
+        serialize_opcode(module, strings, &fused, children);
     }
 
     // Insert return opcode
     struct handlebars_opcode opcode = {0};
     opcode.type = handlebars_opcode_type_return;
-    serialize_opcode(module, &opcode, children);
-    entry->opcode_count++;
+    serialize_opcode(module, strings, &opcode, children);
+    entry->opcode_count = module->opcode_count - entry->opcode_offset;
+
+    // Lower to registers, unless the program uses an opcode only the stack VM runs
+    if( module->flags & handlebars_compiler_flag_registers ) {
+        entry->register_count = lower_registers(&module->opcodes[entry->opcode_offset], entry->opcode_count);
+    }
 
     // Serialize children
     for( i = 0; i < program->children_length; i++ ) {
-        serialize_program2(module, program->children[i], children[i]);
+        serialize_program2(module, strings, program->children[i], children[i]);
     }
 }
 
-static void serialize_program(struct handlebars_module * module, struct handlebars_program * program)
+static void serialize_program(struct handlebars_module * module, struct string_table * strings, struct handlebars_program * program)
 {
     struct handlebars_module_table_entry * entry = serialize_program_shallow(module, program);
-    serialize_program2(module, program, entry);
+    serialize_program2(module, strings, program, entry);
 }
 
 struct handlebars_module * handlebars_program_serialize(
@@ -243,15 +613,29 @@ struct handlebars_module * handlebars_program_serialize(
     struct handlebars_module * module = handlebars_talloc_zero(context, struct handlebars_module);
     memcpy(&module->header, "HBSCM", sizeof("HBSCM"));
     module->version = handlebars_version();
+    module->format = HANDLEBARS_MODULE_FORMAT;
     module->flags = program->flags;
     time(&module->ts);
 
+    // Setup string table
+    struct string_table strings = {0};
+    strings.context = context;
+    strings.memctx = handlebars_talloc_size(context, 0);
+    HANDLEBARS_MEMCHECK(strings.memctx, context);
+    strings.size = 64;
+    strings.entries = handlebars_talloc_array(strings.memctx, struct handlebars_string *, strings.size);
+    HANDLEBARS_MEMCHECK(strings.entries, context);
+    string_table_reset(&strings);
+
     // Calculate size
-    module->size = sizeof(struct handlebars_module) + calculate_size_program(module, program);
+    module->size = sizeof(struct handlebars_module) + calculate_size_program(module, &strings, program);
 
     // Reallocate buffer
     module = handlebars_talloc_realloc_size(context, module, module->size);
     module->addr = (void *) module;
+
+    // Clear the padding in the opcodes, so that the output only depends on the program
+    memset(module->data, 0, module->size - sizeof(struct handlebars_module));
     talloc_set_type(module, struct handlebars_module);
 
     // Setup pointers
@@ -271,7 +655,9 @@ struct handlebars_module * handlebars_program_serialize(
     module->data_offset = offset;
 
     // Copy data
-    serialize_program(module, program);
+    string_table_reset(&strings);
+    serialize_program(module, &strings, program);
+    handlebars_talloc_free(strings.memctx);
 
 #ifndef NDEBUG
     assert(module->program_count == program_count);
@@ -378,6 +764,11 @@ int handlebars_module_get_version(struct handlebars_module * module)
     return module->version;
 }
 
+int handlebars_module_get_format(struct handlebars_module * module)
+{
+    return module->format;
+}
+
 time_t handlebars_module_get_ts(struct handlebars_module * module)
 {
     return module->ts;
@@ -410,8 +801,22 @@ bool handlebars_module_verify(
     struct handlebars_module * module,
     struct handlebars_context * ctx
 ) {
-    uint64_t hash = calculate_hash(module);
+    uint64_t hash;
     bool matched = true;
+    // Check the format first, the rest of a module in another format cannot be trusted
+    if (module->format != HANDLEBARS_MODULE_FORMAT) {
+        if (ctx != NULL) {
+            handlebars_throw(
+                ctx,
+                HANDLEBARS_ERROR,
+                "Invalid module format expected=%d actual=%d",
+                HANDLEBARS_MODULE_FORMAT,
+                module->format
+            );
+        }
+        return false;
+    }
+    hash = calculate_hash(module);
     if (hash != module->hash) {
         if (ctx != NULL) {
             handlebars_throw(
@@ -29,6 +29,12 @@ struct handlebars_program;
 struct handlebars_opcode;
 struct handlebars_module;
 
+/**
+ * The layout of serialized modules. Modules, module caches and bundles written with another format are rejected, so
+ * it must be incremented whenever the layout of modules, program table entries, opcodes or operands changes.
+ */
+#define HANDLEBARS_MODULE_FORMAT 4
+
 extern const size_t HANDLEBARS_MODULE_SIZE;
 extern const size_t HANDLEBARS_MODULE_TABLE_ENTRY_SIZE;
 
@@ -84,6 +90,7 @@ bool handlebars_module_verify(
 
 size_t handlebars_module_get_size(struct handlebars_module * module) HBS_ATTR_NONNULL_ALL;
 int handlebars_module_get_version(struct handlebars_module * module) HBS_ATTR_NONNULL_ALL;
+int handlebars_module_get_format(struct handlebars_module * module) HBS_ATTR_NONNULL_ALL;
 time_t handlebars_module_get_ts(struct handlebars_module * module) HBS_ATTR_NONNULL_ALL;
 long handlebars_module_get_flags(struct handlebars_module * module) HBS_ATTR_NONNULL_ALL;
 uint64_t handlebars_module_get_hash(struct handlebars_module * module) HBS_ATTR_NONNULL_ALL;
@@ -101,6 +108,8 @@ struct handlebars_module_table_entry
     size_t opcode_count;
     //! Offset to start opcode for function
     size_t opcode_offset;
+    //! Number of registers if the program was lowered to registers, zero if it runs on the stacks
+    size_t register_count;
 };
 
 /**
@@ -116,6 +125,9 @@ struct handlebars_module
     //! The handlebars version this program was compiled with
     int version;
 
+    //! The layout of the module, #HANDLEBARS_MODULE_FORMAT. Modules written before it existed have zero here.
+    int format;
+
     //! The original address of the struct used to fix internal pointers
     void * addr;
 
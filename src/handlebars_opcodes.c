@@ -79,6 +79,7 @@ void handlebars_operand_set_stringval(
 
     operand->type = handlebars_operand_type_string;
     operand->data.string.string = talloc_steal(opcode, string);
+    operand->data.string.index = -1;
 }
 
 void handlebars_operand_set_arrayval(
@@ -106,6 +107,7 @@ void handlebars_operand_set_arrayval(
     arrptr = operand->data.array.array;
     for( ; *ptr; ++ptr, ++arrptr ) {
         arrptr->string = talloc_steal(operand->data.array.array, handlebars_string_ctor(context, *ptr, strlen(*ptr)));
+        arrptr->index = -1;
     }
 }
 
@@ -133,6 +135,7 @@ void handlebars_operand_set_arrayval_string(
     for( ; *ptr; ++ptr, ++arrptr ) {
         // arrptr->string = talloc_steal(operand->data.array.array, handlebars_string_ctor(context, (*ptr)->val, (*ptr)->len));
         arrptr->string = talloc_steal(operand->data.array.array, handlebars_string_copy_ctor(context, *ptr));
+        arrptr->index = -1;
     }
 }
 
@@ -189,6 +192,14 @@ const char * handlebars_opcode_readable_type(enum handlebars_opcode_type type)
         // Special
         _RTYPE_CASE(return, return);
 
+        // Superinstructions
+        _RTYPE_CASE(lookup_and_append, lookupAndAppend);
+        _RTYPE_CASE(lookup_and_append_escaped, lookupAndAppendEscaped);
+        _RTYPE_CASE(block_if, blockIf);
+        _RTYPE_CASE(block_unless, blockUnless);
+        _RTYPE_CASE(block_with, blockWith);
+        _RTYPE_CASE(block_each, blockEach);
+
         default: return "invalid";
     }
 }
@@ -212,6 +223,10 @@ enum handlebars_opcode_type handlebars_opcode_reverse_readable_type(const char *
             break;
         case 'b':
             _RTYPE_REV_CMP(block_value, blockValue);
+            _RTYPE_REV_CMP(block_if, blockIf);
+            _RTYPE_REV_CMP(block_unless, blockUnless);
+            _RTYPE_REV_CMP(block_with, blockWith);
+            _RTYPE_REV_CMP(block_each, blockEach);
             break;
         case 'e':
             _RTYPE_REV_CMP(empty_hash, emptyHash);
@@ -230,6 +245,8 @@ enum handlebars_opcode_type handlebars_opcode_reverse_readable_type(const char *
             _RTYPE_REV_CMP(lookup_block_param, lookupBlockParam);
             _RTYPE_REV_CMP(lookup_on_context, lookupOnContext);
             _RTYPE_REV_CMP(lookup_data, lookupData);
+            _RTYPE_REV_CMP(lookup_and_append, lookupAndAppend);
+            _RTYPE_REV_CMP(lookup_and_append_escaped, lookupAndAppendEscaped);
             break;
         case 'n':
             _RTYPE_REV_CMP(nil, nil);
@@ -302,10 +319,16 @@ short handlebars_opcode_num_operands(enum handlebars_opcode_type type)
         case handlebars_opcode_type_push_id:
         // In v4 lookup_data was changed from 2 to 3 operands
         case handlebars_opcode_type_lookup_data:
+        case handlebars_opcode_type_block_if:
+        case handlebars_opcode_type_block_unless:
+        case handlebars_opcode_type_block_with:
+        case handlebars_opcode_type_block_each:
             return 3;
 
         // In v4 lookup_on_context was changed from 3 to 4 operands
         case handlebars_opcode_type_lookup_on_context:
+        case handlebars_opcode_type_lookup_and_append:
+        case handlebars_opcode_type_lookup_and_append_escaped:
             return 4;
     }
 }
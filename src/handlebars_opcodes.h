@@ -88,7 +88,19 @@ enum handlebars_opcode_type {
     handlebars_opcode_type_register_decorator = 26,
 
     // Special opcode
-    handlebars_opcode_type_return = 27
+    handlebars_opcode_type_return = 27,
+
+    // Superinstructions, only emitted by the serializer. Take one array (or null for the context itself), one
+    // integer (the context depth) and two boolean arguments
+    handlebars_opcode_type_lookup_and_append = 28,
+    handlebars_opcode_type_lookup_and_append_escaped = 29,
+
+    // Builtin block helpers, only emitted by the serializer. Take one string (the helper name) and two integer or
+    // null arguments (the program and the inverse)
+    handlebars_opcode_type_block_if = 30,
+    handlebars_opcode_type_block_unless = 31,
+    handlebars_opcode_type_block_with = 32,
+    handlebars_opcode_type_block_each = 33
 };
 
 /**
@@ -231,6 +243,8 @@ void handlebars_opcode_set_loc(
 
 struct handlebars_operand_string {
     struct handlebars_string * string;
+    //! The string as an array index, or -1 if it is not one. Only valid after #handlebars_program_serialize
+    long index;
 };
 
 struct handlebars_operand_array {
@@ -252,6 +266,8 @@ struct handlebars_operand {
 
 struct handlebars_opcode {
     enum handlebars_opcode_type type;
+    //! The first register the opcode reads or writes, only used in programs lowered to registers
+    int reg;
     struct handlebars_operand op1;
     struct handlebars_operand op2;
     struct handlebars_operand op3;
@@ -28,3 +28,4 @@ extern inline void handlebars_rc_init(struct handlebars_rc * rc);
 extern inline void handlebars_rc_addref(struct handlebars_rc * rc);
 extern inline void handlebars_rc_delref(struct handlebars_rc * rc, handlebars_rc_dtor_func dtor);
 extern inline size_t handlebars_rc_refcount(struct handlebars_rc * rc);
+extern inline void handlebars_rc_immortalize(struct handlebars_rc * rc);
@@ -33,14 +33,83 @@ typedef void (*handlebars_rc_dtor_func)(
     struct handlebars_rc *
 );
 
-struct handlebars_rc {
-    uint8_t refcount;
-};
-
 #ifndef UINT8_MAX
 #define UINT8_MAX 255
 #endif
 
+#ifndef UINT32_MAX
+#define UINT32_MAX 4294967295U
+#endif
+
+/**
+ * With HANDLEBARS_ATOMIC_REFCOUNT, reference counts are updated with atomic operations, so that strings, maps and
+ * other refcounted objects may be shared between threads. Only the refcounting is made thread-safe: objects must
+ * still not be modified while shared, and should be immortal (or frozen) if their talloc parent may be freed
+ * concurrently.
+ */
+#ifdef HANDLEBARS_ATOMIC_REFCOUNT
+typedef uint32_t handlebars_rc_count;
+#define HANDLEBARS_RC_IMMORTAL UINT32_MAX
+#else
+typedef uint8_t handlebars_rc_count;
+#define HANDLEBARS_RC_IMMORTAL UINT8_MAX
+#endif
+
+struct handlebars_rc {
+    handlebars_rc_count refcount;
+};
+
+#ifdef HANDLEBARS_ATOMIC_REFCOUNT
+
+HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
+inline void handlebars_rc_init(struct handlebars_rc * rc)
+{
+    __atomic_store_n(&rc->refcount, 0, __ATOMIC_RELAXED);
+}
+
+HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
+inline void handlebars_rc_addref(struct handlebars_rc * rc)
+{
+    handlebars_rc_count count = __atomic_load_n(&rc->refcount, __ATOMIC_RELAXED);
+    while (count < HANDLEBARS_RC_IMMORTAL &&
+            !__atomic_compare_exchange_n(&rc->refcount, &count, count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // count was reloaded, retry
+    }
+}
+
+HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
+inline void handlebars_rc_delref(struct handlebars_rc * rc, handlebars_rc_dtor_func dtor)
+{
+    handlebars_rc_count count = __atomic_load_n(&rc->refcount, __ATOMIC_RELAXED);
+    for (;;) {
+        if (count == HANDLEBARS_RC_IMMORTAL) {
+            return;
+        } else if (count <= 1) {
+            // Last reference, no other thread may hold one
+            __atomic_store_n(&rc->refcount, 0, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            dtor(rc);
+            return;
+        } else if (__atomic_compare_exchange_n(&rc->refcount, &count, count - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
+inline size_t handlebars_rc_refcount(struct handlebars_rc * rc)
+{
+    return __atomic_load_n(&rc->refcount, __ATOMIC_ACQUIRE);
+}
+
+HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
+inline void handlebars_rc_immortalize(struct handlebars_rc * rc)
+{
+    __atomic_store_n(&rc->refcount, HANDLEBARS_RC_IMMORTAL, __ATOMIC_RELEASE);
+}
+
+#else
+
 HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
 inline void handlebars_rc_init(struct handlebars_rc * rc)
 {
@@ -50,7 +119,7 @@ inline void handlebars_rc_init(struct handlebars_rc * rc)
 HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
 inline void handlebars_rc_addref(struct handlebars_rc * rc)
 {
-    if (rc->refcount < UINT8_MAX) {
+    if (rc->refcount < HANDLEBARS_RC_IMMORTAL) {
         rc->refcount++;
     }
 }
@@ -58,7 +127,7 @@ inline void handlebars_rc_addref(struct handlebars_rc * rc)
 HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
 inline void handlebars_rc_delref(struct handlebars_rc * rc, handlebars_rc_dtor_func dtor)
 {
-    if (rc->refcount == UINT8_MAX) {
+    if (rc->refcount == HANDLEBARS_RC_IMMORTAL) {
         // immortal
     } else if (rc->refcount <= 1) {
         rc->refcount = 0;
@@ -74,6 +143,14 @@ inline size_t handlebars_rc_refcount(struct handlebars_rc * rc)
     return rc->refcount;
 }
 
+HBS_ATTR_NONNULL_ALL HBS_ATTR_ALWAYS_INLINE
+inline void handlebars_rc_immortalize(struct handlebars_rc * rc)
+{
+    rc->refcount = HANDLEBARS_RC_IMMORTAL;
+}
+
+#endif /* HANDLEBARS_ATOMIC_REFCOUNT */
+
 HBS_EXTERN_C_END
 
 #endif
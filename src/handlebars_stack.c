@@ -39,6 +39,7 @@
 
 enum handlebars_stack_flags {
     HANDLEBARS_STACK_TALLOCATED = 1,
+    HANDLEBARS_STACK_FROZEN = 2,
 };
 
 struct handlebars_stack {
@@ -166,6 +167,23 @@ void handlebars_stack_dtor(struct handlebars_stack * stack)
 
 // }}} Constructors and Destructors
 
+void handlebars_stack_freeze(struct handlebars_stack * stack)
+{
+    if (stack->flags & HANDLEBARS_STACK_FROZEN) {
+        return;
+    }
+
+    stack->flags |= HANDLEBARS_STACK_FROZEN;
+
+    for (size_t i = 0; i < stack->i; i++) {
+        handlebars_value_freeze(&stack->v[i]);
+    }
+
+#ifndef HANDLEBARS_NO_REFCOUNT
+    handlebars_rc_immortalize(&stack->rc);
+#endif
+}
+
 size_t handlebars_stack_count(struct handlebars_stack * stack)
 {
     return stack->i;
@@ -109,6 +109,15 @@ void handlebars_stack_addref(struct handlebars_stack * stack)
 void handlebars_stack_delref(struct handlebars_stack * stack)
     HBS_ATTR_NONNULL_ALL;
 
+/**
+ * @brief Make the stack immortal and freeze its elements. Any modification returns a copy.
+ *        See #handlebars_value_freeze.
+ * @param[in] stack
+ * @return void
+ */
+void handlebars_stack_freeze(struct handlebars_stack * stack)
+    HBS_ATTR_NONNULL_ALL;
+
 // }}} Reference Counting
 
 /**
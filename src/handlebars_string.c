@@ -45,6 +45,11 @@
 #include "handlebars_rc.h"
 #endif
 
+#if defined(__x86_64__) && ((__GNUC__ >= 5) || defined(__clang__)) && !defined(HANDLEBARS_NO_SIMD)
+#define HANDLEBARS_STRING_SIMD 1
+#include <immintrin.h>
+#endif
+
 
 
 struct handlebars_string {
@@ -214,7 +219,7 @@ static inline struct handlebars_string * separate_string(struct handlebars_strin
 void handlebars_string_immortalize(struct handlebars_string * string)
 {
 #ifndef HANDLEBARS_NO_REFCOUNT
-    string->rc.refcount = UINT8_MAX;
+    handlebars_rc_immortalize(&string->rc);
 #endif
 }
 // }}} Reference Counting
@@ -660,6 +665,182 @@ struct handlebars_string * handlebars_string_vasprintf_append(
 #pragma clang diagnostic pop
 #endif
 
+// {{{ HTML escaping
+
+// Each implementation provides a function returning the number of bytes escaping will add, and a function returning
+// the first character that needs escaping, or end if there are none
+
+struct htmlspecialchars_impl {
+    size_t (*extra_len)(const char * p, const char * end);
+    const char * (*find)(const char * p, const char * end);
+};
+
+static size_t htmlspecialchars_extra_len_scalar(const char * p, const char * end)
+{
+    size_t extra = 0;
+    for( ; p < end; p++ ) {
+        size_t len = htmlspecialchars[(unsigned char) *p].len;
+        if( len ) {
+            extra += len - 1;
+        }
+    }
+    return extra;
+}
+
+static const char * htmlspecialchars_find_scalar(const char * p, const char * end)
+{
+    while( p < end && !htmlspecialchars[(unsigned char) *p].len ) {
+        p++;
+    }
+    return p;
+}
+
+#ifndef HANDLEBARS_STRING_SIMD
+static const struct htmlspecialchars_impl htmlspecialchars_impl_scalar = {
+    htmlspecialchars_extra_len_scalar,
+    htmlspecialchars_find_scalar
+};
+#endif
+
+#ifdef HANDLEBARS_STRING_SIMD
+
+// SSE2 is part of the x86-64 baseline, so this is always available
+
+#define HTMLSPECIALCHARS_SSE2_EQ(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+
+static size_t htmlspecialchars_extra_len_sse2(const char * p, const char * end)
+{
+    size_t extra = 0;
+
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i amp = HTMLSPECIALCHARS_SSE2_EQ(v, '&');
+        __m128i ltgt = _mm_or_si128(HTMLSPECIALCHARS_SSE2_EQ(v, '<'), HTMLSPECIALCHARS_SSE2_EQ(v, '>'));
+        __m128i quot = _mm_or_si128(
+            _mm_or_si128(HTMLSPECIALCHARS_SSE2_EQ(v, '"'), HTMLSPECIALCHARS_SSE2_EQ(v, '\'')),
+            HTMLSPECIALCHARS_SSE2_EQ(v, '`')
+        );
+        if( !_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(amp, ltgt), quot)) ) {
+            continue;
+        }
+        extra += 4 * (size_t) __builtin_popcount(_mm_movemask_epi8(amp));
+        extra += 3 * (size_t) __builtin_popcount(_mm_movemask_epi8(ltgt));
+        extra += 5 * (size_t) __builtin_popcount(_mm_movemask_epi8(quot));
+    }
+
+    return extra + htmlspecialchars_extra_len_scalar(p, end);
+}
+
+static const char * htmlspecialchars_find_sse2(const char * p, const char * end)
+{
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(HTMLSPECIALCHARS_SSE2_EQ(v, '&'), HTMLSPECIALCHARS_SSE2_EQ(v, '<')),
+                _mm_or_si128(HTMLSPECIALCHARS_SSE2_EQ(v, '>'), HTMLSPECIALCHARS_SSE2_EQ(v, '"'))
+            ),
+            _mm_or_si128(HTMLSPECIALCHARS_SSE2_EQ(v, '\''), HTMLSPECIALCHARS_SSE2_EQ(v, '`'))
+        );
+        int mask = _mm_movemask_epi8(m);
+        if( mask ) {
+            return p + __builtin_ctz((unsigned) mask);
+        }
+    }
+
+    return htmlspecialchars_find_scalar(p, end);
+}
+
+static const struct htmlspecialchars_impl htmlspecialchars_impl_sse2 = {
+    htmlspecialchars_extra_len_sse2,
+    htmlspecialchars_find_sse2
+};
+
+#undef HTMLSPECIALCHARS_SSE2_EQ
+
+#define HTMLSPECIALCHARS_AVX2_EQ(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+
+__attribute__((target("avx2")))
+static size_t htmlspecialchars_extra_len_avx2(const char * p, const char * end)
+{
+    size_t extra = 0;
+
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i amp = HTMLSPECIALCHARS_AVX2_EQ(v, '&');
+        __m256i ltgt = _mm256_or_si256(HTMLSPECIALCHARS_AVX2_EQ(v, '<'), HTMLSPECIALCHARS_AVX2_EQ(v, '>'));
+        __m256i quot = _mm256_or_si256(
+            _mm256_or_si256(HTMLSPECIALCHARS_AVX2_EQ(v, '"'), HTMLSPECIALCHARS_AVX2_EQ(v, '\'')),
+            HTMLSPECIALCHARS_AVX2_EQ(v, '`')
+        );
+        if( _mm256_testz_si256(_mm256_or_si256(_mm256_or_si256(amp, ltgt), quot), _mm256_set1_epi8(-1)) ) {
+            continue;
+        }
+        extra += 4 * (size_t) __builtin_popcount((unsigned) _mm256_movemask_epi8(amp));
+        extra += 3 * (size_t) __builtin_popcount((unsigned) _mm256_movemask_epi8(ltgt));
+        extra += 5 * (size_t) __builtin_popcount((unsigned) _mm256_movemask_epi8(quot));
+    }
+
+    return extra + htmlspecialchars_extra_len_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char * htmlspecialchars_find_avx2(const char * p, const char * end)
+{
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_or_si256(HTMLSPECIALCHARS_AVX2_EQ(v, '&'), HTMLSPECIALCHARS_AVX2_EQ(v, '<')),
+                _mm256_or_si256(HTMLSPECIALCHARS_AVX2_EQ(v, '>'), HTMLSPECIALCHARS_AVX2_EQ(v, '"'))
+            ),
+            _mm256_or_si256(HTMLSPECIALCHARS_AVX2_EQ(v, '\''), HTMLSPECIALCHARS_AVX2_EQ(v, '`'))
+        );
+        unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+        if( mask ) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    return htmlspecialchars_find_sse2(p, end);
+}
+
+static const struct htmlspecialchars_impl htmlspecialchars_impl_avx2 = {
+    htmlspecialchars_extra_len_avx2,
+    htmlspecialchars_find_avx2
+};
+
+#undef HTMLSPECIALCHARS_AVX2_EQ
+
+#endif /* HANDLEBARS_STRING_SIMD */
+
+static const struct htmlspecialchars_impl * htmlspecialchars_impl_resolve(void)
+{
+#ifdef HANDLEBARS_STRING_SIMD
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx2") ) {
+        return &htmlspecialchars_impl_avx2;
+    }
+    return &htmlspecialchars_impl_sse2;
+#else
+    return &htmlspecialchars_impl_scalar;
+#endif
+}
+
+// Resolved on first use. Concurrent first calls may both resolve and store the same pointer, so the accesses only
+// need to be atomic, not ordered: the implementations it points to are constants.
+static const struct htmlspecialchars_impl * htmlspecialchars_impl = NULL;
+
+static inline const struct htmlspecialchars_impl * htmlspecialchars_get_impl(void)
+{
+    const struct htmlspecialchars_impl * impl = __atomic_load_n(&htmlspecialchars_impl, __ATOMIC_RELAXED);
+    if( unlikely(impl == NULL) ) {
+        impl = htmlspecialchars_impl_resolve();
+        __atomic_store_n(&htmlspecialchars_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
 struct handlebars_string * handlebars_string_htmlspecialchars(
     struct handlebars_context * context,
     const char * str, size_t len
@@ -674,46 +855,52 @@ struct handlebars_string * handlebars_string_htmlspecialchars_append(
     struct handlebars_string * string,
     const char * str, size_t len
 ) {
-    size_t new_len = len;
-    const char * p;
-    const char * end;
-    const struct htmlspecialchars_pair * pair;
+    const struct htmlspecialchars_impl * impl = htmlspecialchars_get_impl();
+    const char * p = str;
+    const char * end = str + len;
+    const char * next;
+    char * out;
+    size_t extra;
 
     if( len <= 0 ) {
         return string;
     }
 
-    string = separate_string(string);
-
-    // Calculate new size
-    for( p = str + len - 1; p >= str; p-- ) {
-        pair = &htmlspecialchars[(unsigned char) *p];
-        if( pair->len ) {
-            new_len += pair->len - 1;
-        }
-    }
-
-    // If new len is equal to len, nothing to escape, just append
-    if( new_len == len ) {
+    // Calculate new size. If nothing needs to be escaped, just append
+    extra = impl->extra_len(str, end);
+    if( extra == 0 ) {
         return handlebars_string_append(context, string, str, len);
     }
 
     // Realloc original buffer
-    string = handlebars_string_extend(context, string, string->len + new_len);
-
-    // Copy
-    for( p = str, end = str + len; p < end; p++ ) {
-        pair = &htmlspecialchars[(unsigned char) *p];
-        if( pair->len ) {
-            string = handlebars_string_append_unsafe(string, pair->str, pair->len);
-        } else {
-            string = handlebars_string_append_unsafe(string, p, 1);
+    string = separate_string(string);
+    string = handlebars_string_extend(context, string, string->len + len + extra);
+
+    // Copy clean runs in bulk, and the replacement for each escaped character
+    out = string->val + string->len;
+    for( ;; ) {
+        next = impl->find(p, end);
+        memcpy(out, p, next - p);
+        out += next - p;
+        if( next >= end ) {
+            break;
         }
+        const struct htmlspecialchars_pair * pair = &htmlspecialchars[(unsigned char) *next];
+        memcpy(out, pair->str, pair->len);
+        out += pair->len;
+        p = next + 1;
     }
 
+    string->len += len + extra;
+    assert(out == string->val + string->len);
+    string->val[string->len] = 0;
+    string->hash = 0;
+
     return string;
 }
 
+// }}} HTML escaping
+
 struct handlebars_string * handlebars_string_implode(
     struct handlebars_context * context,
     const char * sep,
@@ -594,6 +594,35 @@ long handlebars_value_count(struct handlebars_value * value)
     }
 }
 
+void handlebars_value_freeze(struct handlebars_value * value)
+{
+    // Lazily wrapped user types are converted so that reads never allocate
+    if (value->type == HANDLEBARS_VALUE_TYPE_USER && handlebars_value_get_handlers(value)->convert) {
+        handlebars_value_get_handlers(value)->convert(value, true);
+    }
+
+    switch( value->type ) {
+        case HANDLEBARS_VALUE_TYPE_STRING:
+            (void) hbs_str_hash(value->v.string);
+            handlebars_string_immortalize(value->v.string);
+            break;
+        case HANDLEBARS_VALUE_TYPE_MAP:
+            handlebars_map_freeze(value->v.map);
+            break;
+        case HANDLEBARS_VALUE_TYPE_ARRAY:
+            handlebars_stack_freeze(value->v.stack);
+            break;
+#ifndef HANDLEBARS_NO_REFCOUNT
+        case HANDLEBARS_VALUE_TYPE_USER:
+            handlebars_rc_immortalize(&value->v.user->rc);
+            break;
+#endif
+        default:
+            // do nothing
+            break;
+    }
+}
+
 // }}} Misc
 
 // {{{ Array
@@ -443,6 +443,20 @@ bool handlebars_value_is_scalar(struct handlebars_value * value) HBS_ATTR_NONNUL
  */
 long handlebars_value_count(struct handlebars_value * value) HBS_ATTR_NONNULL_ALL;
 
+/**
+ * @brief Freeze a value tree so that it can be shared between renders and threads. User types with a convert
+ *        handler are converted to maps and arrays, map iteration order is compacted, string hashes are computed,
+ *        and every string, map and array in the tree is made immortal. Reading a frozen tree performs no writes
+ *        to it: reference counting becomes a no-op, and iterating a frozen map does not mark it. Modifying a
+ *        frozen map, array or string produces a copy, leaving the original untouched. The tree is never freed
+ *        by reference counting; it is released together with its talloc parent, which must outlive every
+ *        render using it. Requires reference counting; with HANDLEBARS_NO_REFCOUNT the tree must not be
+ *        modified after freezing.
+ * @param[in] value
+ * @return void
+ */
+void handlebars_value_freeze(struct handlebars_value * value) HBS_ATTR_NONNULL_ALL;
+
 // }}} Misc
 
 // {{{ Array
@@ -38,6 +38,7 @@
 #include "handlebars_delimiters.h"
 #include "handlebars_helpers.h"
 #include "handlebars_map.h"
+#include "handlebars_native.h"
 #include "handlebars_parser.h"
 #include "handlebars_ptr.h"
 #include "handlebars_opcodes.h"
@@ -64,7 +65,7 @@
 #define ACCEPT_FUNCTION(name) ACCEPT_NAMED_FUNCTION(ACCEPT_FN(name))
 
 #undef CONTEXT
-#define CONTEXT HBSCTX(vm)
+#define CONTEXT HANDLEBARS_VM_RENDER_CTX(vm)
 
 // }}} Macros
 
@@ -172,6 +173,46 @@ void handlebars_vm_set_logger(struct handlebars_vm * vm, handlebars_func log_fun
     vm->log_ctx = log_ctx;
 }
 
+void handlebars_vm_set_output(struct handlebars_vm * vm, handlebars_vm_output_func output_func, void * output_ctx, size_t threshold)
+{
+    vm->output_func = output_func;
+    vm->output_ctx = output_ctx;
+    vm->output_threshold = threshold;
+}
+
+void handlebars_vm_set_arena(struct handlebars_vm * vm, size_t size)
+{
+    if (vm->arena_pool && size != vm->arena_size && vm->arena == NULL) {
+        handlebars_talloc_free(vm->arena_pool);
+        vm->arena_pool = NULL;
+    }
+    vm->arena_size = size;
+}
+
+void handlebars_vm_set_profile(struct handlebars_vm * vm, struct handlebars_vm_profile * profile)
+{
+    vm->profile = profile;
+}
+
+void handlebars_vm_set_trace(
+    struct handlebars_vm * vm,
+    handlebars_vm_trace_func begin_func,
+    handlebars_vm_trace_func end_func,
+    void * ctx,
+    unsigned long sample_interval
+) {
+    vm->trace_begin = begin_func;
+    vm->trace_end = end_func;
+    vm->trace_ctx = ctx;
+    vm->trace_sample_interval = sample_interval > 0 ? sample_interval : 1;
+    vm->trace_sample_count = 0;
+}
+
+void handlebars_vm_set_trace_name(struct handlebars_vm * vm, const char * name)
+{
+    vm->trace_name = name;
+}
+
 handlebars_func handlebars_vm_get_log_func(struct handlebars_vm * vm)
 {
     return vm->log_func;
@@ -184,6 +225,83 @@ void * handlebars_vm_get_log_ctx(struct handlebars_vm * vm)
 
 // }}} Getters & Setters
 
+// {{{ Data frames
+
+void handlebars_vm_data_frame_init(
+    struct handlebars_vm_data_frame * frame,
+    struct handlebars_vm_data_frame * parent,
+    struct handlebars_value * data
+) {
+    frame->parent = parent;
+    frame->data = data;
+    handlebars_value_init(&frame->index);
+    handlebars_value_init(&frame->key);
+    handlebars_value_init(&frame->first);
+    handlebars_value_init(&frame->last);
+    frame->map = NULL;
+    frame->map_stale = true;
+}
+
+void handlebars_vm_data_frame_deinit(struct handlebars_vm_data_frame * frame)
+{
+    handlebars_value_dtor(&frame->index);
+    handlebars_value_dtor(&frame->key);
+    handlebars_value_dtor(&frame->first);
+    handlebars_value_dtor(&frame->last);
+    if (frame->map) {
+        handlebars_map_delref(frame->map);
+        frame->map = NULL;
+    }
+}
+
+HBS_ATTR_NONNULL_ALL
+static inline struct handlebars_value * data_frame_find(struct handlebars_vm_data_frame * frame, struct handlebars_string * name)
+{
+    switch (hbs_str_len(name)) {
+        case 3:
+            if (0 == memcmp(hbs_str_val(name), "key", 3)) return &frame->key;
+            break;
+        case 4:
+            if (0 == memcmp(hbs_str_val(name), "last", 4)) return &frame->last;
+            break;
+        case 5:
+            if (0 == memcmp(hbs_str_val(name), "index", 5)) return &frame->index;
+            if (0 == memcmp(hbs_str_val(name), "first", 5)) return &frame->first;
+            break;
+    }
+    return NULL;
+}
+
+// Build the data map of a frame, the same way #each used to for every iteration
+HBS_ATTR_NONNULL_ALL
+static struct handlebars_map * data_frame_map(struct handlebars_vm * vm, struct handlebars_vm_data_frame * frame)
+{
+    if (!frame->map) {
+        if (handlebars_value_get_type(frame->data) == HANDLEBARS_VALUE_TYPE_MAP) {
+            frame->map = handlebars_map_ctor(CONTEXT, handlebars_value_count(frame->data) + 4);
+            HANDLEBARS_VALUE_FOREACH_KV(frame->data, key, child) {
+                frame->map = handlebars_map_update(frame->map, key, child);
+            } HANDLEBARS_VALUE_FOREACH_END();
+        } else {
+            frame->map = handlebars_map_ctor(CONTEXT, 4);
+        }
+        handlebars_map_addref(frame->map);
+        frame->map_stale = true;
+    }
+
+    if (frame->map_stale) {
+        frame->map = handlebars_map_str_update(frame->map, HBS_STRL("index"), &frame->index);
+        frame->map = handlebars_map_str_update(frame->map, HBS_STRL("key"), &frame->key);
+        frame->map = handlebars_map_str_update(frame->map, HBS_STRL("first"), &frame->first);
+        frame->map = handlebars_map_str_update(frame->map, HBS_STRL("last"), &frame->last);
+        frame->map_stale = false;
+    }
+
+    return frame->map;
+}
+
+// }}} Data frames
+
 HBS_ATTR_NONNULL_ALL
 static inline struct handlebars_value * lookup_helper(
     struct handlebars_vm * vm,
@@ -204,6 +322,14 @@ static inline struct handlebars_value * lookup_helper(
     return rv;
 }
 
+bool handlebars_vm_helper_overridden(struct handlebars_vm * vm, const char * name, size_t len)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    bool overridden = NULL != handlebars_value_map_str_find(&vm->helpers, name, len, rv);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    return overridden;
+}
+
 HBS_ATTR_NONNULL(1, 4, 5)
 struct handlebars_value * handlebars_vm_call_helper_str(const char * name, unsigned int len, HANDLEBARS_HELPER_ARGS)
 {
@@ -221,6 +347,19 @@ struct handlebars_value * handlebars_vm_call_helper_str(const char * name, unsig
     return rv;
 }
 
+// Set the scope and data of helper options, using two values of mem
+static inline void setup_options_scope(struct handlebars_vm * vm, struct handlebars_options * options, struct handlebars_value * mem)
+{
+    options->scope = mem++;
+    handlebars_value_value(options->scope, TOP(vm->contextStack));
+    options->data = mem++;
+    if (unlikely(vm->data_frame != NULL)) {
+        handlebars_value_map(options->data, data_frame_map(vm, vm->data_frame));
+    } else {
+        handlebars_value_value(options->data, &vm->data);
+    }
+}
+
 static inline void setup_options(struct handlebars_vm * vm, int argc, struct handlebars_value * argv, struct handlebars_options * options, struct handlebars_value * mem)
 {
     struct handlebars_value * inverse;
@@ -229,10 +368,8 @@ static inline void setup_options(struct handlebars_vm * vm, int argc, struct han
 
     //options->name = ctx->name ? MC(handlebars_talloc_strndup(options, ctx->name->val, ctx->name->len)) : NULL;
     options->hash = POP(vm->stack, mem++);
-    options->scope = mem++;
-    handlebars_value_value(options->scope, TOP(vm->contextStack));
-    options->data = mem++;
-    handlebars_value_value(options->data, &vm->data);
+    setup_options_scope(vm, options, mem);
+    mem += 2;
 
     // programs
     inverse = POP(vm->stack, mem++);
@@ -256,10 +393,13 @@ static inline void setup_options(struct handlebars_vm * vm, int argc, struct han
     }
 }
 
-#define VM_SETUP_OPTIONS(argc) \
+#define VM_DECL_OPTIONS(argc) \
     struct handlebars_options options = {0}; \
     HANDLEBARS_VALUE_ARRAY_DECL(argv, argc); \
-    HANDLEBARS_VALUE_ARRAY_DECL(extra, 5); \
+    HANDLEBARS_VALUE_ARRAY_DECL(extra, 5)
+
+#define VM_SETUP_OPTIONS(argc) \
+    VM_DECL_OPTIONS(argc); \
     setup_options(vm, argc, argv, &options, extra)
 
 #define VM_TEARDOWN_OPTIONS(argc) \
@@ -267,10 +407,310 @@ static inline void setup_options(struct handlebars_vm * vm, int argc, struct han
     HANDLEBARS_VALUE_ARRAY_UNDECL(argv, argc); \
     handlebars_options_deinit(&options)
 
+HBS_ATTR_NONNULL_ALL
+static void flush_output(struct handlebars_vm * vm)
+{
+    if (hbs_str_len(vm->buffer) > 0) {
+        vm->output_func(vm, hbs_str_val(vm->buffer), hbs_str_len(vm->buffer), vm->output_ctx);
+        vm->output_written += hbs_str_len(vm->buffer);
+        vm->buffer = handlebars_string_truncate(vm->buffer, 0, 0);
+    }
+}
+
+HBS_ATTR_NONNULL_ALL
+static inline void maybe_flush_output(struct handlebars_vm * vm)
+{
+    if (unlikely(vm->output_active) && hbs_str_len(vm->buffer) >= vm->output_threshold) {
+        flush_output(vm);
+    }
+}
+
 HBS_ATTR_NONNULL_ALL
 static inline void append_to_buffer(struct handlebars_vm * vm, struct handlebars_value * result, bool escape)
 {
     vm->buffer = handlebars_value_expression_append(CONTEXT, result, vm->buffer, escape);
+    maybe_flush_output(vm);
+}
+
+// {{{ Tracing
+
+static uint64_t trace_begin(struct handlebars_vm * vm, enum handlebars_vm_trace_type type, const char * name, size_t name_len)
+{
+    struct handlebars_vm_trace_event event = {0};
+    event.type = type;
+    event.name = name;
+    event.name_len = name_len;
+    event.depth = vm->trace_depth++;
+    event.start_ns = handlebars_vm_clock_ns();
+    if (vm->trace_begin) {
+        vm->trace_begin(vm, &event, vm->trace_ctx);
+    }
+    return event.start_ns;
+}
+
+static void trace_end(
+    struct handlebars_vm * vm,
+    enum handlebars_vm_trace_type type,
+    const char * name,
+    size_t name_len,
+    uint64_t start_ns,
+    size_t bytes
+) {
+    struct handlebars_vm_trace_event event = {0};
+    event.type = type;
+    event.name = name;
+    event.name_len = name_len;
+    event.depth = --vm->trace_depth;
+    event.start_ns = start_ns;
+    event.duration_ns = handlebars_vm_clock_ns() - start_ns;
+    event.bytes = bytes;
+    if (vm->trace_end) {
+        vm->trace_end(vm, &event, vm->trace_ctx);
+    }
+}
+
+// End the event of a template, partial or helper that threw, then propagate the error to prev. Events nested in it
+// were ended by their own handlers, depth is what trace_depth was before the event began.
+HBS_ATTR_NORETURN
+static void trace_abort(
+    struct handlebars_vm * vm,
+    jmp_buf * prev,
+    long depth,
+    enum handlebars_vm_trace_type type,
+    const char * name,
+    size_t name_len,
+    uint64_t start_ns
+) {
+    HBSCTX(vm)->e->jmp = prev;
+    vm->trace_depth = depth + 1;
+    trace_end(vm, type, name, name_len, start_ns, 0);
+    longjmp(*prev, HBSCTX(vm)->e->num);
+}
+
+HBS_ATTR_NOINLINE
+static struct handlebars_value * call_helper_traced(
+    struct handlebars_vm * vm,
+    struct handlebars_value * fn,
+    int argc,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv
+) {
+    const char * name = options->name ? hbs_str_val(options->name) : "";
+    size_t name_len = options->name ? hbs_str_len(options->name) : 0;
+    size_t start_bytes = vm->output_written + hbs_str_len(vm->buffer);
+    long depth = vm->trace_depth;
+    jmp_buf * prev = HBSCTX(vm)->e->jmp;
+    jmp_buf buf;
+    uint64_t start_ns = trace_begin(vm, handlebars_vm_trace_type_helper, name, name_len);
+    struct handlebars_value * result;
+    size_t bytes;
+
+    if (handlebars_setjmp_ex(vm, &buf)) {
+        trace_abort(vm, prev, depth, handlebars_vm_trace_type_helper, name, name_len, start_ns);
+    }
+    result = handlebars_value_call(fn, argc, argv, options, vm, rv);
+    HBSCTX(vm)->e->jmp = prev;
+
+    bytes = result->type == HANDLEBARS_VALUE_TYPE_STRING ? hbs_str_len(handlebars_value_get_string(result)) : 0;
+    // Builtins may have appended their output to the buffer instead
+    bytes += vm->output_written + hbs_str_len(vm->buffer) - start_bytes;
+    trace_end(vm, handlebars_vm_trace_type_helper, name, name_len, start_ns, bytes);
+    return result;
+}
+
+// Call a helper found by one of the invoke opcodes, reporting it if tracing
+HBS_ATTR_NONNULL_ALL
+static inline struct handlebars_value * call_helper(
+    struct handlebars_vm * vm,
+    struct handlebars_value * fn,
+    int argc,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv
+) {
+    if (unlikely(vm->trace_active)) {
+        return call_helper_traced(vm, fn, argc, argv, options, rv);
+    }
+    return handlebars_value_call(fn, argc, argv, options, vm, rv);
+}
+
+// }}} Tracing
+
+// {{{ Direct append
+
+// Let a block helper append its output to vm->buffer itself, when it is a builtin that renders its programs verbatim
+// and its result would only be appended there by the next opcode. This saves copying the output of nested blocks
+// once per level.
+HBS_ATTR_NONNULL_ALL
+static inline void allow_append_direct(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * fn,
+    struct handlebars_options * options
+) {
+    handlebars_helper_func helper;
+
+    if (opcode[1].type != handlebars_opcode_type_append || fn->type != HANDLEBARS_VALUE_TYPE_HELPER) {
+        return;
+    }
+
+    helper = fn->v.helper;
+    if (helper == handlebars_builtin_if || helper == handlebars_builtin_unless || helper == handlebars_builtin_with ||
+            helper == handlebars_builtin_each || helper == handlebars_builtin_block_helper_missing) {
+        vm->append_options = options;
+    }
+}
+
+// }}} Direct append
+
+// {{{ Builtin blocks
+
+// Builtin block helpers, as bits of handlebars_vm::builtin_overrides
+#define BUILTIN_IF (1 << 0)
+#define BUILTIN_UNLESS (1 << 1)
+#define BUILTIN_WITH (1 << 2)
+#define BUILTIN_EACH (1 << 3)
+
+// Which of the given builtins are replaced by user helpers. Each is only looked up the first time in a render.
+HBS_ATTR_NONNULL_ALL
+static inline unsigned builtin_overrides(struct handlebars_vm * vm, unsigned builtins)
+{
+    static const char * names[] = {"if", "unless", "with", "each"};
+    unsigned unchecked = builtins & ~vm->builtin_checked;
+    size_t i;
+
+    if (unlikely(unchecked)) {
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if ((unchecked & (1u << i)) && handlebars_vm_helper_overridden(vm, names[i], strlen(names[i]))) {
+                vm->builtin_overrides |= 1u << i;
+            }
+        }
+        vm->builtin_checked |= unchecked;
+    }
+
+    return vm->builtin_overrides & builtins;
+}
+
+// Run a block of a builtin helper with one parameter and no hash. The options are built directly from the opcode,
+// and the builtin is called without looking it up and appends its output in place. If a user helper replaced the
+// builtin, it is called the way invokeKnownHelper would.
+HBS_ATTR_NONNULL_ALL
+static inline void invoke_builtin_block(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    handlebars_helper_func builtin,
+    unsigned builtins,
+    struct handlebars_value * argv
+) {
+    const int argc = 1;
+    struct handlebars_options options = {0};
+    struct handlebars_value * result;
+    struct handlebars_value * fn;
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(fnv);
+    HANDLEBARS_VALUE_ARRAY_DECL(extra, 3);
+
+    assert(opcode->op1.type == handlebars_operand_type_string);
+
+    options.name = opcode->op1.data.string.string;
+    options.program = opcode->op2.type == handlebars_operand_type_long ? opcode->op2.data.longval : -1;
+    options.inverse = opcode->op3.type == handlebars_operand_type_long ? opcode->op3.data.longval : -1;
+    options.hash = &extra[0];
+    setup_options_scope(vm, &options, &extra[1]);
+
+    if (likely(!builtin_overrides(vm, builtins))) {
+        // The builtins only look for optional hash entries, so the hash can stay null
+        vm->append_options = &options;
+        if (unlikely(vm->trace_active)) {
+            handlebars_value_helper(fnv, builtin);
+            result = call_helper(vm, fnv, argc, argv, &options, rv);
+        } else {
+            result = builtin(argc, argv, &options, vm, rv);
+        }
+        vm->append_options = NULL;
+    } else {
+        handlebars_value_map(options.hash, handlebars_map_ctor(CONTEXT, 0));
+        fn = lookup_helper(vm, options.name, fnv);
+        if (unlikely(fn == NULL)) {
+            handlebars_throw_ex(
+                CONTEXT,
+                HANDLEBARS_ERROR,
+                &opcode->loc,
+                "Invalid known helper: %.*s",
+                (int) hbs_str_len(options.name),
+                hbs_str_val(options.name)
+            );
+        }
+        result = call_helper(vm, fn, argc, argv, &options, rv);
+    }
+
+    append_to_buffer(vm, result, 0);
+
+    HANDLEBARS_VALUE_ARRAY_UNDECL(extra, 3);
+    handlebars_options_deinit(&options);
+    HANDLEBARS_VALUE_UNDECL(fnv);
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+// Pop the parameter of a builtin block and run it
+HBS_ATTR_NONNULL_ALL
+static inline void accept_builtin_block(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    handlebars_helper_func builtin,
+    unsigned builtins
+) {
+    HANDLEBARS_VALUE_DECL(value);
+
+    HBS_ASSERT(POP(vm->stack, value));
+    invoke_builtin_block(vm, opcode, builtin, builtins, value);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+
+// }}} Builtin blocks
+
+// Look up a path segment on a map using the inline cache. Entries are keyed by the segment operand, which is unique
+// per opcode and position in the path, so rows with the same layout hit the same slot and skip the hash table probe.
+HBS_ATTR_NONNULL_ALL
+static inline struct handlebars_value * inline_cache_map_find(
+    struct handlebars_vm * vm,
+    struct handlebars_operand_string * segment,
+    struct handlebars_value * value,
+    struct handlebars_value * rv
+) {
+    if (unlikely(value->type != HANDLEBARS_VALUE_TYPE_MAP)) {
+        return handlebars_value_map_find(value, segment->string, rv);
+    }
+
+    size_t pos = (size_t) (((uintptr_t) segment / sizeof(*segment)) % HANDLEBARS_VM_INLINE_CACHE_SIZE);
+    struct handlebars_vm_inline_cache_entry * entry = &vm->inline_cache[pos];
+    if (entry->segment != segment) {
+        entry->segment = segment;
+        entry->hint = 0;
+    }
+
+    struct handlebars_value * tmp = handlebars_map_find_ex(value->v.map, segment->string, &entry->hint);
+    if (tmp) {
+        handlebars_value_value(rv, tmp);
+        return rv;
+    }
+    return NULL;
+}
+
+HBS_ATTR_NONNULL_ALL
+static inline void set_last_context(struct handlebars_vm * vm, size_t depth)
+{
+    size_t length = LEN(vm->contextStack);
+
+    if( depth >= length ) {
+        handlebars_value_null(vm->last_context);
+    } else if( depth == 0 ) {
+        handlebars_value_value(vm->last_context, TOP(vm->contextStack));
+    } else {
+        handlebars_value_value(vm->last_context, GET(vm->contextStack, depth));
+    }
 }
 
 HBS_ATTR_NONNULL_ALL
@@ -361,7 +801,8 @@ static struct handlebars_string * execute_template(
                 use_delimiters ? vm->delim_close : NULL
             );
             if (indent) {
-                tmpl = handlebars_string_indent(CONTEXT, tmpl, indent);
+                // May become a cache key, so it must outlive the render arena
+                tmpl = handlebars_string_indent(HBSCTX(vm), tmpl, indent);
             }
         }
         struct handlebars_ast_node * ast = handlebars_parse_ex(parser, tmpl, vm->flags);
@@ -505,10 +946,25 @@ static struct handlebars_value * invoke_mustache_style_lambda_closure(HANDLEBARS
     return rv;
 }
 
+// Render an ambiguous block through blockHelperMissing, when its name did not resolve to a helper
+HBS_ATTR_NONNULL_ALL
+static inline struct handlebars_value * ambiguous_block_value(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv
+) {
+    struct handlebars_value * result;
 
-
-
-
+    if (opcode[1].type == handlebars_opcode_type_append && !handlebars_vm_helper_overridden(vm, HBS_STRL("blockHelperMissing"))) {
+        vm->append_options = options;
+    }
+    result = handlebars_vm_call_helper_str(HBS_STRL("blockHelperMissing"), 1, argv, options, vm, rv);
+    vm->append_options = NULL;
+    assert(result != NULL);
+    return result;
+}
 
 ACCEPT_FUNCTION(ambiguous_block_value)
 {
@@ -516,9 +972,7 @@ ACCEPT_FUNCTION(ambiguous_block_value)
 
     if( vm->last_helper == NULL ) {
         VM_SETUP_OPTIONS(1);
-        struct handlebars_value * result = handlebars_vm_call_helper_str(HBS_STRL("blockHelperMissing"), 1, argv, &options, vm, rv);
-        assert(result != NULL);
-        PUSH(vm->stack, result);
+        PUSH(vm->stack, ambiguous_block_value(vm, opcode, argv, &options, rv));
         VM_TEARDOWN_OPTIONS(1);
     } else if (hbs_str_eq_strl(vm->last_helper, HBS_STRL("lambda"))) {
         VM_SETUP_OPTIONS(0);
@@ -561,6 +1015,7 @@ ACCEPT_FUNCTION(append_content)
     assert(opcode->op1.type == handlebars_operand_type_string);
 
     vm->buffer = handlebars_string_append(CONTEXT, vm->buffer, HBS_STR_STRL(opcode->op1.data.string.string));
+    maybe_flush_output(vm);
 }
 
 ACCEPT_FUNCTION(assign_to_hash)
@@ -586,25 +1041,62 @@ ACCEPT_FUNCTION(assign_to_hash)
     HANDLEBARS_VALUE_UNDECL(hash);
 }
 
-ACCEPT_FUNCTION(block_value)
-{
-    const int argc = 1;
+// Render a block of a value that is not a helper through blockHelperMissing
+HBS_ATTR_NONNULL_ALL
+static inline void block_value(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * argv,
+    struct handlebars_options * options
+) {
     HANDLEBARS_VALUE_DECL(rv);
 
     assert(opcode->op1.type == handlebars_operand_type_string);
 
-    VM_SETUP_OPTIONS(argc);
-    options.name = opcode->op1.data.string.string;
+    options->name = opcode->op1.data.string.string;
 
-    struct handlebars_value * result = handlebars_vm_call_helper_str(HBS_STRL("blockHelperMissing"), argc, argv, &options, vm, rv);
+    if (!handlebars_vm_helper_overridden(vm, HBS_STRL("blockHelperMissing"))) {
+        vm->append_options = options;
+    }
+    struct handlebars_value * result = handlebars_vm_call_helper_str(HBS_STRL("blockHelperMissing"), 1, argv, options, vm, rv);
+    vm->append_options = NULL;
     if (likely(result != NULL)) {
         append_to_buffer(vm, result, 0);
     }
 
-    VM_TEARDOWN_OPTIONS(argc);
     HANDLEBARS_VALUE_UNDECL(rv);
 }
 
+ACCEPT_FUNCTION(block_value)
+{
+    const int argc = 1;
+
+    VM_SETUP_OPTIONS(argc);
+    block_value(vm, opcode, argv, &options);
+    VM_TEARDOWN_OPTIONS(argc);
+}
+
+ACCEPT_FUNCTION(block_if)
+{
+    accept_builtin_block(vm, opcode, handlebars_builtin_if, BUILTIN_IF);
+}
+
+ACCEPT_FUNCTION(block_unless)
+{
+    // Delegates to if
+    accept_builtin_block(vm, opcode, handlebars_builtin_unless, BUILTIN_UNLESS | BUILTIN_IF);
+}
+
+ACCEPT_FUNCTION(block_with)
+{
+    accept_builtin_block(vm, opcode, handlebars_builtin_with, BUILTIN_WITH);
+}
+
+ACCEPT_FUNCTION(block_each)
+{
+    accept_builtin_block(vm, opcode, handlebars_builtin_each, BUILTIN_EACH);
+}
+
 ACCEPT_FUNCTION(empty_hash)
 {
     HANDLEBARS_VALUE_DECL(value);
@@ -620,38 +1112,31 @@ ACCEPT_FUNCTION(get_context)
     assert(opcode->type == handlebars_opcode_type_get_context);
     assert(opcode->op1.type == handlebars_operand_type_long);
 
-    size_t depth = (size_t) opcode->op1.data.longval;
-    size_t length = LEN(vm->contextStack);
-
-    if( depth >= length ) {
-        handlebars_value_null(vm->last_context);
-    } else if( depth == 0 ) {
-        handlebars_value_value(vm->last_context, TOP(vm->contextStack));
-    } else {
-        handlebars_value_value(vm->last_context, GET(vm->contextStack, depth));
-    }
+    set_last_context(vm, (size_t) opcode->op1.data.longval);
 }
 
-ACCEPT_FUNCTION(invoke_ambiguous)
-{
-    HANDLEBARS_VALUE_DECL(rv);
-    HANDLEBARS_VALUE_DECL(value);
-    HANDLEBARS_VALUE_DECL(fnv);
+// Call the helper named by an ambiguous mustache or block, or the value its name resolved to if that is callable.
+// Returns the value to use in its place.
+HBS_ATTR_NONNULL(1, 2, 3, 5, 6, 7)
+static inline struct handlebars_value * invoke_ambiguous(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * value,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv,
+    struct handlebars_value * fnv
+) {
     struct handlebars_value * result;
     struct handlebars_value * fn;
     struct handlebars_string * last_helper = NULL;
-
-    HBS_ASSERT(POP(vm->stack, value));
     const int argc = 0;
     bool is_callable = handlebars_value_is_callable(value);
 
-    ACCEPT_FN(empty_hash)(vm, opcode);
-
     assert(opcode->op1.type == handlebars_operand_type_string);
     assert(opcode->op2.type == handlebars_operand_type_boolean);
 
-    VM_SETUP_OPTIONS(argc);
-    options.name = opcode->op1.data.string.string;
+    options->name = opcode->op1.data.string.string;
     vm->last_helper = NULL;
 
     if (vm->flags & handlebars_compiler_flag_mustache_style_lambdas && is_callable) {
@@ -673,10 +1158,10 @@ ACCEPT_FUNCTION(invoke_ambiguous)
         handlebars_string_addref(last_helper);
 
         HANDLEBARS_VALUE_ARRAY_UNDECL(closure_localv, closure_localc);
-    } else if( NULL != (fn = lookup_helper(vm, options.name, fnv)) ) {
-        last_helper = options.name;
+    } else if( NULL != (fn = lookup_helper(vm, options->name, fnv)) ) {
+        last_helper = options->name;
         handlebars_string_addref(last_helper);
-    } else if (value && is_callable) {
+    } else if (is_callable) {
         fn = value;
     } else {
         struct handlebars_string * tmp_str = handlebars_string_ctor(CONTEXT, HBS_STRL("helperMissing"));
@@ -684,43 +1169,57 @@ ACCEPT_FUNCTION(invoke_ambiguous)
         handlebars_string_delref(tmp_str);
     }
 
-    result = handlebars_value_call(fn, argc, argv, &options, vm, rv);
+    result = call_helper(vm, fn, argc, argv, options, rv);
+
+    vm->last_helper = last_helper;
 
     // Before, the null case was only done for helperMissing
-    if (result->type != HANDLEBARS_VALUE_TYPE_NULL) {
-        PUSH(vm->stack, result);
-    } else {
-        PUSH(vm->stack, value);
-    }
+    return result->type != HANDLEBARS_VALUE_TYPE_NULL ? result : value;
+}
 
-    vm->last_helper = last_helper;
+ACCEPT_FUNCTION(invoke_ambiguous)
+{
+    const int argc = 0;
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(value);
+    HANDLEBARS_VALUE_DECL(fnv);
 
+    HBS_ASSERT(POP(vm->stack, value));
+    ACCEPT_FN(empty_hash)(vm, opcode);
+
+    VM_SETUP_OPTIONS(argc);
+    PUSH(vm->stack, invoke_ambiguous(vm, opcode, value, argv, &options, rv, fnv));
     VM_TEARDOWN_OPTIONS(argc);
+
     HANDLEBARS_VALUE_UNDECL(fnv);
     HANDLEBARS_VALUE_UNDECL(value);
     HANDLEBARS_VALUE_UNDECL(rv);
 }
 
-ACCEPT_FUNCTION(invoke_helper)
-{
-    HANDLEBARS_VALUE_DECL(value);
-    HANDLEBARS_VALUE_DECL(rv);
-    HANDLEBARS_VALUE_DECL(fnv);
+// Call the helper of a helper mustache or block, the value its path resolved to if the name is not a simple helper
+// name, or helperMissing. Returns the result.
+HBS_ATTR_NONNULL(1, 2, 3, 6, 7, 8)
+static inline struct handlebars_value * invoke_helper(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * value,
+    int argc,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv,
+    struct handlebars_value * fnv
+) {
+    struct handlebars_value * result;
     struct handlebars_value * fn;
 
-    HBS_ASSERT(POP(vm->stack, value));
-
-    assert(opcode->op1.type == handlebars_operand_type_long);
     assert(opcode->op2.type == handlebars_operand_type_string);
     assert(opcode->op3.type == handlebars_operand_type_boolean);
 
-    int argc = (int) opcode->op1.data.longval;
-    VM_SETUP_OPTIONS(argc);
-    options.name = opcode->op2.data.string.string;
+    options->name = opcode->op2.data.string.string;
 
-    if (opcode->op3.data.boolval && NULL != (fn = lookup_helper(vm, options.name, fnv))) { // isSimple
+    if (opcode->op3.data.boolval && NULL != (fn = lookup_helper(vm, options->name, fnv))) { // isSimple
         // fallthrough
-    } else if (value && handlebars_value_is_callable(value)) {
+    } else if (handlebars_value_is_callable(value)) {
         fn = value;
     } else {
         struct handlebars_string * tmp_str = handlebars_string_ctor(CONTEXT, HBS_STRL("helperMissing"));
@@ -728,27 +1227,51 @@ ACCEPT_FUNCTION(invoke_helper)
         handlebars_string_delref(tmp_str);
     }
 
-    PUSH(vm->stack, handlebars_value_call(fn, argc, argv, &options, vm, rv));
+    allow_append_direct(vm, opcode, fn, options);
+    result = call_helper(vm, fn, argc, argv, options, rv);
+    vm->append_options = NULL;
 
-    VM_TEARDOWN_OPTIONS(argc);
-    HANDLEBARS_VALUE_UNDECL(fnv);
-    HANDLEBARS_VALUE_UNDECL(rv);
-    HANDLEBARS_VALUE_UNDECL(value);
+    return result;
 }
 
-ACCEPT_FUNCTION(invoke_known_helper)
+ACCEPT_FUNCTION(invoke_helper)
 {
+    HANDLEBARS_VALUE_DECL(value);
     HANDLEBARS_VALUE_DECL(rv);
     HANDLEBARS_VALUE_DECL(fnv);
 
+    HBS_ASSERT(POP(vm->stack, value));
+
     assert(opcode->op1.type == handlebars_operand_type_long);
-    assert(opcode->op2.type == handlebars_operand_type_string);
 
     int argc = (int) opcode->op1.data.longval;
     VM_SETUP_OPTIONS(argc);
-    options.name = opcode->op2.data.string.string;
+    PUSH(vm->stack, invoke_helper(vm, opcode, value, argc, argv, &options, rv, fnv));
+    VM_TEARDOWN_OPTIONS(argc);
+
+    HANDLEBARS_VALUE_UNDECL(fnv);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+
+// Call a helper that was known at compile time. Returns the result.
+HBS_ATTR_NONNULL(1, 2, 5, 6, 7)
+static inline struct handlebars_value * invoke_known_helper(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    int argc,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv,
+    struct handlebars_value * fnv
+) {
+    struct handlebars_value * result;
+
+    assert(opcode->op2.type == handlebars_operand_type_string);
 
-    struct handlebars_value * fn = lookup_helper(vm, options.name, fnv);
+    options->name = opcode->op2.data.string.string;
+
+    struct handlebars_value * fn = lookup_helper(vm, options->name, fnv);
 
     if (unlikely(fn == NULL)) {
         handlebars_throw_ex(
@@ -756,24 +1279,78 @@ ACCEPT_FUNCTION(invoke_known_helper)
             HANDLEBARS_ERROR,
             &opcode->loc,
             "Invalid known helper: %.*s",
-            (int) hbs_str_len(options.name),
-            hbs_str_val(options.name)
+            (int) hbs_str_len(options->name),
+            hbs_str_val(options->name)
         );
     }
 
-    PUSH(vm->stack, handlebars_value_call(fn, argc, argv, &options, vm, rv));
+    allow_append_direct(vm, opcode, fn, options);
+    result = call_helper(vm, fn, argc, argv, options, rv);
+    vm->append_options = NULL;
+
+    return result;
+}
+
+ACCEPT_FUNCTION(invoke_known_helper)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(fnv);
 
+    assert(opcode->op1.type == handlebars_operand_type_long);
+
+    int argc = (int) opcode->op1.data.longval;
+    VM_SETUP_OPTIONS(argc);
+    PUSH(vm->stack, invoke_known_helper(vm, opcode, argc, argv, &options, rv, fnv));
     VM_TEARDOWN_OPTIONS(argc);
+
     HANDLEBARS_VALUE_UNDECL(fnv);
     HANDLEBARS_VALUE_UNDECL(rv);
 }
 
-ACCEPT_FUNCTION(invoke_partial)
-{
+HBS_ATTR_NOINLINE
+static struct handlebars_string * call_partial_traced(
+    struct handlebars_vm * vm,
+    struct handlebars_value * partial,
+    struct handlebars_string * name,
+    int argc,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * rv
+) {
+    const char * name_str = name ? hbs_str_val(name) : "";
+    size_t name_len = name ? hbs_str_len(name) : 0;
+    long depth = vm->trace_depth;
+    jmp_buf * prev = HBSCTX(vm)->e->jmp;
+    jmp_buf buf;
+    uint64_t start_ns = trace_begin(vm, handlebars_vm_trace_type_partial, name_str, name_len);
+    struct handlebars_string * buffer;
+
+    if (handlebars_setjmp_ex(vm, &buf)) {
+        trace_abort(vm, prev, depth, handlebars_vm_trace_type_partial, name_str, name_len, start_ns);
+    }
+    buffer = handlebars_value_expression(
+        CONTEXT,
+        handlebars_value_call(partial, argc, argv, options, vm, rv),
+        false
+    );
+    HBSCTX(vm)->e->jmp = prev;
+
+    trace_end(vm, handlebars_vm_trace_type_partial, name_str, name_len, start_ns, hbs_str_len(buffer));
+    return buffer;
+}
+
+// Render a partial, or the partial named by dynamic_name for dynamic partials, into the buffer
+HBS_ATTR_NONNULL(1, 2, 3, 4)
+static inline void invoke_partial(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * argv,
+    struct handlebars_options * options,
+    struct handlebars_value * dynamic_name
+) {
     const int argc = 1;
     struct handlebars_string * name = NULL;
     struct handlebars_value * partial = NULL;
-    HANDLEBARS_VALUE_DECL(tmp);
     HANDLEBARS_VALUE_DECL(partial_rv);
     HANDLEBARS_VALUE_DECL(rv);
     HANDLEBARS_VALUE_DECL(partial_block);
@@ -784,13 +1361,10 @@ ACCEPT_FUNCTION(invoke_partial)
     assert(opcode->op2.type == handlebars_operand_type_string || opcode->op2.type == handlebars_operand_type_null || opcode->op2.type == handlebars_operand_type_long);
     assert(opcode->op3.type == handlebars_operand_type_string);
 
-    VM_SETUP_OPTIONS(argc);
-
-    if( opcode->op1.data.boolval ) {
+    if( dynamic_name ) {
         // Dynamic partial
-        HBS_ASSERT(POP(vm->stack, tmp));
-        name = handlebars_value_get_string(tmp);
-        options.name = NULL; // fear
+        name = handlebars_value_get_string(dynamic_name);
+        options->name = NULL; // fear
     } else {
         if( opcode->op2.type == handlebars_operand_type_long ) {
             char tmp_str[32];
@@ -812,11 +1386,11 @@ ACCEPT_FUNCTION(invoke_partial)
     }
 
     // Push partial block
-    if (options.program > 0) {
+    if (options->program > 0) {
         const int closure_localc = 3;
         HANDLEBARS_VALUE_ARRAY_DECL(closure_localv, closure_localc);
         handlebars_value_ptr(&closure_localv[0], handlebars_ptr_ctor(CONTEXT, struct handlebars_module, vm->module, true));
-        handlebars_value_integer(&closure_localv[1], options.program);
+        handlebars_value_integer(&closure_localv[1], options->program);
         handlebars_value_integer(&closure_localv[2], LEN(vm->partialBlockStack));
         handlebars_value_closure(partial_block, handlebars_closure_ctor(vm, invoke_partial_block_closure, closure_localc, closure_localv));
         pushed_partial_block = true;
@@ -825,10 +1399,10 @@ ACCEPT_FUNCTION(invoke_partial)
     }
 
     // Merge hashes
-    merge_hash(HBSCTX(vm), &argv[0], options.hash);
+    merge_hash(HBSCTX(vm), &argv[0], options->hash);
 
     if (!partial) {
-        if (options.program >= 0) {
+        if (options->program >= 0) {
             partial = partial_block;
         } else if (vm->flags & handlebars_compiler_flag_compat) {
             goto done;
@@ -871,17 +1445,22 @@ ACCEPT_FUNCTION(invoke_partial)
 
     // Finally, call the partial
     do {
-        buffer = handlebars_value_expression(
-            CONTEXT,
-            handlebars_value_call(partial, argc, argv, &options, vm, rv),
-            false
-        );
+        if (unlikely(vm->trace_active)) {
+            buffer = call_partial_traced(vm, partial, name, argc, argv, options, rv);
+        } else {
+            buffer = handlebars_value_expression(
+                CONTEXT,
+                handlebars_value_call(partial, argc, argv, options, vm, rv),
+                false
+            );
+        }
 
         if (vm->flags & handlebars_compiler_flag_compat) {
             vm->buffer = handlebars_string_append_str(CONTEXT, vm->buffer, buffer);
         } else {
             vm->buffer = handlebars_string_indent_append(HBSCTX(vm), vm->buffer, buffer, opcode->op3.data.string.string);
         }
+        maybe_flush_output(vm);
     } while (0);
 
 done:
@@ -892,17 +1471,34 @@ done:
         HANDLEBARS_VALUE_UNDECL(closure_value);
     }
 
-    VM_TEARDOWN_OPTIONS(argc);
     HANDLEBARS_VALUE_UNDECL(partial_block);
     HANDLEBARS_VALUE_UNDECL(rv);
     HANDLEBARS_VALUE_UNDECL(partial_rv);
+}
+
+ACCEPT_FUNCTION(invoke_partial)
+{
+    const int argc = 1;
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    assert(opcode->op1.type == handlebars_operand_type_boolean);
+
+    VM_SETUP_OPTIONS(argc);
+    if( opcode->op1.data.boolval ) {
+        HBS_ASSERT(POP(vm->stack, tmp));
+    }
+    invoke_partial(vm, opcode, argv, &options, opcode->op1.data.boolval ? tmp : NULL);
+    VM_TEARDOWN_OPTIONS(argc);
+
     HANDLEBARS_VALUE_UNDECL(tmp);
 }
 
-ACCEPT_FUNCTION(lookup_block_param)
+// Resolve a block param into value, which must be null
+HBS_ATTR_NONNULL_ALL
+static inline void lookup_block_param(struct handlebars_vm * vm, struct handlebars_opcode * opcode, struct handlebars_value * value)
 {
-    long blockParam1 = -1;
-    long blockParam2 = -1;
+    long blockParam1;
+    long blockParam2;
     struct handlebars_value * v1 = NULL;
     size_t arr_len;
     struct handlebars_operand_string * arr;
@@ -910,15 +1506,15 @@ ACCEPT_FUNCTION(lookup_block_param)
     HANDLEBARS_VALUE_DECL(empty_value);
     HANDLEBARS_VALUE_DECL(v2_rv);
     HANDLEBARS_VALUE_DECL(rv);
-    HANDLEBARS_VALUE_DECL(value);
     struct handlebars_value * v2 = NULL;
 
     assert(opcode->op1.type == handlebars_operand_type_array);
     assert(opcode->op2.type == handlebars_operand_type_array);
 
-    sscanf(hbs_str_val(opcode->op1.data.array.array[0].string), "%ld", &blockParam1);
-    sscanf(hbs_str_val(opcode->op1.data.array.array[1].string), "%ld", &blockParam2);
+    blockParam1 = opcode->op1.data.array.array[0].index;
+    blockParam2 = opcode->op1.data.array.array[1].index;
 
+    if( blockParam1 < 0 || blockParam2 < 0 ) goto done;
     if( blockParam1 >= (long) LEN(vm->blockParamStack) ) goto done;
 
     v1 = GET(vm->blockParamStack, blockParam1);
@@ -949,19 +1545,25 @@ ACCEPT_FUNCTION(lookup_block_param)
     }
 
 done:
-    PUSH(vm->stack, value);
-
-    HANDLEBARS_VALUE_UNDECL(value);
     HANDLEBARS_VALUE_UNDECL(rv);
     HANDLEBARS_VALUE_UNDECL(v2_rv);
     HANDLEBARS_VALUE_UNDECL(empty_value);
 }
 
-ACCEPT_FUNCTION(lookup_data)
+ACCEPT_FUNCTION(lookup_block_param)
+{
+    HANDLEBARS_VALUE_DECL(value);
+    lookup_block_param(vm, opcode, value);
+    PUSH(vm->stack, value);
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+
+// Resolve a @data path into val, which must be null
+HBS_ATTR_NONNULL_ALL
+static inline void lookup_data(struct handlebars_vm * vm, struct handlebars_opcode * opcode, struct handlebars_value * val)
 {
     HANDLEBARS_VALUE_DECL(rv);
     HANDLEBARS_VALUE_DECL(data);
-    HANDLEBARS_VALUE_DECL(val);
     struct handlebars_value * tmp;
 
     assert(opcode->op1.type == handlebars_operand_type_long);
@@ -978,17 +1580,27 @@ ACCEPT_FUNCTION(lookup_data)
     size_t i;
     struct handlebars_operand_string * arr = opcode->op2.data.array.array;
     struct handlebars_operand_string * first = arr;
+    struct handlebars_vm_data_frame * frame = vm->data_frame;
 
-    if( depth && data ) {
-        while( data && depth-- ) {
-            tmp = handlebars_value_map_str_find(data, HBS_STRL("_parent"), rv);
-            if (tmp != NULL) {
-                handlebars_value_value(data, tmp);
-            }
+    // Each ../ names the iteration of an enclosing #each. The data a frame extends is the data of the level above it,
+    // so past the outermost #each this is the root data
+    for( ; frame && depth > 0; depth-- ) {
+        handlebars_value_value(data, frame->data);
+        frame = frame->parent;
+    }
+
+    // Any remaining levels are above the root data
+    for( ; depth > 0; depth-- ) {
+        tmp = handlebars_value_map_str_find(data, HBS_STRL("_parent"), rv);
+        if( tmp == NULL ) {
+            goto done_and_null;
         }
+        handlebars_value_value(data, tmp);
     }
 
-    if( data && (tmp = handlebars_value_map_find(data, first->string, rv)) ) {
+    if( frame && (tmp = data_frame_find(frame, first->string)) ) {
+        handlebars_value_value(val, tmp);
+    } else if( data && (tmp = handlebars_value_map_find(data, first->string, rv)) ) {
         handlebars_value_value(val, tmp);
     } else if (hbs_str_eq_strl(first->string, HBS_STRL("root"))) {
         handlebars_value_value(val, TOP(vm->contextStack));
@@ -1024,47 +1636,53 @@ ACCEPT_FUNCTION(lookup_data)
         }
     }
 
-    PUSH(vm->stack, val);
-
-    HANDLEBARS_VALUE_UNDECL(val);
     HANDLEBARS_VALUE_UNDECL(data);
     HANDLEBARS_VALUE_UNDECL(rv);
 }
 
-ACCEPT_FUNCTION(lookup_on_context)
+ACCEPT_FUNCTION(lookup_data)
 {
-    HANDLEBARS_VALUE_DECL(empty_value);
-    HANDLEBARS_VALUE_DECL(rv);
-    HANDLEBARS_VALUE_DECL(rv2);
+    HANDLEBARS_VALUE_DECL(val);
+    lookup_data(vm, opcode, val);
+    PUSH(vm->stack, val);
+    HANDLEBARS_VALUE_UNDECL(val);
+}
+
+// Walk the path in op1 starting from the last context. Returns NULL if the path does not resolve and the strict
+// flags permit it. Intermediate values are written to rv and rv2.
+HBS_ATTR_NONNULL_ALL
+static inline struct handlebars_value * lookup_on_context(
+    struct handlebars_vm * vm,
+    struct handlebars_opcode * opcode,
+    struct handlebars_value * rv,
+    struct handlebars_value * rv2
+) {
     struct handlebars_value * value;
 
     assert(opcode->op1.type == handlebars_operand_type_array);
-    assert(opcode->op2.type == handlebars_operand_type_boolean || opcode->op2.type == handlebars_operand_type_null);
     assert(opcode->op3.type == handlebars_operand_type_boolean || opcode->op3.type == handlebars_operand_type_null);
     assert(opcode->op4.type == handlebars_operand_type_boolean || opcode->op4.type == handlebars_operand_type_null);
 
     size_t arr_len = opcode->op1.data.array.count;
     struct handlebars_operand_string * arr = opcode->op1.data.array.array;
     struct handlebars_operand_string * arr_end = arr + arr_len;
-    long index = -1;
     bool is_strict = (vm->flags & handlebars_compiler_flag_strict) || (vm->flags & handlebars_compiler_flag_assume_objects);
     bool require_terminal = (vm->flags & handlebars_compiler_flag_strict) && opcode->op3.data.boolval;
 
     if( !opcode->op4.data.boolval && (vm->flags & handlebars_compiler_flag_compat) ) {
         depthed_lookup(vm, arr->string);
+        value = HBS_ASSERT(POP(vm->stack, rv));
     } else {
-        ACCEPT_FN(push_context)(vm, opcode);
+        value = vm->last_context;
     }
 
-    value = HBS_ASSERT(POP(vm->stack, rv));
-
     do {
         bool is_last = arr == arr_end - 1;
         if( handlebars_value_get_type(value) == HANDLEBARS_VALUE_TYPE_MAP ) {
-            value = handlebars_value_map_find(value, arr->string, rv2);
+            value = inline_cache_map_find(vm, arr, value, rv2);
         } else if( handlebars_value_get_type(value) == HANDLEBARS_VALUE_TYPE_ARRAY ) {
-            if (sscanf(hbs_str_val(arr->string), "%ld", &index)) {
-                value = handlebars_value_array_find(value, index, rv2);
+            if (arr->index >= 0) {
+                value = handlebars_value_array_find(value, arr->index, rv2);
             } else {
                 value = NULL;
             }
@@ -1081,30 +1699,110 @@ ACCEPT_FUNCTION(lookup_on_context)
         }
     } while( ++arr < arr_end );
 
-    if( value == NULL ) {
-        done_and_null:
-        if( require_terminal ) {
-            done_and_err:
-            handlebars_throw_ex(
-                CONTEXT,
-                HANDLEBARS_ERROR,
-                &opcode->loc,
-                "\"%.*s\" not defined in object",
-                (int) hbs_str_len(arr->string),
-                hbs_str_val(arr->string)
-            );
-        } else {
-            value = empty_value;
-        }
+    return value;
+
+done_and_null:
+    if( !require_terminal ) {
+        return NULL;
     }
+done_and_err:
+    handlebars_throw_ex(
+        CONTEXT,
+        HANDLEBARS_ERROR,
+        &opcode->loc,
+        "\"%.*s\" not defined in object",
+        (int) hbs_str_len(arr->string),
+        hbs_str_val(arr->string)
+    );
+}
 
-    PUSH(vm->stack, value);
+ACCEPT_FUNCTION(lookup_on_context)
+{
+    HANDLEBARS_VALUE_DECL(empty_value);
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(rv2);
+
+    assert(opcode->op2.type == handlebars_operand_type_boolean || opcode->op2.type == handlebars_operand_type_null);
+
+    struct handlebars_value * value = lookup_on_context(vm, opcode, rv, rv2);
+    PUSH(vm->stack, value ? value : empty_value);
 
     HANDLEBARS_VALUE_UNDECL(rv2);
     HANDLEBARS_VALUE_UNDECL(rv);
     HANDLEBARS_VALUE_UNDECL(empty_value);
 }
 
+// Call value with the current context if it is callable. Returns the result in rv, or value if it is not callable.
+HBS_ATTR_NONNULL_ALL
+static inline struct handlebars_value * resolve_possible_lambda(
+    struct handlebars_vm * vm,
+    struct handlebars_value * value,
+    struct handlebars_value * rv
+) {
+    if( handlebars_value_is_callable(value) ) {
+        HANDLEBARS_VALUE_DECL(fn);
+        struct handlebars_value * result;
+        // This should really use the same options object as invoke*
+        struct handlebars_options options = {0};
+        const int argc = 1;
+        HANDLEBARS_VALUE_ARRAY_DECL(argv, argc);
+        // Value may be vm->last_context, which the lambda can replace while it runs
+        handlebars_value_value(fn, value);
+        handlebars_value_value(&argv[0], TOP(vm->contextStack));
+        options.scope = &argv[0];
+        result = handlebars_value_call(fn, argc, argv, &options, vm, rv);
+        if( result != rv ) {
+            handlebars_value_value(rv, result);
+        }
+        HANDLEBARS_VALUE_ARRAY_UNDECL(argv, argc);
+        handlebars_options_deinit(&options);
+        HANDLEBARS_VALUE_UNDECL(fn);
+        return rv;
+    }
+
+    return value;
+}
+
+// Superinstruction for `getContext, lookupOnContext|pushContext, resolvePossibleLambda, append|appendEscaped`,
+// see fuse_opcodes() in the serializer. A null op1 means the context itself.
+HBS_ATTR_NONNULL_ALL
+static inline void lookup_and_append(struct handlebars_vm * vm, struct handlebars_opcode * opcode, bool escape)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(rv2);
+    HANDLEBARS_VALUE_DECL(rv3);
+    struct handlebars_value * value;
+
+    assert(opcode->op2.type == handlebars_operand_type_long);
+
+    set_last_context(vm, (size_t) opcode->op2.data.longval);
+
+    if( opcode->op1.type == handlebars_operand_type_null ) {
+        value = vm->last_context;
+    } else {
+        value = lookup_on_context(vm, opcode, rv, rv2);
+    }
+
+    // Appending an empty value is a no-op
+    if( value != NULL ) {
+        append_to_buffer(vm, resolve_possible_lambda(vm, value, rv3), escape);
+    }
+
+    HANDLEBARS_VALUE_UNDECL(rv3);
+    HANDLEBARS_VALUE_UNDECL(rv2);
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+ACCEPT_FUNCTION(lookup_and_append)
+{
+    lookup_and_append(vm, opcode, 0);
+}
+
+ACCEPT_FUNCTION(lookup_and_append_escaped)
+{
+    lookup_and_append(vm, opcode, 1);
+}
+
 ACCEPT_FUNCTION(pop_hash)
 {
     HANDLEBARS_VALUE_DECL(hash);
@@ -1145,10 +1843,10 @@ ACCEPT_FUNCTION(push_program)
     HANDLEBARS_VALUE_UNDECL(value);
 }
 
-ACCEPT_FUNCTION(push_literal)
+// Set value to the literal in op1, undefined and null are left null
+HBS_ATTR_NONNULL_ALL
+static inline void literal_value(struct handlebars_opcode * opcode, struct handlebars_value * value)
 {
-    HANDLEBARS_VALUE_DECL(value);
-
     switch( opcode->op1.type ) {
         case handlebars_operand_type_string:
             if (hbs_str_eq_strl(opcode->op1.data.string.string, HBS_STRL("undefined"))) {
@@ -1172,7 +1870,13 @@ ACCEPT_FUNCTION(push_literal)
             assert(0);
             break;
     }
+}
+
+ACCEPT_FUNCTION(push_literal)
+{
+    HANDLEBARS_VALUE_DECL(value);
 
+    literal_value(opcode, value);
     PUSH(vm->stack, value);
 
     HANDLEBARS_VALUE_UNDECL(value);
@@ -1193,65 +1897,431 @@ ACCEPT_FUNCTION(push_string)
 ACCEPT_FUNCTION(resolve_possible_lambda)
 {
     HANDLEBARS_VALUE_DECL(value);
+    HANDLEBARS_VALUE_DECL(rv);
 
     HBS_ASSERT(POP(vm->stack, value));
+    PUSH(vm->stack, resolve_possible_lambda(vm, value, rv));
 
-    if( handlebars_value_is_callable(value) ) {
-        HANDLEBARS_VALUE_DECL(rv);
-        // This should really use the same options object as invoke*
-        struct handlebars_options options = {0};
-        const int argc = 1;
-        HANDLEBARS_VALUE_ARRAY_DECL(argv, argc);
-        handlebars_value_value(&argv[0], TOP(vm->contextStack));
-        options.scope = &argv[0];
-        PUSH(vm->stack, handlebars_value_call(value, argc, argv, &options, vm, rv));
-        HANDLEBARS_VALUE_ARRAY_UNDECL(argv, argc);
-        handlebars_options_deinit(&options);
-        HANDLEBARS_VALUE_UNDECL(rv);
-    } else {
-        PUSH(vm->stack, value);
-    }
-
+    HANDLEBARS_VALUE_UNDECL(rv);
     HANDLEBARS_VALUE_UNDECL(value);
 }
 
-static void handlebars_vm_accept(struct handlebars_vm * vm, struct handlebars_module_table_entry * entry)
+// {{{ Registers
+
+// Programs lowered by the serializer (handlebars_compiler_flag_registers) keep their operands in a frame of registers
+// instead of on vm->stack and vm->hashStack. Each opcode names the first register it reads or writes in opcode->reg,
+// so operands are read in place and helpers get their arguments straight from the frame. The context, block param
+// and partial block stacks are shared with the stack machine.
+
+#define REGISTER_FN(name) accept_register_ ## name
+#define REGISTER_FUNCTION(name) static inline void REGISTER_FN(name) ( \
+    struct handlebars_vm * vm, \
+    struct handlebars_opcode * opcode, \
+    struct handlebars_value * regs \
+)
+#define REG(n) HANDLEBARS_VALUE_ARRAY_AT(regs, n)
+
+// Release the registers in [from, to)
+HBS_ATTR_NONNULL_ALL
+static inline void clear_registers(struct handlebars_value * regs, int from, int to)
 {
-#if 0
-#define ACCEPT_DEBUG() \
-    do { \
-        struct handlebars_string * tmp = handlebars_opcode_print(HBSCTX(vm), opcode, 0); \
-        fprintf(stdout, "V[%ld] P[%ld] OPCODE: %.*s\n", vm->depth, entry->guid, (int) hbs_str_len(tmp), hbs_str_val(tmp)); \
-        talloc_free(tmp); \
-    } while (0)
-#else
-#define ACCEPT_DEBUG()
-#endif
-#define ACCEPT_ERROR handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Unhandled opcode: %s\n", handlebars_opcode_readable_type(opcode->type));
-#if HAVE_COMPUTED_GOTOS
+    for( ; from < to; from++ ) {
+        handlebars_value_null(REG(from));
+    }
+}
+
+// Set a register to a result, which may belong to the value the register held
+HBS_ATTR_NONNULL_ALL
+static inline void set_register(struct handlebars_value * reg, struct handlebars_value * value)
+{
+    if( reg != value ) {
+        HANDLEBARS_VALUE_DECL(tmp);
+        handlebars_value_value(tmp, value);
+        handlebars_value_null(reg);
+        *reg = *tmp;
+        handlebars_value_init(tmp);
+        HANDLEBARS_VALUE_UNDECL(tmp);
+    }
+}
+
+// Set up options from the program, inverse and hash registers, using two values of mem
+static inline void setup_register_options(
+    struct handlebars_vm * vm,
+    struct handlebars_options * options,
+    struct handlebars_value * programs,
+    struct handlebars_value * mem
+) {
+    options->program = handlebars_value_get_intval(HANDLEBARS_VALUE_ARRAY_AT(programs, 0));
+    options->inverse = handlebars_value_get_intval(HANDLEBARS_VALUE_ARRAY_AT(programs, 1));
+    options->hash = HANDLEBARS_VALUE_ARRAY_AT(programs, 2);
+    setup_options_scope(vm, options, mem);
+}
+
+#define VM_SETUP_REGISTER_OPTIONS(programs) \
+    struct handlebars_options options = {0}; \
+    HANDLEBARS_VALUE_ARRAY_DECL(extra, 2); \
+    setup_register_options(vm, &options, programs, extra)
+
+// Also releases the hash register
+#define VM_TEARDOWN_REGISTER_OPTIONS() \
+    HANDLEBARS_VALUE_ARRAY_UNDECL(extra, 2); \
+    handlebars_options_deinit(&options)
+
+REGISTER_FUNCTION(ambiguous_block_value)
+{
+    struct handlebars_value * value = REG(opcode->reg);
+
+    if( vm->last_helper == NULL ) {
+        HANDLEBARS_VALUE_DECL(rv);
+        VM_SETUP_REGISTER_OPTIONS(REG(opcode->reg + 1));
+        set_register(value, ambiguous_block_value(vm, opcode, value, &options, rv));
+        VM_TEARDOWN_REGISTER_OPTIONS();
+        HANDLEBARS_VALUE_UNDECL(rv);
+    } else if (hbs_str_eq_strl(vm->last_helper, HBS_STRL("lambda"))) {
+        handlebars_string_delref(vm->last_helper);
+        vm->last_helper = NULL;
+    }
+
+    clear_registers(regs, opcode->reg + 1, opcode->reg + 4);
+}
+
+REGISTER_FUNCTION(append)
+{
+    if( likely(opcode->reg >= 0) ) {
+        append_to_buffer(vm, REG(opcode->reg), 0);
+        handlebars_value_null(REG(opcode->reg));
+    }
+}
+
+REGISTER_FUNCTION(append_escaped)
+{
+    if( likely(opcode->reg >= 0) ) {
+        append_to_buffer(vm, REG(opcode->reg), 1);
+        handlebars_value_null(REG(opcode->reg));
+    }
+}
+
+REGISTER_FUNCTION(assign_to_hash)
+{
+    struct handlebars_value * hash = REG(opcode->op2.data.longval);
+
+    assert(opcode->op1.type == handlebars_operand_type_string);
+    assert(opcode->op2.type == handlebars_operand_type_long);
+    assert(handlebars_value_get_type(hash) == HANDLEBARS_VALUE_TYPE_MAP);
+
+    struct handlebars_map * map = handlebars_value_get_map(hash);
+    map = handlebars_map_update(map, opcode->op1.data.string.string, REG(opcode->reg));
+    handlebars_value_map(hash, map);
+    handlebars_value_null(REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(block_value)
+{
+    VM_SETUP_REGISTER_OPTIONS(REG(opcode->reg + 1));
+    block_value(vm, opcode, REG(opcode->reg), &options);
+    VM_TEARDOWN_REGISTER_OPTIONS();
+
+    clear_registers(regs, opcode->reg, opcode->reg + 4);
+}
+
+REGISTER_FUNCTION(block_if)
+{
+    invoke_builtin_block(vm, opcode, handlebars_builtin_if, BUILTIN_IF, REG(opcode->reg));
+    handlebars_value_null(REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(block_unless)
+{
+    invoke_builtin_block(vm, opcode, handlebars_builtin_unless, BUILTIN_UNLESS | BUILTIN_IF, REG(opcode->reg));
+    handlebars_value_null(REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(block_with)
+{
+    invoke_builtin_block(vm, opcode, handlebars_builtin_with, BUILTIN_WITH, REG(opcode->reg));
+    handlebars_value_null(REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(block_each)
+{
+    invoke_builtin_block(vm, opcode, handlebars_builtin_each, BUILTIN_EACH, REG(opcode->reg));
+    handlebars_value_null(REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(empty_hash)
+{
+    handlebars_value_map(REG(opcode->reg), handlebars_map_ctor(CONTEXT, 0));
+}
+
+REGISTER_FUNCTION(invoke_ambiguous)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(fnv);
+    HANDLEBARS_VALUE_DECL(value);
+
+    // The empty hash takes the place of the value, after the programs
+    handlebars_value_value(value, REG(opcode->reg + 2));
+    handlebars_value_map(REG(opcode->reg + 2), handlebars_map_ctor(CONTEXT, 0));
+
+    VM_SETUP_REGISTER_OPTIONS(REG(opcode->reg));
+    set_register(REG(opcode->reg), invoke_ambiguous(vm, opcode, value, REG(opcode->reg), &options, rv, fnv));
+    VM_TEARDOWN_REGISTER_OPTIONS();
+
+    clear_registers(regs, opcode->reg + 1, opcode->reg + 3);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    HANDLEBARS_VALUE_UNDECL(fnv);
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+REGISTER_FUNCTION(invoke_helper)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(fnv);
+    int argc = (int) opcode->op1.data.longval;
+    struct handlebars_value * argv = REG(opcode->reg);
+    struct handlebars_value * result;
+
+    assert(opcode->op1.type == handlebars_operand_type_long);
+
+    VM_SETUP_REGISTER_OPTIONS(REG(opcode->reg + argc));
+    result = invoke_helper(vm, opcode, REG(opcode->reg + argc + 3), argc, argv, &options, rv, fnv);
+    set_register(REG(opcode->reg), result);
+    VM_TEARDOWN_REGISTER_OPTIONS();
+
+    clear_registers(regs, opcode->reg + 1, opcode->reg + argc + 4);
+
+    HANDLEBARS_VALUE_UNDECL(fnv);
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+REGISTER_FUNCTION(invoke_known_helper)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(fnv);
+    int argc = (int) opcode->op1.data.longval;
+    struct handlebars_value * argv = REG(opcode->reg);
+    struct handlebars_value * result;
+
+    assert(opcode->op1.type == handlebars_operand_type_long);
+
+    VM_SETUP_REGISTER_OPTIONS(REG(opcode->reg + argc));
+    result = invoke_known_helper(vm, opcode, argc, argv, &options, rv, fnv);
+    set_register(REG(opcode->reg), result);
+    VM_TEARDOWN_REGISTER_OPTIONS();
+
+    clear_registers(regs, opcode->reg + 1, opcode->reg + argc + 3);
+
+    HANDLEBARS_VALUE_UNDECL(fnv);
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+REGISTER_FUNCTION(invoke_partial)
+{
+    int dynamic = opcode->op1.data.boolval ? 1 : 0;
+
+    assert(opcode->op1.type == handlebars_operand_type_boolean);
+
+    VM_SETUP_REGISTER_OPTIONS(REG(opcode->reg + dynamic + 1));
+    invoke_partial(vm, opcode, REG(opcode->reg + dynamic), &options, dynamic ? REG(opcode->reg) : NULL);
+    VM_TEARDOWN_REGISTER_OPTIONS();
+
+    clear_registers(regs, opcode->reg, opcode->reg + dynamic + 4);
+}
+
+REGISTER_FUNCTION(lookup_block_param)
+{
+    lookup_block_param(vm, opcode, REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(lookup_data)
+{
+    lookup_data(vm, opcode, REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(lookup_on_context)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(rv2);
+
+    struct handlebars_value * value = lookup_on_context(vm, opcode, rv, rv2);
+    if( value ) {
+        handlebars_value_value(REG(opcode->reg), value);
+    }
+
+    HANDLEBARS_VALUE_UNDECL(rv2);
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+REGISTER_FUNCTION(pop_hash)
+{
+    // The hash was built in place
+    (void) vm;
+    (void) opcode;
+    (void) regs;
+}
+
+REGISTER_FUNCTION(push_context)
+{
+    handlebars_value_value(REG(opcode->reg), vm->last_context);
+}
+
+REGISTER_FUNCTION(push_hash)
+{
+    handlebars_value_map(REG(opcode->reg), handlebars_map_ctor(CONTEXT, 4));
+}
+
+REGISTER_FUNCTION(push_program)
+{
+    (void) vm;
+    handlebars_value_integer(REG(opcode->reg), opcode->op1.type == handlebars_operand_type_long ? opcode->op1.data.longval : -1);
+}
+
+REGISTER_FUNCTION(push_literal)
+{
+    (void) vm;
+    literal_value(opcode, REG(opcode->reg));
+}
+
+REGISTER_FUNCTION(push_string)
+{
+    (void) vm;
+    assert(opcode->op1.type == handlebars_operand_type_string);
+    handlebars_value_str(REG(opcode->reg), opcode->op1.data.string.string);
+}
+
+REGISTER_FUNCTION(resolve_possible_lambda)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    set_register(REG(opcode->reg), resolve_possible_lambda(vm, REG(opcode->reg), rv));
+    HANDLEBARS_VALUE_UNDECL(rv);
+}
+
+// }}} Registers
+
+// {{{ Native
+
+#define NATIVE_FUNCTION(name) \
+    void handlebars_vm_native_ ## name(struct handlebars_vm * vm, struct handlebars_opcode * opcode) \
+    { \
+        ACCEPT_FN(name)(vm, opcode); \
+    }
+
+NATIVE_FUNCTION(ambiguous_block_value)
+NATIVE_FUNCTION(append)
+NATIVE_FUNCTION(append_escaped)
+NATIVE_FUNCTION(assign_to_hash)
+NATIVE_FUNCTION(block_value)
+NATIVE_FUNCTION(block_if)
+NATIVE_FUNCTION(block_unless)
+NATIVE_FUNCTION(block_with)
+NATIVE_FUNCTION(block_each)
+NATIVE_FUNCTION(empty_hash)
+NATIVE_FUNCTION(get_context)
+NATIVE_FUNCTION(invoke_ambiguous)
+NATIVE_FUNCTION(invoke_helper)
+NATIVE_FUNCTION(invoke_known_helper)
+NATIVE_FUNCTION(invoke_partial)
+NATIVE_FUNCTION(lookup_block_param)
+NATIVE_FUNCTION(lookup_data)
+NATIVE_FUNCTION(lookup_on_context)
+NATIVE_FUNCTION(lookup_and_append)
+NATIVE_FUNCTION(lookup_and_append_escaped)
+NATIVE_FUNCTION(pop_hash)
+NATIVE_FUNCTION(push_context)
+NATIVE_FUNCTION(push_hash)
+NATIVE_FUNCTION(push_program)
+NATIVE_FUNCTION(push_literal)
+NATIVE_FUNCTION(push_string)
+NATIVE_FUNCTION(resolve_possible_lambda)
+
+void handlebars_vm_native_unhandled(struct handlebars_vm * vm, struct handlebars_opcode * opcode)
+{
+    handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Unhandled opcode: %s\n", handlebars_opcode_readable_type(opcode->type));
+}
+
+void handlebars_vm_native_append_static(struct handlebars_vm * vm, const char * str, size_t len)
+{
+    vm->buffer = handlebars_string_append(CONTEXT, vm->buffer, str, len);
+    maybe_flush_output(vm);
+}
+
+// }}} Native
+
+#ifdef HANDLEBARS_ENABLE_PROFILING
+static inline void handlebars_vm_profile_opcode_end(
+    struct handlebars_vm_profile * profile,
+    enum handlebars_opcode_type type,
+    uint64_t start,
+    uint64_t nested
+) {
+    struct handlebars_vm_profile_stat * stat = &profile->opcodes[type];
+    uint64_t elapsed = handlebars_vm_clock_ns() - start;
+    stat->count++;
+    stat->total_ns += elapsed;
+    stat->self_ns += elapsed - (profile->nested_ns - nested);
+}
+#endif
+
+static void handlebars_vm_accept(struct handlebars_vm * vm, struct handlebars_module_table_entry * entry)
+{
+#if 0
+#define ACCEPT_DEBUG() \
+    do { \
+        struct handlebars_string * tmp = handlebars_opcode_print(HBSCTX(vm), opcode, 0); \
+        fprintf(stdout, "V[%ld] P[%ld] OPCODE: %.*s\n", vm->depth, entry->guid, (int) hbs_str_len(tmp), hbs_str_val(tmp)); \
+        talloc_free(tmp); \
+    } while (0)
+#else
+#define ACCEPT_DEBUG()
+#endif
+#ifdef HANDLEBARS_ENABLE_PROFILING
+    struct handlebars_vm_profile * profile = vm->profile;
+    uint64_t profile_start = 0;
+    uint64_t profile_nested = 0;
+#define ACCEPT_PROFILE_START() \
+    if( profile ) { \
+        profile_nested = profile->nested_ns; \
+        profile_start = handlebars_vm_clock_ns(); \
+    }
+#define ACCEPT_PROFILE_END(name) \
+    if( profile ) { \
+        handlebars_vm_profile_opcode_end(profile, OPCODE_NAME(name), profile_start, profile_nested); \
+    }
+#else
+#define ACCEPT_PROFILE_START()
+#define ACCEPT_PROFILE_END(name)
+#endif
+#define ACCEPT_ERROR handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Unhandled opcode: %s\n", handlebars_opcode_readable_type(opcode->type));
+#if HAVE_COMPUTED_GOTOS
 #define DISPATCH() goto *dispatch_table[opcode->type]
 #define ACCEPT_LABEL(name) do_ ## name
 #define ACCEPT_CASE(name) ACCEPT_LABEL(name):
-#define ACCEPT(name) ACCEPT_LABEL(name): ACCEPT_DEBUG(); ACCEPT_FN(name)(vm, opcode); opcode++; DISPATCH();
-    static void * dispatch_table[] = {
-            &&do_nil, &&do_ambiguous_block_value, &&do_append, &&do_append_escaped, &&do_empty_hash,
-            &&do_pop_hash, &&do_push_context, &&do_push_hash, &&do_resolve_possible_lambda, &&do_get_context,
-            &&do_push_program, &&do_append_content, &&do_assign_to_hash, &&do_block_value, &&do_push,
-            &&do_push_literal, &&do_push_string, &&do_invoke_partial, &&do_push_id, &&do_push_string_param,
-            &&do_invoke_ambiguous, &&do_invoke_known_helper, &&do_invoke_helper, &&do_lookup_on_context, &&do_lookup_data,
-            &&do_lookup_block_param, &&do_register_decorator, &&do_return
-    };
+#define ACCEPT(name) ACCEPT_LABEL(name): ACCEPT_DEBUG(); ACCEPT_PROFILE_START(); ACCEPT_FN(name)(vm, opcode); ACCEPT_PROFILE_END(name); opcode++; DISPATCH();
+#define ACCEPT_REGISTER(name) ACCEPT_LABEL(name): ACCEPT_DEBUG(); ACCEPT_PROFILE_START(); REGISTER_FN(name)(vm, opcode, regs); ACCEPT_PROFILE_END(name); opcode++; DISPATCH();
+#define DECLARE_DISPATCH_TABLE static void * dispatch_table[] = { \
+            &&do_nil, &&do_ambiguous_block_value, &&do_append, &&do_append_escaped, &&do_empty_hash, \
+            &&do_pop_hash, &&do_push_context, &&do_push_hash, &&do_resolve_possible_lambda, &&do_get_context, \
+            &&do_push_program, &&do_append_content, &&do_assign_to_hash, &&do_block_value, &&do_push, \
+            &&do_push_literal, &&do_push_string, &&do_invoke_partial, &&do_push_id, &&do_push_string_param, \
+            &&do_invoke_ambiguous, &&do_invoke_known_helper, &&do_invoke_helper, &&do_lookup_on_context, &&do_lookup_data, \
+            &&do_lookup_block_param, &&do_register_decorator, &&do_return, &&do_lookup_and_append, \
+            &&do_lookup_and_append_escaped, &&do_block_if, &&do_block_unless, &&do_block_with, &&do_block_each \
+    }
 #define ACCEPT_DEFAULT
 #define START_ACCEPT DISPATCH();
 #define END_ACCEPT
 #else
 #define ACCEPT_CASE(name) case OPCODE_NAME(name):
-#define ACCEPT(name) case OPCODE_NAME(name) : ACCEPT_FN(name)(vm, opcode); opcode++; break;
+#define ACCEPT(name) case OPCODE_NAME(name) : ACCEPT_PROFILE_START(); ACCEPT_FN(name)(vm, opcode); ACCEPT_PROFILE_END(name); opcode++; break;
+#define ACCEPT_REGISTER(name) case OPCODE_NAME(name) : ACCEPT_PROFILE_START(); REGISTER_FN(name)(vm, opcode, regs); ACCEPT_PROFILE_END(name); opcode++; break;
+#define DECLARE_DISPATCH_TABLE
 #define ACCEPT_DEFAULT default: ACCEPT_ERROR
 #define START_ACCEPT start: switch( opcode->type ) {
 #define END_ACCEPT } goto start;
 #endif
 
+    DECLARE_DISPATCH_TABLE;
     struct handlebars_opcode * opcode = &vm->module->opcodes[entry->opcode_offset];
     START_ACCEPT
         ACCEPT(ambiguous_block_value)
@@ -1260,6 +2330,10 @@ static void handlebars_vm_accept(struct handlebars_vm * vm, struct handlebars_mo
         ACCEPT(append_content)
         ACCEPT(assign_to_hash)
         ACCEPT(block_value)
+        ACCEPT(block_if)
+        ACCEPT(block_unless)
+        ACCEPT(block_with)
+        ACCEPT(block_each)
         ACCEPT(get_context)
         ACCEPT(empty_hash)
         ACCEPT(invoke_ambiguous)
@@ -1269,6 +2343,8 @@ static void handlebars_vm_accept(struct handlebars_vm * vm, struct handlebars_mo
         ACCEPT(lookup_block_param)
         ACCEPT(lookup_data)
         ACCEPT(lookup_on_context)
+        ACCEPT(lookup_and_append)
+        ACCEPT(lookup_and_append_escaped)
         ACCEPT(pop_hash)
         ACCEPT(push_context)
         ACCEPT(push_hash)
@@ -1291,15 +2367,118 @@ static void handlebars_vm_accept(struct handlebars_vm * vm, struct handlebars_mo
     END_ACCEPT
 }
 
-struct handlebars_string * handlebars_vm_execute_program_ex(
+// Same as handlebars_vm_accept, for programs lowered to registers
+static void handlebars_vm_accept_registers(struct handlebars_vm * vm, struct handlebars_module_table_entry * entry)
+{
+#ifdef HANDLEBARS_ENABLE_PROFILING
+    struct handlebars_vm_profile * profile = vm->profile;
+    uint64_t profile_start = 0;
+    uint64_t profile_nested = 0;
+#endif
+    const int register_count = (int) entry->register_count;
+
+    DECLARE_DISPATCH_TABLE;
+    struct handlebars_opcode * opcode = &vm->module->opcodes[entry->opcode_offset];
+    HANDLEBARS_VALUE_ARRAY_DECL(regs, register_count);
+
+    START_ACCEPT
+        ACCEPT_REGISTER(ambiguous_block_value)
+        ACCEPT_REGISTER(append)
+        ACCEPT_REGISTER(append_escaped)
+        ACCEPT(append_content)
+        ACCEPT_REGISTER(assign_to_hash)
+        ACCEPT_REGISTER(block_value)
+        ACCEPT_REGISTER(block_if)
+        ACCEPT_REGISTER(block_unless)
+        ACCEPT_REGISTER(block_with)
+        ACCEPT_REGISTER(block_each)
+        ACCEPT(get_context)
+        ACCEPT_REGISTER(empty_hash)
+        ACCEPT_REGISTER(invoke_ambiguous)
+        ACCEPT_REGISTER(invoke_helper)
+        ACCEPT_REGISTER(invoke_known_helper)
+        ACCEPT_REGISTER(invoke_partial)
+        ACCEPT_REGISTER(lookup_block_param)
+        ACCEPT_REGISTER(lookup_data)
+        ACCEPT_REGISTER(lookup_on_context)
+        ACCEPT(lookup_and_append)
+        ACCEPT(lookup_and_append_escaped)
+        ACCEPT_REGISTER(pop_hash)
+        ACCEPT_REGISTER(push_context)
+        ACCEPT_REGISTER(push_hash)
+        ACCEPT_REGISTER(push_program)
+        ACCEPT_REGISTER(push_literal)
+        ACCEPT_REGISTER(push_string)
+        ACCEPT_REGISTER(resolve_possible_lambda)
+
+        // Special return opcode
+        ACCEPT_CASE(return)
+            HANDLEBARS_VALUE_ARRAY_UNDECL(regs, register_count);
+            return;
+
+        // Unhandled opcodes, the serializer does not lower programs that contain them
+        ACCEPT_CASE(nil)
+        ACCEPT_CASE(push)
+        ACCEPT_CASE(push_id)
+        ACCEPT_CASE(push_string_param)
+        ACCEPT_CASE(register_decorator)
+        ACCEPT_DEFAULT
+            ACCEPT_ERROR
+    END_ACCEPT
+}
+
+static inline void accept_program(struct handlebars_vm * vm, struct handlebars_module_table_entry * entry)
+{
+    if( vm->native ) {
+        vm->native[entry - vm->module->programs](vm, &vm->module->opcodes[entry->opcode_offset]);
+    } else if( entry->register_count > 0 ) {
+        handlebars_vm_accept_registers(vm, entry);
+    } else {
+        handlebars_vm_accept(vm, entry);
+    }
+}
+
+#ifdef HANDLEBARS_ENABLE_PROFILING
+static void handlebars_vm_accept_profiled(struct handlebars_vm * vm, struct handlebars_module_table_entry * entry, long program_num)
+{
+    struct handlebars_vm_profile * profile = vm->profile;
+    size_t index = handlebars_vm_profile_program_index(profile, vm->module, program_num);
+    struct handlebars_vm_profile_stat * stat;
+    uint64_t nested = profile->nested_ns;
+    uint64_t start;
+    uint64_t elapsed;
+
+    // Only the difference is used, like for opcodes, so an error unwinding nested programs leaves nothing to restore
+    start = handlebars_vm_clock_ns();
+    accept_program(vm, entry);
+    elapsed = handlebars_vm_clock_ns() - start;
+
+    // Nested programs may have moved the stats
+    stat = &profile->programs[index].stat;
+    stat->count++;
+    stat->total_ns += elapsed;
+    stat->self_ns += elapsed - (profile->nested_ns - nested);
+
+    // Whatever is executing this program counts it as nested
+    profile->nested_ns = nested + elapsed;
+}
+#endif
+
+// Execute a program into buffer, or a new buffer if NULL. The frame replaces the current one for the duration.
+static struct handlebars_string * execute_program(
     struct handlebars_vm * vm,
     long program_num,
     struct handlebars_value * context,
     struct handlebars_value * data,
-    struct handlebars_value * block_params
+    struct handlebars_vm_data_frame * frame,
+    struct handlebars_value * block_params,
+    struct handlebars_string * buffer
 ) {
+    // The top-level buffer is returned to the caller, so it must not come from the render arena
+    struct handlebars_context * buffer_ctx = vm->buffer == NULL ? HBSCTX(vm) : CONTEXT;
+
     if( program_num < 0 ) {
-        return handlebars_string_init(CONTEXT, 0);
+        return buffer ? buffer : handlebars_string_init(buffer_ctx, 0);
     } else if( program_num >= (long) vm->module->program_count ) {
         handlebars_throw(CONTEXT, HANDLEBARS_ERROR, "Invalid program: %ld", program_num);
     }
@@ -1307,9 +2486,25 @@ struct handlebars_string * handlebars_vm_execute_program_ex(
     // Get program
 	struct handlebars_module_table_entry * entry = &vm->module->programs[program_num];
 
-    // Save and set buffer
+    // Save and set buffer. Only the top-level program is streamed to the output sink, nested programs are
+    // flushed once they have been appended to it, unless they append to the current buffer in place
     struct handlebars_string * prev_buffer = vm->buffer;
-    vm->buffer = handlebars_string_init(CONTEXT, HANDLEBARS_VM_BUFFER_INIT_SIZE);
+    bool prev_output_active = vm->output_active;
+    bool in_place = (buffer != NULL && buffer == prev_buffer);
+    if (!in_place) {
+        vm->output_active = (prev_buffer == NULL && buffer == NULL && vm->output_func != NULL);
+    }
+    if (buffer) {
+        vm->buffer = buffer;
+    } else if (vm->output_active && vm->output_threshold > HANDLEBARS_VM_BUFFER_INIT_SIZE) {
+        vm->buffer = handlebars_string_init(buffer_ctx, vm->output_threshold);
+    } else {
+        vm->buffer = handlebars_string_init(buffer_ctx, HANDLEBARS_VM_BUFFER_INIT_SIZE);
+    }
+
+    // Save and set the data frame
+    struct handlebars_vm_data_frame * prev_frame = vm->data_frame;
+    vm->data_frame = frame;
 
     // Check stacks
     assert(vm->stack != NULL);
@@ -1344,7 +2539,15 @@ struct handlebars_string * handlebars_vm_execute_program_ex(
     }
 
     // Execute the program
-	handlebars_vm_accept(vm, entry);
+#ifdef HANDLEBARS_ENABLE_PROFILING
+    if( vm->profile ) {
+        handlebars_vm_accept_profiled(vm, entry, program_num);
+    } else {
+        accept_program(vm, entry);
+    }
+#else
+	accept_program(vm, entry);
+#endif
 
     // Restore stacks
     handlebars_stack_restore(vm->stack, st);
@@ -1363,19 +2566,121 @@ struct handlebars_string * handlebars_vm_execute_program_ex(
         handlebars_value_value(&vm->data, prev_data);
     }
     HANDLEBARS_VALUE_UNDECL(prev_data);
+    vm->data_frame = prev_frame;
 
-    // Restore buffer
-    struct handlebars_string * buffer = vm->buffer;
-    vm->buffer = prev_buffer;
+    // Flush remaining output
+    if (vm->output_active && prev_buffer == NULL) {
+        flush_output(vm);
+    }
+
+    // Restore buffer, which may have moved if appended to in place
+    buffer = vm->buffer;
+    vm->buffer = in_place ? buffer : prev_buffer;
+    vm->output_active = prev_output_active;
 
     return buffer;
 }
 
+struct handlebars_string * handlebars_vm_execute_program_ex(
+    struct handlebars_vm * vm,
+    long program_num,
+    struct handlebars_value * context,
+    struct handlebars_value * data,
+    struct handlebars_value * block_params
+) {
+    // Programs that inherit the data also inherit the #each frame on top of it
+    return execute_program(vm, program_num, context, data, data ? NULL : vm->data_frame, block_params, NULL);
+}
+
+struct handlebars_string * handlebars_vm_execute_program_append(
+    struct handlebars_vm * vm,
+    long program,
+    struct handlebars_value * context,
+    struct handlebars_value * data,
+    struct handlebars_vm_data_frame * frame,
+    struct handlebars_value * block_params,
+    struct handlebars_string * buffer
+) {
+    return execute_program(vm, program, context, data, frame, block_params, buffer);
+}
+
 struct handlebars_string * handlebars_vm_execute_program(struct handlebars_vm * vm, long program, struct handlebars_value * context)
 {
     return handlebars_vm_execute_program_ex(vm, program, context, NULL, NULL);
 }
 
+HBS_ATTR_NOINLINE
+static struct handlebars_string * execute_program_traced(
+    struct handlebars_vm * vm,
+    long program,
+    struct handlebars_value * context,
+    struct handlebars_value * data,
+    struct handlebars_value * block_params
+) {
+    const char * name = vm->trace_name ? vm->trace_name : "template";
+    size_t name_len = strlen(name);
+    jmp_buf * prev = HBSCTX(vm)->e->jmp;
+    jmp_buf buf;
+    uint64_t start_ns = trace_begin(vm, handlebars_vm_trace_type_template, name, name_len);
+    struct handlebars_string * buffer;
+
+    if (handlebars_setjmp_ex(vm, &buf)) {
+        trace_abort(vm, prev, 0, handlebars_vm_trace_type_template, name, name_len, start_ns);
+    }
+    buffer = handlebars_vm_execute_program_ex(vm, program, context, data, block_params);
+    HBSCTX(vm)->e->jmp = prev;
+
+    trace_end(vm, handlebars_vm_trace_type_template, name, name_len, start_ns, vm->output_written + hbs_str_len(buffer));
+    return buffer;
+}
+
+// The pool is kept across renders. Once every object of a render has been freed it holds no other chunk, so talloc
+// rewinds it and the next render allocates from its start again without going back to malloc.
+static void arena_ctor(struct handlebars_vm * vm)
+{
+    struct handlebars_context * arena;
+    if (vm->arena_pool == NULL) {
+        vm->arena_pool = talloc_pool(HBSCTX(vm), vm->arena_size);
+        HANDLEBARS_MEMCHECK(vm->arena_pool, HBSCTX(vm));
+    }
+    arena = handlebars_talloc_zero(vm->arena_pool, struct handlebars_context);
+    HANDLEBARS_MEMCHECK(arena, HBSCTX(vm));
+    handlebars_context_bind(HBSCTX(vm), arena);
+    vm->arena = arena;
+}
+
+static inline bool arena_owns(struct handlebars_vm * vm, const void * ptr)
+{
+    while (ptr) {
+        if (ptr == vm->arena) {
+            return true;
+        }
+        ptr = talloc_parent(ptr);
+    }
+    return false;
+}
+
+static void arena_dtor(struct handlebars_vm * vm, bool error)
+{
+    struct handlebars_error * e = HBSCTX(vm)->e;
+
+    // Move the error message out of the arena, it is the only copy that is kept. Out of memory messages may be string
+    // literals rather than allocations, and copying them would most likely fail anyway.
+    if (error && e->num == HANDLEBARS_NOMEM) {
+        e->msg = HANDLEBARS_MEMCHECK_MSG;
+    } else if (error && e->msg && arena_owns(vm, e->msg)) {
+        const char * msg = handlebars_talloc_strdup(HBSCTX(vm), e->msg);
+        e->msg = msg ? msg : HANDLEBARS_MEMCHECK_MSG;
+    }
+
+    // The name of the last helper may point into the arena
+    vm->last_helper = NULL;
+
+    // Frees each object of the render in turn, running their destructors, and leaves the pool empty
+    handlebars_talloc_free(vm->arena);
+    vm->arena = NULL;
+}
+
 struct handlebars_string * handlebars_vm_execute_ex(
     struct handlebars_vm * vm,
     struct handlebars_module * module,
@@ -1386,17 +2691,27 @@ struct handlebars_string * handlebars_vm_execute_ex(
 ) {
     jmp_buf * prev = HBSCTX(vm)->e->jmp;
     struct handlebars_module * prev_module = vm->module;
+    const handlebars_native_func * prev_native = vm->native;
     unsigned long prev_flags = vm->flags;
     struct handlebars_value * prev_last_context = vm->last_context;
     struct handlebars_string * prev_delim_open = vm->delim_open;
     struct handlebars_string * prev_delim_close = vm->delim_close;
+    struct handlebars_string * prev_buffer = vm->buffer;
+    bool prev_output_active = vm->output_active;
 
-    struct handlebars_string * buffer = NULL;
+    struct handlebars_string * volatile buffer = NULL;
     bool volatile setup_stacks = false;
+    bool volatile setup_arena = false;
     jmp_buf buf;
 
-    // Save jump buffer
-    if( !prev ) {
+    // Setup render arena
+    if (vm->arena_size > 0 && vm->arena == NULL) {
+        arena_ctor(vm);
+        setup_arena = true;
+    }
+
+    // Save jump buffer. The arena must be released before an error propagates, so catch them here as well.
+    if( !prev || setup_arena ) {
         if( handlebars_setjmp_ex(vm, &buf) ) {
             goto done;
         }
@@ -1418,13 +2733,35 @@ struct handlebars_string * handlebars_vm_execute_ex(
     }
 
     vm->module = module;
+    vm->native = handlebars_native_module_programs(module);
     vm->flags |= module->flags;
 
-    // Execute
-    buffer = handlebars_vm_execute_program_ex(vm, program, context, data, block_params);
+    // Execute. Only top-level renders are sampled and reported as templates, partials run from here as well.
+    if (prev_buffer == NULL) {
+        vm->output_written = 0;
+        vm->trace_active = (vm->trace_begin || vm->trace_end) && vm->trace_sample_count++ % vm->trace_sample_interval == 0;
+        vm->trace_depth = 0;
+        vm->builtin_checked = 0;
+        vm->builtin_overrides = 0;
+#ifdef HANDLEBARS_ENABLE_PROFILING
+        if (vm->profile) {
+            vm->profile->nested_ns = 0;
+        }
+#endif
+    }
+    if (unlikely(vm->trace_active) && prev_buffer == NULL) {
+        buffer = execute_program_traced(vm, program, context, data, block_params);
+    } else {
+        buffer = handlebars_vm_execute_program_ex(vm, program, context, data, block_params);
+    }
 
 done:
     HBSCTX(vm)->e->jmp = prev;
+    if (prev_buffer == NULL) {
+        vm->trace_active = false;
+        vm->data_frame = NULL;
+        vm->append_options = NULL;
+    }
 
     // Reset stacks
     if (setup_stacks) {
@@ -1436,12 +2773,23 @@ done:
     }
 
     // Reset
+    vm->buffer = prev_buffer;
+    vm->output_active = prev_output_active;
     vm->delim_open = prev_delim_open;
     vm->delim_close = prev_delim_close;
     vm->last_context = prev_last_context;
     vm->module = prev_module;
+    vm->native = prev_native;
     vm->flags = prev_flags;
 
+    if (setup_arena) {
+        arena_dtor(vm, buffer == NULL);
+        if (buffer == NULL && prev) {
+            // Propagate the error as it was raised, formatting it again would allocate another copy of the message
+            longjmp(*prev, HBSCTX(vm)->e->num);
+        }
+    }
+
     return buffer;
 }
 
@@ -38,8 +38,31 @@ struct handlebars_vm;
 #define HANDLEBARS_VM_BUFFER_INIT_SIZE 128
 #endif
 
+#ifndef HANDLEBARS_VM_INLINE_CACHE_SIZE
+#define HANDLEBARS_VM_INLINE_CACHE_SIZE 128
+#endif
+
+#ifndef HANDLEBARS_VM_OUTPUT_THRESHOLD
+#define HANDLEBARS_VM_OUTPUT_THRESHOLD 8192
+#endif
+
 extern const size_t HANDLEBARS_VM_SIZE;
 
+/**
+ * @brief Output sink callback. Receives rendered output of the top-level program in order, as it is produced.
+ * @param[in] vm The VM
+ * @param[in] str The output chunk. Only valid for the duration of the call.
+ * @param[in] len The length of the output chunk
+ * @param[in] ctx The user pointer given to #handlebars_vm_set_output
+ * @return void
+ */
+typedef void (*handlebars_vm_output_func)(
+    struct handlebars_vm * vm,
+    const char * str,
+    size_t len,
+    void * ctx
+);
+
 /**
  * @brief Construct a VM
  * @param[in] ctx The parent handlebars context
@@ -104,6 +127,38 @@ void handlebars_vm_set_data(struct handlebars_vm * vm, struct handlebars_value *
 void handlebars_vm_set_cache(struct handlebars_vm * vm, struct handlebars_cache * cache) HBS_ATTR_NONNULL_ALL;
 void handlebars_vm_set_logger(struct handlebars_vm * vm, handlebars_func log_func, void * log_ctx) HBS_ATTR_NONNULL(1, 2);
 
+/**
+ * @brief Stream the output of the top-level program to a sink instead of accumulating it. The output buffer is
+ *        flushed to the sink whenever it reaches the threshold, and once more when execution finishes. While a sink
+ *        is set, #handlebars_vm_execute returns an empty string. Nested programs (block helpers, partials) are
+ *        still rendered into their own buffers and flushed once appended to the top-level output.
+ * @param[in] vm The VM
+ * @param[in] output_func The sink, or NULL to disable streaming
+ * @param[in] output_ctx An opaque user pointer passed to the sink
+ * @param[in] threshold The number of buffered bytes after which the buffer is flushed. Zero flushes after every write.
+ * @return void
+ */
+void handlebars_vm_set_output(
+    struct handlebars_vm * vm,
+    handlebars_vm_output_func output_func,
+    void * output_ctx,
+    size_t threshold
+) HBS_ATTR_NONNULL(1);
+
+/**
+ * @brief Allocate the transient objects of each render (intermediate strings, hashes, closures, options) from a
+ *        talloc pool of the given size instead of individually from the VM. The objects are freed when
+ *        #handlebars_vm_execute returns, instead of when the VM is destroyed. Freeing still visits each object and
+ *        runs its destructor, but their memory goes back to the pool, which is created by the first render and
+ *        reused by the following ones. Objects that outgrow the pool fall back to regular allocations. The returned
+ *        buffer is allocated from the VM as usual. Values created by helpers during a render must not be kept after
+ *        it; one that is would also keep the pool from being reused.
+ * @param[in] vm The VM
+ * @param[in] size The size of the pool in bytes, or zero to disable
+ * @return void
+ */
+void handlebars_vm_set_arena(struct handlebars_vm * vm, size_t size) HBS_ATTR_NONNULL_ALL;
+
 handlebars_func handlebars_vm_get_log_func(struct handlebars_vm * vm);
 void * handlebars_vm_get_log_ctx(struct handlebars_vm * vm);
 
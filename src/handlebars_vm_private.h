@@ -18,9 +18,16 @@
 #ifndef HANDLEBARS_VM_PRIVATE_H
 #define HANDLEBARS_VM_PRIVATE_H
 
+#include <time.h>
+
 #include "handlebars.h"
+#include "handlebars_native.h"
+#include "handlebars_opcodes.h"
 #include "handlebars_types.h"
 #include "handlebars_value_private.h"
+#include "handlebars_vm.h"
+#include "handlebars_vm_profile.h"
+#include "handlebars_vm_trace.h"
 
 HBS_EXTERN_C_START
 
@@ -29,17 +36,136 @@ struct handlebars_module;
 struct handlebars_string;
 struct handlebars_stack;
 
+//! Inline cache entry for map lookups, remembers the map slot of the last hit for a path segment
+struct handlebars_vm_inline_cache_entry {
+    const void * segment;
+    uint32_t hint;
+};
+
+//! The number of opcode types
+#define HANDLEBARS_VM_PROFILE_OPCODE_COUNT (handlebars_opcode_type_block_each + 1)
+
+struct handlebars_vm_profile_program {
+    struct handlebars_module * module;
+    long program;
+    struct handlebars_vm_profile_stat stat;
+};
+
+struct handlebars_vm_profile_module {
+    struct handlebars_module * module;
+    //! Index into handlebars_vm_profile::programs by program number, SIZE_MAX if not executed yet
+    size_t * programs;
+};
+
+struct handlebars_vm_profile {
+    struct handlebars_context ctx;
+    struct handlebars_vm_profile_stat opcodes[HANDLEBARS_VM_PROFILE_OPCODE_COUNT];
+    struct handlebars_vm_profile_program * programs;
+    size_t program_count;
+    struct handlebars_vm_profile_module * modules;
+    size_t module_count;
+    //! Index of the module of the last program looked up
+    size_t last_module;
+    //! Time spent in programs during the current render. Programs and opcodes subtract its change over their own
+    //! execution from their self time, so it does not need restoring when an error unwinds them.
+    uint64_t nested_ns;
+};
+
+//! Monotonic time in nanoseconds, for profiling and tracing
+static inline uint64_t handlebars_vm_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+//! Index into handlebars_vm_profile::programs of a program, added if not executed yet
+size_t handlebars_vm_profile_program_index(
+    struct handlebars_vm_profile * profile,
+    struct handlebars_module * module,
+    long program
+) HBS_ATTR_NONNULL_ALL;
+
+//! The data of an #each iteration. @index, @key, @first and @last are kept in fixed slots that lookup_data reads
+//! directly, the data map is only built when a helper asks for options->data.
+struct handlebars_vm_data_frame {
+    //! The frame of the enclosing #each, or NULL
+    struct handlebars_vm_data_frame * parent;
+    //! The data the frame extends
+    struct handlebars_value * data;
+    struct handlebars_value index;
+    struct handlebars_value key;
+    struct handlebars_value first;
+    struct handlebars_value last;
+    //! The frame as a data map, or NULL if not built yet
+    struct handlebars_map * map;
+    //! Whether the slots changed since the map was built
+    bool map_stale;
+};
+
+void handlebars_vm_data_frame_init(
+    struct handlebars_vm_data_frame * frame,
+    struct handlebars_vm_data_frame * parent,
+    struct handlebars_value * data
+) HBS_ATTR_NONNULL(1, 3);
+
+void handlebars_vm_data_frame_deinit(
+    struct handlebars_vm_data_frame * frame
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Execute a program, appending its output to the given buffer instead of a new one
+ * @param[in] vm The VM
+ * @param[in] program The program number
+ * @param[in] context The context
+ * @param[in] data The data, or NULL to keep the current data
+ * @param[in] frame The data frame the program sees on top of data, or NULL
+ * @param[in] block_params The block params, or NULL
+ * @param[in] buffer The buffer to append to
+ * @return The buffer, which may have been reallocated
+ */
+struct handlebars_string * handlebars_vm_execute_program_append(
+    struct handlebars_vm * vm,
+    long program,
+    struct handlebars_value * context,
+    struct handlebars_value * data,
+    struct handlebars_vm_data_frame * frame,
+    struct handlebars_value * block_params,
+    struct handlebars_string * buffer
+) HBS_ATTR_NONNULL(1, 3, 7) HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Check whether a builtin helper has been replaced by a user helper of the same name
+ * @param[in] vm The VM
+ * @param[in] name The helper name
+ * @param[in] len The helper name length
+ * @return Whether the name resolves to a user helper
+ */
+bool handlebars_vm_helper_overridden(
+    struct handlebars_vm * vm,
+    const char * name,
+    size_t len
+) HBS_ATTR_NONNULL_ALL;
+
 struct handlebars_vm {
     struct handlebars_context ctx;
     struct handlebars_cache * cache;
 
     struct handlebars_module * module;
+    //! The native programs of the module, or NULL if it is interpreted
+    const handlebars_native_func * native;
 
     long depth;
     unsigned long flags;
 
     struct handlebars_string * buffer;
 
+    handlebars_vm_output_func output_func;
+    void * output_ctx;
+    size_t output_threshold;
+    //! Whether vm->buffer is the top-level buffer being streamed to output_func
+    bool output_active;
+
     struct handlebars_value data;
     struct handlebars_value helpers;
     struct handlebars_value partials;
@@ -58,8 +184,47 @@ struct handlebars_vm {
 
     struct handlebars_string * delim_open;
     struct handlebars_string * delim_close;
+
+    struct handlebars_vm_inline_cache_entry inline_cache[HANDLEBARS_VM_INLINE_CACHE_SIZE];
+
+    //! Size of the render arena, zero if disabled
+    size_t arena_size;
+    //! The render arena pool, kept across renders once created
+    void * arena_pool;
+    //! Context allocated from the render arena pool, only set during a render
+    struct handlebars_context * arena;
+
+    //! Where execution is recorded, if profiling
+    struct handlebars_vm_profile * profile;
+
+    handlebars_vm_trace_func trace_begin;
+    handlebars_vm_trace_func trace_end;
+    void * trace_ctx;
+    const char * trace_name;
+    unsigned long trace_sample_interval;
+    unsigned long trace_sample_count;
+    //! Whether the current render is being traced
+    bool trace_active;
+    long trace_depth;
+    //! Bytes of the current render already written to output_func
+    size_t output_written;
+
+    //! The innermost #each frame visible to the current program, or NULL
+    struct handlebars_vm_data_frame * data_frame;
+
+    //! The options of the helper call that may append its output to vm->buffer itself instead of returning it, or
+    //! NULL. Only set for builtins whose result would be appended verbatim.
+    struct handlebars_options * append_options;
+
+    //! Which of the builtin block helpers run by the blockIf, blockUnless, blockWith and blockEach opcodes have been
+    //! replaced by user helpers, and which of them have been checked in the current render
+    unsigned builtin_overrides;
+    unsigned builtin_checked;
 };
 
+//! Context for allocations that only live for the current render
+#define HANDLEBARS_VM_RENDER_CTX(vm) ((vm)->arena ? (vm)->arena : HBSCTX(vm))
+
 HBS_EXTERN_C_END
 
 #endif /* HANDLEBARS_VM_PRIVATE_H */
@@ -0,0 +1,220 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <talloc.h>
+
+#define HANDLEBARS_OPCODE_SERIALIZER_PRIVATE
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_private.h"
+#include "handlebars_string.h"
+#include "handlebars_vm_private.h"
+#include "handlebars_vm_profile.h"
+
+#include "sort_r.h"
+
+
+
+#undef CONTEXT
+#define CONTEXT context
+
+struct handlebars_vm_profile * handlebars_vm_profile_ctor(struct handlebars_context * context)
+{
+    struct handlebars_vm_profile * profile = MC(handlebars_talloc_zero(context, struct handlebars_vm_profile));
+    handlebars_context_bind(context, HBSCTX(profile));
+    return profile;
+}
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(profile)
+
+void handlebars_vm_profile_dtor(struct handlebars_vm_profile * profile)
+{
+    handlebars_talloc_free(profile);
+}
+
+size_t handlebars_vm_profile_program_index(
+    struct handlebars_vm_profile * profile,
+    struct handlebars_module * module,
+    long program
+) {
+    struct handlebars_vm_profile_module * pmodule = NULL;
+    struct handlebars_vm_profile_program * pprogram;
+    size_t i;
+
+    assert(program >= 0 && program < (long) module->program_count);
+
+    // Usually the same module as last time
+    if( profile->module_count > 0 && profile->modules[profile->last_module].module == module ) {
+        pmodule = &profile->modules[profile->last_module];
+    } else {
+        for( i = 0; i < profile->module_count; i++ ) {
+            if( profile->modules[i].module == module ) {
+                pmodule = &profile->modules[i];
+                break;
+            }
+        }
+
+        if( !pmodule ) {
+            profile->modules = MC(handlebars_talloc_realloc(profile, profile->modules, struct handlebars_vm_profile_module, profile->module_count + 1));
+            pmodule = &profile->modules[profile->module_count++];
+            pmodule->module = module;
+            pmodule->programs = MC(handlebars_talloc_array(profile->modules, size_t, module->program_count));
+            for( i = 0; i < module->program_count; i++ ) {
+                pmodule->programs[i] = SIZE_MAX;
+            }
+        }
+
+        profile->last_module = (size_t) (pmodule - profile->modules);
+    }
+
+    if( pmodule->programs[program] == SIZE_MAX ) {
+        profile->programs = MC(handlebars_talloc_realloc(profile, profile->programs, struct handlebars_vm_profile_program, profile->program_count + 1));
+        pprogram = &profile->programs[profile->program_count];
+        memset(pprogram, 0, sizeof(*pprogram));
+        pprogram->module = module;
+        pprogram->program = program;
+        pmodule->programs[program] = profile->program_count++;
+    }
+
+    return pmodule->programs[program];
+}
+
+const struct handlebars_vm_profile_stat * handlebars_vm_profile_opcode(
+    struct handlebars_vm_profile * profile,
+    enum handlebars_opcode_type type
+) {
+    assert(type < HANDLEBARS_VM_PROFILE_OPCODE_COUNT);
+    return &profile->opcodes[type];
+}
+
+size_t handlebars_vm_profile_program_count(struct handlebars_vm_profile * profile)
+{
+    return profile->program_count;
+}
+
+const struct handlebars_vm_profile_stat * handlebars_vm_profile_program(
+    struct handlebars_vm_profile * profile,
+    size_t index,
+    struct handlebars_module ** module,
+    long * program
+) {
+    assert(index < profile->program_count);
+    *module = profile->programs[index].module;
+    *program = profile->programs[index].program;
+    return &profile->programs[index].stat;
+}
+
+#undef CONTEXT
+#define CONTEXT context
+
+static int stat_compare(const void * a, const void * b, void * arg)
+{
+    const struct handlebars_vm_profile_stat * const * stats = arg;
+    const struct handlebars_vm_profile_stat * sa = stats[*(const size_t *) a];
+    const struct handlebars_vm_profile_stat * sb = stats[*(const size_t *) b];
+
+    // Slowest first, then in their original order
+    if( sa->self_ns != sb->self_ns ) {
+        return sa->self_ns < sb->self_ns ? 1 : -1;
+    }
+    return *(const size_t *) a < *(const size_t *) b ? -1 : 1;
+}
+
+// Indexes of the stats, ordered by self time
+static size_t * sort_stats(struct handlebars_context * context, const struct handlebars_vm_profile_stat ** stats, size_t count)
+{
+    size_t * order = MC(handlebars_talloc_array(context, size_t, count ? count : 1));
+    size_t i;
+
+    for( i = 0; i < count; i++ ) {
+        order[i] = i;
+    }
+    sort_r(order, count, sizeof(size_t), stat_compare, (void *) stats);
+    return order;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? (double) part * 100.0 / (double) whole : 0.0;
+}
+
+struct handlebars_string * handlebars_vm_profile_print(
+    struct handlebars_context * context,
+    struct handlebars_vm_profile * profile
+) {
+    const struct handlebars_vm_profile_stat * opcodes[HANDLEBARS_VM_PROFILE_OPCODE_COUNT];
+    const struct handlebars_vm_profile_stat ** programs = MC(handlebars_talloc_array(context, const struct handlebars_vm_profile_stat *, profile->program_count ? profile->program_count : 1));
+    struct handlebars_string * string = handlebars_string_init(context, 1024);
+    uint64_t total_ns = 0;
+    uint64_t program_total_ns = 0;
+    size_t * order;
+    size_t i;
+    size_t j;
+
+    for( i = 0; i < HANDLEBARS_VM_PROFILE_OPCODE_COUNT; i++ ) {
+        opcodes[i] = &profile->opcodes[i];
+        total_ns += profile->opcodes[i].self_ns;
+    }
+    for( i = 0; i < profile->program_count; i++ ) {
+        programs[i] = &profile->programs[i].stat;
+        program_total_ns += profile->programs[i].stat.self_ns;
+    }
+
+    // Opcodes
+    string = handlebars_string_asprintf_append(context, string, "%-28s %12s %14s %14s %7s\n", "opcode", "count", "self ns", "total ns", "self %");
+    order = sort_stats(context, opcodes, HANDLEBARS_VM_PROFILE_OPCODE_COUNT);
+    for( i = 0; i < HANDLEBARS_VM_PROFILE_OPCODE_COUNT; i++ ) {
+        const struct handlebars_vm_profile_stat * stat = opcodes[order[i]];
+        if( stat->count == 0 ) {
+            continue;
+        }
+        string = handlebars_string_asprintf_append(
+            context, string, "%-28s %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %6.2f%%\n",
+            handlebars_opcode_readable_type((enum handlebars_opcode_type) order[i]),
+            stat->count, stat->self_ns, stat->total_ns, percent(stat->self_ns, total_ns)
+        );
+    }
+    handlebars_talloc_free(order);
+
+    // Programs, with modules numbered in the order they were first executed
+    string = handlebars_string_asprintf_append(context, string, "\n%-28s %12s %14s %14s %7s\n", "program", "count", "self ns", "total ns", "self %");
+    order = sort_stats(context, programs, profile->program_count);
+    for( i = 0; i < profile->program_count; i++ ) {
+        struct handlebars_vm_profile_program * program = &profile->programs[order[i]];
+        for( j = 0; j < profile->module_count && profile->modules[j].module != program->module; j++ );
+        string = handlebars_string_asprintf_append(
+            context, string, "module %-6zu program %-6ld %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %6.2f%%\n",
+            j, program->program, program->stat.count, program->stat.self_ns, program->stat.total_ns,
+            percent(program->stat.self_ns, program_total_ns)
+        );
+    }
+    handlebars_talloc_free(order);
+    handlebars_talloc_free(programs);
+
+    return string;
+}
@@ -0,0 +1,129 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Execution profiles
+ *
+ * A profile counts the opcodes and programs a VM executes, and the time spent in them. Total time includes
+ * everything that ran while an opcode or program was executing, including nested programs such as the body of a
+ * block helper or a partial. Self time excludes nested programs. Profiles are only collected when the library is
+ * built with HANDLEBARS_ENABLE_PROFILING (`--enable-profiling`), otherwise they stay empty.
+ */
+
+#ifndef HANDLEBARS_VM_PROFILE_H
+#define HANDLEBARS_VM_PROFILE_H
+
+#include "handlebars.h"
+#include "handlebars_opcodes.h"
+
+HBS_EXTERN_C_START
+
+struct handlebars_context;
+struct handlebars_module;
+struct handlebars_string;
+struct handlebars_vm;
+struct handlebars_vm_profile;
+
+struct handlebars_vm_profile_stat {
+    //! The number of times it was executed
+    uint64_t count;
+    //! The time spent in it in nanoseconds, including nested programs
+    uint64_t total_ns;
+    //! The time spent in it in nanoseconds, excluding nested programs
+    uint64_t self_ns;
+};
+
+/**
+ * @brief Construct a profile
+ * @param[in] context The handlebars context
+ * @return The profile
+ */
+struct handlebars_vm_profile * handlebars_vm_profile_ctor(
+    struct handlebars_context * context
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Destruct a profile
+ * @param[in] profile The profile
+ * @return void
+ */
+void handlebars_vm_profile_dtor(
+    struct handlebars_vm_profile * profile
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Record what a VM executes into a profile. A profile may be shared by several VMs in turn, but not
+ *        concurrently. Programs are identified by their module, so the modules must outlive the profile.
+ * @param[in] vm The VM
+ * @param[in] profile The profile, or NULL to stop profiling
+ * @return void
+ */
+void handlebars_vm_set_profile(
+    struct handlebars_vm * vm,
+    struct handlebars_vm_profile * profile
+) HBS_ATTR_NONNULL(1);
+
+/**
+ * @brief Get the statistics of an opcode type
+ * @param[in] profile The profile
+ * @param[in] type The opcode type
+ * @return The statistics
+ */
+const struct handlebars_vm_profile_stat * handlebars_vm_profile_opcode(
+    struct handlebars_vm_profile * profile,
+    enum handlebars_opcode_type type
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL;
+
+/**
+ * @brief Get the number of programs that were executed
+ * @param[in] profile The profile
+ * @return The number of programs
+ */
+size_t handlebars_vm_profile_program_count(
+    struct handlebars_vm_profile * profile
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_PURE;
+
+/**
+ * @brief Get the statistics of a program, in the order they were first executed
+ * @param[in] profile The profile
+ * @param[in] index The index of the program, less than #handlebars_vm_profile_program_count
+ * @param[out] module The module the program belongs to
+ * @param[out] program The program number (guid) within the module
+ * @return The statistics
+ */
+const struct handlebars_vm_profile_stat * handlebars_vm_profile_program(
+    struct handlebars_vm_profile * profile,
+    size_t index,
+    struct handlebars_module ** module,
+    long * program
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL;
+
+/**
+ * @brief Print a profile as a table of opcodes and a table of programs, each ordered by self time
+ * @param[in] context The handlebars context
+ * @param[in] profile The profile
+ * @return The report
+ */
+struct handlebars_string * handlebars_vm_profile_print(
+    struct handlebars_context * context,
+    struct handlebars_vm_profile * profile
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+HBS_EXTERN_C_END
+
+#endif /* HANDLEBARS_VM_PROFILE_H */
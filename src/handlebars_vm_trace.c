@@ -0,0 +1,311 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <talloc.h>
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_private.h"
+#include "handlebars_string.h"
+#include "handlebars_vm_trace.h"
+
+#include "sort_r.h"
+
+
+
+struct handlebars_vm_trace_record {
+    enum handlebars_vm_trace_type type;
+    char * name;
+    //! Index of the enclosing record, SIZE_MAX for templates
+    size_t parent;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    //! Time spent in enclosed records
+    uint64_t nested_ns;
+    size_t bytes;
+    //! Whether the record ended, records left open by an error are not exported
+    bool done;
+};
+
+struct handlebars_vm_trace_collector {
+    struct handlebars_context ctx;
+    struct handlebars_vm_trace_record * records;
+    size_t count;
+    size_t size;
+    //! The maximum number of records, zero for no limit
+    size_t limit;
+    //! The number of events dropped at the limit
+    size_t dropped;
+    //! The number of dropped events still open, their ends are ignored
+    size_t skipped;
+    //! Index of the innermost open record, SIZE_MAX if none
+    size_t current;
+    //! Time of the first record, Chrome traces start at zero
+    uint64_t epoch_ns;
+};
+
+static const char * trace_type_names[] = {
+    "template", "partial", "helper"
+};
+
+#undef CONTEXT
+#define CONTEXT context
+
+struct handlebars_vm_trace_collector * handlebars_vm_trace_collector_ctor(struct handlebars_context * context)
+{
+    struct handlebars_vm_trace_collector * collector = MC(handlebars_talloc_zero(context, struct handlebars_vm_trace_collector));
+    handlebars_context_bind(context, HBSCTX(collector));
+    collector->limit = HANDLEBARS_VM_TRACE_COLLECTOR_LIMIT;
+    collector->current = SIZE_MAX;
+    return collector;
+}
+
+#undef CONTEXT
+#define CONTEXT HBSCTX(collector)
+
+void handlebars_vm_trace_collector_dtor(struct handlebars_vm_trace_collector * collector)
+{
+    handlebars_talloc_free(collector);
+}
+
+static void collector_begin(struct handlebars_vm * vm, const struct handlebars_vm_trace_event * event, void * ctx)
+{
+    struct handlebars_vm_trace_collector * collector = ctx;
+    struct handlebars_vm_trace_record * record;
+    (void) vm;
+
+    // Anything left open belongs to a render that failed
+    if( event->type == handlebars_vm_trace_type_template ) {
+        collector->current = SIZE_MAX;
+        collector->skipped = 0;
+    }
+
+    // Records are only added, so once the limit is reached every event until the reset is dropped. They all nest
+    // inside the open records, which still end normally.
+    if( collector->limit && collector->count >= collector->limit ) {
+        collector->dropped++;
+        collector->skipped++;
+        return;
+    }
+
+    if( collector->count >= collector->size ) {
+        collector->size = collector->size ? collector->size * 2 : 64;
+        if( collector->limit && collector->size > collector->limit ) {
+            collector->size = collector->limit;
+        }
+        collector->records = MC(handlebars_talloc_realloc(collector, collector->records, struct handlebars_vm_trace_record, collector->size));
+    }
+    if( collector->count == 0 ) {
+        collector->epoch_ns = event->start_ns;
+    }
+
+    record = &collector->records[collector->count];
+    memset(record, 0, sizeof(*record));
+    record->type = event->type;
+    record->name = MC(handlebars_talloc_strndup(collector->records, event->name, event->name_len));
+    record->parent = collector->current;
+    record->start_ns = event->start_ns;
+    collector->current = collector->count++;
+}
+
+static void collector_end(struct handlebars_vm * vm, const struct handlebars_vm_trace_event * event, void * ctx)
+{
+    struct handlebars_vm_trace_collector * collector = ctx;
+    struct handlebars_vm_trace_record * record;
+    (void) vm;
+
+    if( collector->skipped > 0 ) {
+        collector->skipped--;
+        return;
+    }
+    if( collector->current == SIZE_MAX ) {
+        return;
+    }
+
+    record = &collector->records[collector->current];
+    record->duration_ns = event->duration_ns;
+    record->bytes = event->bytes;
+    record->done = true;
+
+    collector->current = record->parent;
+    if( record->parent != SIZE_MAX ) {
+        collector->records[record->parent].nested_ns += event->duration_ns;
+    }
+}
+
+void handlebars_vm_trace_collector_attach(
+    struct handlebars_vm_trace_collector * collector,
+    struct handlebars_vm * vm,
+    unsigned long sample_interval
+) {
+    handlebars_vm_set_trace(vm, collector_begin, collector_end, collector, sample_interval);
+}
+
+void handlebars_vm_trace_collector_set_limit(struct handlebars_vm_trace_collector * collector, size_t limit)
+{
+    collector->limit = limit;
+}
+
+void handlebars_vm_trace_collector_reset(struct handlebars_vm_trace_collector * collector)
+{
+    handlebars_talloc_free(collector->records);
+    collector->records = NULL;
+    collector->count = 0;
+    collector->size = 0;
+    collector->dropped = 0;
+    collector->skipped = 0;
+    collector->current = SIZE_MAX;
+}
+
+size_t handlebars_vm_trace_collector_count(struct handlebars_vm_trace_collector * collector)
+{
+    return collector->count;
+}
+
+size_t handlebars_vm_trace_collector_dropped(struct handlebars_vm_trace_collector * collector)
+{
+    return collector->dropped;
+}
+
+#undef CONTEXT
+#define CONTEXT context
+
+static struct handlebars_string * append_json_string(struct handlebars_context * context, struct handlebars_string * string, const char * str)
+{
+    string = handlebars_string_append(context, string, HBS_STRL("\""));
+    for( ; *str; str++ ) {
+        unsigned char c = (unsigned char) *str;
+        if( c == '"' || c == '\\' ) {
+            char buf[2] = {'\\', (char) c};
+            string = handlebars_string_append(context, string, buf, 2);
+        } else if( c < 0x20 ) {
+            string = handlebars_string_asprintf_append(context, string, "\\u%04x", c);
+        } else {
+            string = handlebars_string_append(context, string, (const char *) &c, 1);
+        }
+    }
+    return handlebars_string_append(context, string, HBS_STRL("\""));
+}
+
+struct handlebars_string * handlebars_vm_trace_collector_chrome(
+    struct handlebars_context * context,
+    struct handlebars_vm_trace_collector * collector
+) {
+    struct handlebars_string * string = handlebars_string_init(context, 256 + collector->count * 128);
+    bool first = true;
+    size_t i;
+
+    string = handlebars_string_append(context, string, HBS_STRL("{\"traceEvents\":["));
+    for( i = 0; i < collector->count; i++ ) {
+        struct handlebars_vm_trace_record * record = &collector->records[i];
+        if( !record->done ) {
+            continue;
+        }
+        string = handlebars_string_append(context, string, first ? "\n" : ",\n", first ? 1 : 2);
+        first = false;
+        string = handlebars_string_append(context, string, HBS_STRL("{\"name\":"));
+        string = append_json_string(context, string, record->name);
+        string = handlebars_string_asprintf_append(
+            context, string, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"bytes\":%zu}}",
+            trace_type_names[record->type],
+            (double) (record->start_ns - collector->epoch_ns) / 1000.0,
+            (double) record->duration_ns / 1000.0,
+            record->bytes
+        );
+    }
+    string = handlebars_string_append(context, string, HBS_STRL("\n],\"displayTimeUnit\":\"ns\"}\n"));
+
+    return string;
+}
+
+// The stack of a record, outermost first
+static struct handlebars_string * append_stack(
+    struct handlebars_context * context,
+    struct handlebars_string * string,
+    struct handlebars_vm_trace_collector * collector,
+    size_t index
+) {
+    struct handlebars_vm_trace_record * record = &collector->records[index];
+
+    if( record->parent != SIZE_MAX ) {
+        string = append_stack(context, string, collector, record->parent);
+        string = handlebars_string_append(context, string, HBS_STRL(";"));
+    }
+    if( record->type == handlebars_vm_trace_type_template ) {
+        string = handlebars_string_asprintf_append(context, string, "%s", record->name);
+    } else {
+        string = handlebars_string_asprintf_append(context, string, "%s:%s", trace_type_names[record->type], record->name);
+    }
+    return string;
+}
+
+static int compare_stacks(const void * a, const void * b, void * arg)
+{
+    struct handlebars_string ** stacks = arg;
+    return strcmp(hbs_str_val(stacks[*(const size_t *) a]), hbs_str_val(stacks[*(const size_t *) b]));
+}
+
+struct handlebars_string * handlebars_vm_trace_collector_folded(
+    struct handlebars_context * context,
+    struct handlebars_vm_trace_collector * collector
+) {
+    struct handlebars_string * string = handlebars_string_init(context, 256);
+    struct handlebars_string ** stacks = MC(handlebars_talloc_array(context, struct handlebars_string *, collector->count ? collector->count : 1));
+    size_t * order = MC(handlebars_talloc_array(context, size_t, collector->count ? collector->count : 1));
+    size_t count = 0;
+    size_t i;
+    size_t j;
+
+    for( i = 0; i < collector->count; i++ ) {
+        if( collector->records[i].done ) {
+            stacks[i] = append_stack(context, handlebars_string_init(context, 64), collector, i);
+            order[count++] = i;
+        } else {
+            stacks[i] = NULL;
+        }
+    }
+
+    // Merge identical stacks
+    sort_r(order, count, sizeof(size_t), compare_stacks, stacks);
+    for( i = 0; i < count; i = j ) {
+        uint64_t self_ns = 0;
+        for( j = i; j < count && 0 == strcmp(hbs_str_val(stacks[order[i]]), hbs_str_val(stacks[order[j]])); j++ ) {
+            struct handlebars_vm_trace_record * record = &collector->records[order[j]];
+            self_ns += record->duration_ns > record->nested_ns ? record->duration_ns - record->nested_ns : 0;
+        }
+        string = handlebars_string_append_str(context, string, stacks[order[i]]);
+        string = handlebars_string_asprintf_append(context, string, " %" PRIu64 "\n", self_ns);
+    }
+
+    for( i = 0; i < collector->count; i++ ) {
+        if( stacks[i] ) {
+            handlebars_talloc_free(stacks[i]);
+        }
+    }
+    handlebars_talloc_free(order);
+    handlebars_talloc_free(stacks);
+
+    return string;
+}
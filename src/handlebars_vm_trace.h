@@ -0,0 +1,208 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Execution tracing
+ *
+ * A VM can report when it begins and ends rendering a template, a partial or a helper call. Unlike profiles, tracing
+ * is always compiled in; when no trace callbacks are set, or a render is not sampled, it costs one branch per event.
+ * The trace collector records the events of a VM and exports them as Chrome trace event JSON (for chrome://tracing
+ * or Perfetto) or as folded stacks (for flamegraph.pl).
+ */
+
+#ifndef HANDLEBARS_VM_TRACE_H
+#define HANDLEBARS_VM_TRACE_H
+
+#include "handlebars.h"
+
+HBS_EXTERN_C_START
+
+struct handlebars_context;
+struct handlebars_string;
+struct handlebars_vm;
+struct handlebars_vm_trace_collector;
+
+#ifndef HANDLEBARS_VM_TRACE_COLLECTOR_LIMIT
+#define HANDLEBARS_VM_TRACE_COLLECTOR_LIMIT 100000
+#endif
+
+enum handlebars_vm_trace_type {
+    //! A top-level render
+    handlebars_vm_trace_type_template = 0,
+    //! A partial, including partial blocks
+    handlebars_vm_trace_type_partial = 1,
+    //! A helper call, including block helpers and helperMissing
+    handlebars_vm_trace_type_helper = 2
+};
+
+struct handlebars_vm_trace_event {
+    enum handlebars_vm_trace_type type;
+    //! The template, partial or helper name. Only valid for the duration of the callback.
+    const char * name;
+    size_t name_len;
+    //! The number of enclosing events, zero for the template
+    long depth;
+    //! When the event began, in nanoseconds from an arbitrary point (CLOCK_MONOTONIC)
+    uint64_t start_ns;
+    //! The duration of the event in nanoseconds, only set when it ends
+    uint64_t duration_ns;
+    //! The number of bytes the template, partial or helper produced, only set when it ends
+    size_t bytes;
+};
+
+/**
+ * @brief Trace callback
+ * @param[in] vm The VM
+ * @param[in] event The event
+ * @param[in] ctx The user pointer given to #handlebars_vm_set_trace
+ * @return void
+ */
+typedef void (*handlebars_vm_trace_func)(
+    struct handlebars_vm * vm,
+    const struct handlebars_vm_trace_event * event,
+    void * ctx
+);
+
+/**
+ * @brief Report the templates, partials and helpers a VM executes. Events nest: every begin is followed by the
+ *        matching end, also when an error aborts the render. Events ended by an error report no bytes.
+ * @param[in] vm The VM
+ * @param[in] begin_func Called when an event begins, or NULL
+ * @param[in] end_func Called when an event ends, or NULL
+ * @param[in] ctx An opaque user pointer passed to the callbacks
+ * @param[in] sample_interval Trace one in this many top-level renders, zero or one to trace all of them
+ * @return void
+ */
+void handlebars_vm_set_trace(
+    struct handlebars_vm * vm,
+    handlebars_vm_trace_func begin_func,
+    handlebars_vm_trace_func end_func,
+    void * ctx,
+    unsigned long sample_interval
+) HBS_ATTR_NONNULL(1);
+
+/**
+ * @brief Set the name reported for top-level renders. The string is not copied.
+ * @param[in] vm The VM
+ * @param[in] name The name, or NULL for "template"
+ * @return void
+ */
+void handlebars_vm_set_trace_name(
+    struct handlebars_vm * vm,
+    const char * name
+) HBS_ATTR_NONNULL(1);
+
+/**
+ * @brief Construct a trace collector. It records at most #HANDLEBARS_VM_TRACE_COLLECTOR_LIMIT events until it is
+ *        reset, see #handlebars_vm_trace_collector_set_limit.
+ * @param[in] context The handlebars context
+ * @return The trace collector
+ */
+struct handlebars_vm_trace_collector * handlebars_vm_trace_collector_ctor(
+    struct handlebars_context * context
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Destruct a trace collector
+ * @param[in] collector The trace collector
+ * @return void
+ */
+void handlebars_vm_trace_collector_dtor(
+    struct handlebars_vm_trace_collector * collector
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Record the events of a VM into a trace collector. A collector may be attached to several VMs in turn,
+ *        but not concurrently.
+ * @param[in] collector The trace collector
+ * @param[in] vm The VM
+ * @param[in] sample_interval See #handlebars_vm_set_trace
+ * @return void
+ */
+void handlebars_vm_trace_collector_attach(
+    struct handlebars_vm_trace_collector * collector,
+    struct handlebars_vm * vm,
+    unsigned long sample_interval
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Set the maximum number of events to record. Once it is reached, further events are dropped until the
+ *        collector is reset, so a long running VM does not keep growing the collector.
+ * @param[in] collector The trace collector
+ * @param[in] limit The maximum number of events, or zero for no limit
+ * @return void
+ */
+void handlebars_vm_trace_collector_set_limit(
+    struct handlebars_vm_trace_collector * collector,
+    size_t limit
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Discard the recorded events and the dropped count, e.g. after exporting them. Must not be called while an
+ *        attached VM is rendering.
+ * @param[in] collector The trace collector
+ * @return void
+ */
+void handlebars_vm_trace_collector_reset(
+    struct handlebars_vm_trace_collector * collector
+) HBS_ATTR_NONNULL_ALL;
+
+/**
+ * @brief Get the number of events that were recorded
+ * @param[in] collector The trace collector
+ * @return The number of events
+ */
+size_t handlebars_vm_trace_collector_count(
+    struct handlebars_vm_trace_collector * collector
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_PURE;
+
+/**
+ * @brief Get the number of events that were dropped because the limit was reached
+ * @param[in] collector The trace collector
+ * @return The number of events
+ */
+size_t handlebars_vm_trace_collector_dropped(
+    struct handlebars_vm_trace_collector * collector
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_PURE;
+
+/**
+ * @brief Export the recorded events in the Chrome trace event format, as complete ("X") events
+ * @param[in] context The handlebars context
+ * @param[in] collector The trace collector
+ * @return The JSON document
+ */
+struct handlebars_string * handlebars_vm_trace_collector_chrome(
+    struct handlebars_context * context,
+    struct handlebars_vm_trace_collector * collector
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+/**
+ * @brief Export the recorded events as folded stacks, one line per distinct stack with its self time in
+ *        nanoseconds, e.g. "index;partial:row;helper:each 1200"
+ * @param[in] context The handlebars context
+ * @param[in] collector The trace collector
+ * @return The folded stacks
+ */
+struct handlebars_string * handlebars_vm_trace_collector_folded(
+    struct handlebars_context * context,
+    struct handlebars_vm_trace_collector * collector
+) HBS_ATTR_NONNULL_ALL HBS_ATTR_RETURNS_NONNULL HBS_ATTR_WARN_UNUSED_RESULT;
+
+HBS_EXTERN_C_END
+
+#endif /* HANDLEBARS_VM_TRACE_H */
@@ -0,0 +1,336 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <check.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_binary.h"
+#include "handlebars_json_parser.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "utils.h"
+
+
+
+// The same document in all three formats, using most integer widths
+static const char * document_json =
+    "{\"title\":\"catalog\",\"count\":3,\"items\":["
+    "{\"id\":1,\"name\":\"first\",\"tags\":[\"a\",\"b\"]},"
+    "{\"id\":-2,\"price\":2.5,\"stock\":null},"
+    "{\"id\":300,\"neg\":-300,\"wide\":70000,\"big\":5000000000,\"nested\":{\"deep\":[[true],[false]]}}"
+    "],\"empty\":{},\"none\":[]}";
+
+static const char document_msgpack[] =
+    "\x85\xa5\x74\x69\x74\x6c\x65\xa7\x63\x61\x74\x61\x6c\x6f\x67\xa5\x63\x6f\x75\x6e\x74\x03\xa5\x69"
+    "\x74\x65\x6d\x73\x93\x83\xa2\x69\x64\x01\xa4\x6e\x61\x6d\x65\xa5\x66\x69\x72\x73\x74\xa4\x74\x61"
+    "\x67\x73\x92\xa1\x61\xa1\x62\x83\xa2\x69\x64\xfe\xa5\x70\x72\x69\x63\x65\xca\x40\x20\x00\x00\xa5"
+    "\x73\x74\x6f\x63\x6b\xc0\x85\xa2\x69\x64\xcd\x01\x2c\xa3\x6e\x65\x67\xd1\xfe\xd4\xa4\x77\x69\x64"
+    "\x65\xce\x00\x01\x11\x70\xa3\x62\x69\x67\xcf\x00\x00\x00\x01\x2a\x05\xf2\x00\xa6\x6e\x65\x73\x74"
+    "\x65\x64\x81\xa4\x64\x65\x65\x70\x92\x91\xc3\x91\xc2\xa5\x65\x6d\x70\x74\x79\x80\xa4\x6e\x6f\x6e"
+    "\x65\x90";
+
+static const char document_cbor[] =
+    "\xa5\x65\x74\x69\x74\x6c\x65\x67\x63\x61\x74\x61\x6c\x6f\x67\x65\x63\x6f\x75\x6e\x74\x03\x65\x69"
+    "\x74\x65\x6d\x73\x83\xa3\x62\x69\x64\x01\x64\x6e\x61\x6d\x65\x65\x66\x69\x72\x73\x74\x64\x74\x61"
+    "\x67\x73\x82\x61\x61\x61\x62\xa3\x62\x69\x64\x21\x65\x70\x72\x69\x63\x65\xf9\x41\x00\x65\x73\x74"
+    "\x6f\x63\x6b\xf6\xa5\x62\x69\x64\x19\x01\x2c\x63\x6e\x65\x67\x39\x01\x2b\x64\x77\x69\x64\x65\x1a"
+    "\x00\x01\x11\x70\x63\x62\x69\x67\x1b\x00\x00\x00\x01\x2a\x05\xf2\x00\x66\x6e\x65\x73\x74\x65\x64"
+    "\xa1\x64\x64\x65\x65\x70\x82\x81\xf5\x81\xf4\x65\x65\x6d\x70\x74\x79\xa0\x64\x6e\x6f\x6e\x65\x80";
+
+typedef void (*decode_func)(struct handlebars_context * ctx, struct handlebars_value * value, const char * data, size_t length);
+
+static void assert_decodes_as_json(decode_func decode, const char * data, size_t length)
+{
+    HANDLEBARS_VALUE_DECL(expected);
+    HANDLEBARS_VALUE_DECL(actual);
+    char * expected_dump;
+    char * actual_dump;
+
+    handlebars_value_parse_json_string(context, expected, document_json);
+    decode(context, actual, data, length);
+
+    expected_dump = handlebars_value_dump(expected, context, 0);
+    actual_dump = handlebars_value_dump(actual, context, 0);
+    ck_assert_str_eq(actual_dump, expected_dump);
+    handlebars_talloc_free(actual_dump);
+
+    handlebars_value_convert(actual);
+    ck_assert_int_eq(handlebars_value_get_real_type(actual), HANDLEBARS_VALUE_TYPE_MAP);
+    actual_dump = handlebars_value_dump(actual, context, 0);
+    ck_assert_str_eq(actual_dump, expected_dump);
+    handlebars_talloc_free(actual_dump);
+    handlebars_talloc_free(expected_dump);
+
+    HANDLEBARS_VALUE_UNDECL(actual);
+    HANDLEBARS_VALUE_UNDECL(expected);
+}
+
+START_TEST(test_msgpack_document)
+{
+    assert_decodes_as_json(handlebars_value_init_msgpack_stringl, document_msgpack, sizeof(document_msgpack) - 1);
+    assert_decodes_as_json(handlebars_value_init_msgpack_lazy, document_msgpack, sizeof(document_msgpack) - 1);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_cbor_document)
+{
+    assert_decodes_as_json(handlebars_value_init_cbor_stringl, document_cbor, sizeof(document_cbor) - 1);
+    assert_decodes_as_json(handlebars_value_init_cbor_lazy, document_cbor, sizeof(document_cbor) - 1);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_msgpack_scalars)
+{
+    HANDLEBARS_VALUE_DECL(value);
+
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xc3"));
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_TRUE);
+
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xe0"));
+    ck_assert_int_eq(handlebars_value_get_intval(value), -32);
+
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xd0\x80"));
+    ck_assert_int_eq(handlebars_value_get_intval(value), -128);
+
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xd3\x80\x00\x00\x00\x00\x00\x00\x00"));
+    ck_assert(handlebars_value_get_intval(value) == (-9223372036854775807L - 1));
+
+    // Too large for a long
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xcf\xff\xff\xff\xff\xff\xff\xff\xff"));
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_FLOAT);
+    ck_assert(handlebars_value_get_floatval(value) == 18446744073709551615.0);
+
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00"));
+    ck_assert(handlebars_value_get_floatval(value) == 1.5);
+
+    // bin, ext and fixext payloads are strings
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xc4\x03""bin"));
+    ck_assert_str_eq(handlebars_value_get_strval(value), "bin");
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xc7\x03\x05""ext"));
+    ck_assert_str_eq(handlebars_value_get_strval(value), "ext");
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xd6\x01""four"));
+    ck_assert_str_eq(handlebars_value_get_strval(value), "four");
+    handlebars_value_init_msgpack_stringl(context, value, HBS_STRL("\xda\x00\x05""str16"));
+    ck_assert_str_eq(handlebars_value_get_strval(value), "str16");
+
+    // A scalar root is decoded directly by the lazy variant
+    handlebars_value_init_msgpack_lazy(context, value, HBS_STRL("\xa3""abc"));
+    ck_assert_int_eq(handlebars_value_get_real_type(value), HANDLEBARS_VALUE_TYPE_STRING);
+    ck_assert_str_eq(handlebars_value_get_strval(value), "abc");
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_cbor_scalars)
+{
+    HANDLEBARS_VALUE_DECL(value);
+
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\x38\x63"));
+    ck_assert_int_eq(handlebars_value_get_intval(value), -100);
+
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\x3b\x7f\xff\xff\xff\xff\xff\xff\xff"));
+    ck_assert(handlebars_value_get_intval(value) == (-9223372036854775807L - 1));
+
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\x3b\xff\xff\xff\xff\xff\xff\xff\xff"));
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_FLOAT);
+
+    // Half, single and double precision
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xf9\x3c\x00"));
+    ck_assert(handlebars_value_get_floatval(value) == 1.0);
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xf9\x00\x01"));
+    ck_assert(handlebars_value_get_floatval(value) == 5.960464477539063e-8);
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xf9\xfc\x00"));
+    ck_assert(isinf(handlebars_value_get_floatval(value)) && handlebars_value_get_floatval(value) < 0);
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xfa\x47\xc3\x50\x00"));
+    ck_assert(handlebars_value_get_floatval(value) == 100000.0);
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xfb\x3f\xf1\x99\x99\x99\x99\x99\x9a"));
+    ck_assert(handlebars_value_get_floatval(value) == 1.1);
+
+    // undefined
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xf7"));
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_NULL);
+
+    // Tags are ignored, byte strings are strings
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xc0\x74""2013-03-21T20:04:00Z"));
+    ck_assert_str_eq(handlebars_value_get_strval(value), "2013-03-21T20:04:00Z");
+    handlebars_value_init_cbor_stringl(context, value, HBS_STRL("\xd8\x20\x43""abc"));
+    ck_assert_str_eq(handlebars_value_get_strval(value), "abc");
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_integer_keys)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(value);
+    struct handlebars_value * item;
+
+    // {1: "one", -2: "two", "1": "dup"}, the last duplicate wins
+    static const char msgpack[] = "\x83\x01\xa3one\xfe\xa3two\xa1\x31\xa3""dup";
+    static const char cbor[] = "\xa3\x01\x63one\x21\x63two\x61\x31\x63""dup";
+
+    handlebars_value_init_msgpack_stringl(context, value, msgpack, sizeof(msgpack) - 1);
+    ck_assert_int_eq(handlebars_value_count(value), 2);
+    item = handlebars_value_map_str_find(value, HBS_STRL("1"), rv);
+    ck_assert_str_eq(handlebars_value_get_strval(item), "dup");
+    item = handlebars_value_map_str_find(value, HBS_STRL("-2"), rv);
+    ck_assert_str_eq(handlebars_value_get_strval(item), "two");
+
+    handlebars_value_init_cbor_lazy(context, value, cbor, sizeof(cbor) - 1);
+    ck_assert_int_eq(handlebars_value_count(value), 2);
+    item = handlebars_value_map_str_find(value, HBS_STRL("1"), rv);
+    ck_assert_str_eq(handlebars_value_get_strval(item), "dup");
+    item = handlebars_value_map_str_find(value, HBS_STRL("-2"), rv);
+    ck_assert_str_eq(handlebars_value_get_strval(item), "two");
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+struct invalid_document {
+    decode_func decode;
+    const char * data;
+    size_t length;
+    const char * error;
+};
+
+#define INVALID_MSGPACK(str) {handlebars_value_init_msgpack_stringl, HBS_STRL(str), "MessagePack decode error: "}, \
+    {handlebars_value_init_msgpack_lazy, HBS_STRL(str), "MessagePack decode error: "}
+#define INVALID_CBOR(str) {handlebars_value_init_cbor_stringl, HBS_STRL(str), "CBOR decode error: "}, \
+    {handlebars_value_init_cbor_lazy, HBS_STRL(str), "CBOR decode error: "}
+
+static const struct invalid_document invalid_documents[] = {
+    INVALID_MSGPACK(""),
+    INVALID_MSGPACK("\xc1"),
+    INVALID_MSGPACK("\x01\x02"),
+    INVALID_MSGPACK("\x92\x01"),
+    INVALID_MSGPACK("\xa5""abc"),
+    INVALID_MSGPACK("\xcd\x01"),
+    INVALID_MSGPACK("\xd9"),
+    INVALID_MSGPACK("\xdd\xff\xff\xff\xff\x01"),
+    INVALID_MSGPACK("\x81\xa1k\x82\xa1x\x01\x90\x01"),
+    INVALID_MSGPACK("\x81\xa1k"),
+    INVALID_CBOR(""),
+    INVALID_CBOR("\x9f\xff"),
+    INVALID_CBOR("\x1c"),
+    INVALID_CBOR("\x18"),
+    INVALID_CBOR("\xc0"),
+    INVALID_CBOR("\x65""abc"),
+    INVALID_CBOR("\xa1\xf5\x01"),
+    INVALID_CBOR("\x9b\xff\xff\xff\xff\xff\xff\xff\xff\x01"),
+    INVALID_CBOR("\xf6\xf6"),
+};
+
+START_TEST(test_binary_errors)
+{
+    volatile size_t i;
+
+    for (i = 0; i < sizeof(invalid_documents) / sizeof(invalid_documents[0]); i++) {
+        const struct invalid_document * doc = &invalid_documents[i];
+        jmp_buf buf;
+        jmp_buf * prev = HBSCTX(context)->e->jmp;
+        HANDLEBARS_VALUE_DECL(value);
+        volatile bool thrown = false;
+        size_t blocks = talloc_total_blocks(context);
+
+        if (handlebars_setjmp_ex(context, &buf)) {
+            thrown = true;
+        } else {
+            doc->decode(context, value, doc->data, doc->length);
+        }
+        HBSCTX(context)->e->jmp = prev;
+
+        ck_assert_msg(thrown, "Decode of document %zu should have failed", (size_t) i);
+        ck_assert_msg(
+            0 == strncmp(handlebars_error_msg(context), doc->error, strlen(doc->error)),
+            "Unexpected error: %s", handlebars_error_msg(context)
+        );
+        // Only the error message should remain
+        ck_assert_msg(talloc_total_blocks(context) == blocks + 1, "Decode of document %zu leaked memory", (size_t) i);
+
+        HANDLEBARS_VALUE_UNDECL(value);
+    }
+}
+END_TEST
+
+START_TEST(test_binary_max_depth)
+{
+    jmp_buf buf;
+    jmp_buf * prev = HBSCTX(context)->e->jmp;
+    HANDLEBARS_VALUE_DECL(value);
+    volatile bool thrown = false;
+    char data[HANDLEBARS_BINARY_MAX_DEPTH + 2];
+
+    memset(data, '\x91', sizeof(data) - 1);
+    data[sizeof(data) - 1] = '\xc0';
+
+    if (handlebars_setjmp_ex(context, &buf)) {
+        thrown = true;
+    } else {
+        handlebars_value_init_msgpack_stringl(context, value, data, sizeof(data));
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert_str_eq(handlebars_error_msg(context), "MessagePack decode error: maximum nesting depth exceeded at offset 513");
+
+    // One level less is fine
+    handlebars_value_init_msgpack_stringl(context, value, data + 1, sizeof(data) - 1);
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_ARRAY);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+END_TEST
+
+static Suite * suite(void);
+static Suite * suite(void)
+{
+    Suite * s = suite_create("Binary");
+
+    REGISTER_TEST_FIXTURE(s, test_msgpack_document, "MessagePack document");
+    REGISTER_TEST_FIXTURE(s, test_cbor_document, "CBOR document");
+    REGISTER_TEST_FIXTURE(s, test_msgpack_scalars, "MessagePack scalars");
+    REGISTER_TEST_FIXTURE(s, test_cbor_scalars, "CBOR scalars");
+    REGISTER_TEST_FIXTURE(s, test_integer_keys, "Integer keys");
+    REGISTER_TEST_FIXTURE(s, test_binary_errors, "Decode errors");
+    REGISTER_TEST_FIXTURE(s, test_binary_max_depth, "Maximum depth");
+
+    return s;
+}
+
+int main(void)
+{
+    return default_main(&suite);
+}
@@ -0,0 +1,320 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <unistd.h>
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define HANDLEBARS_OPCODE_SERIALIZER_PRIVATE
+
+#include "handlebars.h"
+#include "handlebars_bundle.h"
+#include "handlebars_compiler.h"
+#include "handlebars_json_parser.h"
+#include "handlebars_memory.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_parser.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "handlebars_vm.h"
+#include "utils.h"
+
+
+
+static char bundle_file[] = "./handlebars-bundle-test.hbsb";
+static char bundle_file2[] = "./handlebars-bundle-test2.hbsb";
+
+static const char * names[] = {
+    "index", "users/list", "users/row"
+};
+
+static const char * tmpls[] = {
+    "Hello {{name}}!",
+    "{{#each users}}{{name}},{{/each}}",
+    "<li>{{name}}</li>"
+};
+
+static void write_bundle(const char * filename, bool reverse)
+{
+    struct handlebars_bundle_builder * builder = handlebars_bundle_builder_ctor(context);
+    size_t i;
+
+    for( i = 0; i < 3; i++ ) {
+        size_t j = reverse ? 2 - i : i;
+        handlebars_bundle_builder_add(builder, handlebars_string_ctor(context, names[j], strlen(names[j])), compile_module(tmpls[j], 0));
+    }
+
+    handlebars_bundle_builder_write(builder, filename);
+    handlebars_bundle_builder_dtor(builder);
+}
+
+static char * read_file(const char * filename, size_t * length)
+{
+    FILE * fp = fopen(filename, "rb");
+    char * buf;
+
+    ck_assert_ptr_ne(fp, NULL);
+    fseek(fp, 0, SEEK_END);
+    *length = (size_t) ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = talloc_size(context, *length);
+    ck_assert_uint_eq(fread(buf, 1, *length, fp), *length);
+    fclose(fp);
+    return buf;
+}
+
+START_TEST(test_bundle_roundtrip)
+{
+    struct handlebars_bundle * bundle;
+    struct handlebars_module * module;
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(value);
+
+    write_bundle(bundle_file, false);
+
+    bundle = handlebars_bundle_ctor(context, bundle_file);
+    ck_assert_uint_eq(handlebars_bundle_count(bundle), 3);
+
+    handlebars_value_parse_json_string(context, value, "{\"name\": \"Bob\", \"users\": [{\"name\": \"a\"}, {\"name\": \"b\"}]}");
+
+    module = handlebars_bundle_find(bundle, HBS_STRL("index"));
+    ck_assert_ptr_ne(module, NULL);
+    ck_assert_ptr_eq(module->addr, module);
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "Hello Bob!");
+
+    module = handlebars_bundle_find(bundle, HBS_STRL("users/list"));
+    ck_assert_ptr_ne(module, NULL);
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "a,b,");
+
+    // A second lookup returns the same module
+    ck_assert_ptr_eq(handlebars_bundle_find(bundle, HBS_STRL("users/list")), module);
+
+    module = handlebars_bundle_find(bundle, HBS_STRL("users/row"));
+    ck_assert_ptr_ne(module, NULL);
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "<li>Bob</li>");
+
+    ck_assert_ptr_eq(handlebars_bundle_find(bundle, HBS_STRL("users")), NULL);
+    ck_assert_ptr_eq(handlebars_bundle_find(bundle, HBS_STRL("users/rows")), NULL);
+    ck_assert_ptr_eq(handlebars_bundle_find(bundle, HBS_STRL("")), NULL);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    handlebars_bundle_dtor(bundle);
+}
+END_TEST
+
+START_TEST(test_bundle_deterministic)
+{
+    size_t length1;
+    size_t length2;
+    char * buf1;
+    char * buf2;
+
+    write_bundle(bundle_file, false);
+    sleep(1);
+    write_bundle(bundle_file2, true);
+
+    buf1 = read_file(bundle_file, &length1);
+    buf2 = read_file(bundle_file2, &length2);
+    ck_assert_uint_eq(length1, length2);
+    ck_assert(0 == memcmp(buf1, buf2, length1));
+}
+END_TEST
+
+START_TEST(test_bundle_duplicate_name)
+{
+    struct handlebars_bundle_builder * builder = handlebars_bundle_builder_ctor(context);
+    struct handlebars_module * module = compile_module("{{foo}}", 0);
+    jmp_buf buf;
+    jmp_buf * prev = HBSCTX(context)->e->jmp;
+    volatile bool thrown = false;
+
+    handlebars_bundle_builder_add(builder, handlebars_string_ctor(context, HBS_STRL("foo")), module);
+    handlebars_bundle_builder_add(builder, handlebars_string_ctor(context, HBS_STRL("bar")), module);
+    handlebars_bundle_builder_add(builder, handlebars_string_ctor(context, HBS_STRL("foo")), module);
+
+    if( handlebars_setjmp_ex(context, &buf) ) {
+        thrown = true;
+    } else {
+        handlebars_bundle_builder_write(builder, bundle_file);
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert_str_eq(handlebars_error_msg(context), "Duplicate module name in bundle: foo");
+    handlebars_bundle_builder_dtor(builder);
+}
+END_TEST
+
+START_TEST(test_bundle_damaged)
+{
+    struct handlebars_bundle * volatile bundle = NULL;
+    struct handlebars_module * module;
+    size_t length;
+    char * data;
+    FILE * fp;
+    jmp_buf buf;
+    jmp_buf * prev = HBSCTX(context)->e->jmp;
+    volatile bool thrown = false;
+
+    write_bundle(bundle_file, false);
+    data = read_file(bundle_file, &length);
+
+    // Damage the last module
+    data[length - 32] ^= 0x55;
+    fp = fopen(bundle_file, "wb");
+    ck_assert_uint_eq(fwrite(data, 1, length, fp), length);
+    fclose(fp);
+
+    bundle = handlebars_bundle_ctor(context, bundle_file);
+    module = handlebars_bundle_find(bundle, HBS_STRL("index"));
+    ck_assert_ptr_ne(module, NULL);
+
+    if( handlebars_setjmp_ex(context, &buf) ) {
+        thrown = true;
+    } else {
+        module = handlebars_bundle_find(bundle, HBS_STRL("users/row"));
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert(0 == strncmp(handlebars_error_msg(context), "Invalid module hash", strlen("Invalid module hash")));
+    handlebars_bundle_dtor(bundle);
+
+    // Not a bundle at all
+    fp = fopen(bundle_file, "wb");
+    ck_assert_uint_eq(fwrite(data + 8, 1, length - 8, fp), length - 8);
+    fclose(fp);
+
+    thrown = false;
+    if( handlebars_setjmp_ex(context, &buf) ) {
+        thrown = true;
+    } else {
+        bundle = handlebars_bundle_ctor(context, bundle_file);
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert(0 == strncmp(handlebars_error_msg(context), "Invalid bundle", strlen("Invalid bundle")));
+}
+END_TEST
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#define BUNDLE_TEST_THREADS 8
+
+static void * bundle_find_thread(void * ptr)
+{
+    struct handlebars_bundle * bundle = ptr;
+    size_t i;
+
+    for( i = 0; i < 3; i++ ) {
+        struct handlebars_module * module = handlebars_bundle_find(bundle, names[i], strlen(names[i]));
+        if( !module || module->addr != module ) {
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST(test_bundle_concurrent_find)
+{
+    struct handlebars_bundle * bundle;
+    struct handlebars_module * module;
+    struct handlebars_string * buffer;
+    pthread_t threads[BUNDLE_TEST_THREADS];
+    void * result;
+    int i;
+    HANDLEBARS_VALUE_DECL(value);
+
+    write_bundle(bundle_file, false);
+    bundle = handlebars_bundle_ctor(context, bundle_file);
+
+    // Every thread races to relocate the same modules
+    for( i = 0; i < BUNDLE_TEST_THREADS; i++ ) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, bundle_find_thread, bundle), 0);
+    }
+    for( i = 0; i < BUNDLE_TEST_THREADS; i++ ) {
+        ck_assert_int_eq(pthread_join(threads[i], &result), 0);
+        ck_assert_ptr_eq(result, NULL);
+    }
+
+    // Relocated exactly once
+    handlebars_value_parse_json_string(context, value, "{\"name\": \"Bob\", \"users\": [{\"name\": \"a\"}, {\"name\": \"b\"}]}");
+    module = handlebars_bundle_find(bundle, HBS_STRL("users/list"));
+    ck_assert_ptr_eq(module->addr, module);
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "a,b,");
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    handlebars_bundle_dtor(bundle);
+}
+END_TEST
+#endif
+
+START_TEST(test_bundle_module_format)
+{
+    struct handlebars_module * module = compile_module("{{foo}}", 0);
+
+    handlebars_module_generate_hash(module);
+    ck_assert_int_eq(handlebars_module_get_format(module), HANDLEBARS_MODULE_FORMAT);
+    ck_assert(handlebars_module_verify(module, NULL));
+
+    // Modules in another layout are rejected even if their hash matches
+    module->format = 0;
+    handlebars_module_generate_hash(module);
+    ck_assert(!handlebars_module_verify(module, NULL));
+}
+END_TEST
+
+static Suite * suite(void);
+static Suite * suite(void)
+{
+    Suite * s = suite_create("Bundle");
+
+    REGISTER_TEST_FIXTURE(s, test_bundle_roundtrip, "Round trip");
+    REGISTER_TEST_FIXTURE(s, test_bundle_deterministic, "Deterministic output");
+    REGISTER_TEST_FIXTURE(s, test_bundle_duplicate_name, "Duplicate name");
+    REGISTER_TEST_FIXTURE(s, test_bundle_damaged, "Damaged bundle");
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    REGISTER_TEST_FIXTURE(s, test_bundle_concurrent_find, "Concurrent find");
+#endif
+    REGISTER_TEST_FIXTURE(s, test_bundle_module_format, "Module format");
+
+    return s;
+}
+
+int main(void)
+{
+    int exit_code = default_main(&suite);
+    unlink(bundle_file);
+    unlink(bundle_file2);
+    return exit_code;
+}
@@ -23,6 +23,12 @@
 #include <stdio.h>
 #include <talloc.h>
 
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
 #ifndef YY_NO_UNISTD_H
 #include <unistd.h>
 #endif
@@ -58,6 +64,7 @@ struct cache_test_ctx {
 
 char lmdb_db_file[] = "./handlebars-lmdb-cache-test.mdb";
 char lmdb_db_lock_file[] = "./handlebars-lmdb-cache-test.mdb-lock";
+char mmap_cache_file[] = "./handlebars-mmap-cache-test.bin";
 
 static const char * tmpls[] = {
     "{{foo}}", "{{bar}}", "{{baz}}"
@@ -282,6 +289,257 @@ START_TEST(test_mmap_cache_reset)
     handlebars_cache_dtor(cache);
 }
 END_TEST
+
+#define MMAP_TEST_KEYS 100
+#define MMAP_TEST_THREADS 8
+#define MMAP_TEST_ITERATIONS 1000
+
+struct mmap_cache_thread_args {
+    struct handlebars_cache * cache;
+    struct handlebars_string ** keys;
+};
+
+static void * mmap_cache_thread(void * ptr)
+{
+    struct mmap_cache_thread_args * args = ptr;
+    int i;
+    int j;
+
+    for( i = 0; i < MMAP_TEST_ITERATIONS; i++ ) {
+        for( j = 0; j < MMAP_TEST_KEYS; j++ ) {
+            struct handlebars_module * module = handlebars_cache_find(args->cache, args->keys[j]);
+            if( module ) {
+                handlebars_cache_release(args->cache, args->keys[j], module);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST(test_mmap_cache_shards)
+{
+    struct handlebars_cache * cache = handlebars_cache_mmap_ctor(context, 2097152, 2053);
+    struct handlebars_module * module = compile_module("{{foo}}", 0);
+    struct handlebars_string * keys[MMAP_TEST_KEYS];
+    struct handlebars_module * found[MMAP_TEST_KEYS];
+    struct handlebars_cache_stat stat;
+    struct mmap_cache_thread_args args = {cache, keys};
+    pthread_t threads[MMAP_TEST_THREADS];
+    size_t found_count = 0;
+    size_t hits;
+    char buf[32];
+    int i;
+
+    for( i = 0; i < MMAP_TEST_KEYS; i++ ) {
+        snprintf(buf, sizeof(buf), "template-%d", i);
+        keys[i] = handlebars_string_ctor(context, buf, strlen(buf));
+        handlebars_cache_add(cache, keys[i], module);
+    }
+
+    // Each key either has its own slot or collided with another one
+    stat = handlebars_cache_stat(cache);
+    ck_assert_uint_eq(stat.current_entries + stat.collisions, MMAP_TEST_KEYS);
+
+    for( i = 0; i < MMAP_TEST_KEYS; i++ ) {
+        found[i] = handlebars_cache_find(cache, keys[i]);
+        if( found[i] ) {
+            ck_assert_uint_eq(found[i]->size, module->size);
+            found_count++;
+        }
+    }
+    ck_assert_uint_eq(found_count, stat.current_entries);
+    ck_assert_uint_eq(handlebars_cache_stat(cache).refcount, found_count);
+
+    for( i = 0; i < MMAP_TEST_KEYS; i++ ) {
+        if( found[i] ) {
+            handlebars_cache_release(cache, keys[i], found[i]);
+        }
+    }
+    ck_assert_uint_eq(handlebars_cache_stat(cache).refcount, 0);
+
+    // Concurrent lookups
+    hits = handlebars_cache_stat(cache).hits;
+    for( i = 0; i < MMAP_TEST_THREADS; i++ ) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, mmap_cache_thread, &args), 0);
+    }
+    for( i = 0; i < MMAP_TEST_THREADS; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+    stat = handlebars_cache_stat(cache);
+    ck_assert_uint_eq(stat.hits - hits, found_count * MMAP_TEST_THREADS * MMAP_TEST_ITERATIONS);
+    ck_assert_uint_eq(stat.refcount, 0);
+
+    handlebars_cache_reset(cache);
+    ck_assert_uint_eq(handlebars_cache_stat(cache).current_entries, 0);
+    ck_assert_ptr_eq(handlebars_cache_find(cache, keys[0]), NULL);
+
+    handlebars_cache_dtor(cache);
+}
+END_TEST
+
+static void assert_module_intact(struct handlebars_module * module, struct handlebars_module * expected)
+{
+    ck_assert_ptr_eq(module->addr, module);
+    ck_assert_uint_eq(module->size, expected->size);
+    ck_assert_uint_eq(module->opcode_count, expected->opcode_count);
+    ck_assert((char *) module->opcodes > (char *) module && (char *) module->opcodes < (char *) module + module->size);
+}
+
+START_TEST(test_mmap_cache_eviction)
+{
+    // Room for about a hundred modules of different sizes, and far more slots than that
+    struct handlebars_cache * cache = handlebars_cache_mmap_ctor(context, 512 * 1024, 2048);
+    struct handlebars_module * modules[3];
+    struct handlebars_string * pinned_key;
+    struct handlebars_module * pinned;
+    struct handlebars_cache_stat stat;
+    size_t collisions = 0;
+    char buf[32];
+    int i;
+
+    modules[0] = compile_module("{{foo}}", 0);
+    modules[1] = compile_module("{{a}} {{b}} {{c}}", 0);
+    modules[2] = compile_module("{{a}} {{b}} {{c}} {{d}} {{e}} {{f}}", 0);
+
+    pinned_key = handlebars_string_ctor(context, HBS_STRL("pinned"));
+    handlebars_cache_add(cache, pinned_key, modules[1]);
+    pinned = handlebars_cache_find(cache, pinned_key);
+    ck_assert_ptr_ne(pinned, NULL);
+
+    // Every added entry is immediately available, older ones are evicted to make room for it
+    for( i = 0; i < 5000; i++ ) {
+        struct handlebars_string * key;
+        struct handlebars_module * module;
+
+        snprintf(buf, sizeof(buf), "template-%d", i);
+        key = handlebars_string_ctor(context, buf, strlen(buf));
+        handlebars_cache_add(cache, key, modules[i % 3]);
+
+        module = handlebars_cache_find(cache, key);
+        if( module ) {
+            assert_module_intact(module, modules[i % 3]);
+            handlebars_cache_release(cache, key, module);
+        } else {
+            ck_assert_uint_gt(handlebars_cache_stat(cache).collisions, collisions);
+            collisions = handlebars_cache_stat(cache).collisions;
+        }
+        handlebars_talloc_free(key);
+    }
+
+    // Entries that were moved to defragment the segment are still intact
+    for( i = 0; i < 5000; i++ ) {
+        struct handlebars_string * key;
+        struct handlebars_module * module;
+
+        snprintf(buf, sizeof(buf), "template-%d", i);
+        key = handlebars_string_ctor(context, buf, strlen(buf));
+        module = handlebars_cache_find(cache, key);
+        if( module ) {
+            assert_module_intact(module, modules[i % 3]);
+            handlebars_cache_release(cache, key, module);
+        }
+        handlebars_talloc_free(key);
+    }
+
+    stat = handlebars_cache_stat(cache);
+    ck_assert_uint_gt(stat.current_entries, 10);
+    ck_assert_uint_lt(stat.current_entries, 5000);
+    ck_assert_uint_le(stat.current_data_size, stat.total_data_size);
+    ck_assert_uint_eq(stat.refcount, 1);
+
+    // The entry in use was neither evicted nor moved
+    ck_assert_ptr_eq(handlebars_cache_find(cache, pinned_key), pinned);
+    assert_module_intact(pinned, modules[1]);
+    handlebars_cache_release(cache, pinned_key, pinned);
+    handlebars_cache_release(cache, pinned_key, pinned);
+    ck_assert_uint_eq(handlebars_cache_stat(cache).refcount, 0);
+
+    // Reset frees everything
+    handlebars_cache_reset(cache);
+    stat = handlebars_cache_stat(cache);
+    ck_assert_uint_eq(stat.current_entries, 0);
+    ck_assert_uint_eq(stat.current_data_size, 0);
+
+    handlebars_cache_dtor(cache);
+}
+END_TEST
+
+START_TEST(test_mmap_cache_file)
+{
+    struct handlebars_cache * cache;
+    struct handlebars_module * modules[3];
+    struct handlebars_string * keys[3];
+    struct handlebars_module * module;
+    void * base;
+    void * placeholder;
+    size_t size;
+    off_t corrupt_offset = 0;
+    int fd;
+    int i;
+
+    modules[0] = compile_module("{{foo}}", 0);
+    modules[1] = compile_module("{{a}} {{b}} {{c}}", 0);
+    modules[2] = compile_module("{{a}} {{b}} {{c}} {{d}} {{e}} {{f}}", 0);
+    keys[0] = handlebars_string_ctor(context, HBS_STRL("foo"));
+    keys[1] = handlebars_string_ctor(context, HBS_STRL("bar"));
+    keys[2] = handlebars_string_ctor(context, HBS_STRL("baz"));
+
+    cache = handlebars_cache_mmap_file_ctor(context, mmap_cache_file, 2097152, 2053);
+    for( i = 0; i < 3; i++ ) {
+        handlebars_cache_add(cache, keys[i], modules[i]);
+    }
+    handlebars_cache_dtor(cache);
+
+    // The entries survive closing the file
+    cache = handlebars_cache_mmap_file_ctor(context, mmap_cache_file, 2097152, 2053);
+    ck_assert_uint_eq(handlebars_cache_stat(cache).current_entries, 3);
+    for( i = 0; i < 3; i++ ) {
+        module = handlebars_cache_find(cache, keys[i]);
+        ck_assert_ptr_ne(module, NULL);
+        assert_module_intact(module, modules[i]);
+        if( i == 1 ) {
+            corrupt_offset = (off_t) ((char *) module - (char *) cache->internal) + (off_t) module->size - 1;
+        }
+        handlebars_cache_release(cache, keys[i], module);
+    }
+    base = cache->internal;
+    size = handlebars_cache_stat(cache).total_size;
+    handlebars_cache_dtor(cache);
+
+    // Damage one of them, and take the address the file was mapped at
+    fd = open(mmap_cache_file, O_RDWR);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pwrite(fd, "\xff", 1, corrupt_offset), 1);
+    close(fd);
+    placeholder = mmap(base, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ck_assert_ptr_ne(placeholder, MAP_FAILED);
+
+    // The file is moved and the damaged entry is dropped
+    cache = handlebars_cache_mmap_file_ctor(context, mmap_cache_file, 2097152, 2053);
+    if( placeholder == base ) {
+        ck_assert_ptr_ne(cache->internal, base);
+    }
+    ck_assert_uint_eq(handlebars_cache_stat(cache).current_entries, 2);
+    ck_assert_ptr_eq(handlebars_cache_find(cache, keys[1]), NULL);
+    for( i = 0; i < 3; i += 2 ) {
+        module = handlebars_cache_find(cache, keys[i]);
+        ck_assert_ptr_ne(module, NULL);
+        assert_module_intact(module, modules[i]);
+        handlebars_cache_release(cache, keys[i], module);
+    }
+    handlebars_cache_add(cache, keys[1], modules[1]);
+    ck_assert_uint_eq(handlebars_cache_stat(cache).current_entries, 3);
+    handlebars_cache_dtor(cache);
+    munmap(placeholder, size);
+
+    // A different layout starts over
+    cache = handlebars_cache_mmap_file_ctor(context, mmap_cache_file, 2097152, 1024);
+    ck_assert_uint_eq(handlebars_cache_stat(cache).current_entries, 0);
+    ck_assert_ptr_eq(handlebars_cache_find(cache, keys[0]), NULL);
+    handlebars_cache_dtor(cache);
+}
+END_TEST
 #endif
 
 static Suite * suite(void);
@@ -300,6 +558,9 @@ static Suite * suite(void)
 #ifdef HANDLEBARS_HAVE_PTHREAD
     REGISTER_TEST_FIXTURE(s, test_mmap_cache_gc, "MMAP Cache (GC)");
     REGISTER_TEST_FIXTURE(s, test_mmap_cache_reset, "MMAP Cache (Reset)");
+    REGISTER_TEST_FIXTURE(s, test_mmap_cache_shards, "MMAP Cache (Shards)");
+    REGISTER_TEST_FIXTURE(s, test_mmap_cache_eviction, "MMAP Cache (Eviction)");
+    REGISTER_TEST_FIXTURE(s, test_mmap_cache_file, "MMAP Cache (File)");
 #endif
 
     return s;
@@ -309,8 +570,10 @@ int main(void)
 {
     unlink(lmdb_db_file);
     unlink(lmdb_db_lock_file);
+    unlink(mmap_cache_file);
     int exit_code = default_main(&suite);
     unlink(lmdb_db_file);
     unlink(lmdb_db_lock_file);
+    unlink(mmap_cache_file);
     return exit_code;
 }
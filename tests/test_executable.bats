@@ -309,6 +309,13 @@ load "../vendor/bats-assert/assert"
     assert_output "|bar|"
 }
 
+@test "--execute --stream" {
+    skip_if_no_json
+    run $HANDLEBARSC --execute --stream --data $BENCH_DIR/templates/partial.json $PARTIAL_FLAGS $BENCH_DIR/templates/partial.handlebars
+    assert_success
+    assert_output "`cat $BENCH_DIR/templates/partial.expected`"
+}
+
 @test "array-each" {
     skip_if_no_json
     run $HANDLEBARSC --data $BENCH_DIR/templates/array-each.json $BENCH_DIR/templates/array-each.handlebars
@@ -462,3 +469,35 @@ load "../vendor/bats-assert/assert"
     assert_success
     assert_output "`cat $BENCH_DIR/templates/variables.expected`"
 }
+
+@test "--bundle" {
+    skip_if_no_json
+    run $HANDLEBARSC --bundle --partial-ext .handlebars --jobs 4 --bundle-file $BATS_TMPDIR/templates.hbsb -t $BENCH_DIR/templates
+    assert_success
+    run $HANDLEBARSC --bundle-file $BATS_TMPDIR/templates.hbsb --data $BENCH_DIR/templates/complex.json complex
+    assert_success
+    assert_output "`cat $BENCH_DIR/templates/complex.expected`"
+}
+
+@test "--bundle --timings" {
+    run $HANDLEBARSC --bundle --partial-ext .handlebars --timings --bundle-file $BATS_TMPDIR/templates.hbsb -t $BENCH_DIR/templates
+    assert_success
+    assert_output --partial "Compiled 12 templates"
+}
+
+@test "--bundle with a list of templates" {
+    skip_if_no_json
+    printf '%s\n' $BENCH_DIR/templates/complex.handlebars $BENCH_DIR/templates/string.handlebars > $BATS_TMPDIR/templates.txt
+    run $HANDLEBARSC --bundle --partial-ext .handlebars --bundle-file $BATS_TMPDIR/list.hbsb -t $BATS_TMPDIR/templates.txt
+    assert_success
+    run $HANDLEBARSC --bundle-file $BATS_TMPDIR/list.hbsb --data $BENCH_DIR/templates/string.json $BENCH_DIR/templates/string
+    assert_success
+    assert_output "`cat $BENCH_DIR/templates/string.expected`"
+}
+
+@test "--bundle with a missing template" {
+    echo "missing.handlebars" > $BATS_TMPDIR/missing.txt
+    run $HANDLEBARSC --bundle --bundle-file $BATS_TMPDIR/missing.hbsb -t $BATS_TMPDIR/missing.txt
+    assert_failure
+    assert_output --partial "missing.handlebars: Failed to open file"
+}
@@ -0,0 +1,407 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <unistd.h>
+
+#include "handlebars.h"
+#include "handlebars_memory.h"
+#include "handlebars_map.h"
+#include "handlebars_json.h"
+#include "handlebars_json_parser.h"
+#include "handlebars_stack.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "utils.h"
+
+
+
+START_TEST(test_json_parser_scalars)
+{
+    HANDLEBARS_VALUE_DECL(value);
+
+    handlebars_value_parse_json_string(context, value, " true ");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_TRUE);
+
+    handlebars_value_parse_json_string(context, value, "false");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_FALSE);
+
+    handlebars_value_parse_json_string(context, value, "null");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_NULL);
+
+    handlebars_value_parse_json_string(context, value, "-2358");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_INTEGER);
+    ck_assert_int_eq(handlebars_value_get_intval(value), -2358);
+
+    handlebars_value_parse_json_string(context, value, "9223372036854775807");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_INTEGER);
+    ck_assert(handlebars_value_get_intval(value) == 9223372036854775807L);
+
+    handlebars_value_parse_json_string(context, value, "92233720368547758070");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_FLOAT);
+
+    handlebars_value_parse_json_string(context, value, "-1234.5e-2");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_FLOAT);
+    ck_assert(handlebars_value_get_floatval(value) == -12.345);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_json_parser_strings)
+{
+    HANDLEBARS_VALUE_DECL(value);
+
+    handlebars_value_parse_json_string(context, value, "\"a string long enough to cross a sixteen byte boundary\"");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_STRING);
+    ck_assert_str_eq(handlebars_value_get_strval(value), "a string long enough to cross a sixteen byte boundary");
+
+    handlebars_value_parse_json_string(context, value, "\"tab\\tquote\\\"slash\\/back\\\\\\u00e9\\u20ac\\ud83d\\ude00\"");
+    ck_assert_str_eq(handlebars_value_get_strval(value), "tab\tquote\"slash/back\\\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+
+    // Unpaired surrogates are replaced
+    handlebars_value_parse_json_string(context, value, "\"\\ud83dx\"");
+    ck_assert_str_eq(handlebars_value_get_strval(value), "\xef\xbf\xbdx");
+
+    // Embedded NUL
+    handlebars_value_parse_json_string(context, value, "\"a\\u0000b\"");
+    ck_assert_uint_eq(handlebars_value_get_strlen(value), 3);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_json_parser_complex)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(rv2);
+    HANDLEBARS_VALUE_DECL(value);
+    struct handlebars_value * value2;
+    struct handlebars_value * value3;
+
+    handlebars_value_parse_json_string(context, value, "{\"a\": 2358, \"b\": [1, 2.1, [], {}], \"c\": {\"d\": \"test\", \"d\": \"dup\"}}");
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_MAP);
+    ck_assert_uint_eq(handlebars_value_count(value), 3);
+
+    value2 = handlebars_value_map_str_find(value, HBS_STRL("a"), rv);
+    ck_assert_int_eq(handlebars_value_get_type(value2), HANDLEBARS_VALUE_TYPE_INTEGER);
+    ck_assert_int_eq(handlebars_value_get_intval(value2), 2358);
+
+    value2 = handlebars_value_map_str_find(value, HBS_STRL("b"), rv);
+    ck_assert_int_eq(handlebars_value_get_type(value2), HANDLEBARS_VALUE_TYPE_ARRAY);
+    ck_assert_uint_eq(handlebars_value_count(value2), 4);
+    value3 = handlebars_value_array_find(value2, 1, rv2);
+    ck_assert_int_eq(handlebars_value_get_type(value3), HANDLEBARS_VALUE_TYPE_FLOAT);
+    value3 = handlebars_value_array_find(value2, 2, rv2);
+    ck_assert_int_eq(handlebars_value_get_type(value3), HANDLEBARS_VALUE_TYPE_ARRAY);
+    ck_assert_uint_eq(handlebars_value_count(value3), 0);
+    value3 = handlebars_value_array_find(value2, 3, rv2);
+    ck_assert_int_eq(handlebars_value_get_type(value3), HANDLEBARS_VALUE_TYPE_MAP);
+    ck_assert_uint_eq(handlebars_value_count(value3), 0);
+
+    // The last duplicate key wins
+    value2 = handlebars_value_map_str_find(value, HBS_STRL("c"), rv);
+    ck_assert_uint_eq(handlebars_value_count(value2), 1);
+    value3 = handlebars_value_map_str_find(value2, HBS_STRL("d"), rv2);
+    ck_assert_str_eq(handlebars_value_get_strval(value3), "dup");
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    HANDLEBARS_VALUE_UNDECL(rv2);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_json_parser_shared_keys)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(value);
+    struct handlebars_string * keys[2] = {NULL, NULL};
+    int i;
+
+    handlebars_value_parse_json_string(context, value, "[{\"name\": 1}, {\"n\\u0061me\": 2}]");
+
+    for (i = 0; i < 2; i++) {
+        struct handlebars_value * item = handlebars_value_array_find(value, i, rv);
+        struct handlebars_map * map = handlebars_value_get_map(item);
+        handlebars_map_foreach(map, index, key, child) {
+            (void) child;
+            keys[i] = key;
+        } handlebars_map_foreach_end(map);
+    }
+
+    ck_assert_ptr_ne(keys[0], NULL);
+    ck_assert_ptr_eq(keys[0], keys[1]);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+static const char * invalid_json[] = {
+    "",
+    "   ",
+    "{\"key\":1",
+    "{\"key\" 1}",
+    "{key: 1}",
+    "[1, 2,]",
+    "[1 2]",
+    "01",
+    "-",
+    "1.",
+    "1e",
+    "tru",
+    "nul",
+    "\"unterminated",
+    "\"bad \\x escape\"",
+    "\"bad \\u12 escape\"",
+    "\"raw \n newline\"",
+    "{} {}",
+    "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+    "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+    "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+    "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+    "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[",
+    "{\"a\": [1, {\"b\": \"c\"}, 2], \"d\": ]",
+};
+
+START_TEST(test_json_parser_errors)
+{
+    volatile size_t i;
+
+    for (i = 0; i < sizeof(invalid_json) / sizeof(invalid_json[0]); i++) {
+        jmp_buf buf;
+        jmp_buf * prev = HBSCTX(context)->e->jmp;
+        HANDLEBARS_VALUE_DECL(value);
+        volatile bool thrown = false;
+#if !defined(HANDLEBARS_NO_REFCOUNT)
+        size_t blocks = talloc_total_blocks(context);
+#endif
+
+        if (handlebars_setjmp_ex(context, &buf)) {
+            thrown = true;
+        } else {
+            handlebars_value_parse_json_string(context, value, invalid_json[i]);
+        }
+        HBSCTX(context)->e->jmp = prev;
+
+        ck_assert_msg(thrown, "Parse of '%s' should have failed", invalid_json[i]);
+        ck_assert_msg(
+            0 == strncmp(handlebars_error_msg(context), HBS_STRL("JSON Parse error: ")),
+            "Unexpected error: %s", handlebars_error_msg(context)
+        );
+#if !defined(HANDLEBARS_NO_REFCOUNT)
+        // Only the error message should remain
+        ck_assert_msg(talloc_total_blocks(context) == blocks + 1, "Parse of '%s' leaked memory", invalid_json[i]);
+#endif
+
+        HANDLEBARS_VALUE_UNDECL(value);
+    }
+}
+END_TEST
+
+static const char * lazy_document =
+    "{\"title\": \"catalog\", \"count\": 3, \"items\": ["
+    "{\"id\": 1, \"name\": \"first\", \"tags\": [\"a\", \"b\"]}, "
+    "{\"id\": 2, \"name\": \"second\", \"price\": 2.5, \"stock\": null}, "
+    "{\"id\": 3, \"name\": \"th\\u0069rd\", \"nested\": {\"deep\": [[true], [false]]}}"
+    "], \"t\\u0069tle\": \"dup\", \"empty\": {}, \"none\": []}";
+
+START_TEST(test_json_parser_lazy)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(rv2);
+    HANDLEBARS_VALUE_DECL(value);
+    struct handlebars_value * items;
+    struct handlebars_value * item;
+
+    handlebars_value_init_json_lazy(context, value, lazy_document, strlen(lazy_document));
+    ck_assert_int_eq(handlebars_value_get_real_type(value), HANDLEBARS_VALUE_TYPE_USER);
+    ck_assert_int_eq(handlebars_value_get_type(value), HANDLEBARS_VALUE_TYPE_MAP);
+
+    // The duplicate key, spelled with an escape, replaces the value in place
+    ck_assert_int_eq(handlebars_value_count(value), 5);
+    item = handlebars_value_map_str_find(value, HBS_STRL("title"), rv);
+    ck_assert_str_eq(handlebars_value_get_strval(item), "dup");
+    ck_assert_ptr_eq(handlebars_value_map_str_find(value, HBS_STRL("missing"), rv), NULL);
+
+    items = handlebars_value_map_str_find(value, HBS_STRL("items"), rv);
+    ck_assert_int_eq(handlebars_value_get_type(items), HANDLEBARS_VALUE_TYPE_ARRAY);
+    ck_assert_int_eq(handlebars_value_count(items), 3);
+    ck_assert_ptr_eq(handlebars_value_array_find(items, 3, rv2), NULL);
+
+    item = handlebars_value_array_find(items, 2, rv2);
+    item = handlebars_value_map_str_find(item, HBS_STRL("name"), rv2);
+    ck_assert_str_eq(handlebars_value_get_strval(item), "third");
+
+    item = handlebars_value_array_find(items, 1, rv2);
+    item = handlebars_value_map_str_find(item, HBS_STRL("price"), rv2);
+    ck_assert(handlebars_value_get_floatval(item) == 2.5);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    HANDLEBARS_VALUE_UNDECL(rv2);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_json_parser_lazy_matches_parser)
+{
+    HANDLEBARS_VALUE_DECL(expected);
+    HANDLEBARS_VALUE_DECL(actual);
+    char * expected_dump;
+    char * actual_dump;
+
+    handlebars_value_parse_json_string(context, expected, lazy_document);
+    handlebars_value_init_json_lazy(context, actual, lazy_document, strlen(lazy_document));
+
+    // Dumping iterates the lazy value
+    expected_dump = handlebars_value_dump(expected, context, 0);
+    actual_dump = handlebars_value_dump(actual, context, 0);
+    ck_assert_str_eq(actual_dump, expected_dump);
+    handlebars_talloc_free(actual_dump);
+
+    handlebars_value_convert(actual);
+    ck_assert_int_eq(handlebars_value_get_real_type(actual), HANDLEBARS_VALUE_TYPE_MAP);
+    actual_dump = handlebars_value_dump(actual, context, 0);
+    ck_assert_str_eq(actual_dump, expected_dump);
+    handlebars_talloc_free(actual_dump);
+    handlebars_talloc_free(expected_dump);
+
+    HANDLEBARS_VALUE_UNDECL(actual);
+    HANDLEBARS_VALUE_UNDECL(expected);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_json_parser_lazy_file)
+{
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(value);
+    char filename[] = "/tmp/handlebars-json-XXXXXX";
+    int fd = mkstemp(filename);
+    struct handlebars_value * item;
+
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(write(fd, lazy_document, strlen(lazy_document)), strlen(lazy_document));
+    close(fd);
+
+    handlebars_value_init_json_lazy_file(context, value, filename);
+    unlink(filename);
+
+    item = handlebars_value_map_str_find(value, HBS_STRL("count"), rv);
+    ck_assert_int_eq(handlebars_value_get_intval(item), 3);
+
+    HANDLEBARS_VALUE_UNDECL(value);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_json_parser_lazy_errors)
+{
+    volatile size_t i;
+
+    for (i = 0; i < sizeof(invalid_json) / sizeof(invalid_json[0]); i++) {
+        jmp_buf buf;
+        jmp_buf * prev = HBSCTX(context)->e->jmp;
+        HANDLEBARS_VALUE_DECL(value);
+        volatile bool thrown = false;
+        size_t blocks = talloc_total_blocks(context);
+
+        if (handlebars_setjmp_ex(context, &buf)) {
+            thrown = true;
+        } else {
+            handlebars_value_init_json_lazy(context, value, invalid_json[i], strlen(invalid_json[i]));
+        }
+        HBSCTX(context)->e->jmp = prev;
+
+        ck_assert_msg(thrown, "Parse of '%s' should have failed", invalid_json[i]);
+        ck_assert_msg(
+            0 == strncmp(handlebars_error_msg(context), HBS_STRL("JSON Parse error: ")),
+            "Unexpected error: %s", handlebars_error_msg(context)
+        );
+        ck_assert_msg(talloc_total_blocks(context) == blocks + 1, "Parse of '%s' leaked memory", invalid_json[i]);
+
+        HANDLEBARS_VALUE_UNDECL(value);
+    }
+}
+END_TEST
+
+#ifdef HANDLEBARS_HAVE_JSON
+START_TEST(test_json_parser_matches_json_c)
+{
+    static const char * documents[] = {
+        "{\"a\": 2358, \"b\": [1, 2.5, true, false, null], \"c\": {\"d\": \"test\", \"e\": \"\\u00e9\\n\"}}",
+        "[{\"id\": 1, \"tags\": [\"x\", \"y\"]}, {\"id\": 2, \"tags\": []}, {\"id\": -3, \"nested\": {\"deep\": [[1], [2]]}}]",
+        "\"just a string\"",
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(documents) / sizeof(documents[0]); i++) {
+        HANDLEBARS_VALUE_DECL(expected);
+        HANDLEBARS_VALUE_DECL(actual);
+
+        handlebars_value_init_json_string(context, expected, documents[i]);
+        handlebars_value_convert(expected);
+        handlebars_value_parse_json_string(context, actual, documents[i]);
+
+        ck_assert_str_eq(handlebars_value_dump(actual, context, 0), handlebars_value_dump(expected, context, 0));
+
+        HANDLEBARS_VALUE_UNDECL(actual);
+        HANDLEBARS_VALUE_UNDECL(expected);
+    }
+}
+END_TEST
+#endif
+
+static Suite * suite(void);
+static Suite * suite(void)
+{
+    Suite * s = suite_create("JSON Parser");
+
+    REGISTER_TEST_FIXTURE(s, test_json_parser_scalars, "Scalars");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_strings, "Strings");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_complex, "Complex");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_shared_keys, "Shared keys");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_errors, "Parse errors");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_lazy, "Lazy");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_lazy_matches_parser, "Lazy matches parser");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_lazy_file, "Lazy file");
+    REGISTER_TEST_FIXTURE(s, test_json_parser_lazy_errors, "Lazy parse errors");
+#ifdef HANDLEBARS_HAVE_JSON
+    REGISTER_TEST_FIXTURE(s, test_json_parser_matches_json_c, "Matches json-c");
+#endif
+
+    return s;
+}
+
+int main(void)
+{
+    return default_main(&suite);
+}
@@ -20,6 +20,7 @@
 #endif
 
 #include <check.h>
+#include <string.h>
 #include <talloc.h>
 
 #include "handlebars.h"
@@ -341,6 +342,91 @@ START_TEST(test_map_remove_nonexist)
 }
 END_TEST
 
+START_TEST(test_map_find_ex)
+{
+    struct handlebars_map * map;
+    struct handlebars_string * str1;
+    struct handlebars_string * str2;
+    uint32_t hint = 0;
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    map = handlebars_map_ctor(context, 3);
+    str1 = handlebars_string_ctor(context, HBS_STRL("a"));
+    handlebars_string_addref(str1);
+    str2 = handlebars_string_ctor(context, HBS_STRL("b"));
+    handlebars_string_addref(str2);
+
+    handlebars_value_integer(tmp, 1);
+    map = handlebars_map_add(map, str1, tmp);
+    handlebars_value_integer(tmp, 2);
+    map = handlebars_map_add(map, str2, tmp);
+
+    // Miss on the hinted slot falls back to a probe and updates the hint
+    ck_assert_int_eq(2, handlebars_value_get_intval(handlebars_map_find_ex(map, str2, &hint)));
+    ck_assert_uint_eq(1, hint);
+    ck_assert_int_eq(2, handlebars_value_get_intval(handlebars_map_find_ex(map, str2, &hint)));
+    ck_assert_uint_eq(1, hint);
+
+    // Out of range hint
+    hint = 1000;
+    ck_assert_int_eq(1, handlebars_value_get_intval(handlebars_map_find_ex(map, str1, &hint)));
+    ck_assert_uint_eq(0, hint);
+
+    // Removed entries must not be returned from the hinted slot
+    map = handlebars_map_remove(map, str1);
+    ck_assert_ptr_eq(NULL, handlebars_map_find_ex(map, str1, &hint));
+    ck_assert_uint_eq(0, hint);
+
+    handlebars_string_delref(str1);
+    handlebars_string_delref(str2);
+    handlebars_map_delref(map);
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    ASSERT_INIT_BLOCKS();
+}
+END_TEST
+
+START_TEST(test_map_freeze_after_remove)
+{
+    struct handlebars_map * map = handlebars_map_ctor(context, 4);
+    const char * keys[] = {"a", "b", "d"};
+    size_t i;
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    handlebars_value_integer(tmp, 1);
+    map = handlebars_map_str_update(map, HBS_STRL("a"), tmp);
+    handlebars_value_integer(tmp, 2);
+    map = handlebars_map_str_update(map, HBS_STRL("b"), tmp);
+    handlebars_value_integer(tmp, 3);
+    map = handlebars_map_str_update(map, HBS_STRL("c"), tmp);
+    handlebars_value_integer(tmp, 4);
+    map = handlebars_map_str_update(map, HBS_STRL("d"), tmp);
+    map = handlebars_map_str_remove(map, HBS_STRL("c"));
+
+    // Freezing compacts the removed entry away
+    handlebars_map_freeze(map);
+    ck_assert(!handlebars_map_is_sparse(map));
+    ck_assert_uint_eq(3, handlebars_map_count(map));
+    ck_assert_ptr_eq(NULL, handlebars_map_str_find(map, HBS_STRL("c")));
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        struct handlebars_value * value = handlebars_map_str_find(map, keys[i], strlen(keys[i]));
+        ck_assert_ptr_ne(NULL, value);
+        ck_assert_int_eq(i < 2 ? i + 1 : 4, handlebars_value_get_intval(value));
+    }
+
+    // And keeps the insertion order
+    i = 0;
+    handlebars_map_foreach(map, index, key, value) {
+        ck_assert_str_eq(keys[i], hbs_str_val(key));
+        (void) index; (void) value;
+        i++;
+    } handlebars_map_foreach_end(map);
+    ck_assert_uint_eq(3, i);
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+}
+END_TEST
+
 static Suite * suite(void);
 static Suite * suite(void)
 {
@@ -355,6 +441,8 @@ static Suite * suite(void)
 #endif
     REGISTER_TEST_FIXTURE(s, test_map_sizeof, "Map sizeof");
     REGISTER_TEST_FIXTURE(s, test_map_remove_nonexist, "Map remove noexistent key");
+    REGISTER_TEST_FIXTURE(s, test_map_find_ex, "Map find with slot hint");
+    REGISTER_TEST_FIXTURE(s, test_map_freeze_after_remove, "Map freeze after remove");
 
     return s;
 }
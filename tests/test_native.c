@@ -0,0 +1,362 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+
+#define HANDLEBARS_OPCODE_SERIALIZER_PRIVATE
+#define HANDLEBARS_OPCODES_PRIVATE
+
+#include "handlebars.h"
+#include "handlebars_cache.h"
+#include "handlebars_compiler.h"
+#include "handlebars_json_parser.h"
+#include "handlebars_map.h"
+#include "handlebars_memory.h"
+#include "handlebars_native.h"
+#include "handlebars_opcodes.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_parser.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "handlebars_vm.h"
+#include "utils.h"
+
+
+
+static int native_calls = 0;
+
+// Generated from fixture5.hbs with handlebarsc --emit-c when the tests are built
+extern const struct handlebars_native_template handlebars_native_template_fixture5;
+
+// What handlebarsc --emit-c generates for "Hello {{name}}!"
+static void hello_program_0(struct handlebars_vm * vm, struct handlebars_opcode * opcodes)
+{
+    native_calls++;
+    handlebars_vm_native_append_static(vm,
+        "Hello ", 6);
+    handlebars_vm_native_get_context(vm, &opcodes[1]);
+    handlebars_vm_native_push_program(vm, &opcodes[2]);
+    handlebars_vm_native_push_program(vm, &opcodes[3]);
+    handlebars_vm_native_get_context(vm, &opcodes[4]);
+    handlebars_vm_native_lookup_on_context(vm, &opcodes[5]);
+    handlebars_vm_native_invoke_ambiguous(vm, &opcodes[6]);
+    handlebars_vm_native_append_escaped(vm, &opcodes[7]);
+    handlebars_vm_native_append_static(vm,
+        "!", 1);
+}
+
+static const handlebars_native_func hello_programs[1] = {
+    hello_program_0,
+};
+
+// The module as it is embedded in the generated source
+static unsigned char * embed_module(struct handlebars_module * module)
+{
+    struct handlebars_module * copy = talloc_size(context, module->size);
+    memcpy(copy, module, module->size);
+    handlebars_module_patch_pointers(copy);
+    handlebars_module_normalize_pointers(copy, (void *) 0);
+    copy->ts = 0;
+    handlebars_module_generate_hash(copy);
+    return (unsigned char *) copy;
+}
+
+START_TEST(test_native_emit)
+{
+    struct handlebars_module * module = compile_module("Hello {{name}}!", 0);
+    struct handlebars_string * source = handlebars_native_emit(context, module, "users/show");
+
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "const struct handlebars_native_template handlebars_native_template_users_2fshow = {\n    \"users/show\", 10,\n"), NULL);
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "static const unsigned char hbs_native_users_2fshow_module["), NULL);
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "static const handlebars_native_func hbs_native_users_2fshow_programs[1] = {\n    hbs_native_users_2fshow_program_0,\n};"), NULL);
+
+    // The generated program is the one above
+    ck_assert_ptr_ne(strstr(hbs_str_val(source),
+        "static void hbs_native_users_2fshow_program_0(struct handlebars_vm * vm, struct handlebars_opcode * opcodes)\n"
+        "{\n"
+        "    handlebars_vm_native_append_static(vm,\n"
+        "        \"Hello \", 6);\n"
+        "    handlebars_vm_native_get_context(vm, &opcodes[1]);\n"
+        "    handlebars_vm_native_push_program(vm, &opcodes[2]);\n"
+        "    handlebars_vm_native_push_program(vm, &opcodes[3]);\n"
+        "    handlebars_vm_native_get_context(vm, &opcodes[4]);\n"
+        "    handlebars_vm_native_lookup_on_context(vm, &opcodes[5]);\n"
+        "    handlebars_vm_native_invoke_ambiguous(vm, &opcodes[6]);\n"
+        "    handlebars_vm_native_append_escaped(vm, &opcodes[7]);\n"
+        "    handlebars_vm_native_append_static(vm,\n"
+        "        \"!\", 1);\n"
+        "}\n"
+    ), NULL);
+
+    // Static content is escaped
+    module = compile_module("a\"b\\c?\?=\001\nd", 0);
+    source = handlebars_native_emit(context, module, "x");
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "\"a\\\"b\\\\c\\?\\?=\\001\\n\"\n        \"d\", 11);"), NULL);
+}
+END_TEST
+
+START_TEST(test_native_emit_names)
+{
+    struct handlebars_module * module = compile_module("x", 0);
+    struct handlebars_string * source;
+
+    // A leading digit stays behind the prefix
+    source = handlebars_native_emit(context, module, "404-page");
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "const struct handlebars_native_template handlebars_native_template_404_2dpage = {"), NULL);
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "static const unsigned char hbs_native_404_2dpage_module["), NULL);
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "static void hbs_native_404_2dpage_program_0("), NULL);
+
+    // Names that differ only in characters outside an identifier do not collide
+    source = handlebars_native_emit(context, module, "a-b");
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "handlebars_native_template_a_2db = {"), NULL);
+    source = handlebars_native_emit(context, module, "a_b");
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "handlebars_native_template_a__b = {"), NULL);
+    source = handlebars_native_emit(context, module, "a_2db");
+    ck_assert_ptr_ne(strstr(hbs_str_val(source), "handlebars_native_template_a__2db = {"), NULL);
+}
+END_TEST
+
+START_TEST(test_native_emit_registers)
+{
+    struct handlebars_module * module = compile_module("{{foo}}", handlebars_compiler_flag_registers);
+    struct handlebars_string * volatile source = NULL;
+    jmp_buf buf;
+    jmp_buf * prev = HBSCTX(context)->e->jmp;
+    volatile bool thrown = false;
+
+    if( handlebars_setjmp_ex(context, &buf) ) {
+        thrown = true;
+    } else {
+        source = handlebars_native_emit(context, module, "foo");
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert_ptr_eq(source, NULL);
+}
+END_TEST
+
+START_TEST(test_native_execute)
+{
+    struct handlebars_module * module = compile_module("Hello {{name}}!", 0);
+    unsigned char * blob = embed_module(module);
+    struct handlebars_native_template native = {
+        "hello", 5,
+        blob, module->size,
+        hello_programs, 1
+    };
+    const struct handlebars_native_template * templates[] = { &native };
+    struct handlebars_module * native_module;
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(value);
+
+    ck_assert_ptr_eq(handlebars_native_find(templates, 1, HBS_STRL("hello")), &native);
+    ck_assert_ptr_eq(handlebars_native_find(templates, 1, HBS_STRL("hell")), NULL);
+    ck_assert_ptr_eq(handlebars_native_find(templates, 0, HBS_STRL("hello")), NULL);
+
+    native_module = handlebars_native_module_ctor(context, &native);
+    ck_assert_ptr_eq(native_module->addr, native_module);
+    ck_assert_ptr_eq(handlebars_native_module_programs(native_module), hello_programs);
+    ck_assert_ptr_eq(handlebars_native_module_programs(module), NULL);
+
+    handlebars_value_parse_json_string(context, value, "{\"name\": \"<Bob>\"}");
+
+    native_calls = 0;
+    buffer = handlebars_vm_execute(vm, native_module, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "Hello &lt;Bob&gt;!");
+    ck_assert_int_eq(native_calls, 1);
+
+    // Same as the interpreted module
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "Hello &lt;Bob&gt;!");
+    ck_assert_int_eq(native_calls, 1);
+
+    // Native code is not embedded again
+    ck_assert(0 == memcmp(embed_module(native_module), blob, module->size));
+
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+END_TEST
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+START_TEST(test_native_mmap_cache)
+{
+    struct handlebars_module * module = compile_module("Hello {{name}}!", 0);
+    unsigned char * blob = embed_module(module);
+    struct handlebars_native_template native = {
+        "hello", 5,
+        blob, module->size,
+        hello_programs, 1
+    };
+    struct handlebars_cache * cache = handlebars_cache_mmap_ctor(context, 2097152, 2053);
+    struct handlebars_string * key = handlebars_string_ctor(context, HBS_STRL("hello"));
+    struct handlebars_module * native_module;
+    struct handlebars_module * cached;
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(value);
+
+    handlebars_value_parse_json_string(context, value, "{\"name\": \"<Bob>\"}");
+
+    native_module = handlebars_native_module_ctor(context, &native);
+    handlebars_cache_add(cache, key, native_module);
+
+    // The copy in the cache is interpreted
+    cached = handlebars_cache_find(cache, key);
+    ck_assert_ptr_ne(cached, NULL);
+    ck_assert_ptr_ne(cached, native_module);
+    ck_assert_ptr_eq(handlebars_native_module_programs(cached), NULL);
+
+    native_calls = 0;
+    buffer = handlebars_vm_execute(vm, cached, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "Hello &lt;Bob&gt;!");
+    ck_assert_int_eq(native_calls, 0);
+    handlebars_cache_release(cache, key, cached);
+
+    // And outlives the native module
+    handlebars_talloc_free(native_module);
+
+    cached = handlebars_cache_find(cache, key);
+    ck_assert_ptr_ne(cached, NULL);
+    buffer = handlebars_vm_execute(vm, cached, value);
+    ck_assert_str_eq(hbs_str_val(buffer), "Hello &lt;Bob&gt;!");
+    ck_assert_int_eq(native_calls, 0);
+    handlebars_cache_release(cache, key, cached);
+
+    handlebars_cache_dtor(cache);
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+END_TEST
+#endif
+
+START_TEST(test_native_fixture)
+{
+    struct handlebars_module * module = handlebars_native_module_ctor(context, &handlebars_native_template_fixture5);
+    struct handlebars_map * map = handlebars_map_ctor(context, 1);
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(value);
+    HANDLEBARS_VALUE_DECL(partials);
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    ck_assert_ptr_eq(handlebars_native_module_programs(module), handlebars_native_template_fixture5.programs);
+
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("<footer>{{title}}</footer>")));
+    map = handlebars_map_str_update(map, HBS_STRL("footer"), tmp);
+    handlebars_value_map(partials, map);
+    handlebars_vm_set_partials(vm, partials);
+
+    handlebars_value_parse_json_string(context, value,
+        "{\"title\": \"A & B\", \"users\": ["
+        "{\"name\": \"<Bob>\", \"bio\": \"<b>bold</b>\", \"address\": {\"city\": \"Paris\"}},"
+        "{\"name\": \"Al\", \"bio\": \"\"}],"
+        " \"tags\": {\"x\": 1, \"y\": true}, \"labels\": {\"ok\": \"OK\"}}");
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer),
+        "<h1>A &amp; B</h1>\n"
+        "<ul>\n"
+        "  <li class=\"first\">0. &lt;Bob&gt; <b>bold</b> (Paris),</li>\n"
+        "  <li class=\"row\">1. Al </li>\n"
+        "</ul>\n"
+        "[x=1][y=true]\n"
+        "OK <footer>A &amp; B</footer>\n");
+
+    handlebars_value_parse_json_string(context, value, "{\"title\": \"None\", \"users\": []}");
+    buffer = handlebars_vm_execute(vm, module, value);
+    ck_assert_str_eq(hbs_str_val(buffer),
+        "<h1>None</h1>\n"
+        "<p>No users</p>\n"
+        "\n"
+        " <footer>None</footer>\n");
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(partials);
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+END_TEST
+
+START_TEST(test_native_invalid)
+{
+    struct handlebars_module * module = compile_module("Hello {{name}}!", 0);
+    unsigned char * blob = embed_module(module);
+    struct handlebars_native_template native = {
+        "hello", 5,
+        blob, module->size,
+        hello_programs, 2
+    };
+    struct handlebars_module * volatile native_module = NULL;
+    jmp_buf buf;
+    jmp_buf * prev = HBSCTX(context)->e->jmp;
+    volatile bool thrown = false;
+
+    // Program count mismatch
+    if( handlebars_setjmp_ex(context, &buf) ) {
+        thrown = true;
+    } else {
+        native_module = handlebars_native_module_ctor(context, &native);
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert_ptr_eq(native_module, NULL);
+    ck_assert_str_eq(handlebars_error_msg(context), "Invalid native template: hello");
+
+    // Damaged module
+    native.program_count = 1;
+    blob[module->size - 8] ^= 0x55;
+    thrown = false;
+    if( handlebars_setjmp_ex(context, &buf) ) {
+        thrown = true;
+    } else {
+        native_module = handlebars_native_module_ctor(context, &native);
+    }
+    HBSCTX(context)->e->jmp = prev;
+
+    ck_assert(thrown);
+    ck_assert_ptr_eq(native_module, NULL);
+    ck_assert(0 == strncmp(handlebars_error_msg(context), "Invalid module hash", strlen("Invalid module hash")));
+}
+END_TEST
+
+static Suite * suite(void);
+static Suite * suite(void)
+{
+    Suite * s = suite_create("Native");
+
+    REGISTER_TEST_FIXTURE(s, test_native_emit, "Emit C source");
+    REGISTER_TEST_FIXTURE(s, test_native_emit_names, "Emit C identifiers for any template name");
+    REGISTER_TEST_FIXTURE(s, test_native_emit_registers, "Emit C source from registers");
+    REGISTER_TEST_FIXTURE(s, test_native_execute, "Execute native template");
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    REGISTER_TEST_FIXTURE(s, test_native_mmap_cache, "Native template in the mmap cache");
+#endif
+    REGISTER_TEST_FIXTURE(s, test_native_fixture, "Execute generated native template");
+    REGISTER_TEST_FIXTURE(s, test_native_invalid, "Invalid native template");
+
+    return s;
+}
+
+int main(void)
+{
+    return default_main(&suite);
+}
@@ -115,6 +115,11 @@ START_TEST(test_opcode_readable_type)
 
     _RTYPE_TEST(invalid, invalid);
 
+    _RTYPE_TEST(block_if, blockIf);
+    _RTYPE_TEST(block_unless, blockUnless);
+    _RTYPE_TEST(block_with, blockWith);
+    _RTYPE_TEST(block_each, blockEach);
+
     ck_assert_str_eq("invalid", handlebars_opcode_readable_type(13434534));
 }
 END_TEST
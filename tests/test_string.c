@@ -342,6 +342,39 @@ START_TEST(test_handlebars_string_htmlspecialchars_6)
 }
 END_TEST
 
+START_TEST(test_handlebars_string_htmlspecialchars_7)
+{
+    // Cover the vectorized paths: escaped characters at every offset within and across blocks, and the scalar tail
+    static const char chars[] = "ab&c<d>e\"f'g`h";
+    char input[128];
+    struct handlebars_string * expected;
+    struct handlebars_string * actual;
+    size_t len;
+    size_t i;
+
+    for( len = 0; len < sizeof(input); len++ ) {
+        expected = handlebars_string_ctor(context, HBS_STRL("prefix"));
+        for( i = 0; i < len; i++ ) {
+            input[i] = (i * 7 + len) % 5 ? 'x' : chars[(i + len) % (sizeof(chars) - 1)];
+            switch( input[i] ) {
+                case '&': expected = handlebars_string_append(context, expected, HBS_STRL("&amp;")); break;
+                case '<': expected = handlebars_string_append(context, expected, HBS_STRL("&lt;")); break;
+                case '>': expected = handlebars_string_append(context, expected, HBS_STRL("&gt;")); break;
+                case '"': expected = handlebars_string_append(context, expected, HBS_STRL("&quot;")); break;
+                case '\'': expected = handlebars_string_append(context, expected, HBS_STRL("&#x27;")); break;
+                case '`': expected = handlebars_string_append(context, expected, HBS_STRL("&#x60;")); break;
+                default: expected = handlebars_string_append(context, expected, &input[i], 1); break;
+            }
+        }
+        actual = handlebars_string_ctor(context, HBS_STRL("prefix"));
+        actual = handlebars_string_htmlspecialchars_append(context, actual, input, len);
+        ck_assert_hbs_str_eq(expected, actual);
+        handlebars_talloc_free(actual);
+        handlebars_talloc_free(expected);
+    }
+}
+END_TEST
+
 START_TEST(test_handlebars_string_implode_1)
 {
     struct handlebars_string ** parts = handlebars_talloc_array(context, struct handlebars_string *, 1);
@@ -505,6 +538,7 @@ static Suite * suite(void)
     REGISTER_TEST_FIXTURE(s, test_handlebars_string_htmlspecialchars_4, "handlebars_string_htmlspecialchars 4");
     REGISTER_TEST_FIXTURE(s, test_handlebars_string_htmlspecialchars_5, "handlebars_string_htmlspecialchars 5");
     REGISTER_TEST_FIXTURE(s, test_handlebars_string_htmlspecialchars_6, "handlebars_string_htmlspecialchars 6");
+    REGISTER_TEST_FIXTURE(s, test_handlebars_string_htmlspecialchars_7, "handlebars_string_htmlspecialchars 7");
 
     REGISTER_TEST_FIXTURE(s, test_handlebars_string_implode_1, "handlebars_string_implode 1");
     REGISTER_TEST_FIXTURE(s, test_handlebars_string_implode_2, "handlebars_string_implode 2");
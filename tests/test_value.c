@@ -456,6 +456,61 @@ START_TEST(test_dump_map)
 }
 END_TEST
 
+START_TEST(test_freeze)
+{
+    HANDLEBARS_VALUE_DECL(value);
+    HANDLEBARS_VALUE_DECL(tmp);
+    struct handlebars_map * map = handlebars_map_ctor(context, 4);
+    struct handlebars_map * new_map;
+    struct handlebars_stack * stack = handlebars_stack_ctor(context, 2);
+    struct handlebars_stack * new_stack;
+    int i = 0;
+
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("foo")));
+    stack = handlebars_stack_push(stack, tmp);
+    handlebars_value_array(tmp, stack);
+    map = handlebars_map_str_update(map, HBS_STRL("a"), tmp);
+    handlebars_value_integer(tmp, 2);
+    map = handlebars_map_str_update(map, HBS_STRL("b"), tmp);
+    handlebars_value_integer(tmp, 3);
+    map = handlebars_map_str_update(map, HBS_STRL("c"), tmp);
+    map = handlebars_map_str_remove(map, HBS_STRL("b"));
+    handlebars_value_map(value, map);
+
+    handlebars_value_freeze(value);
+    ck_assert(handlebars_map_is_frozen(map));
+    ck_assert(!handlebars_map_is_sparse(map));
+
+    // Nested iteration of the same map is allowed once frozen
+    HANDLEBARS_VALUE_FOREACH_KV(value, key, child) {
+        HANDLEBARS_VALUE_FOREACH_KV(value, key2, child2) {
+            (void) key; (void) child; (void) key2; (void) child2;
+            ++i;
+        } HANDLEBARS_VALUE_FOREACH_END();
+    } HANDLEBARS_VALUE_FOREACH_END();
+    ck_assert_int_eq(4, i);
+
+    // Modifications produce a copy and leave the frozen map untouched
+    handlebars_value_integer(tmp, 4);
+    new_map = handlebars_map_str_update(map, HBS_STRL("d"), tmp);
+    ck_assert_ptr_ne(map, new_map);
+    ck_assert(!handlebars_map_is_frozen(new_map));
+    ck_assert_uint_eq(2, handlebars_map_count(map));
+    ck_assert_uint_eq(3, handlebars_map_count(new_map));
+    handlebars_map_delref(new_map);
+
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("bar")));
+    new_stack = handlebars_stack_push(stack, tmp);
+    ck_assert_ptr_ne(stack, new_stack);
+    ck_assert_uint_eq(1, handlebars_stack_count(stack));
+    ck_assert_uint_eq(2, handlebars_stack_count(new_stack));
+    handlebars_stack_delref(new_stack);
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(value);
+}
+END_TEST
+
 static Suite * suite(void);
 static Suite * suite(void)
 {
@@ -480,6 +535,7 @@ static Suite * suite(void)
     REGISTER_TEST_FIXTURE(s, test_dump_float, "dump - float");
     REGISTER_TEST_FIXTURE(s, test_dump_array, "dump - array");
     REGISTER_TEST_FIXTURE(s, test_dump_map, "dump - map");
+    REGISTER_TEST_FIXTURE(s, test_freeze, "Freeze");
 
     return s;
 }
@@ -0,0 +1,1001 @@
+/**
+ * Copyright (c) anno Domini nostri Jesu Christi MMXVI-MMXXIV John Boehr & contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <check.h>
+#include <string.h>
+#include <talloc.h>
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define HANDLEBARS_OPCODE_SERIALIZER_PRIVATE
+#define HANDLEBARS_OPCODES_PRIVATE
+
+#include "handlebars.h"
+#include "handlebars_compiler.h"
+#include "handlebars_helpers.h"
+#include "handlebars_json_parser.h"
+#include "handlebars_map.h"
+#include "handlebars_memory.h"
+#include "handlebars_opcodes.h"
+#include "handlebars_opcode_serializer.h"
+#include "handlebars_parser.h"
+#include "handlebars_stack.h"
+#include "handlebars_string.h"
+#include "handlebars_value.h"
+#include "handlebars_vm.h"
+#include "handlebars_vm_profile.h"
+#include "handlebars_vm_trace.h"
+#include "utils.h"
+
+
+
+struct output_sink {
+    struct handlebars_string * str;
+    size_t calls;
+};
+
+static void output_sink_write(struct handlebars_vm * vm_, const char * str, size_t len, void * ctx)
+{
+    struct output_sink * sink = ctx;
+    (void) vm_;
+    ck_assert_uint_gt(len, 0);
+    sink->str = handlebars_string_append(context, sink->str, str, len);
+    sink->calls++;
+}
+
+static struct handlebars_module * compile_template(const char * tmpl)
+{
+    return compile_module(tmpl, 0);
+}
+
+static void make_input(struct handlebars_value * input)
+{
+    HANDLEBARS_VALUE_DECL(tmp);
+    HANDLEBARS_VALUE_DECL(items);
+    struct handlebars_map * map = handlebars_map_ctor(context, 2);
+    struct handlebars_stack * stack = handlebars_stack_ctor(context, 64);
+    char buf[32];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        snprintf(buf, sizeof(buf), "item <%d>", i);
+        handlebars_value_str(tmp, handlebars_string_ctor(context, buf, strlen(buf)));
+        stack = handlebars_stack_push(stack, tmp);
+    }
+    handlebars_value_array(items, stack);
+
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("Report & <summary>")));
+    map = handlebars_map_str_update(map, HBS_STRL("title"), tmp);
+    map = handlebars_map_str_update(map, HBS_STRL("items"), items);
+    handlebars_value_map(input, map);
+
+    HANDLEBARS_VALUE_UNDECL(items);
+    HANDLEBARS_VALUE_UNDECL(tmp);
+}
+
+static const char * output_tmpl = "<h1>{{title}}</h1>\n{{#each items}}<li>{{@index}}: {{this}}</li>\n{{/each}}{{{title}}}";
+
+static void run_output_sink_test(size_t threshold)
+{
+    struct handlebars_module * module = compile_template(output_tmpl);
+    struct output_sink sink = {0};
+    struct handlebars_string * expected;
+    struct handlebars_string * actual;
+    HANDLEBARS_VALUE_DECL(input);
+
+    make_input(input);
+
+    expected = handlebars_vm_execute(vm, module, input);
+
+    sink.str = handlebars_string_init(context, 0);
+    handlebars_vm_set_output(vm, output_sink_write, &sink, threshold);
+    actual = handlebars_vm_execute(vm, module, input);
+
+    ck_assert_uint_eq(0, hbs_str_len(actual));
+    ck_assert_hbs_str_eq(expected, sink.str);
+    ck_assert_uint_gt(sink.calls, 1);
+
+    // Disabling the sink restores buffering
+    handlebars_vm_set_output(vm, NULL, NULL, 0);
+    actual = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq(expected, actual);
+
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+
+START_TEST(test_vm_output_sink)
+{
+    run_output_sink_test(0);
+    run_output_sink_test(64);
+}
+END_TEST
+
+START_TEST(test_vm_output_sink_large_threshold)
+{
+    struct handlebars_module * module = compile_template("a{{#if 1}}b{{/if}}c");
+    struct output_sink sink = {0};
+    HANDLEBARS_VALUE_DECL(input);
+
+    sink.str = handlebars_string_init(context, 0);
+    handlebars_vm_set_output(vm, output_sink_write, &sink, HANDLEBARS_VM_OUTPUT_THRESHOLD);
+    (void) handlebars_vm_execute(vm, module, input);
+
+    ck_assert_hbs_str_eq_cstr(sink.str, "abc");
+    ck_assert_uint_eq(1, sink.calls);
+
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_array_index_lookup)
+{
+    struct handlebars_module * module = compile_template(
+        "{{items.[1]}}|{{items.[10]}}|{{items.foo}}|{{items.[-1]}}|{{items.[64]}}"
+    );
+    struct handlebars_string * buffer;
+    struct handlebars_string * expected = handlebars_string_init(context, 0);
+    int i;
+    HANDLEBARS_VALUE_DECL(input);
+
+    make_input(input);
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "item &lt;1&gt;|item &lt;10&gt;|||");
+
+    // Block param coordinates
+    for (i = 0; i < 64; i++) {
+        expected = handlebars_string_asprintf_append(context, expected, "%d=item &lt;%d&gt;,", i, i);
+    }
+    module = compile_template("{{#each items as |x i|}}{{i}}={{x}},{{/each}}");
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq(buffer, expected);
+
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_inline_cache)
+{
+    // Rows alternate between two key orders and one row is missing a key, so the cached slot both hits and misses
+    struct handlebars_module * module = compile_template("{{#each rows}}{{a}}{{b}}{{c.d}};{{/each}}");
+    struct handlebars_stack * stack = handlebars_stack_ctor(context, 8);
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(tmp);
+    HANDLEBARS_VALUE_DECL(row);
+    HANDLEBARS_VALUE_DECL(child);
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        struct handlebars_map * map = handlebars_map_ctor(context, 4);
+        struct handlebars_map * child_map = handlebars_map_ctor(context, 1);
+        handlebars_value_integer(tmp, i);
+        child_map = handlebars_map_str_update(child_map, HBS_STRL("d"), tmp);
+        handlebars_value_map(child, child_map);
+        if (i % 2) {
+            map = handlebars_map_str_update(map, HBS_STRL("c"), child);
+            map = handlebars_map_str_update(map, HBS_STRL("b"), tmp);
+        }
+        if (i != 4) {
+            map = handlebars_map_str_update(map, HBS_STRL("a"), tmp);
+        }
+        if (!(i % 2)) {
+            map = handlebars_map_str_update(map, HBS_STRL("b"), tmp);
+            map = handlebars_map_str_update(map, HBS_STRL("c"), child);
+        }
+        handlebars_value_map(row, map);
+        stack = handlebars_stack_push(stack, row);
+    }
+
+    handlebars_value_array(tmp, stack);
+    handlebars_value_map(input, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("rows"), tmp));
+
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "000;111;222;333;44;555;666;777;");
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "000;111;222;333;44;555;666;777;");
+
+    HANDLEBARS_VALUE_UNDECL(child);
+    HANDLEBARS_VALUE_UNDECL(row);
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+static HANDLEBARS_FUNCTION(lambda_scope_title)
+{
+    // Lambdas are called with the current scope
+    struct handlebars_value * title = handlebars_value_map_str_find(options->scope, HBS_STRL("title"), rv);
+    ck_assert_ptr_nonnull(title);
+    return title;
+}
+
+START_TEST(test_vm_lookup_and_append)
+{
+    struct handlebars_module * module = compile_template(
+        "{{title}}|{{{title}}}|{{items.[2]}}|{{#each items}}{{#if @first}}{{../title}}{{this}}{{{.}}}{{/if}}{{/each}}|"
+        "{{this.lambda}}|{{{this.lambda}}}|{{missing.title}}"
+    );
+    struct handlebars_string * buffer;
+    size_t i;
+    bool found = false;
+    struct handlebars_map * map = handlebars_map_ctor(context, 3);
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(tmp);
+    HANDLEBARS_VALUE_DECL(rv);
+    HANDLEBARS_VALUE_DECL(fn);
+
+    // The serializer should have fused the simple mustaches
+    for (i = 0; i < module->opcode_count; i++) {
+        if (module->opcodes[i].type == handlebars_opcode_type_lookup_and_append_escaped) {
+            found = true;
+        }
+        ck_assert_int_ne(module->opcodes[i].type, handlebars_opcode_type_resolve_possible_lambda);
+    }
+    ck_assert(found);
+
+    make_input(tmp);
+    map = handlebars_map_str_update(map, HBS_STRL("title"), handlebars_value_map_str_find(tmp, HBS_STRL("title"), rv));
+    map = handlebars_map_str_update(map, HBS_STRL("items"), handlebars_value_map_str_find(tmp, HBS_STRL("items"), rv));
+    handlebars_value_helper(fn, lambda_scope_title);
+    map = handlebars_map_str_update(map, HBS_STRL("lambda"), fn);
+    handlebars_value_map(input, map);
+
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(
+        buffer,
+        "Report &amp; &lt;summary&gt;|Report & <summary>|item &lt;2&gt;|"
+        "Report &amp; &lt;summary&gt;item &lt;0&gt;item <0>|"
+        "Report &amp; &lt;summary&gt;|Report & <summary>|"
+    );
+
+    HANDLEBARS_VALUE_UNDECL(fn);
+    HANDLEBARS_VALUE_UNDECL(rv);
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_append_content_coalescing)
+{
+    struct handlebars_module * module = compile_template("a{{! one }}b{{!-- two --}}c{{this.title}}abc");
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(input);
+
+    // Adjacent content is merged and identical strings share storage in the data segment
+    ck_assert_uint_eq(4, module->opcode_count);
+    ck_assert_int_eq(handlebars_opcode_type_append_content, module->opcodes[0].type);
+    ck_assert_int_eq(handlebars_opcode_type_append_content, module->opcodes[2].type);
+    ck_assert_hbs_str_eq_cstr(module->opcodes[0].op1.data.string.string, "abc");
+    ck_assert_ptr_eq(module->opcodes[0].op1.data.string.string, module->opcodes[2].op1.data.string.string);
+
+    make_input(input);
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "abcReport &amp; &lt;summary&gt;abc");
+
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+static HANDLEBARS_FUNCTION(data_index)
+{
+    // Helpers called from an #each body see the iteration variables in options->data
+    struct handlebars_value * index = handlebars_value_map_str_find(options->data, HBS_STRL("index"), rv);
+    ck_assert_ptr_nonnull(index);
+    return index;
+}
+
+START_TEST(test_vm_each_data_frame)
+{
+    struct handlebars_module * module = compile_template(
+        "{{#each outer}}{{#each this}}{{@../index}}.{{@index}}{{#if @first}}F{{/if}}{{#if @last}}L{{/if}}"
+        "{{data_index}};{{/each}}{{/each}}|{{#each map}}{{@key}}={{this}},{{/each}}|"
+        "{{#each outer as |row i|}}{{i}}:{{row}};{{/each}}|{{#each empty}}x{{else}}none{{/each}}"
+    );
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(helpers);
+    HANDLEBARS_VALUE_DECL(fn);
+
+    handlebars_value_parse_json_string(context, input, "{\"outer\": [[\"a\", \"b\"], [\"c\"]], \"map\": {\"x\": 1, \"y\": 2}, \"empty\": []}");
+    handlebars_value_helper(fn, data_index);
+    handlebars_value_map(helpers, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("data_index"), fn));
+    handlebars_vm_set_helpers(vm, helpers);
+
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "0.0F0;0.1L1;1.0FL0;|x=1,y=2,|0:a,b;1:c;|none");
+
+    HANDLEBARS_VALUE_UNDECL(fn);
+    HANDLEBARS_VALUE_UNDECL(helpers);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+static HANDLEBARS_FUNCTION(wrapped_if)
+{
+    // Overrides the builtin, which must then return its output instead of appending it
+    struct handlebars_value * result = handlebars_builtin_if(HANDLEBARS_FUNCTION_ARGS_PASSTHRU);
+    struct handlebars_string * str = handlebars_string_init(context, 0);
+    str = handlebars_string_append(context, str, HBS_STRL("["));
+    str = handlebars_string_append_str(context, str, handlebars_value_get_string(result));
+    str = handlebars_string_append(context, str, HBS_STRL("]"));
+    handlebars_value_str(rv, str);
+    return rv;
+}
+
+START_TEST(test_vm_append_direct)
+{
+    struct handlebars_module * module = compile_template(
+        "{{#with outer}}<{{#each this}}{{#if @first}}{{this}}{{else}}{{#unless @last}}-{{/unless}}{{/if}}{{/each}}>{{/with}}"
+        "{{#map}}{{x}}{{/map}}{{#empty}}x{{else}}e{{/empty}}"
+    );
+    struct output_sink sink = {0};
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(helpers);
+    HANDLEBARS_VALUE_DECL(fn);
+
+    handlebars_value_parse_json_string(context, input, "{\"outer\": [\"a\", \"b\", \"c\"], \"map\": {\"x\": 1}, \"empty\": []}");
+
+    // Nested blocks append to the buffer of the enclosing program
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "<a->1e");
+
+    // ... and are streamed as they are rendered
+    sink.str = handlebars_string_init(context, 0);
+    handlebars_vm_set_output(vm, output_sink_write, &sink, 0);
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_uint_eq(0, hbs_str_len(buffer));
+    ck_assert_hbs_str_eq_cstr(sink.str, "<a->1e");
+    ck_assert_uint_gt(sink.calls, 3);
+    handlebars_vm_set_output(vm, NULL, NULL, 0);
+
+    // A user helper replacing a builtin, and builtins delegating to it, get the output returned
+    handlebars_value_helper(fn, wrapped_if);
+    handlebars_value_map(helpers, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("if"), fn));
+    handlebars_vm_set_helpers(vm, helpers);
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "<[a][[-]][[]]>1e");
+
+    HANDLEBARS_VALUE_UNDECL(fn);
+    HANDLEBARS_VALUE_UNDECL(helpers);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+static HANDLEBARS_FUNCTION(user_each)
+{
+    handlebars_value_str(rv, handlebars_string_ctor(context, HBS_STRL("user each")));
+    return rv;
+}
+
+START_TEST(test_vm_builtin_blocks)
+{
+    struct handlebars_module * module = compile_template(
+        "{{#if a}}A{{else}}{{#unless b}}B{{/unless}}{{/if}}|{{#if zero includeZero=true}}Z{{/if}}|"
+        "{{#with obj}}{{x}}{{else}}none{{/with}}|{{#each arr}}{{this}}{{/each}}|{{{if a}}}|{{#if a}}{{#each arr}}{{#unless @last}}{{.}},{{/unless}}{{/each}}{{/if}}"
+    );
+    struct handlebars_string * buffer;
+    size_t counts[handlebars_opcode_type_block_each + 1] = {0};
+    size_t i;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(helpers);
+    HANDLEBARS_VALUE_DECL(fn);
+
+    // Blocks of builtins with one parameter and no hash are specialized by the serializer
+    for (i = 0; i < module->opcode_count; i++) {
+        counts[module->opcodes[i].type]++;
+    }
+    ck_assert_uint_eq(3, counts[handlebars_opcode_type_block_if]);
+    ck_assert_uint_eq(2, counts[handlebars_opcode_type_block_unless]);
+    ck_assert_uint_eq(1, counts[handlebars_opcode_type_block_with]);
+    ck_assert_uint_eq(2, counts[handlebars_opcode_type_block_each]);
+    ck_assert_uint_eq(1, counts[handlebars_opcode_type_invoke_known_helper]);
+
+    handlebars_value_parse_json_string(context, input, "{\"a\": false, \"b\": false, \"zero\": 0, \"obj\": {\"x\": \"X\"}, \"arr\": [1, 2, 3]}");
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "B|Z|X|123||");
+
+    handlebars_value_parse_json_string(context, input, "{\"a\": true, \"obj\": null, \"arr\": [1, 2, 3]}");
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "A||none|123||1,2,");
+
+    // User helpers still replace the builtins
+    handlebars_value_helper(fn, user_each);
+    handlebars_value_map(helpers, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("each"), fn));
+    handlebars_vm_set_helpers(vm, helpers);
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "A||none|user each||user each");
+
+    HANDLEBARS_VALUE_UNDECL(fn);
+    HANDLEBARS_VALUE_UNDECL(helpers);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+static HANDLEBARS_FUNCTION(concat)
+{
+    // Joins the params with the sep hash entry
+    HANDLEBARS_VALUE_DECL(tmp);
+    struct handlebars_value * sep = handlebars_value_map_str_find(options->hash, HBS_STRL("sep"), tmp);
+    struct handlebars_string * str = handlebars_string_init(context, 0);
+    int i;
+    for (i = 0; i < argc; i++) {
+        if (i > 0 && sep) {
+            str = handlebars_string_append_str(context, str, handlebars_value_expression(context, sep, false));
+        }
+        str = handlebars_string_append_str(context, str, handlebars_value_expression(context, HANDLEBARS_ARG_AT(i), false));
+    }
+    handlebars_value_str(rv, str);
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    return rv;
+}
+
+START_TEST(test_vm_registers)
+{
+    static const char * tmpls[] = {
+        "{{#if a}}A{{else}}{{#unless b}}B{{/unless}}{{/if}}|{{#with obj}}{{x}}{{else}}none{{/with}}|{{{obj.y}}}",
+        "{{#each arr as |v i|}}{{i}}={{v}}{{#if @first}}f{{/if}}{{@root.a}},{{/each}}|{{@foo}}",
+        "{{concat a b sep=(concat \"-\" \"-\")}}|{{concat (concat x y sep=\"+\") \"z\" 1 true}}|{{concat}}",
+        "{{#concat a}}ignored{{/concat}}|{{#obj}}{{x}}{{/obj}}{{^arr}}none{{/arr}}|{{#missing}}m{{else}}n{{/missing}}",
+        "{{#obj.x}}[{{.}}]{{/obj.x}}|{{#each arr}}{{lookup ../obj \"x\"}}{{#with ../obj}}{{../this}}{{/with}}{{/each}}",
+        "{{> part}}|{{> part obj x=\"h\"}}|{{> (concat \"pa\" \"rt\")}}|{{#> missing}}block{{/missing}}",
+    };
+    struct handlebars_module * module;
+    struct handlebars_string * expected;
+    struct handlebars_string * actual;
+    size_t i;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(helpers);
+    HANDLEBARS_VALUE_DECL(partials);
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    handlebars_value_parse_json_string(context, input,
+        "{\"a\": \"<a>\", \"b\": false, \"x\": 1, \"y\": 2, \"obj\": {\"x\": \"X\", \"y\": \"<Y>\"}, \"arr\": [1, \"two\", 3]}");
+    handlebars_value_helper(tmp, concat);
+    handlebars_value_map(helpers, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("concat"), tmp));
+    handlebars_vm_set_helpers(vm, helpers);
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("P{{x}}{{#if y}}{{concat a x}}{{/if}}")));
+    handlebars_value_map(partials, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("part"), tmp));
+    handlebars_vm_set_partials(vm, partials);
+
+    // Programs lowered to registers render the same as on the stacks
+    for (i = 0; i < sizeof(tmpls) / sizeof(tmpls[0]); i++) {
+        module = compile_template(tmpls[i]);
+        ck_assert_uint_eq(0, module->programs[0].register_count);
+        expected = handlebars_vm_execute(vm, module, input);
+
+        module = compile_module(tmpls[i], handlebars_compiler_flag_registers);
+        ck_assert_uint_gt(module->programs[0].register_count, 0);
+        actual = handlebars_vm_execute(vm, module, input);
+        ck_assert_hbs_str_eq(expected, actual);
+    }
+
+    // Programs using opcodes without a register form stay on the stacks
+    module = compile_module("{{foo bar}}", handlebars_compiler_flag_registers | handlebars_compiler_flag_string_params);
+    ck_assert_uint_eq(0, module->programs[0].register_count);
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(partials);
+    HANDLEBARS_VALUE_UNDECL(helpers);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_each_parent_data)
+{
+    struct handlebars_module * module = compile_template(
+        "{{#each outer}}{{#each this}}[{{@../index}}.{{@index}}]{{/each}}{{/each}}|"
+        "{{#each map}}{{#each this}}{{@../key}}.{{@key}},{{/each}}{{/each}}|"
+        "{{#each outer}}{{#each this}}{{#each ../this}}{{@../../index}}{{@../index}}{{/each}}{{/each}}{{/each}}|"
+        "{{#each outer}}{{#with this}}{{#each this}}{{@../index}}{{/each}}{{/with}}{{/each}}"
+    );
+    struct handlebars_string * buffer;
+    HANDLEBARS_VALUE_DECL(input);
+
+    handlebars_value_parse_json_string(context, input, "{\"outer\": [[\"a\"], [\"b\", \"c\"], [\"d\"]], \"map\": {\"x\": {\"p\": 1}, \"y\": {\"q\": 2}}}");
+
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "[0.0][1.0][1.1][2.0]|x.p,y.q,|001010111120|0112");
+
+    // Levels past the outermost #each have no iteration data
+    module = compile_template("{{#each a}}{{#each b}}[{{@../../index}}|{{@../../../index}}|{{@../index}}]{{/each}}{{/each}}");
+    handlebars_value_parse_json_string(context, input, "{\"a\": [{\"b\": [1, 2]}, {\"b\": [3]}]}");
+
+    buffer = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(buffer, "[||0][||0][||1]");
+
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_profile)
+{
+    struct handlebars_module * module = compile_template("{{title}}{{#each items}}<li>{{this}}</li>{{/each}}");
+    struct handlebars_vm_profile * profile = handlebars_vm_profile_ctor(context);
+    const struct handlebars_vm_profile_stat * stat;
+    struct handlebars_module * stat_module;
+    struct handlebars_string * report;
+    long program;
+    HANDLEBARS_VALUE_DECL(input);
+
+    make_input(input);
+
+    handlebars_vm_set_profile(vm, profile);
+    handlebars_vm_execute(vm, module, input);
+    handlebars_vm_execute(vm, module, input);
+    handlebars_vm_set_profile(vm, NULL);
+    handlebars_vm_execute(vm, module, input);
+
+#ifdef HANDLEBARS_ENABLE_PROFILING
+    // The each body runs once per item
+    stat = handlebars_vm_profile_opcode(profile, handlebars_opcode_type_append_content);
+    ck_assert_uint_eq(2 * 64 * 2, stat->count);
+    stat = handlebars_vm_profile_opcode(profile, handlebars_opcode_type_invoke_partial);
+    ck_assert_uint_eq(0, stat->count);
+
+    ck_assert_uint_eq(2, handlebars_vm_profile_program_count(profile));
+    stat = handlebars_vm_profile_program(profile, 0, &stat_module, &program);
+    ck_assert_ptr_eq(module, stat_module);
+    ck_assert_int_eq(0, program);
+    ck_assert_uint_eq(2, stat->count);
+    ck_assert_uint_ge(stat->total_ns, stat->self_ns);
+    stat = handlebars_vm_profile_program(profile, 1, &stat_module, &program);
+    ck_assert_int_ne(0, program);
+    ck_assert_uint_eq(2 * 64, stat->count);
+    ck_assert_uint_eq(stat->total_ns, stat->self_ns);
+
+    report = handlebars_vm_profile_print(context, profile);
+    ck_assert_ptr_ne(NULL, strstr(hbs_str_val(report), "appendContent"));
+#else
+    (void) stat_module;
+    (void) program;
+    stat = handlebars_vm_profile_opcode(profile, handlebars_opcode_type_append_content);
+    ck_assert_uint_eq(0, stat->count);
+    ck_assert_uint_eq(0, handlebars_vm_profile_program_count(profile));
+    report = handlebars_vm_profile_print(context, profile);
+    ck_assert_ptr_eq(NULL, strstr(hbs_str_val(report), "appendContent"));
+#endif
+
+    handlebars_vm_profile_dtor(profile);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+struct trace_log {
+    struct handlebars_string * str;
+    long depth;
+};
+
+static void trace_log_begin(struct handlebars_vm * vm_, const struct handlebars_vm_trace_event * event, void * ctx)
+{
+    struct trace_log * log = ctx;
+    (void) vm_;
+    ck_assert_int_eq(log->depth++, event->depth);
+    log->str = handlebars_string_asprintf_append(context, log->str, "<%d:%.*s>", (int) event->type, (int) event->name_len, event->name);
+}
+
+static void trace_log_end(struct handlebars_vm * vm_, const struct handlebars_vm_trace_event * event, void * ctx)
+{
+    struct trace_log * log = ctx;
+    (void) vm_;
+    ck_assert_int_eq(--log->depth, event->depth);
+    log->str = handlebars_string_asprintf_append(context, log->str, "</%.*s:%zu>", (int) event->name_len, event->name, event->bytes);
+}
+
+START_TEST(test_vm_trace)
+{
+    struct handlebars_module * module = compile_template("{{#each items}}{{#if @first}}{{> row}}{{/if}}{{/each}}");
+    struct trace_log log = {0};
+    struct handlebars_map * map = handlebars_map_ctor(context, 1);
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(partials);
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    make_input(input);
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("[{{this}}]")));
+    map = handlebars_map_str_update(map, HBS_STRL("row"), tmp);
+    handlebars_value_map(partials, map);
+    handlebars_vm_set_partials(vm, partials);
+
+    // Only every other render is traced
+    log.str = handlebars_string_init(context, 0);
+    handlebars_vm_set_trace(vm, trace_log_begin, trace_log_end, &log, 2);
+    handlebars_vm_set_trace_name(vm, "index");
+    handlebars_vm_execute(vm, module, input);
+    handlebars_vm_execute(vm, module, input);
+    ck_assert_int_eq(0, log.depth);
+    ck_assert_ptr_eq(hbs_str_val(log.str), strstr(hbs_str_val(log.str), "<0:index><2:each><2:if><1:row></row:16></if:16><2:if></if:0>"));
+    ck_assert_ptr_eq(NULL, strstr(hbs_str_val(log.str) + 1, "<0:index>"));
+    ck_assert_str_eq(hbs_str_val(log.str) + hbs_str_len(log.str) - strlen("</each:16></index:16>"), "</each:16></index:16>");
+    handlebars_vm_set_trace(vm, NULL, NULL, NULL, 0);
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(partials);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+static HANDLEBARS_FUNCTION(trace_fail)
+{
+    handlebars_throw(HBSCTX(vm), HANDLEBARS_ERROR, "trace_fail");
+}
+
+START_TEST(test_vm_trace_error)
+{
+    struct handlebars_module * module = compile_template("{{#each items}}{{#if @first}}{{> row}}{{trace_fail this}}{{/if}}{{/each}}");
+    struct trace_log log = {0};
+    struct handlebars_map * map = handlebars_map_ctor(context, 1);
+    jmp_buf * prev = HBSCTX(vm)->e->jmp;
+    jmp_buf buf;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(partials);
+    HANDLEBARS_VALUE_DECL(helpers);
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    make_input(input);
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("[{{this}}]")));
+    map = handlebars_map_str_update(map, HBS_STRL("row"), tmp);
+    handlebars_value_map(partials, map);
+    handlebars_vm_set_partials(vm, partials);
+    handlebars_value_helper(tmp, trace_fail);
+    handlebars_value_map(helpers, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("trace_fail"), tmp));
+    handlebars_vm_set_helpers(vm, helpers);
+
+    // Every event the error unwinds through still ends
+    log.str = handlebars_string_init(context, 0);
+    handlebars_vm_set_trace(vm, trace_log_begin, trace_log_end, &log, 0);
+    handlebars_vm_set_trace_name(vm, "index");
+    if (!handlebars_setjmp_ex(vm, &buf)) {
+        (void) handlebars_vm_execute(vm, module, input);
+        ck_abort_msg("should have thrown"); // LCOV_EXCL_LINE
+    }
+    HBSCTX(vm)->e->jmp = prev;
+    ck_assert_str_eq("trace_fail", handlebars_error_msg(HBSCTX(vm)));
+    ck_assert_int_eq(0, log.depth);
+    ck_assert_str_eq(
+        hbs_str_val(log.str),
+        "<0:index><2:each><2:if><1:row></row:16><2:trace_fail></trace_fail:0></if:0></each:0></index:0>"
+    );
+    handlebars_vm_set_trace(vm, NULL, NULL, NULL, 0);
+
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(helpers);
+    HANDLEBARS_VALUE_UNDECL(partials);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_profile_error)
+{
+    struct handlebars_module * error_module = compile_template("{{#each items}}<li>{{trace_fail this}}</li>{{/each}}");
+    struct handlebars_module * module = compile_template("{{title}}{{#each items}}<li>{{this}}</li>{{/each}}");
+    struct handlebars_vm_profile * profile = handlebars_vm_profile_ctor(context);
+    jmp_buf * prev = HBSCTX(vm)->e->jmp;
+    jmp_buf buf;
+    HANDLEBARS_VALUE_DECL(input);
+    HANDLEBARS_VALUE_DECL(helpers);
+    HANDLEBARS_VALUE_DECL(tmp);
+
+    make_input(input);
+    handlebars_value_helper(tmp, trace_fail);
+    handlebars_value_map(helpers, handlebars_map_str_update(handlebars_map_ctor(context, 1), HBS_STRL("trace_fail"), tmp));
+    handlebars_vm_set_helpers(vm, helpers);
+    handlebars_vm_set_profile(vm, profile);
+
+    // With an arena the VM is restored before the error propagates, so it can render again
+    handlebars_vm_set_arena(vm, 64 * 1024);
+    if (!handlebars_setjmp_ex(vm, &buf)) {
+        (void) handlebars_vm_execute(vm, error_module, input);
+        ck_abort_msg("should have thrown"); // LCOV_EXCL_LINE
+    }
+    HBSCTX(vm)->e->jmp = prev;
+    handlebars_vm_execute(vm, module, input);
+    handlebars_vm_set_profile(vm, NULL);
+
+#ifdef HANDLEBARS_ENABLE_PROFILING
+    {
+        const struct handlebars_vm_profile_stat * stat;
+        size_t i;
+
+        // The programs the error unwound through are not counted, and it does not skew the render after it
+        for (i = 0; i < handlebars_vm_profile_program_count(profile); i++) {
+            struct handlebars_module * stat_module;
+            long program;
+            stat = handlebars_vm_profile_program(profile, i, &stat_module, &program);
+            ck_assert_uint_eq(stat_module == error_module ? 0 : program == 0 ? 1 : 64, stat->count);
+            ck_assert_uint_ge(stat->total_ns, stat->self_ns);
+        }
+        stat = handlebars_vm_profile_opcode(profile, handlebars_opcode_type_invoke_helper);
+        ck_assert_uint_ge(stat->total_ns, stat->self_ns);
+    }
+#endif
+
+    handlebars_vm_profile_dtor(profile);
+    HANDLEBARS_VALUE_UNDECL(tmp);
+    HANDLEBARS_VALUE_UNDECL(helpers);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_trace_collector)
+{
+    struct handlebars_module * module = compile_template("{{#each items}}{{#if @first}}{{this}}{{/if}}{{/each}}");
+    struct handlebars_vm_trace_collector * collector = handlebars_vm_trace_collector_ctor(context);
+    struct handlebars_string * str;
+    HANDLEBARS_VALUE_DECL(input);
+
+    make_input(input);
+
+    handlebars_vm_trace_collector_attach(collector, vm, 0);
+    handlebars_vm_execute(vm, module, input);
+    handlebars_vm_set_trace(vm, NULL, NULL, NULL, 0);
+    handlebars_vm_execute(vm, module, input);
+
+    // The template, each, and if for each of the 64 items
+    ck_assert_uint_eq(2 + 64, handlebars_vm_trace_collector_count(collector));
+
+    str = handlebars_vm_trace_collector_chrome(context, collector);
+    ck_assert_ptr_ne(NULL, strstr(hbs_str_val(str), "{\"name\":\"template\",\"cat\":\"template\",\"ph\":\"X\",\"ts\":0.000,"));
+    ck_assert_ptr_ne(NULL, strstr(hbs_str_val(str), "{\"name\":\"if\",\"cat\":\"helper\","));
+
+    str = handlebars_vm_trace_collector_folded(context, collector);
+    ck_assert_ptr_eq(hbs_str_val(str), strstr(hbs_str_val(str), "template "));
+    ck_assert_ptr_ne(NULL, strstr(hbs_str_val(str), "\ntemplate;helper:each "));
+    ck_assert_ptr_ne(NULL, strstr(hbs_str_val(str), "\ntemplate;helper:each;helper:if "));
+    ck_assert_uint_eq(0, handlebars_vm_trace_collector_dropped(collector));
+
+    // Recording stops at the limit, the records that were open still end
+    handlebars_vm_trace_collector_reset(collector);
+    ck_assert_uint_eq(0, handlebars_vm_trace_collector_count(collector));
+    handlebars_vm_trace_collector_set_limit(collector, 10);
+    handlebars_vm_trace_collector_attach(collector, vm, 0);
+    handlebars_vm_execute(vm, module, input);
+    handlebars_vm_execute(vm, module, input);
+    ck_assert_uint_eq(10, handlebars_vm_trace_collector_count(collector));
+    ck_assert_uint_eq(2 * (2 + 64) - 10, handlebars_vm_trace_collector_dropped(collector));
+
+    str = handlebars_vm_trace_collector_folded(context, collector);
+    ck_assert_ptr_eq(hbs_str_val(str), strstr(hbs_str_val(str), "template "));
+    ck_assert_ptr_ne(NULL, strstr(hbs_str_val(str), "\ntemplate;helper:each "));
+
+    // And resumes after a reset
+    handlebars_vm_trace_collector_reset(collector);
+    handlebars_vm_execute(vm, module, input);
+    ck_assert_uint_eq(10, handlebars_vm_trace_collector_count(collector));
+    ck_assert_uint_eq(2 + 64 - 10, handlebars_vm_trace_collector_dropped(collector));
+    handlebars_vm_set_trace(vm, NULL, NULL, NULL, 0);
+
+    handlebars_vm_trace_collector_dtor(collector);
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+START_TEST(test_vm_arena)
+{
+    struct handlebars_module * module = compile_template(
+        "{{#each items}}{{#if @first}}{{lookup ../this 0}}{{/if}}{{/each}}{{#with (lookup this \"title\")}}{{this}}{{/with}}"
+    );
+    struct handlebars_module * error_module = compile_template("a{{#each}}{{/each}}");
+    struct handlebars_string * expected;
+    struct handlebars_string * actual;
+    size_t blocks;
+    jmp_buf * prev = HBSCTX(vm)->e->jmp;
+    jmp_buf buf;
+    HANDLEBARS_VALUE_DECL(input);
+
+    make_input(input);
+    expected = handlebars_vm_execute(vm, module, input);
+
+    // The pool is created by the first render
+    handlebars_vm_set_arena(vm, 64 * 1024);
+    blocks = talloc_total_blocks(vm);
+    actual = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq(expected, actual);
+    handlebars_talloc_free(actual);
+    ck_assert_uint_eq(blocks + 1, talloc_total_blocks(vm));
+
+    // Everything but the returned buffer is released with the arena, and the pool is reused
+    blocks = talloc_total_blocks(vm);
+    actual = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq(expected, actual);
+    handlebars_talloc_free(actual);
+    ck_assert_uint_eq(blocks, talloc_total_blocks(vm));
+
+    // Errors propagate with their message once the arena has been released, and the VM remains usable
+    if (!handlebars_setjmp_ex(vm, &buf)) {
+        (void) handlebars_vm_execute(vm, error_module, input);
+        ck_abort_msg("should have thrown"); // LCOV_EXCL_LINE
+    }
+    HBSCTX(vm)->e->jmp = prev;
+    ck_assert_int_eq(HANDLEBARS_ERROR, handlebars_error_num(HBSCTX(vm)));
+    ck_assert_str_eq("Must pass iterator to #each", handlebars_error_msg(HBSCTX(vm)));
+
+    // The message is copied out of the arena once. It and the unfinished output buffer are left on the VM.
+    ck_assert_ptr_eq(talloc_parent(handlebars_error_msg(HBSCTX(vm))), vm);
+    ck_assert_uint_eq(blocks + 2, talloc_total_blocks(vm));
+
+    actual = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq(expected, actual);
+
+    HANDLEBARS_VALUE_UNDECL(input);
+}
+END_TEST
+
+#ifdef HANDLEBARS_HAVE_PTHREAD
+#define SHARED_MODULE_THREADS 4
+
+struct shared_module_thread {
+    pthread_t thread;
+    struct handlebars_context * ctx;
+    struct handlebars_vm * vm;
+    struct handlebars_module * module;
+    struct handlebars_value * input;
+    struct handlebars_string * expected;
+    int failures;
+};
+
+static void * shared_module_thread_main(void * arg)
+{
+    struct shared_module_thread * t = arg;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        struct handlebars_string * actual = handlebars_vm_execute(t->vm, t->module, t->input);
+        if (hbs_str_len(actual) != hbs_str_len(t->expected) ||
+                0 != memcmp(hbs_str_val(actual), hbs_str_val(t->expected), hbs_str_len(actual))) {
+            t->failures++;
+        }
+        handlebars_talloc_free(actual);
+    }
+
+    return NULL;
+}
+
+static void run_shared_module_threads(struct handlebars_module * module, struct handlebars_value ** inputs)
+{
+    struct shared_module_thread threads[SHARED_MODULE_THREADS];
+    struct handlebars_string * expected;
+    int i;
+
+    expected = handlebars_vm_execute(vm, module, inputs[0]);
+
+    // Contexts are created up front, talloc hierarchies may only be modified by one thread at a time
+    for (i = 0; i < SHARED_MODULE_THREADS; i++) {
+        threads[i].ctx = handlebars_context_ctor_ex(context);
+        threads[i].vm = handlebars_vm_ctor(threads[i].ctx);
+        threads[i].module = module;
+        threads[i].input = inputs[i];
+        threads[i].expected = expected;
+        threads[i].failures = 0;
+    }
+
+    for (i = 0; i < SHARED_MODULE_THREADS; i++) {
+        ck_assert_int_eq(0, pthread_create(&threads[i].thread, NULL, shared_module_thread_main, &threads[i]));
+    }
+
+    for (i = 0; i < SHARED_MODULE_THREADS; i++) {
+        ck_assert_int_eq(0, pthread_join(threads[i].thread, NULL));
+        ck_assert_int_eq(0, threads[i].failures);
+        handlebars_vm_dtor(threads[i].vm);
+        handlebars_context_dtor(threads[i].ctx);
+    }
+}
+
+START_TEST(test_vm_shared_module_threads)
+{
+    // A serialized module only holds immortal strings, so it can be executed by many threads at once. Input data is
+    // only shared when refcounting is atomic.
+    struct handlebars_module * module = compile_template(output_tmpl);
+    struct handlebars_value * inputs[SHARED_MODULE_THREADS];
+    int i;
+    HANDLEBARS_VALUE_ARRAY_DECL(values, SHARED_MODULE_THREADS);
+
+    for (i = 0; i < SHARED_MODULE_THREADS; i++) {
+        inputs[i] = HANDLEBARS_VALUE_ARRAY_AT(values, i);
+#ifdef HANDLEBARS_ATOMIC_REFCOUNT
+        if (i > 0) {
+            handlebars_value_value(inputs[i], inputs[0]);
+            continue;
+        }
+#endif
+        make_input(inputs[i]);
+    }
+
+    run_shared_module_threads(module, inputs);
+
+    HANDLEBARS_VALUE_ARRAY_UNDECL(values, SHARED_MODULE_THREADS);
+}
+END_TEST
+
+START_TEST(test_vm_frozen_input_threads)
+{
+    // A frozen input is never written to while rendering, so it can be shared without atomic refcounting
+    struct handlebars_module * module = compile_template(
+        "{{#each labels}}{{@key}}={{this}}{{#each ../labels}}.{{/each}};{{/each}}{{#with labels}}{{b}}{{/with}}"
+    );
+    struct handlebars_value * inputs[SHARED_MODULE_THREADS];
+    struct handlebars_map * map = handlebars_map_ctor(context, 1);
+    struct handlebars_map * labels = handlebars_map_ctor(context, 2);
+    struct handlebars_string * expected;
+    int i;
+    HANDLEBARS_VALUE_DECL(tmp);
+    HANDLEBARS_VALUE_DECL(input);
+
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("one")));
+    labels = handlebars_map_str_update(labels, HBS_STRL("a"), tmp);
+    handlebars_value_str(tmp, handlebars_string_ctor(context, HBS_STRL("two")));
+    labels = handlebars_map_str_update(labels, HBS_STRL("b"), tmp);
+    handlebars_value_map(tmp, labels);
+    map = handlebars_map_str_update(map, HBS_STRL("labels"), tmp);
+    handlebars_value_map(input, map);
+    handlebars_value_freeze(input);
+
+    expected = handlebars_vm_execute(vm, module, input);
+    ck_assert_hbs_str_eq_cstr(expected, "a=one..;b=two..;two");
+
+    for (i = 0; i < SHARED_MODULE_THREADS; i++) {
+        inputs[i] = input;
+    }
+
+    run_shared_module_threads(module, inputs);
+
+    HANDLEBARS_VALUE_UNDECL(input);
+    HANDLEBARS_VALUE_UNDECL(tmp);
+}
+END_TEST
+#endif
+
+static Suite * suite(void);
+static Suite * suite(void)
+{
+    Suite * s = suite_create("VM");
+
+    REGISTER_TEST_FIXTURE(s, test_vm_output_sink, "Output sink");
+    REGISTER_TEST_FIXTURE(s, test_vm_output_sink_large_threshold, "Output sink (large threshold)");
+    REGISTER_TEST_FIXTURE(s, test_vm_array_index_lookup, "Array index lookup");
+    REGISTER_TEST_FIXTURE(s, test_vm_inline_cache, "Inline lookup cache");
+    REGISTER_TEST_FIXTURE(s, test_vm_lookup_and_append, "Lookup and append superinstruction");
+    REGISTER_TEST_FIXTURE(s, test_vm_append_content_coalescing, "Append content coalescing");
+    REGISTER_TEST_FIXTURE(s, test_vm_each_data_frame, "Each data frame");
+    REGISTER_TEST_FIXTURE(s, test_vm_each_parent_data, "Each parent data");
+    REGISTER_TEST_FIXTURE(s, test_vm_append_direct, "Append nested programs in place");
+    REGISTER_TEST_FIXTURE(s, test_vm_builtin_blocks, "Builtin block opcodes");
+    REGISTER_TEST_FIXTURE(s, test_vm_registers, "Register lowering");
+    REGISTER_TEST_FIXTURE(s, test_vm_arena, "Render arena");
+    REGISTER_TEST_FIXTURE(s, test_vm_profile, "Profile");
+    REGISTER_TEST_FIXTURE(s, test_vm_trace, "Trace");
+    REGISTER_TEST_FIXTURE(s, test_vm_profile_error, "Profile a render that throws");
+    REGISTER_TEST_FIXTURE(s, test_vm_trace_error, "Trace error");
+    REGISTER_TEST_FIXTURE(s, test_vm_trace_collector, "Trace collector");
+#ifdef HANDLEBARS_HAVE_PTHREAD
+    REGISTER_TEST_FIXTURE(s, test_vm_shared_module_threads, "Shared module across threads");
+    REGISTER_TEST_FIXTURE(s, test_vm_frozen_input_threads, "Frozen input across threads");
+#endif
+
+    return s;
+}
+
+int main(void)
+{
+    return default_main(&suite);
+}
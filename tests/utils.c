@@ -52,6 +52,7 @@
 #include "handlebars_compiler.h"
 #include "handlebars_parser.h"
 #include "handlebars_helpers.h"
+#include "handlebars_opcode_serializer.h"
 #include "handlebars_string.h"
 #include "handlebars_value.h"
 #include "handlebars_vm.h"
@@ -119,6 +120,24 @@ void default_teardown(void)
     ck_assert_uint_le(talloc_total_blocks(NULL), null_blocks);
 }
 
+struct handlebars_module * compile_module(const char * tmpl, unsigned long flags)
+{
+    // The parser and compiler are not reusable, so use fresh ones for each template
+    struct handlebars_parser * tmp_parser = handlebars_parser_ctor(context);
+    struct handlebars_compiler * tmp_compiler = handlebars_compiler_ctor(context);
+    struct handlebars_ast_node * ast;
+    struct handlebars_program * program;
+    struct handlebars_module * module;
+
+    handlebars_compiler_set_flags(tmp_compiler, flags);
+    ast = handlebars_parse_ex(tmp_parser, handlebars_string_ctor(context, tmpl, strlen(tmpl)), flags);
+    program = handlebars_compiler_compile_ex(tmp_compiler, ast);
+    module = handlebars_program_serialize(context, program);
+    handlebars_compiler_dtor(tmp_compiler);
+    handlebars_parser_dtor(tmp_parser);
+    return module;
+}
+
 
 
 int file_get_contents(const char * filename, char ** buf, size_t * len)
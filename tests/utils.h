@@ -128,6 +128,7 @@ extern struct handlebars_vm * vm;
 extern size_t init_blocks;
 void default_setup(void);
 void default_teardown(void);
+struct handlebars_module * compile_module(const char * tmpl, unsigned long flags);
 typedef Suite * (*suite_ctor_func)(void);
 int default_main(suite_ctor_func suite_ctor);
 